@@ -1,4 +1,6 @@
 #include "audio.h"
+#include "hu_metrics.h"
+#include "hu_alloc.h"
 
 AudioOutput::AudioOutput(const char *outDev)
 {
@@ -39,7 +41,7 @@ void AudioOutput::MediaPacketAUD(uint64_t timestamp, const byte *buf, int len)
     //Do we need the timestamp?
     if (aud_handle)
     {
-        MediaPacket(aud_handle, buf, len);
+        MediaPacket(AA_CH_AUD, aud_handle, buf, len);
     }
 }
 
@@ -47,11 +49,11 @@ void AudioOutput::MediaPacketAU1(uint64_t timestamp, const byte *buf, int len)
 {
     if (au1_handle)
     {
-        MediaPacket(au1_handle, buf, len);
+        MediaPacket(AA_CH_AU1, au1_handle, buf, len);
     }
 }
 
-void AudioOutput::MediaPacket(snd_pcm_t *pcm, const byte *buf, int len)
+void AudioOutput::MediaPacket(int chan, snd_pcm_t *pcm, const byte *buf, int len)
 {
     snd_pcm_sframes_t framecount = snd_pcm_bytes_to_frames(pcm, len);
     snd_pcm_sframes_t frames = snd_pcm_writei(pcm, buf, framecount);
@@ -59,12 +61,14 @@ void AudioOutput::MediaPacket(snd_pcm_t *pcm, const byte *buf, int len)
         frames = snd_pcm_recover(pcm, frames, 1);
         if (frames < 0) {
             loge("snd_pcm_recover failed: %s\n", snd_strerror(frames));
+            hu_metrics_add(hu_metrics_chan(chan).drops);
         } else {
             frames = snd_pcm_writei(pcm, buf, framecount);
         }
     }
     if (frames >= 0 && frames < framecount) {
         loge("Short write (expected %i, wrote %i)\n", (int)framecount, (int)frames);
+        hu_metrics_add(hu_metrics_chan(chan).drops);
     }
 }
 
@@ -112,6 +116,7 @@ snd_pcm_sframes_t MicInput::read_mic_cancelable(snd_pcm_t* mic_handle, void *buf
 void MicInput::MicThreadMain(IHUAnyThreadInterface* threadInterface)
 {
     pthread_setname_np(pthread_self(), "mic_thread");
+    HU_ALLOC_SCOPE(HU_ALLOC_SCOPE_MIC);
 
     snd_pcm_t* mic_handle = nullptr;
 
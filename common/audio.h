@@ -13,7 +13,7 @@ class AudioOutput
     snd_pcm_t* aud_handle = nullptr;
     snd_pcm_t* au1_handle = nullptr;
 
-    void MediaPacket(snd_pcm_t* pcm, const byte * buf, int len);
+    void MediaPacket(int chan, snd_pcm_t* pcm, const byte * buf, int len);
 public:
     AudioOutput(const char* outDev = "default");
     ~AudioOutput();
@@ -2,6 +2,10 @@
 #include "json/json.hpp"
 
 #include "hu_uti.h"
+#include "hu_metrics.h"
+#include "hu_trace.h"
+#include "hu_capture.h"
+#include "hu_alloc.h"
 
 using json = nlohmann::json;
 
@@ -37,6 +41,108 @@ CommandServer::CommandServer(ICommandServerCallbacks &callbacks)
         AddCORSHeaders(resp);
     });
 
+    server.get("/metrics", [](WPP::Request& req, WPP::Response& resp)
+    {
+        resp.type = "text/plain; version=0.0.4";
+        resp.body << hu_metrics_text();
+
+        AddCORSHeaders(resp);
+    });
+
+    server.get("/trace", [](WPP::Request& req, WPP::Response& resp)
+    {
+        resp.type = "text/plain";
+        resp.body << hu_trace_drain();
+
+        AddCORSHeaders(resp);
+    });
+
+    // /logLevel lists the tags, /logLevel?tag=hu_aap&level=debug changes one (default, verbose, debug, warn, error, off)
+    server.get("/logLevel", [](WPP::Request& req, WPP::Response& resp)
+    {
+        resp.type = "application/json";
+        json result;
+        std::string tag = req.query["tag"];
+        if (tag.length() > 0)
+        {
+            int level = hu_log_level_from_name(req.query["level"]);
+            result["result"] = (level >= 0 && hu_log_set_level(tag.c_str(), level) == 0) ? "ok" : "invalid tag or level";
+        }
+        for (auto& entry : hu_log_levels())
+        {
+            result["levels"][entry.first] = hu_log_level_name(entry.second);
+        }
+
+        resp.body << std::setw(4) << result;
+
+        AddCORSHeaders(resp);
+    });
+
+    // /capture shows the recorder, /capture?action=start&file=/tmp/root/session.hucap or /capture?action=stop
+    server.get("/capture", [](WPP::Request& req, WPP::Response& resp)
+    {
+        resp.type = "application/json";
+        json result;
+        std::string action = req.query["action"];
+        if (action == "start")
+        {
+            std::string file = req.query["file"];
+            result["result"] = (file.length() > 0 && hu_capture_start(file) == 0) ? "ok" : "can't open file";
+        }
+        else if (action == "stop")
+        {
+            hu_capture_stop();
+            result["result"] = "ok";
+        }
+        hu_capture_stats stats = hu_capture_get_stats();
+        result["active"]  = stats.active;
+        result["file"]    = stats.path;
+        result["records"] = stats.records;
+        result["bytes"]   = stats.bytes;
+        result["dropped"] = stats.dropped;
+
+        resp.body << std::setw(4) << result;
+
+        AddCORSHeaders(resp);
+    });
+
+    // /allocs needs a "make ALLOC_TRACK=1" build. /allocs?action=reset starts a new window, do it once streaming
+    server.get("/allocs", [](WPP::Request& req, WPP::Response& resp)
+    {
+        resp.type = "application/json";
+        if (req.query["action"] == "reset")
+        {
+            hu_alloc_reset_window();
+        }
+        hu_alloc_report report = hu_alloc_get_report();
+        json result;
+        result["enabled"] = report.enabled;
+        result["windowSeconds"] = report.window_s;
+        result["liveBytes"] = report.live_bytes;
+        result["allocs"] = report.allocs;
+        result["bytes"] = report.bytes;
+        result["allocsPerSecond"] = report.allocs_per_s;
+        result["bytesPerSecond"] = report.bytes_per_s;
+        result["rows"] = json::array();
+        for (const hu_alloc_row& row : report.rows)
+        {
+            json entry;
+            entry["thread"] = row.thread;
+            entry["scope"] = hu_alloc_scope_name(row.scope);
+            entry["allocs"] = row.allocs;
+            entry["news"] = row.news;
+            entry["frees"] = row.frees;
+            entry["bytes"] = row.bytes;
+            entry["allocsPerSecond"] = row.allocs_per_s;
+            entry["bytesPerSecond"] = row.bytes_per_s;
+            result["rows"].push_back(entry);
+        }
+
+        resp.body << std::setw(4) << result;
+
+        AddCORSHeaders(resp);
+    });
+
     server.get("/updateConfig", [&callbacks](WPP::Request& req, WPP::Response& resp)
     {
         resp.type = "application/json";
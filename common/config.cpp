@@ -9,6 +9,18 @@ bool config::carGPS = true;
 HU_TRANSPORT_TYPE config::transport_type = HU_TRANSPORT_TYPE::USB;
 std::string config::phoneIpAddress = "192.168.43.1";
 bool config::reverseGPS = false;
+//Dead reckoned LocationData between the car's GPS fixes this often, 0 to only send the fixes
+int config::gpsUpsampleMs = 100;
+bool config::sslFastPath = false;
+//Push each video fragment to the decoder as it arrives instead of waiting for the whole frame
+bool config::streamVideoChunks = false;
+//Offered in this order. No AES instructions on the CMU's Cortex-A9, so the NEON friendly GCM/ChaCha suites go first,
+//AES128 before AES256 (fewer rounds) and the CBC/SHA1 suites last. Use "headunit bench-crypto" to check on the target.
+std::string config::sslCipherList = "ECDHE-RSA-CHACHA20-POLY1305:ECDHE-RSA-AES128-GCM-SHA256:AES128-GCM-SHA256:ECDHE-RSA-AES256-GCM-SHA384:AES256-GCM-SHA384:ECDHE-RSA-AES128-SHA:AES128-SHA";
+//Record the decrypted session to this file from startup, empty for off. See hu_capture.h
+std::string config::captureFile = "";
+//Desktop only: draw the input latency stages over the video
+bool config::latencyOverlay = false;
 
 void config::parseJson(json config_json)
 {
@@ -32,6 +44,30 @@ void config::parseJson(json config_json)
     {
         config::reverseGPS = config_json["reverseGPS"];
     }
+    if (config_json["gpsUpsampleMs"].is_number_integer())
+    {
+        config::gpsUpsampleMs = config_json["gpsUpsampleMs"];
+    }
+    if (config_json["sslFastPath"].is_boolean())
+    {
+        config::sslFastPath = config_json["sslFastPath"];
+    }
+    if (config_json["streamVideoChunks"].is_boolean())
+    {
+        config::streamVideoChunks = config_json["streamVideoChunks"];
+    }
+    if (config_json["sslCipherList"].is_string())
+    {
+        config::sslCipherList = config_json["sslCipherList"];
+    }
+    if (config_json["captureFile"].is_string())
+    {
+        config::captureFile = config_json["captureFile"];
+    }
+    if (config_json["latencyOverlay"].is_boolean())
+    {
+        config::latencyOverlay = config_json["latencyOverlay"];
+    }
     printf("json config parsed\n");
 }
 
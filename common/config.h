@@ -16,6 +16,12 @@ public:
     static HU_TRANSPORT_TYPE transport_type;
     static std::string phoneIpAddress;
     static bool reverseGPS;
+    static int gpsUpsampleMs;
+    static bool sslFastPath;
+    static bool streamVideoChunks;
+    static std::string sslCipherList;
+    static std::string captureFile;
+    static bool latencyOverlay;
 
 private:
     static json readConfigFile();
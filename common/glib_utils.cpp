@@ -1,29 +1,279 @@
 #include "glib_utils.h"
+#include "hu_alloc.h"
+#include "hu_uti.h"
+#include "hu_metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
 
 GMainContext* run_on_thread_main_context = nullptr;
+static std::mutex main_context_mutex;                                   //Held while it changes, and by run_on_main_thread_in
+
+// Every run_on_main_thread call used to make, attach and destroy a GSource of its own, each one a trip through the
+// context lock and the source list. Now tasks go on one lock free list that any thread pushes to, and a single
+// source per context takes the whole list each time it is dispatched. Delayed tasks wait in a heap on the main
+// thread, and the source's timeout is the next one due, so the loop still sleeps until there is work.
+
+struct main_task
+{
+    std::function<bool()> func;
+    main_task* next = nullptr;
+    uint64_t posted_us = 0;
+    uint64_t due_us = 0;                                                //0: as soon as possible
+    guint interval_ms = 0;                                              //For a delayed task that asks to run again
+    uint64_t seq = 0;                                                   //Orders tasks due at the same time
+    uint32_t generation = 0;                                            //The source it was posted to
+};
+
+struct main_queue_source
+{
+    GSource source;
+    GMainContext* context;
+    uint32_t generation;
+};
+
+static std::atomic<main_task*> main_incoming(nullptr);                  //Newest first, any thread pushes
+static std::atomic<uint64_t> main_seq(0);
 
-static gboolean run_on_main_thread_func(gpointer p)
+static std::mutex main_source_mutex;
+static std::atomic<main_queue_source*> main_source(nullptr);
+static main_queue_source* main_source_retired = nullptr;                //Unreffed one replacement later, a poster may still be reading it
+static uint32_t main_generation = 0;
+
+//Only the thread running the context touches these
+static std::vector<main_task*> main_timers;                             //Heap, earliest due on top
+static std::vector<main_task*> main_again;                              //Immediate tasks that asked to run again
+static std::vector<main_task*> main_batch;                              //Scratch
+static uint32_t main_consumer_generation = 0;
+
+static bool main_timer_later(const main_task* a, const main_task* b)
 {
-    std::function<bool()>* func = reinterpret_cast<std::function<bool()>*>(p);
-    bool ret = (*func)();
-    delete func;
-    return ret ? TRUE : FALSE;
+    return a->due_us != b->due_us ? a->due_us > b->due_us : a->seq > b->seq;
 }
 
-void run_on_main_thread(std::function<bool()>&& f)
+static void main_drop_stale(std::vector<main_task*>& tasks, uint32_t generation)
 {
-    GSource* source = g_idle_source_new();
-    g_source_set_callback(source, run_on_main_thread_func, new std::function<bool()>(f), nullptr);
+    //Posted for a context that is gone, whatever they captured went with it
+    auto stale = std::partition(tasks.begin(), tasks.end(), [generation](main_task* task) { return task->generation >= generation; });
+    for (auto it = stale; it != tasks.end(); ++it)
+        delete *it;
+    tasks.erase(stale, tasks.end());
+}
 
-    g_source_attach(source, run_on_thread_main_context);
-    g_source_unref(source);
+static void main_queue_sync(uint32_t generation)
+{
+    if (main_consumer_generation >= generation)
+        return;
+    main_drop_stale(main_again, generation);
+    main_drop_stale(main_timers, generation);
+    std::make_heap(main_timers.begin(), main_timers.end(), main_timer_later);
+    main_consumer_generation = generation;
+}
+
+static gboolean main_queue_prepare(GSource* source, gint* timeout)
+{
+    main_queue_sync(reinterpret_cast<main_queue_source*>(source)->generation);
+    *timeout = -1;
+    if (main_incoming.load(std::memory_order_acquire) != nullptr || !main_again.empty())
+        return TRUE;
+    if (main_timers.empty())
+        return FALSE;
+    uint64_t now_us = hu_get_time_us();
+    uint64_t due_us = main_timers.front()->due_us;
+    if (due_us <= now_us)
+        return TRUE;
+    *timeout = (gint) ((due_us - now_us + 999) / 1000);
+    return FALSE;
+}
+
+static gboolean main_queue_check(GSource* source)
+{
+    gint timeout;
+    return main_queue_prepare(source, &timeout);
+}
+
+static bool main_task_run(main_task* task, uint64_t now_us)
+{
+    hu_metrics.main_loop_wait_us.observe(now_us - std::min(now_us, task->due_us ? task->due_us : task->posted_us));
+    return task->func();
+}
+
+static void main_queue_push(main_task* task)
+{
+    main_task* head = main_incoming.load(std::memory_order_relaxed);
+    do
+    {
+        task->next = head;
+    }
+    while (!main_incoming.compare_exchange_weak(head, task, std::memory_order_release, std::memory_order_relaxed));
+    //Later posts ride on this wakeup until the list is taken
+    if (head == nullptr)
+        g_main_context_wakeup(reinterpret_cast<main_queue_source*>(main_source.load(std::memory_order_acquire))->context);
+}
+
+static gboolean main_queue_dispatch(GSource* source, GSourceFunc, gpointer)
+{
+    HU_ALLOC_SCOPE(HU_ALLOC_SCOPE_MAIN_LOOP);
+    uint32_t generation = reinterpret_cast<main_queue_source*>(source)->generation;
+    main_queue_sync(generation);
+    if (generation < main_consumer_generation)                          //Replaced while this context was still running
+        return TRUE;
+    uint64_t now_us = hu_get_time_us();
+    uint64_t ran = 0;
+
+    //Only what is here now, a task that posts another or asks to run again waits for the next dispatch
+    main_batch.swap(main_again);
+    size_t again_count = main_batch.size();
+    main_task* incoming = main_incoming.exchange(nullptr, std::memory_order_acquire);
+    size_t first_new = main_batch.size();
+    for (; incoming != nullptr; incoming = incoming->next)
+        main_batch.push_back(incoming);
+    std::reverse(main_batch.begin() + first_new, main_batch.end());    //Pushed newest first
+
+    for (size_t idx = 0; idx < main_batch.size(); idx++)
+    {
+        main_task* task = main_batch[idx];
+        if (task->generation < generation)
+        {
+            delete task;
+        }
+        else if (task->generation > generation)
+        {
+            main_queue_push(task);                                      //For the context that replaced this one
+        }
+        else if (task->due_us != 0)
+        {
+            main_timers.push_back(task);
+            std::push_heap(main_timers.begin(), main_timers.end(), main_timer_later);
+        }
+        else
+        {
+            ran++;
+            if (idx < again_count)
+                task->posted_us = now_us;                               //Its wait is from when it asked to run again
+            if (main_task_run(task, now_us))
+                main_again.push_back(task);
+            else
+                delete task;
+        }
+    }
+    main_batch.clear();
+
+    size_t timers_due = 0;
+    while (timers_due < main_timers.size() && main_timers.front()->due_us <= now_us)
+    {
+        std::pop_heap(main_timers.begin(), main_timers.end() - timers_due, main_timer_later);
+        timers_due++;
+    }
+    //Popped ones sit at the back, earliest last
+    main_batch.assign(main_timers.rbegin(), main_timers.rbegin() + timers_due);
+    main_timers.resize(main_timers.size() - timers_due);
+    for (main_task* task : main_batch)
+    {
+        ran++;
+        if (main_task_run(task, now_us))
+        {
+            task->due_us = hu_get_time_us() + (uint64_t) task->interval_ms * 1000;
+            task->seq = main_seq.fetch_add(1, std::memory_order_relaxed);
+            main_timers.push_back(task);
+            std::push_heap(main_timers.begin(), main_timers.end(), main_timer_later);
+        }
+        else
+        {
+            delete task;
+        }
+    }
+    main_batch.clear();
+
+    if (ran > 0)
+    {
+        hu_metrics_add(hu_metrics.main_loop_wakeups);
+        hu_metrics_add(hu_metrics.main_loop_tasks, ran);
+        uint64_t batch_max = hu_metrics.main_loop_batch_max.load(std::memory_order_relaxed);
+        while (ran > batch_max && !hu_metrics.main_loop_batch_max.compare_exchange_weak(batch_max, ran, std::memory_order_relaxed))
+            ;
+    }
+    return TRUE;
+}
+
+static GSourceFuncs main_queue_funcs = {main_queue_prepare, main_queue_check, main_queue_dispatch, nullptr};
+
+//The generation tasks for this context are tagged with, attaching the queue's source to it the first time
+static uint32_t main_queue_attach(GMainContext* context)
+{
+    main_queue_source* current = main_source.load(std::memory_order_acquire);
+    if (current != nullptr && current->context == context && !g_source_is_destroyed(&current->source))
+        return current->generation;
+
+    std::lock_guard<std::mutex> lk(main_source_mutex);
+    current = main_source.load(std::memory_order_relaxed);
+    //Destroyed too, since a new context can be allocated where the last one was
+    if (current != nullptr && current->context == context && !g_source_is_destroyed(&current->source))
+        return current->generation;
+
+    main_queue_source* source = reinterpret_cast<main_queue_source*>(g_source_new(&main_queue_funcs, sizeof(main_queue_source)));
+    source->context = context;
+    source->generation = ++main_generation;
+    //What g_idle_source_new gave every task before, so they still yield to the GStreamer bus watches on this loop
+    g_source_set_priority(&source->source, G_PRIORITY_DEFAULT_IDLE);
+    g_source_attach(&source->source, context);
+
+    if (current != nullptr)
+        g_source_destroy(&current->source);
+    if (main_source_retired != nullptr)
+        g_source_unref(&main_source_retired->source);
+    main_source_retired = current;
+    main_source.store(source, std::memory_order_release);
+    return source->generation;
+}
+
+static void main_queue_post(guint milliseconds, bool delayed, std::function<bool()>&& f)
+{
+    HU_ALLOC_SCOPE(HU_ALLOC_SCOPE_MAIN_LOOP);
+    GMainContext* context = run_on_thread_main_context ? run_on_thread_main_context : g_main_context_default();
+    main_task* task = new main_task();
+    task->func = std::move(f);
+    task->posted_us = hu_get_time_us();
+    if (delayed)
+    {
+        //At least 1 us so it is told apart from an immediate task
+        task->due_us = task->posted_us + std::max<uint64_t>(1, (uint64_t) milliseconds * 1000);
+        task->interval_ms = milliseconds;
+    }
+    task->seq = main_seq.fetch_add(1, std::memory_order_relaxed);
+    task->generation = main_queue_attach(context);
+    main_queue_push(task);
+}
+
+void run_on_thread_main_context_set(GMainContext* context)
+{
+    std::lock_guard<std::mutex> lk(main_context_mutex);
+    run_on_thread_main_context = context;
+}
+
+GMainContext* run_on_thread_main_context_ref()
+{
+    std::lock_guard<std::mutex> lk(main_context_mutex);
+    return run_on_thread_main_context ? g_main_context_ref(run_on_thread_main_context) : nullptr;
+}
+
+void run_on_main_thread(std::function<bool()>&& f)
+{
+    main_queue_post(0, false, std::move(f));
 }
 
 void run_on_main_thread_delay(guint milliseconds, std::function<bool()>&& f)
 {
-    GSource* source = g_timeout_source_new(milliseconds);
-    g_source_set_callback(source, run_on_main_thread_func, new std::function<bool()>(f), nullptr);
+    main_queue_post(milliseconds, true, std::move(f));
+}
 
-    g_source_attach(source, run_on_thread_main_context);
-    g_source_unref(source);
+bool run_on_main_thread_in(GMainContext* context, guint milliseconds, std::function<bool()>&& f)
+{
+    std::lock_guard<std::mutex> lk(main_context_mutex);
+    if (context == nullptr || context != run_on_thread_main_context)
+        return false;
+    main_queue_post(milliseconds, milliseconds > 0, std::move(f));
+    return true;
 }
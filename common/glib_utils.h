@@ -3,7 +3,15 @@
 #include <glib.h>
 #include <functional>
 
+//Read it freely on the main thread, but change it with run_on_thread_main_context_set so other threads can't post to one being freed
 extern GMainContext* run_on_thread_main_context;
 
+void run_on_thread_main_context_set(GMainContext* context);
+GMainContext* run_on_thread_main_context_ref();                         //A new ref on the current context, or nullptr
+
 void run_on_main_thread(std::function<bool()>&& f);
 void run_on_main_thread_delay(guint milliseconds, std::function<bool()>&& f);
+
+//For other threads: posts only if context is still the current one, checked under the lock the setter takes.
+//Returns false when it was dropped. A delay of 0 runs it as soon as possible
+bool run_on_main_thread_in(GMainContext* context, guint milliseconds, std::function<bool()>&& f);
@@ -5,6 +5,11 @@
 #include "hu_ssl.h"
 #include "hu_aap.h"
 #include "hu_aad.h"
+#include "hu_metrics.h"
+#include "hu_trace.h"
+#include "hu_capture.h"
+#include "hu_alloc.h"
+#include "hu_pb_fast.h"
 #include <fstream>
 #include <memory>
 #include <endian.h>
@@ -27,11 +32,37 @@
 
 #include "hu_usb.h"
 #include "hu_tcp.h"
+#include "hu_replay.h"
+#include "hu_loopback.h"
 
   HUServer::HUServer(IHUConnectionThreadEventCallbacks& callbacks)
   : callbacks(callbacks)
   {
+    auto init = [this] (HU_INIT_MESSAGE msg_type, const char * name, hu_builtin_handler handle) {
+      hu_set_handler (init_handlers [(uint16_t) msg_type], name, hu_builtin (handle));
+    };
+    init (HU_INIT_MESSAGE::VersionResponse, "VersionResponse", &HUServer::hu_handle_VersionResponse);
+    init (HU_INIT_MESSAGE::SSLHandshake, "SSLHandshake", &HUServer::hu_handle_SSLHandshake);
+
+    auto control = [this] (HU_PROTOCOL_MESSAGE msg_type, const char * name, hu_builtin_handler handle) {
+      hu_set_handler (control_handlers [(uint16_t) msg_type], name, hu_builtin (handle));
+    };
+    control (HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp, "MediaDataWithTimestamp", &HUServer::hu_handle_MediaDataWithTimestamp);
+    control (HU_PROTOCOL_MESSAGE::MediaData, "MediaData", &HUServer::hu_handle_MediaData);
+    control (HU_PROTOCOL_MESSAGE::ServiceDiscoveryRequest, "ServiceDiscoveryRequest", &HUServer::hu_handle_ServiceDiscoveryRequest);
+    control (HU_PROTOCOL_MESSAGE::ChannelOpenRequest, "ChannelOpenRequest", &HUServer::hu_handle_ChannelOpenRequest);
+    control (HU_PROTOCOL_MESSAGE::PingRequest, "PingRequest", &HUServer::hu_handle_PingRequest);
+    control (HU_PROTOCOL_MESSAGE::NavigationFocusRequest, "NavigationFocusRequest", &HUServer::hu_handle_NavigationFocusRequest);
+    control (HU_PROTOCOL_MESSAGE::ShutdownRequest, "ShutdownRequest", &HUServer::hu_handle_ShutdownRequest);
+    control (HU_PROTOCOL_MESSAGE::VoiceSessionRequest, "VoiceSessionRequest", &HUServer::hu_handle_VoiceSessionRequest);
+    control (HU_PROTOCOL_MESSAGE::AudioFocusRequest, "AudioFocusRequest", &HUServer::hu_handle_AudioFocusRequest);
+  }
 
+  HUServer::~HUServer() {
+    hu_aap_shutdown();
+    delete temp_assembly_buffer;
+    for (auto& buffer : channel_assembly_buffers)
+      delete buffer.second;
   }
 
   int HUServer::ihu_tra_start (HU_TRANSPORT_TYPE transportType, std::string& phoneIpAddress, bool waitForDevice) {
@@ -46,6 +77,19 @@
       logd ("AA over USB");
       iaap_tra_recv_tmo = 0;//100;
       iaap_tra_send_tmo = 2500;
+    }
+    else if (transportType == HU_TRANSPORT_TYPE::REPLAY) {
+      logd ("AA replayed from %s", phoneIpAddress.c_str());                // The address is the capture file here
+      transport = std::unique_ptr<HUTransportStream>(new HUTransportStreamReplay(phoneIpAddress));
+      iaap_plaintext = true;
+      iaap_tra_recv_tmo = 1000;
+      iaap_tra_send_tmo = 1000;
+    }
+    else if (transportType == HU_TRANSPORT_TYPE::LOOPBACK) {
+      logd ("AA over loopback to the fake phone");
+      transport = std::unique_ptr<HUTransportStream>(new HUTransportStreamLoopback());
+      iaap_tra_recv_tmo = 1000;
+      iaap_tra_send_tmo = 1000;
     } else {
       loge("Unknown transport type");
       return -1;
@@ -109,8 +153,12 @@
     ret = read(readfd, buf, len);
     if (ret < 0) {
       loge ("ihu_tra_recv() error so stop Transport & AAP  ret: %d", ret);
+      hu_metrics_add (hu_metrics.transport_errors);
       hu_aap_stop ();
     }
+    else {
+      hu_metrics_add (hu_metrics.transport_rx_bytes, ret);
+    }
     return (ret);
   }
 
@@ -126,6 +174,7 @@
 
     int ret = transport->Write(buf, len, tmo);
     if (ret < 0 || ret != len) {
+      hu_metrics_add (hu_metrics.transport_errors);
       if (retry == 0) {
         loge ("Error ihu_tra_send() error so stop Transport & AAP  ret: %d  len: %d", ret, len);
 		    hu_aap_stop ();
@@ -136,6 +185,15 @@
 
     if (ena_log_verbo && ena_log_aap_send)
       logd ("OK ihu_tra_send() ret: %d  len: %d", ret, len);
+    hu_channel_metrics & metrics = hu_metrics_chan (buf [0]);           // Every frame starts with the channel
+    hu_metrics_add (metrics.tx_frames);
+    hu_metrics_add (metrics.tx_bytes, len);
+    hu_metrics_add (hu_metrics.transport_tx_bytes, len);
+    if (hu_input_current != NULL) {                                     // Once per input event, with its first frame
+      if (!hu_input_current->handed_off)                                // Transports that write synchronously are done now
+        hu_input_written (* hu_input_current, hu_get_time_us ());
+      hu_input_current = NULL;
+    }
     return (ret);
   }
 
@@ -158,12 +216,40 @@
       return -1;
     }
 
-    logd ("Send %s on channel %i %s", message.GetTypeName().c_str(), chan, chan_get(chan));
+    hu_trace (HU_TRACE_MSG_TX, chan, messageCode, messageSize);
     //hex_dump("PB:", 80, temp_assembly_buffer->data(), requiredSize);
     return hu_aap_enc_send(retry, chan, temp_assembly_buffer->data(), requiredSize, overrideTimeout);
 
   }
 
+  int HUServer::hu_aap_enc_send_blob(int retry, int chan, uint16_t messageCode, const byte* buffer, int bufferLen, int overrideTimeout)
+  {
+    const int requiredSize = bufferLen + 2;
+    if (temp_assembly_buffer->size() < requiredSize)
+    {
+      temp_assembly_buffer->resize(requiredSize);
+    }
+
+    uint16_t* destMessageCode = reinterpret_cast<uint16_t*>(temp_assembly_buffer->data());
+    *destMessageCode++ = htobe16(messageCode);
+
+    memcpy(destMessageCode, buffer, bufferLen);
+
+    hu_trace (HU_TRACE_MSG_TX, chan, messageCode, bufferLen);
+    return hu_aap_enc_send(retry, chan, temp_assembly_buffer->data(), requiredSize, overrideTimeout);
+  }
+
+  int HUServer::hu_aap_send_media_ack (int chan) {                      // Once per media message, encoded in place
+    byte msg [2 + HU_PB_MEDIA_ACK_MAX];
+    *((uint16_t *) msg) = htobe16 ((uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaAck);
+    int len = hu_pb_media_ack (& msg [2], channel_session_id [chan], 1);
+
+    hu_trace (HU_TRACE_MSG_TX, chan, (uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaAck, len);
+    int ret = hu_aap_enc_send (0, chan, msg, 2 + len);
+    hu_metrics_chan (chan).ack_latency_us.observe (hu_get_time_us () - channel_rx_start_us [chan]);
+    return (ret);
+  }
+
   int HUServer::hu_aap_enc_send_media_packet(int retry, int chan, uint16_t messageCode, uint64_t timeStamp, const byte* buffer, int bufferLen, int overrideTimeout)
   {
     const int requiredSize = bufferLen + 2 + 8;
@@ -180,7 +266,7 @@
 
     memcpy(destTimestamp, buffer, bufferLen);
 
-    //logd ("Send %s on channel %i %s", message.GetTypeName().c_str(), chan, chan_get(chan));
+    hu_trace (HU_TRACE_MSG_TX, chan, messageCode, bufferLen);
     //hex_dump("PB:", 80, temp_assembly_buffer->data(), requiredSize);
     return hu_aap_enc_send(retry, chan, temp_assembly_buffer->data(), requiredSize, overrideTimeout);
   }
@@ -193,12 +279,17 @@
       return (-1);
     }
 
-    byte base_flags = HU_FRAME_ENCRYPTED;
+    hu_channel_metrics & metrics = hu_metrics_chan (chan);
+    hu_metrics_add (metrics.tx_messages);
+
+    byte base_flags = iaap_plaintext ? 0 : HU_FRAME_ENCRYPTED;
     uint16_t message_type = be16toh(*((uint16_t*)buf));
     if (chan != AA_CH_CTR && message_type >= 2 && message_type < 0x8000) {                            // If not control channel and msg_type = 0 - 255 = control type message
         base_flags |= HU_FRAME_CONTROL_MESSAGE;                                                     // Set Control Flag (On non-control channels, indicates generic/"control type" messages
         //logd ("Setting control");
     }
+    if (hu_capture_active ())
+      hu_capture_message (chan, base_flags, true, buf, len);
 
     for (int frag_start = 0; frag_start < len; frag_start += MAX_FRAME_PAYLOAD_SIZE)
     {
@@ -224,19 +315,6 @@
   #endif
 
 
-      int bytes_written = SSL_write (hu_ssl_ssl, &buf[frag_start], cur_len);               // Write plaintext to SSL
-      if (bytes_written <= 0) {
-        loge ("SSL_write() bytes_written: %d", bytes_written);
-        hu_ssl_ret_log (bytes_written);
-        hu_ssl_inf_log ();
-        hu_aap_stop ();
-        return (-1);
-      }
-      if (bytes_written != cur_len)
-        loge ("SSL_write() cur_len: %d  bytes_written: %d  chan: %d %s", cur_len, bytes_written, chan, chan_get (chan));
-      else if (ena_log_verbo && ena_log_aap_send)
-        logd ("SSL_write() cur_len: %d  bytes_written: %d  chan: %d %s", cur_len, bytes_written, chan, chan_get (chan));
-
       enc_buf [0] = (byte) chan;                                              // Encode channel and flags
       enc_buf [1] = flags;
 
@@ -248,15 +326,46 @@
         header_size += 4;
       }
 
-      int bytes_read = BIO_read (hu_ssl_wm_bio, & enc_buf [header_size], sizeof (enc_buf) - header_size); // Read encrypted from SSL BIO to enc_buf +
+      uint64_t encrypt_start_us = hu_get_time_us ();
+      if (hu_input_current != NULL)
+        hu_input_current->ssl_us = encrypt_start_us;
+      int bytes_read = 0;
+      if (iaap_plaintext)
+      {
+        memcpy (& enc_buf [header_size], &buf[frag_start], cur_len);
+        bytes_read = cur_len;
+      }
+      else if (hu_ssl_fast.active ())
+      {
+        bytes_read = hu_ssl_fast.seal (HU_SSL_CONTENT_APPLICATION_DATA, &buf[frag_start], cur_len, & enc_buf [header_size], sizeof (enc_buf) - header_size);
+      }
+      else
+      {
+        hu_ssl_bio_state.set_output (& enc_buf [header_size], sizeof (enc_buf) - header_size);     // SSL writes the record straight into enc_buf after the header
+
+        int bytes_written = SSL_write (hu_ssl_ssl, &buf[frag_start], cur_len);               // Write plaintext to SSL
+        bytes_read = hu_ssl_bio_state.take_output ();
+        if (bytes_written <= 0) {
+          loge ("SSL_write() bytes_written: %d", bytes_written);
+          hu_ssl_ret_log (bytes_written);
+          hu_ssl_inf_log ();
+          hu_aap_stop ();
+          return (-1);
+        }
+        if (bytes_written != cur_len)
+          loge ("SSL_write() cur_len: %d  bytes_written: %d  chan: %d %s", cur_len, bytes_written, chan, chan_get (chan));
+        else if (ena_log_verbo && ena_log_aap_send)
+          logd ("SSL_write() cur_len: %d  bytes_written: %d  chan: %d %s", cur_len, bytes_written, chan, chan_get (chan));
+      }
 
       if (bytes_read <= 0) {
-        loge ("BIO_read() bytes_read: %d", bytes_read);
+        loge ("SSL_write() no encrypted output: %d", bytes_read);
         hu_aap_stop ();
         return (-1);
       }
       if (ena_log_verbo && ena_log_aap_send)
-        logd ("BIO_read() bytes_read: %d", bytes_read);
+        logd ("SSL_write() encrypted bytes: %d", bytes_read);
+      metrics.encrypt_us.observe (hu_get_time_us () - encrypt_start_us);
 
 
 
@@ -285,6 +394,8 @@
         base_flags |= HU_FRAME_CONTROL_MESSAGE;                                                     // Set Control Flag (On non-control channels, indicates generic/"control type" messages
         //logd ("Setting control");
     }
+    if (hu_capture_active ())
+      hu_capture_message (chan, base_flags, true, buf, len);
 
     logd("Sending hu_aap_unenc_send %i bytes", len);
 
@@ -512,7 +623,7 @@
     HU::ChannelDescriptor* audioChannel2 = carInfo.add_channels();
     audioChannel2->set_channel_id(AA_CH_AU2);
     {
-      auto inner = audioChannel1->mutable_output_stream_channel();
+      auto inner = audioChannel2->mutable_output_stream_channel();
       inner->set_type(HU::STREAM_TYPE_AUDIO);
       inner->set_audio_type(HU::AUDIO_TYPE_SYSTEM);
       auto audioConfig = inner->add_audio_configs();
@@ -589,6 +700,13 @@
 
     callbacks.CustomizeCarInfo(carInfo);
 
+    //In before the response goes, the phone opens channels as soon as it has it
+    for (auto & table : service_handlers)
+      table.reset ();
+    for (const HU::ChannelDescriptor & channel : carInfo.channels ())
+      hu_register_service (channel);
+    callbacks.RegisterHandlers (*this);
+
     return hu_aap_enc_send_message(0, chan, HU_PROTOCOL_MESSAGE::ServiceDiscoveryResponse, carInfo);
   }
 
@@ -681,9 +799,10 @@
     if (chan == AA_CH_SEN) {                                            // If Sensor channel...
       ms_sleep (2);//20);
 
-      HU::SensorEvent sensorEvent;
-      sensorEvent.add_driving_status()->set_status(HU::SensorEvent::DrivingStatus::DRIVE_STATUS_UNRESTRICTED);
-      return hu_aap_enc_send_message(0, AA_CH_SEN, HU_SENSOR_CHANNEL_MESSAGE::SensorEvent, sensorEvent);
+      byte sensor_buf [HU_PB_SENSOR_EVENT_MAX];
+      hu_pb_sensor_event sensorEvent (sensor_buf);
+      sensorEvent.driving_status (HU::SensorEvent::DrivingStatus::DRIVE_STATUS_UNRESTRICTED);
+      return hu_aap_enc_send_blob(0, AA_CH_SEN, HU_SENSOR_CHANNEL_MESSAGE::SensorEvent, sensor_buf, sensorEvent.size());
     }
     return (ret);
   }
@@ -785,7 +904,7 @@
     if (!request.ParseFromArray(buf, len))
       loge ("MediaAck");
     else
-      logd ("MediaAck");
+      hu_trace (HU_TRACE_MEDIA_ACK_RX, chan);
     return (0);
   }
 
@@ -808,39 +927,50 @@
     return (0);
   }
 
+  int HUServer::hu_aap_media_deliver (int chan, uint64_t timestamp, const byte * buf, int len) {
+    uint64_t start_us = hu_get_time_us ();
+    int ret = hu_aap_media_route (chan, timestamp, buf, len);
+    hu_metrics_chan (chan).sink_us.observe (hu_get_time_us () - start_us);
+    return (ret);
+  }
+
+  int HUServer::hu_aap_media_route (int chan, uint64_t timestamp, const byte * buf, int len) {
+    HU_ALLOC_SCOPE (HU_ALLOC_SCOPE_MEDIA);
+    hu_media_stream_state & stream = media_stream [chan];
+    if (stream.active) {                                                // Earlier fragments were streamed, this is the tail
+      stream.active = false;
+      if (stream.offset + len != stream.total)
+        logw ("Streamed %s message is %d bytes, expected %d", chan_get (chan), stream.offset + len, stream.total);
+      return callbacks.MediaPacketChunk(chan, stream.timestamp, stream.offset, stream.total, buf, len);
+    }
+    if (callbacks.MediaStreamChunks(chan))                              // Single frame message, one chunk
+      return callbacks.MediaPacketChunk(chan, timestamp, 0, len, buf, len);
+    return callbacks.MediaPacket(chan, timestamp, buf, len);
+  }
+
   int HUServer::hu_handle_MediaDataWithTimestamp (int chan, byte * buf, int len) {
 
     uint64_t timestamp = be64toh(*((uint64_t*)buf));
-    logd("Media timestamp %s %llu", chan_get(chan), timestamp);
+    hu_trace (HU_TRACE_MEDIA_RX, chan, 0, len - 8, timestamp);
 
-    int ret  = callbacks.MediaPacket(chan, timestamp, &buf [8], len - 8);
+    int ret  = hu_aap_media_deliver(chan, timestamp, &buf [8], len - 8);
     if (ret < 0)
     {
       return ret;
     }
 
-
-    HU::MediaAck mediaAck;
-    mediaAck.set_session(channel_session_id[chan]);
-    mediaAck.set_value(1);
-
-    return hu_aap_enc_send_message(0, chan, HU_MEDIA_CHANNEL_MESSAGE::MediaAck, mediaAck);
+    return (hu_aap_send_media_ack (chan));
   }
 
   int HUServer::hu_handle_MediaData(int chan, byte * buf, int len) {
 
-    int ret  = callbacks.MediaPacket(chan, 0, buf, len);
+    int ret  = hu_aap_media_deliver(chan, 0, buf, len);
     if (ret < 0)
     {
       return ret;
     }
 
-
-    HU::MediaAck mediaAck;
-    mediaAck.set_session(channel_session_id[chan]);
-    mediaAck.set_value(1);
-
-    return hu_aap_enc_send_message(0, chan, HU_MEDIA_CHANNEL_MESSAGE::MediaAck, mediaAck);
+    return (hu_aap_send_media_ack (chan));
   }
 
   int HUServer::hu_handle_PhoneStatus(int chan, byte * buf, int len) {
@@ -986,7 +1116,97 @@
       return 0;
     }
 
+  HUMessageHandler HUServer::hu_builtin (hu_builtin_handler handle) {
+    return [this, handle] (IHUConnectionThreadInterface &, int chan, byte * buf, int len) {
+      return ((this->*handle) (chan, buf, len));
+    };
+  }
+
+  void HUServer::hu_set_handler (hu_dispatch_entry & entry, const char * name, HUMessageHandler handler) {
+    entry.metrics = handler ? & hu_metrics_handler (name) : NULL;
+    entry.handler = std::move (handler);
+  }
+
+  void HUServer::hu_register_handler (int chan, uint16_t msg_type, const char * name, HUMessageHandler handler) {
+    if (chan < 0 || chan >= AA_CH_MAX || msg_type < 0x8000 || msg_type - 0x8000 >= HU_SERVICE_MESSAGES) {
+      loge ("Can't register %s for chan: %d  msg_type: %d", name, chan, msg_type);
+      return;
+    }
+    if (!service_handlers [chan])
+      service_handlers [chan].reset (new hu_dispatch_entry [HU_SERVICE_MESSAGES]);
+    hu_set_handler (service_handlers [chan] [msg_type - 0x8000], name, std::move (handler));
+  }
+
+  void HUServer::hu_register_service (const HU::ChannelDescriptor & channel) {     // Built in handlers for the kind of service channel is
+    int chan = channel.channel_id ();
+    auto builtin = [this, chan] (uint16_t msg_type, const char * name, hu_builtin_handler handle) {
+      hu_register_handler (chan, msg_type, name, hu_builtin (handle));
+    };
+
+    if (channel.has_output_stream_channel () || channel.has_input_stream_channel ()) {
+      builtin ((uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaSetupRequest, "MediaSetupRequest", &HUServer::hu_handle_MediaSetupRequest);
+      builtin ((uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaStartRequest, "MediaStartRequest", &HUServer::hu_handle_MediaStartRequest);
+      builtin ((uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaStopRequest, "MediaStopRequest", &HUServer::hu_handle_MediaStopRequest);
+      builtin ((uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaAck, "MediaAck", &HUServer::hu_handle_MediaAck);
+      builtin ((uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MicRequest, "MicRequest", &HUServer::hu_handle_MicRequest);
+      builtin ((uint16_t) HU_MEDIA_CHANNEL_MESSAGE::VideoFocusRequest, "VideoFocusRequest", &HUServer::hu_handle_VideoFocusRequest);
+    }
+    if (channel.has_sensor_channel ())
+      builtin ((uint16_t) HU_SENSOR_CHANNEL_MESSAGE::SensorStartRequest, "SensorStartRequest", &HUServer::hu_handle_SensorStartRequest);
+    if (channel.has_input_event_channel ())
+      builtin ((uint16_t) HU_INPUT_CHANNEL_MESSAGE::BindingRequest, "BindingRequest", &HUServer::hu_handle_BindingRequest);
+    if (channel.has_bluetooth_service ()) {
+      builtin ((uint16_t) HU_BLUETOOTH_CHANNEL_MESSAGE::BluetoothPairingRequest, "BluetoothPairingRequest", &HUServer::hu_handle_BluetoothPairingRequest);
+      builtin ((uint16_t) HU_BLUETOOTH_CHANNEL_MESSAGE::BluetoothAuthData, "BluetoothAuthData", &HUServer::hu_handle_BluetoothAuthData);
+    }
+    if (channel.has_phone_status_service ())
+      builtin ((uint16_t) HU_PHONE_STATUS_CHANNEL_MESSAGE::PhoneStatus, "PhoneStatus", &HUServer::hu_handle_PhoneStatus);
+    if (channel.has_generic_notification_service ()) {
+      builtin ((uint16_t) HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::StartGenericNotifications, "StartGenericNotifications", &HUServer::hu_handle_StartGenericNotifications);
+      builtin ((uint16_t) HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::StopGenericNotifications, "StopGenericNotifications", &HUServer::hu_handle_StopGenericNotifications);
+      builtin ((uint16_t) HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::GenericNotificationResponse, "GenericNotificationResponse", &HUServer::hu_handle_GenericNotificationResponse);
+    }
+    if (channel.has_navigation_status_service ()) {
+      auto navi = [this, chan] (HU_NAVI_CHANNEL_MESSAGE msg_type, const char * name, hu_builtin_handler handle) {
+        hu_register_handler (chan, msg_type, name, [this, handle] (IHUConnectionThreadInterface &, int chan, byte * buf, int len) {
+          hex_dump ("AA_CH_NAVI", 80, buf, len);
+          (this->*handle) (chan, buf, len);
+          return (0);                                                   // A navigation message we can't parse isn't worth the connection
+        });
+      };
+      navi (HU_NAVI_CHANNEL_MESSAGE::Status, "NaviStatus", &HUServer::hu_handle_NaviStatus);
+      navi (HU_NAVI_CHANNEL_MESSAGE::Turn, "NaviTurn", &HUServer::hu_handle_NaviTurn);
+      navi (HU_NAVI_CHANNEL_MESSAGE::TurnDistance, "NaviTurnDistance", &HUServer::hu_handle_NaviTurnDistance);
+    }
+  }
+
+  HUServer::hu_dispatch_entry * HUServer::hu_handler_find (int chan, uint16_t msg_type) {
+    hu_dispatch_entry * entry = NULL;
+    if (iaap_state == hu_STATE_STARTIN) {
+      if (msg_type < HU_INIT_MESSAGES)
+        entry = & init_handlers [msg_type];
+    }
+    else if (msg_type < HU_CONTROL_MESSAGES) {
+      entry = & control_handlers [msg_type];
+    }
+    else if (msg_type >= 0x8000 && msg_type - 0x8000 < HU_SERVICE_MESSAGES && chan >= 0 && chan < AA_CH_MAX && service_handlers [chan]) {
+      entry = & service_handlers [chan] [msg_type - 0x8000];
+    }
+    return (entry != NULL && entry->handler ? entry : NULL);
+  }
+
+  int HUServer::hu_dispatch (hu_dispatch_entry & entry, int chan, byte * buf, int len) {
+    hu_handler_metrics * metrics = entry.metrics;                      // A handler can stop the session, entry isn't touched after it
+    uint64_t start_us = hu_get_time_us ();
+    int ret = entry.handler (*this, chan, buf, len);
+    metrics->time_us.observe (hu_get_time_us () - start_us);
+    if (ret < 0)
+      hu_metrics_add (metrics->errors);
+    return (ret);
+  }
+
   int HUServer::iaap_msg_process (int chan, uint16_t msg_type, byte * buf, int len) {
+    HU_ALLOC_SCOPE (HU_ALLOC_SCOPE_PROTOCOL);
 
     if (ena_log_verbo)
       logd ("iaap_msg_process msg_type: %d  len: %d  buf: %p", msg_type, len, buf);
@@ -1001,164 +1221,20 @@
       return 0; //handled
     }
 
-    if (iaap_state == hu_STATE_STARTIN)
-    {
-        switch((HU_INIT_MESSAGE)msg_type)
-        {
-          case HU_INIT_MESSAGE::VersionResponse:
-            return hu_handle_VersionResponse(chan, buf, len);
-          case HU_INIT_MESSAGE::SSLHandshake:
-            return hu_handle_SSLHandshake(chan, buf, len);
-          default:
-            loge ("Unknown msg_type: %d", msg_type);
-            return (0);
-        }
-    }
-    else
-    {
-      const bool isControlMessage = msg_type < 0x8000;
-
-      if (isControlMessage)
-      {
-        switch((HU_PROTOCOL_MESSAGE)msg_type)
-        {
-          case HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp:
-            return hu_handle_MediaDataWithTimestamp(chan, buf, len);
-          case HU_PROTOCOL_MESSAGE::MediaData:
-            return hu_handle_MediaData(chan, buf, len);
-          case HU_PROTOCOL_MESSAGE::ServiceDiscoveryRequest:
-            return hu_handle_ServiceDiscoveryRequest(chan, buf, len);
-          case HU_PROTOCOL_MESSAGE::ChannelOpenRequest:
-            return hu_handle_ChannelOpenRequest(chan, buf, len);
-          case HU_PROTOCOL_MESSAGE::PingRequest:
-            return hu_handle_PingRequest(chan, buf, len);
-          case HU_PROTOCOL_MESSAGE::NavigationFocusRequest:
-            return hu_handle_NavigationFocusRequest(chan, buf, len);
-          case HU_PROTOCOL_MESSAGE::ShutdownRequest:
-            return hu_handle_ShutdownRequest(chan, buf, len);
-          case HU_PROTOCOL_MESSAGE::VoiceSessionRequest:
-            return hu_handle_VoiceSessionRequest(chan, buf, len);
-          case HU_PROTOCOL_MESSAGE::AudioFocusRequest:
-            return hu_handle_AudioFocusRequest(chan, buf, len);
-          default:
-            loge ("Unknown msg_type: %d", msg_type);
-            return (0);
-        }
-      }
-      else if (chan == AA_CH_SEN)
-      {
-        switch((HU_SENSOR_CHANNEL_MESSAGE)msg_type)
-        {
-          case HU_SENSOR_CHANNEL_MESSAGE::SensorStartRequest:
-            return hu_handle_SensorStartRequest(chan, buf, len);
-          default:
-            loge ("Unknown msg_type: %d", msg_type);
-            return (0);
-        }
-      }
-      else if (chan == AA_CH_TOU)
-      {
-        switch((HU_INPUT_CHANNEL_MESSAGE)msg_type)
-        {
-          case HU_INPUT_CHANNEL_MESSAGE::BindingRequest:
-            return hu_handle_BindingRequest(chan, buf, len);
-          default:
-            loge ("Unknown msg_type: %d", msg_type);
-            return (0);
-        }
-      }
-      else if (chan == AA_CH_BT)
-      {
-        switch((HU_BLUETOOTH_CHANNEL_MESSAGE)msg_type)
-        {
-        case HU_BLUETOOTH_CHANNEL_MESSAGE::BluetoothPairingRequest:
-          return hu_handle_BluetoothPairingRequest(chan, buf, len);
-        case HU_BLUETOOTH_CHANNEL_MESSAGE::BluetoothAuthData:
-          return hu_handle_BluetoothAuthData(chan, buf, len);
-        default:
-          logw("BLUETOOTH CHANNEL MESSAGE = chan %d - msg_type: %d", chan, msg_type);
-          return (0);
-        }
-      }
-      else if (chan == AA_CH_PSTAT)
-      {
-          switch((HU_PHONE_STATUS_CHANNEL_MESSAGE)msg_type)
-          {
-            case HU_PHONE_STATUS_CHANNEL_MESSAGE::PhoneStatus:
-              return hu_handle_PhoneStatus(chan, buf, len);
-            default:
-              loge ("Unknown msg_type: %d", msg_type);
-              return (0);
-          }
-      }
-      else if (chan == AA_CH_NOT)
-      {
-          switch((HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE)msg_type)
-          {
-            case HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::StartGenericNotifications:
-              return hu_handle_StartGenericNotifications(chan, buf, len);
-            case HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::StopGenericNotifications:
-              return hu_handle_StopGenericNotifications(chan, buf, len);
-            case HU_GENERIC_NOTIFICATIONS_CHANNEL_MESSAGE::GenericNotificationResponse:
-              return hu_handle_GenericNotificationResponse(chan, buf, len);
-            default:
-              loge ("Unknown msg_type: %d", msg_type);
-              return (0);
-          }
-      }
-      else if (chan == AA_CH_AUD || chan == AA_CH_AU1 || chan == AA_CH_AU2 || chan == AA_CH_VID || chan == AA_CH_MIC)
-      {
-        switch((HU_MEDIA_CHANNEL_MESSAGE)msg_type)
-        {
-          case HU_MEDIA_CHANNEL_MESSAGE::MediaSetupRequest:
-            return hu_handle_MediaSetupRequest(chan, buf, len);
-          case HU_MEDIA_CHANNEL_MESSAGE::MediaStartRequest:
-            return hu_handle_MediaStartRequest(chan, buf, len);
-          case HU_MEDIA_CHANNEL_MESSAGE::MediaStopRequest:
-            return hu_handle_MediaStopRequest(chan, buf, len);
-          case HU_MEDIA_CHANNEL_MESSAGE::MediaAck:
-            return hu_handle_MediaAck(chan, buf, len);
-          case HU_MEDIA_CHANNEL_MESSAGE::MicRequest:
-            return hu_handle_MicRequest(chan, buf, len);
-          case HU_MEDIA_CHANNEL_MESSAGE::VideoFocusRequest:
-            return hu_handle_VideoFocusRequest(chan, buf, len);
-	  default:
-            loge ("Unknown msg_type: %d", msg_type);
-            return (0);
-        }
-      }
-      else if (chan == AA_CH_NAVI)
-      {
-          logv ("AA_CH_NAVI");
-          logv ("AA_CH_NAVI msg_type: %04x  len: %d  buf: %p", msg_type, len, buf);
-          hex_dump("AA_CH_NAVI", 80, buf, len);
-          switch((HU_NAVI_CHANNEL_MESSAGE)msg_type)
-          {
-              case HU_NAVI_CHANNEL_MESSAGE::Status:
-                logv ("AA_CH_NAVI: HU_NAVI_CHANNEL_MESSAGE::Status");
-                hu_handle_NaviStatus(chan, buf, len);
-                return (0);
-              case HU_NAVI_CHANNEL_MESSAGE::Turn:
-                logv ("AA_CH_NAVI: HU_NAVI_CHANNEL_MESSAGE::Turn");
-                hu_handle_NaviTurn(chan, buf, len);
-                return (0);
-              case HU_NAVI_CHANNEL_MESSAGE::TurnDistance:
-                logv ("AA_CH_NAVI: HU_NAVI_CHANNEL_MESSAGE::TurnDistance");
-                hu_handle_NaviTurnDistance(chan, buf, len);
-                return (0);
-              default:
-                loge ("Unknown msg_type: %d", msg_type);
-                return (0);
-          }
-      }
-    }
+    hu_dispatch_entry * entry = hu_handler_find (chan, msg_type);
+    if (entry != NULL)
+      return (hu_dispatch (*entry, chan, buf, len));
 
-    loge ("Unknown chan: %d", chan);
+    if (iaap_state != hu_STATE_STARTIN && msg_type >= 0x8000 && (chan < 0 || chan >= AA_CH_MAX || !service_handlers [chan]))
+      loge ("Unknown chan: %d", chan);
+    else
+      loge ("Unknown chan: %d  msg_type: %d", chan, msg_type);
     return (0);
   }
 
   int HUServer::hu_queue_command(IHUAnyThreadInterface::HUThreadCommand&& command)
   {
+    HU_ALLOC_SCOPE (HU_ALLOC_SCOPE_COMMAND);
     IHUAnyThreadInterface::HUThreadCommand* ptr = new IHUAnyThreadInterface::HUThreadCommand(command);
     int ret = write(command_write_fd, &ptr, sizeof(ptr));
     if (ret < 0)
@@ -1166,6 +1242,11 @@
       delete ptr;
       loge("hu_queue_command error %d", ret);
     }
+    else
+    {
+      hu_metrics_add (hu_metrics.command_queue_depth, 1);
+    }
+    return (ret);
   }
 
   int HUServer::hu_aap_shutdown()
@@ -1206,6 +1287,7 @@
     logd ("  SET: iaap_state: %d (%s)", iaap_state, state_get (iaap_state));
 
     int ret = ihu_tra_stop ();                                           // Stop Transport/USBACC/OAP
+    hu_ssl_free ();                                                      // Keeps the session for resumption on reconnect
     iaap_state = hu_STATE_STOPPED;
     logd ("  SET: iaap_state: %d (%s)", iaap_state, state_get (iaap_state));
 
@@ -1243,6 +1325,7 @@
     }
     else if (ret == sizeof(ptr))
     {
+      hu_metrics_add (hu_metrics.command_queue_depth, -1);
       return ptr;
     }
     return nullptr;
@@ -1283,11 +1366,12 @@
       {
         if (FD_ISSET(command_read_fd, &sock_set))
         {
-          logd("Got command_read_fd");
+          hu_trace (HU_TRACE_THREAD_WAKE_COMMAND, -1);
           IHUAnyThreadInterface::HUThreadCommand* ptr = nullptr;
           if(ptr = hu_pop_command())
           {
-            logd("Running %p", ptr);
+            HU_ALLOC_SCOPE (HU_ALLOC_SCOPE_COMMAND);
+            hu_trace (HU_TRACE_COMMAND_RUN, -1, hu_metrics.command_queue_depth.load (std::memory_order_relaxed));
             (*ptr)(*this);
             delete ptr;
           }
@@ -1295,7 +1379,7 @@
         if (FD_ISSET(transportFD, &sock_set))
         {
           //data ready
-          logd("Got transportFD");
+          hu_trace (HU_TRACE_THREAD_WAKE_TRANSPORT, -1);
           ret = hu_aap_recv_process(iaap_tra_recv_tmo);
           if (ret < 0)
           {
@@ -1319,6 +1403,9 @@
 
     pthread_setname_np(pthread_self(), "main_thread");
 
+    for (auto & table : service_handlers)                               // Until this session's service discovery
+      table.reset ();
+
     iaap_state = hu_STATE_STARTIN;
     logd ("  SET: iaap_state: %d (%s)", iaap_state, state_get (iaap_state));
 
@@ -1329,8 +1416,14 @@
       return (ret);                                                     // Done if error
     }
 
+    if (iaap_plaintext) {
+      iaap_state = hu_STATE_STARTED;                                    // Nothing to negotiate, go straight to the session
+      logd ("  SET: iaap_state: %d (%s)", iaap_state, state_get (iaap_state));
+    }
+
     byte vr_buf [] = { 0, 1, 0, 1};                    // Version Request
-    ret = hu_aap_unenc_send_blob(0, AA_CH_CTR, HU_INIT_MESSAGE::VersionRequest, vr_buf, sizeof (vr_buf), 2000);
+    if (!iaap_plaintext)
+      ret = hu_aap_unenc_send_blob(0, AA_CH_CTR, HU_INIT_MESSAGE::VersionRequest, vr_buf, sizeof (vr_buf), 2000);
     if (ret < 0) {
       loge ("Version request send ret: %d", ret);
       return (-1);
@@ -1359,13 +1452,59 @@
     command_read_fd = pipefd[0];
     command_write_fd = pipefd[1];
     hu_thread_quit_flag = false;
+    hu_metrics_set (hu_metrics.command_queue_depth, 0);                 // Commands left in the old pipe died with it
+    hu_metrics_add (hu_metrics.sessions);
     hu_thread = std::thread([this] { this->hu_thread_main(); });
 
 
     return (0);
   }
 
+  // Hands the decrypted payload of a media message fragment to MediaPacketChunk before the rest of the message arrives.
+  // The assembly buffer is cut back to the message header after each chunk; the last fragment goes through iaap_msg_process as usual.
+  // Not while capturing, the capture needs the whole message.
+  int HUServer::hu_aap_stream_media_chunk (int chan, int flags, uint32_t total_size) {
+    HU_ALLOC_SCOPE (HU_ALLOC_SCOPE_MEDIA);
+    hu_media_stream_state & stream = media_stream [chan];
+    if (flags & HU_FRAME_FIRST_FRAME) {
+      stream.active = false;
+      if ((flags & HU_FRAME_LAST_FRAME) || chan == AA_CH_CTR || iaap_state != hu_STATE_STARTED || temp_assembly_buffer->size() < 2 || hu_capture_active ())
+        return (0);
+
+      uint16_t msg_type = be16toh(*reinterpret_cast<uint16_t*>(temp_assembly_buffer->data()));
+      int hdr = 0;
+      if (msg_type == (uint16_t) HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp)
+        hdr = 2 + 8;
+      else if (msg_type == (uint16_t) HU_PROTOCOL_MESSAGE::MediaData)
+        hdr = 2;
+      if (hdr == 0 || (int) temp_assembly_buffer->size() < hdr || (int) total_size < hdr || !callbacks.MediaStreamChunks(chan))
+        return (0);
+
+      stream.active = true;
+      stream.hdr = hdr;
+      stream.timestamp = hdr > 2 ? be64toh(*((uint64_t*)&(*temp_assembly_buffer)[2])) : 0;
+      stream.offset = 0;
+      stream.total = total_size - hdr;
+    }
+    else if (!stream.active || (flags & HU_FRAME_LAST_FRAME)) {
+      return (0);
+    }
+
+    int len = temp_assembly_buffer->size() - stream.hdr;
+    if (len <= 0)
+      return (0);
+    int ret = callbacks.MediaPacketChunk(chan, stream.timestamp, stream.offset, stream.total, &(*temp_assembly_buffer)[stream.hdr], len);
+    if (ret < 0) {
+      stream.active = false;
+      return (ret);
+    }
+    stream.offset += len;
+    temp_assembly_buffer->resize(stream.hdr);
+    return (0);
+  }
+
   int HUServer::hu_aap_recv_process (int tmo) {                                          //
+    HU_ALLOC_SCOPE (HU_ALLOC_SCOPE_TRANSPORT);
                                                                         // Terminate unless started or starting (we need to process when starting)
     if (iaap_state != hu_STATE_STARTED && iaap_state != hu_STATE_STARTIN) {
       loge ("CHECK: iaap_state: %d (%s)", iaap_state, state_get (iaap_state));
@@ -1380,6 +1519,7 @@
     bool has_last = false;
     bool has_first = false;
     int chan = -1;
+    int last_flags = 0;                                                 // Flags of the final frame, for the capture
     while (!has_last)
     {                                              // While length remaining to process,... Process Rx packet:
       have_len = hu_aap_tra_recv (enc_buf, min_size_hdr, tmo);
@@ -1409,9 +1549,10 @@
       chan = cur_chan;
 
       int flags = enc_buf [1];                                              // Flags
+      last_flags = flags;
       int frame_len = be16toh(*((uint16_t*)&enc_buf[2]));
 
-      logd("Frame flags %i len %i", flags, frame_len);
+      hu_trace (HU_TRACE_FRAME_RX, chan, flags, frame_len);
 
       if (frame_len > MAX_FRAME_PAYLOAD_SIZE)
       {
@@ -1431,7 +1572,7 @@
       int remaining_bytes_in_frame = (frame_len + header_size) - have_len;
       while(remaining_bytes_in_frame > 0)
       {
-        logd("Getting more %i", remaining_bytes_in_frame);
+        hu_trace (HU_TRACE_FRAME_RX_MORE, chan, remaining_bytes_in_frame);
         int got_bytes = hu_aap_tra_recv (&enc_buf[have_len], remaining_bytes_in_frame, tmo);     // Get Rx packet from Transport
         if (got_bytes < 0) {                                      // If we don't have a full 6 byte header at least...
           loge ("Recv got_bytes: %d", got_bytes);
@@ -1444,8 +1585,11 @@
       auto buffer = channel_assembly_buffers.find(chan);
       if (buffer != channel_assembly_buffers.end()) // Have old buffer with incomplete data for channel
       {
-        logd ("Found existing buffer for chan %s", chan_get (chan));
+        if (temp_assembly_buffer != NULL)                                   // Not preserved (held a finished message), so it's ours to free
+          delete temp_assembly_buffer;
         temp_assembly_buffer = buffer->second;
+        channel_assembly_buffers.erase(buffer);                             // The map only holds buffers that aren't current
+        hu_trace (HU_TRACE_FRAME_RX_RESUME, chan, 0, temp_assembly_buffer->size());
       }
       else if (temp_assembly_buffer == NULL) // Old buffer had incomplete data and was preserved, need to create new one
       {
@@ -1466,10 +1610,17 @@
       has_first = true;
       has_last = (flags & HU_FRAME_LAST_FRAME) != 0;
 
+      hu_channel_metrics & metrics = hu_metrics_chan (chan);
+      hu_metrics_add (metrics.rx_frames);
+      hu_metrics_add (metrics.rx_bytes, frame_len + header_size);
+      if (flags & HU_FRAME_FIRST_FRAME)
+        channel_rx_start_us [chan] = hu_get_time_us ();
+
+      uint32_t total_size = 0;
       if (has_total_size_header)
       {
-        uint32_t total_size = be32toh(*((uint32_t*)&enc_buf[4]));
-        logd("First only, total len %u", total_size);
+        total_size = be32toh(*((uint32_t*)&enc_buf[4]));
+        hu_trace (HU_TRACE_FRAME_RX_TOTAL, chan, 0, total_size);
         temp_assembly_buffer->reserve(total_size);
       }
       else
@@ -1480,40 +1631,61 @@
 
       if (flags & HU_FRAME_ENCRYPTED)
       {
+          uint64_t decrypt_start_us = hu_get_time_us ();
           size_t cur_vec = temp_assembly_buffer->size();
           temp_assembly_buffer->resize(cur_vec + frame_len); //just incase
 
-          int bytes_written = BIO_write (hu_ssl_rm_bio, &enc_buf[header_size], frame_len);           // Write encrypted to SSL input BIO
-          if (bytes_written <= 0) {
-            loge ("BIO_write() bytes_written: %d", bytes_written);
-            return (-1);
+          int bytes_read = 0;
+          if (hu_ssl_fast.active ())
+          {
+            bytes_read = hu_ssl_fast_recv (&enc_buf[header_size], frame_len, &(*temp_assembly_buffer)[cur_vec], frame_len);
+            if (bytes_read < 0)
+              return (-1);
           }
-          if (bytes_written != frame_len)
-            loge ("BIO_write() len: %d  bytes_written: %d  chan: %d %s", frame_len, bytes_written, chan, chan_get (chan));
-          else if (ena_log_verbo)
-            logd ("BIO_write() len: %d  bytes_written: %d  chan: %d %s", frame_len, bytes_written, chan, chan_get (chan));
-
-          int bytes_read = SSL_read (hu_ssl_ssl, &(*temp_assembly_buffer)[cur_vec], frame_len);   // Read decrypted to decrypted rx buf
-          if (bytes_read <= 0 || bytes_read > frame_len) {
-            loge ("SSL_read() bytes_read: %d  errno: %d", bytes_read, errno);
-            hu_ssl_ret_log (bytes_read);
-            return (-1);                                                      // Fatal so return error and de-initialize; Should we be able to recover, if Transport data got corrupted ??
+          else
+          {
+            hu_ssl_bio_state.set_input (&enc_buf[header_size], frame_len);                         // SSL reads the ciphertext straight from enc_buf
+
+            do
+            {
+              int ret_read = SSL_read (hu_ssl_ssl, &(*temp_assembly_buffer)[cur_vec + bytes_read], frame_len - bytes_read);   // Read decrypted to decrypted rx buf
+              if (ret_read <= 0 || bytes_read + ret_read > frame_len) {
+                loge ("SSL_read() bytes_read: %d  errno: %d", ret_read, errno);
+                hu_ssl_ret_log (ret_read);
+                hu_ssl_bio_state.set_input (NULL, 0);
+                return (-1);                                                      // Fatal so return error and de-initialize; Should we be able to recover, if Transport data got corrupted ??
+              }
+              bytes_read += ret_read;
+            } while (hu_ssl_bio_state.rd_len > 0);                                                    // More than one record in the frame
+            hu_ssl_bio_state.set_input (NULL, 0);
           }
+
           if (ena_log_verbo)
-            logd ("SSL_read() bytes_read: %d", bytes_read);
+            logd ("SSL_read() len: %d  bytes_read: %d  chan: %d %s", frame_len, bytes_read, chan, chan_get (chan));
 
           temp_assembly_buffer->resize(cur_vec + bytes_read);
+          metrics.decrypt_us.observe (hu_get_time_us () - decrypt_start_us);
       }
       else
       {
           temp_assembly_buffer->insert(temp_assembly_buffer->end(), &enc_buf[header_size], &enc_buf[frame_len+header_size]);
       }
+
+      if (hu_aap_stream_media_chunk (chan, flags, total_size) < 0)
+      {
+        loge ("MediaPacketChunk failed for chan %s", chan_get (chan));
+        return (-1);
+      }
     }
 
     const int buf_len = temp_assembly_buffer->size();
     if (buf_len >= 2)
     {
+      hu_metrics_add (hu_metrics_chan (chan).rx_messages);
       uint16_t msg_type = be16toh(*reinterpret_cast<uint16_t*>(temp_assembly_buffer->data()));
+      hu_trace (HU_TRACE_MSG_RX, chan, msg_type, buf_len - 2);
+      if (hu_capture_active ())
+        hu_capture_message (chan, last_flags, false, temp_assembly_buffer->data(), buf_len);
 
       ret = iaap_msg_process (chan, msg_type, &(*temp_assembly_buffer)[2], buf_len - 2);          // Decrypt & Process 1 received encrypted message
       if (ret < 0 && iaap_state != hu_STATE_STOPPED) {                                                    // If error...
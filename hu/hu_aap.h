@@ -82,7 +82,9 @@ public:
 enum class HU_TRANSPORT_TYPE
 {
     USB,
-    WIFI
+    WIFI,
+    REPLAY,                                                               // Capture file instead of a phone, see hu_replay.h
+    LOOPBACK                                                              // In-process fake phone, see hu_loopback.h
 };
 
 class IHUConnectionThreadInterface;
@@ -107,6 +109,8 @@ public:
   virtual int hu_aap_enc_send_message(int retry, int chan, uint16_t messageCode, const google::protobuf::MessageLite& message, int overrideTimeout = -1) = 0;
   virtual int hu_aap_enc_send_media_packet(int retry, int chan, uint16_t messageCode, uint64_t timeStamp, const byte* buffer, int bufferLen, int overrideTimeout = -1) = 0;
   virtual int hu_aap_unenc_send_blob(int retry, int chan, uint16_t messageCode, const byte* buffer, int bufferLen, int overrideTimeout = -1) = 0;
+  //buffer is an already encoded message, see hu_pb_fast.h
+  virtual int hu_aap_enc_send_blob(int retry, int chan, uint16_t messageCode, const byte* buffer, int bufferLen, int overrideTimeout = -1) = 0;
   virtual int hu_aap_unenc_send_message(int retry, int chan, uint16_t messageCode, const google::protobuf::MessageLite& message, int overrideTimeout = -1) = 0;
 
   template<typename EnumType>
@@ -127,6 +131,12 @@ public:
     return hu_aap_unenc_send_blob(retry, chan, static_cast<uint16_t>(messageCode), buffer, bufferLen, overrideTimeout);
   }
 
+  template<typename EnumType>
+  inline int hu_aap_enc_send_blob(int retry, int chan, EnumType messageCode, const byte* buffer, int bufferLen, int overrideTimeout = -1)
+  {
+    return hu_aap_enc_send_blob(retry, chan, static_cast<uint16_t>(messageCode), buffer, bufferLen, overrideTimeout);
+  }
+
   template<typename EnumType>
   inline int hu_aap_unenc_send_message(int retry, int chan, EnumType messageCode, const google::protobuf::MessageLite& message, int overrideTimeout = -1)
   {
@@ -136,6 +146,29 @@ public:
   virtual int hu_aap_stop() = 0;
 };
 
+//Handles one message, buf and len are its payload after the message type. Return < 0 to end the connection
+typedef std::function<int(IHUConnectionThreadInterface& stream, int chan, byte* buf, int len)> HUMessageHandler;
+
+//Service messages (msg_type 0x8000 and up) are looked up in a table per channel instead of a chain of ifs. The
+//table is refilled at every service discovery: each channel in the ServiceDiscoveryResponse gets the built in
+//handlers for its kind of service, so a channel added in CustomizeCarInfo (AU2, notifications, ...) works
+//without touching hu_aap.cpp. RegisterHandlers runs after that to add or replace handlers.
+class IHUHandlerRegistry
+{
+protected:
+  ~IHUHandlerRegistry() {}
+  IHUHandlerRegistry() {}
+public:
+  //Replaces whatever chan had for msg_type, an empty handler removes it. Stats are kept under name
+  virtual void hu_register_handler(int chan, uint16_t msg_type, const char* name, HUMessageHandler handler) = 0;
+
+  template<typename EnumType>
+  inline void hu_register_handler(int chan, EnumType msg_type, const char* name, HUMessageHandler handler)
+  {
+    hu_register_handler(chan, static_cast<uint16_t>(msg_type), name, std::move(handler));
+  }
+};
+
 //These callbacks are executed in the HU thread
 class IHUConnectionThreadEventCallbacks
 {
@@ -149,6 +182,10 @@ public:
 
   //return -1 for error
   virtual int MediaPacket(int chan, uint64_t timestamp, const byte * buf, int len) = 0;
+  //return true to get media on chan through MediaPacketChunk instead, one call per decrypted fragment as it arrives
+  virtual bool MediaStreamChunks(int chan) { return false; }
+  //offset and total are in payload bytes, the last chunk has offset + len == total, return -1 for error
+  virtual int MediaPacketChunk(int chan, uint64_t timestamp, int offset, int total, const byte * buf, int len) { return 0; }
   virtual int MediaStart(int chan) = 0;
   virtual int MediaStop(int chan) = 0;
   virtual void MediaSetupComplete(int chan) = 0;
@@ -162,6 +199,9 @@ public:
   virtual void CustomizeInputChannel(int chan, HU::ChannelDescriptor::InputStreamChannel& streamChannel) {}
   virtual void CustomizeBluetoothService(int chan, HU::ChannelDescriptor::BluetoothService& bluetoothService) {}
 
+  //At service discovery, once the built in handlers for the channels in the response are in
+  virtual void RegisterHandlers(IHUHandlerRegistry& registry) {}
+
   //returning a empty string means no bluetooth
   virtual std::string GetCarBluetoothAddress() { return std::string(); }
 
@@ -183,7 +223,13 @@ public:
 };
 
 
-class HUServer : protected IHUConnectionThreadInterface
+#define HU_INIT_MESSAGES     0x0008                                   // Handled while starting, before the handshake is done
+#define HU_CONTROL_MESSAGES  0x0020                                   // Below 0x8000, the same on every channel
+#define HU_SERVICE_MESSAGES  0x0020                                   // 0x8000 and up, per channel
+
+struct hu_handler_metrics;
+
+class HUServer : protected IHUConnectionThreadInterface, protected IHUHandlerRegistry
 {
 public:
   //Must be called from the "main" thread (as defined by the user)
@@ -191,7 +237,7 @@ public:
   int hu_aap_shutdown ();
 
   HUServer(IHUConnectionThreadEventCallbacks& callbacks);
-  ~HUServer() { hu_aap_shutdown(); }
+  ~HUServer();
 
   inline IHUAnyThreadInterface& GetAnyThreadInterface() { return *this; }
 
@@ -199,12 +245,22 @@ protected:
   IHUConnectionThreadEventCallbacks& callbacks;
   std::unique_ptr<HUTransportStream> transport;
   HU_STATE iaap_state = hu_STATE_INITIAL;
+  bool iaap_plaintext = false;                                          // No version exchange, handshake or encryption (replay)
   int iaap_tra_recv_tmo = 150;//100;//1;//10;//100;//250;//100;//250;//100;//25; // 10 doesn't work ? 100 does
   int iaap_tra_send_tmo = 500;//2;//25;//250;//500;//100;//500;//250;
   std::vector<uint8_t>* temp_assembly_buffer = new std::vector<uint8_t>();
   std::map<int, std::vector<uint8_t>*> channel_assembly_buffers;
   byte enc_buf[MAX_FRAME_SIZE] = {0};
   int32_t channel_session_id[AA_CH_MAX] = {0};
+  struct hu_media_stream_state {
+    bool active;                                                        // Fragments of the current message already went to MediaPacketChunk
+    int hdr;                                                            // Message type + timestamp bytes kept in the assembly buffer
+    uint64_t timestamp;
+    int offset;
+    int total;
+  };
+  hu_media_stream_state media_stream[AA_CH_MAX] = {};
+  uint64_t channel_rx_start_us[AA_CH_MAX] = {0};                       // First frame of the last message per channel, for ack latency
 
   std::thread hu_thread;
   int command_read_fd = -1;
@@ -215,39 +271,66 @@ protected:
 
   void hu_thread_main();
 
-  SSL_METHOD  * hu_ssl_method  = NULL;
-  SSL_CTX     * hu_ssl_ctx     = NULL;
+  SSL_CTX     * hu_ssl_ctx     = NULL;                                // Shared by all instances, never freed
   SSL         * hu_ssl_ssl    = NULL;
-  BIO         * hu_ssl_rm_bio = NULL;
-  BIO         * hu_ssl_wm_bio = NULL;
+  BIO         * hu_ssl_bio    = NULL;                                 // Frame BIO, see hu_ssl_frame_bio
+  hu_ssl_frame_bio hu_ssl_bio_state;
+  hu_ssl_aead   hu_ssl_fast;                                          // Used instead of SSL_read/SSL_write when active
+  uint64_t      hu_ssl_handshake_start_us = 0;
 
   void hu_ssl_ret_log (int ret);
   void hu_ssl_inf_log();
 
   int send_ssl_handshake_packet();
   int hu_ssl_begin_handshake ();
+  void hu_ssl_free ();
+  int hu_ssl_fast_recv (const byte * buf, int len, byte * out, int out_cap);
   int hu_handle_SSLHandshake(int chan, byte * buf, int len);
 
   int ihu_tra_start (HU_TRANSPORT_TYPE transportType, std::string& phoneIpAddress, bool waitForDevice);
   int ihu_tra_stop();
   int iaap_msg_process (int chan, uint16_t msg_type, byte * buf, int len);
 
+  struct hu_dispatch_entry {
+    HUMessageHandler handler;
+    hu_handler_metrics * metrics = NULL;
+  };
+  typedef int (HUServer::*hu_builtin_handler) (int chan, byte * buf, int len);
+
+  hu_dispatch_entry init_handlers [HU_INIT_MESSAGES];
+  hu_dispatch_entry control_handlers [HU_CONTROL_MESSAGES];
+  std::unique_ptr<hu_dispatch_entry[]> service_handlers [AA_CH_MAX];   // Null for channels nothing was registered on
+
+  HUMessageHandler hu_builtin (hu_builtin_handler handle);
+  void hu_set_handler (hu_dispatch_entry & entry, const char * name, HUMessageHandler handler);
+  void hu_register_service (const HU::ChannelDescriptor & channel);
+  hu_dispatch_entry * hu_handler_find (int chan, uint16_t msg_type);
+  int hu_dispatch (hu_dispatch_entry & entry, int chan, byte * buf, int len);
+  virtual void hu_register_handler(int chan, uint16_t msg_type, const char* name, HUMessageHandler handler) override;
+  using IHUHandlerRegistry::hu_register_handler;
+
+  int hu_aap_stream_media_chunk (int chan, int flags, uint32_t total_size);
+  int hu_aap_media_deliver (int chan, uint64_t timestamp, const byte * buf, int len);
+  int hu_aap_media_route (int chan, uint64_t timestamp, const byte * buf, int len);
   int hu_aap_tra_recv (byte * buf, int len, int tmo);                      // Used by intern,                      hu_ssl
   int hu_aap_tra_send (int retry, byte * buf, int len, int tmo);                      // Used by intern,                      hu_ssl
   int hu_aap_enc_send (int retry, int chan, byte * buf, int len, int overrideTimeout = -1);                     // Used by intern,            hu_jni     // Encrypted Send
   int hu_aap_unenc_send (int retry, int chan, byte * buf, int len, int overrideTimeout = -1);
+  int hu_aap_send_media_ack (int chan);
 
   int hu_aap_recv_process (int tmo);                                              // Used by          hu_mai,  hu_jni     // Process 1 encrypted receive message set:
                                                                                                                           // Respond to decrypted message
   virtual int hu_aap_enc_send_message(int retry, int chan, uint16_t messageCode, const google::protobuf::MessageLite& message, int overrideTimeout = -1) override;
   virtual int hu_aap_enc_send_media_packet(int retry, int chan, uint16_t messageCode, uint64_t timeStamp, const byte* buffer, int bufferLen, int overrideTimeout = -1) override;
   virtual int hu_aap_unenc_send_blob(int retry, int chan, uint16_t messageCode, const byte* buffer, int bufferLen, int overrideTimeout = -1) override;
+  virtual int hu_aap_enc_send_blob(int retry, int chan, uint16_t messageCode, const byte* buffer, int bufferLen, int overrideTimeout = -1) override;
   virtual int hu_aap_unenc_send_message(int retry, int chan, uint16_t messageCode, const google::protobuf::MessageLite& message, int overrideTimeout = -1) override;
   virtual int hu_aap_stop     () override;
 
   using IHUConnectionThreadInterface::hu_aap_enc_send_message;
   using IHUConnectionThreadInterface::hu_aap_enc_send_media_packet;
   using IHUConnectionThreadInterface::hu_aap_unenc_send_blob;
+  using IHUConnectionThreadInterface::hu_aap_enc_send_blob;
   using IHUConnectionThreadInterface::hu_aap_unenc_send_message;
 
   int hu_handle_VersionResponse (int chan, byte * buf, int len);
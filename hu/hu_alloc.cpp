@@ -0,0 +1,299 @@
+
+  #define LOGTAG "hu_alloc"
+  #include "hu_uti.h"
+  #include "hu_alloc.h"
+
+  #include <algorithm>
+  #include <atomic>
+  #include <map>
+  #include <mutex>
+
+  static const char * alloc_scope_names [HU_ALLOC_SCOPE_COUNT] = {"none", "transport", "protocol", "media", "command", "main_loop", "mic"};
+
+  const char * hu_alloc_scope_name (int scope) {
+    if (scope < 0 || scope >= HU_ALLOC_SCOPE_COUNT)
+      return ("unknown");
+    return (alloc_scope_names [scope]);
+  }
+
+  #ifdef HU_ALLOC_TRACK
+
+  #include <malloc.h>
+  #include <new>
+  #include <pthread.h>
+  #include <sys/prctl.h>
+  #include <sys/syscall.h>
+
+  // Nothing between here and the report code may allocate, lock or log: it runs inside malloc, on every thread,
+  // including before main and inside the allocator's own callers.
+
+  // A thread gives its slot back when it exits, so per-session threads don't use them up. The last slot is
+  // "other threads": exited threads' counts are folded into it, and threads past ALLOC_THREADS alive at once share it.
+  #define ALLOC_THREADS 64
+  #define ALLOC_OTHER   (ALLOC_THREADS - 1)
+
+  enum {ALLOC_ALLOCS, ALLOC_NEWS, ALLOC_FREES, ALLOC_BYTES, ALLOC_FREED_BYTES, ALLOC_FIELDS};
+
+  struct alloc_thread_slot {
+    std::atomic<bool> claimed;
+    std::atomic<int> tid;                                               // Set last, readers skip the slot until then
+    char name [16];
+    std::atomic<uint64_t> counts [HU_ALLOC_SCOPE_COUNT][ALLOC_FIELDS];  // Only the owning thread adds, except to ALLOC_OTHER
+  };
+
+  static alloc_thread_slot alloc_slots [ALLOC_THREADS];
+  static pthread_once_t alloc_key_once = PTHREAD_ONCE_INIT;
+  static pthread_key_t alloc_key;
+
+  __thread int hu_alloc_current_scope = HU_ALLOC_SCOPE_NONE;
+  static __thread alloc_thread_slot * alloc_slot = NULL;
+
+  static void alloc_thread_exit (void * slot);
+
+  static void alloc_key_create () {
+    pthread_key_create (& alloc_key, alloc_thread_exit);
+  }
+
+  extern "C" {
+    void * __libc_malloc (size_t size);
+    void * __libc_calloc (size_t count, size_t size);
+    void * __libc_realloc (void * ptr, size_t size);
+    void * __libc_memalign (size_t alignment, size_t size);
+    void   __libc_free (void * ptr);
+  }
+
+  static alloc_thread_slot * alloc_this_thread () {
+    if (alloc_slot == NULL) {
+      alloc_slot = & alloc_slots [ALLOC_OTHER];
+      for (int idx = 0; idx < ALLOC_OTHER; idx ++) {
+        if (alloc_slots [idx].claimed.load (std::memory_order_relaxed) || alloc_slots [idx].claimed.exchange (true, std::memory_order_acquire))
+          continue;
+        alloc_slot = & alloc_slots [idx];
+        prctl (PR_GET_NAME, alloc_slot->name);                         // Often renamed later, the report reads it again
+        alloc_slot->tid.store (syscall (SYS_gettid), std::memory_order_release);
+        // alloc_slot is set first, so an allocation in here counts to it instead of claiming another. pthread_once
+        // only locks the first time, and setting a low key doesn't allocate
+        pthread_once (& alloc_key_once, alloc_key_create);
+        pthread_setspecific (alloc_key, alloc_slot);
+        break;
+      }
+    }
+    return (alloc_slot);
+  }
+
+  static inline void alloc_add (int field, uint64_t n) {
+    int scope = hu_alloc_current_scope;
+    alloc_this_thread ()->counts [scope][field].fetch_add (n, std::memory_order_relaxed);
+  }
+
+  static inline void alloc_count (void * ptr) {
+    if (ptr == NULL)
+      return;
+    alloc_add (ALLOC_ALLOCS, 1);
+    alloc_add (ALLOC_BYTES, malloc_usable_size (ptr));
+  }
+
+  static inline void alloc_count_free (size_t usable) {
+    alloc_add (ALLOC_FREES, 1);
+    alloc_add (ALLOC_FREED_BYTES, usable);
+  }
+
+  extern "C" {
+
+  void * malloc (size_t size) {
+    void * ptr = __libc_malloc (size);
+    alloc_count (ptr);
+    return (ptr);
+  }
+
+  void * calloc (size_t count, size_t size) {
+    void * ptr = __libc_calloc (count, size);
+    alloc_count (ptr);
+    return (ptr);
+  }
+
+  void * realloc (void * ptr, size_t size) {
+    size_t old_usable = ptr ? malloc_usable_size (ptr) : 0;
+    void * new_ptr = __libc_realloc (ptr, size);
+    if (ptr && (new_ptr || size == 0))                                  // Counted as a free and an alloc, even when it grew in place
+      alloc_count_free (old_usable);
+    alloc_count (new_ptr);
+    return (new_ptr);
+  }
+
+  void * memalign (size_t alignment, size_t size) {
+    void * ptr = __libc_memalign (alignment, size);
+    alloc_count (ptr);
+    return (ptr);
+  }
+
+  void * aligned_alloc (size_t alignment, size_t size) {
+    return (memalign (alignment, size));
+  }
+
+  int posix_memalign (void ** out, size_t alignment, size_t size) {
+    if (alignment % sizeof (void *) != 0 || (alignment & (alignment - 1)) != 0)
+      return (EINVAL);
+    void * ptr = memalign (alignment, size);
+    if (ptr == NULL)
+      return (ENOMEM);
+    *out = ptr;
+    return (0);
+  }
+
+  void free (void * ptr) {
+    if (ptr == NULL)
+      return;
+    alloc_count_free (malloc_usable_size (ptr));
+    __libc_free (ptr);
+  }
+
+  }
+
+  // libstdc++'s operator new is malloc underneath, so these only add the count of how many came through new
+
+  void * operator new (size_t size) {
+    void * ptr = malloc (size ? size : 1);
+    if (ptr == NULL)
+      throw std::bad_alloc ();
+    alloc_add (ALLOC_NEWS, 1);
+    return (ptr);
+  }
+
+  void * operator new [] (size_t size) {
+    return (operator new (size));
+  }
+
+  void * operator new (size_t size, const std::nothrow_t &) noexcept {
+    void * ptr = malloc (size ? size : 1);
+    if (ptr)
+      alloc_add (ALLOC_NEWS, 1);
+    return (ptr);
+  }
+
+  void * operator new [] (size_t size, const std::nothrow_t & nothrow) noexcept {
+    return (operator new (size, nothrow));
+  }
+
+  void operator delete (void * ptr) noexcept {
+    free (ptr);
+  }
+
+  void operator delete [] (void * ptr) noexcept {
+    free (ptr);
+  }
+
+  // Report side, runs on the web server thread and may allocate like anything else
+
+  static std::mutex alloc_report_mutex;
+  static uint64_t alloc_window_base [ALLOC_THREADS][HU_ALLOC_SCOPE_COUNT][ALLOC_FIELDS];
+  static uint64_t alloc_window_start_us = hu_get_time_us ();           // Process start until the first reset
+
+  // The key's destructor, at thread exit. Counts and window base move to ALLOC_OTHER together, so the window
+  // keeps what the thread did in it, and the slot is free again. What the exiting thread frees after this counts there
+  static void alloc_thread_exit (void * p) {
+    alloc_thread_slot & slot = * reinterpret_cast<alloc_thread_slot *> (p);
+    int idx = & slot - alloc_slots;
+    alloc_thread_slot & other = alloc_slots [ALLOC_OTHER];
+    alloc_slot = & other;
+
+    std::lock_guard<std::mutex> lock (alloc_report_mutex);
+    slot.tid.store (0, std::memory_order_relaxed);
+    for (int scope = 0; scope < HU_ALLOC_SCOPE_COUNT; scope ++) {
+      for (int field = 0; field < ALLOC_FIELDS; field ++) {
+        other.counts [scope][field].fetch_add (slot.counts [scope][field].exchange (0, std::memory_order_relaxed), std::memory_order_relaxed);
+        alloc_window_base [ALLOC_OTHER][scope][field] += alloc_window_base [idx][scope][field];
+        alloc_window_base [idx][scope][field] = 0;
+      }
+    }
+    slot.claimed.store (false, std::memory_order_release);
+  }
+
+  static void alloc_refresh_name (alloc_thread_slot & slot, int tid) {
+    char path [64];
+    snprintf (path, sizeof (path), "/proc/self/task/%d/comm", tid);
+    FILE * fp = fopen (path, "r");
+    if (fp == NULL)                                                     // Exited, keep the last name seen
+      return;
+    char name [sizeof (slot.name)] = {0};
+    if (fgets (name, sizeof (name), fp)) {
+      name [strcspn (name, "\n")] = 0;
+      memcpy (slot.name, name, sizeof (name));
+    }
+    fclose (fp);
+  }
+
+  hu_alloc_report hu_alloc_get_report () {
+    std::lock_guard<std::mutex> lock (alloc_report_mutex);
+    hu_alloc_report report = {};
+    report.enabled = true;
+    uint64_t now_us = hu_get_time_us ();
+    report.window_s = (now_us - alloc_window_start_us) / 1000000.0;
+
+    std::map<std::pair<std::string, int>, hu_alloc_row> rows;
+    for (int idx = 0; idx < ALLOC_THREADS; idx ++) {
+      alloc_thread_slot & slot = alloc_slots [idx];
+      int tid = slot.tid.load (std::memory_order_acquire);
+      if (idx == ALLOC_OTHER)
+        strcpy (slot.name, "other threads");
+      else if (tid > 0)
+        alloc_refresh_name (slot, tid);
+      else
+        continue;
+      for (int scope = 0; scope < HU_ALLOC_SCOPE_COUNT; scope ++) {
+        uint64_t now [ALLOC_FIELDS];
+        for (int field = 0; field < ALLOC_FIELDS; field ++)
+          now [field] = slot.counts [scope][field].load (std::memory_order_relaxed);
+        report.live_bytes += (int64_t) now [ALLOC_BYTES] - (int64_t) now [ALLOC_FREED_BYTES];
+
+        const uint64_t * base = alloc_window_base [idx][scope];
+        if (now [ALLOC_ALLOCS] == base [ALLOC_ALLOCS] && now [ALLOC_FREES] == base [ALLOC_FREES])
+          continue;
+        hu_alloc_row & row = rows [std::make_pair (std::string (slot.name), scope)];
+        row.thread = slot.name;
+        row.scope = scope;
+        row.allocs += now [ALLOC_ALLOCS] - base [ALLOC_ALLOCS];
+        row.news += now [ALLOC_NEWS] - base [ALLOC_NEWS];
+        row.frees += now [ALLOC_FREES] - base [ALLOC_FREES];
+        row.bytes += now [ALLOC_BYTES] - base [ALLOC_BYTES];
+      }
+    }
+
+    for (auto & entry : rows) {
+      hu_alloc_row & row = entry.second;
+      if (report.window_s > 0) {
+        row.allocs_per_s = row.allocs / report.window_s;
+        row.bytes_per_s = row.bytes / report.window_s;
+      }
+      report.allocs += row.allocs;
+      report.bytes += row.bytes;
+      report.rows.push_back (row);
+    }
+    if (report.window_s > 0) {
+      report.allocs_per_s = report.allocs / report.window_s;
+      report.bytes_per_s = report.bytes / report.window_s;
+    }
+    std::sort (report.rows.begin (), report.rows.end (), [] (const hu_alloc_row & a, const hu_alloc_row & b) { return (a.allocs > b.allocs); });
+    return (report);
+  }
+
+  void hu_alloc_reset_window () {
+    std::lock_guard<std::mutex> lock (alloc_report_mutex);
+    for (int idx = 0; idx < ALLOC_THREADS; idx ++)
+      for (int scope = 0; scope < HU_ALLOC_SCOPE_COUNT; scope ++)
+        for (int field = 0; field < ALLOC_FIELDS; field ++)
+          alloc_window_base [idx][scope][field] = alloc_slots [idx].counts [scope][field].load (std::memory_order_relaxed);
+    alloc_window_start_us = hu_get_time_us ();
+  }
+
+  #else
+
+  hu_alloc_report hu_alloc_get_report () {
+    hu_alloc_report report = {};
+    return (report);
+  }
+
+  void hu_alloc_reset_window () {
+  }
+
+  #endif
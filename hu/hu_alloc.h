@@ -0,0 +1,70 @@
+#pragma once
+
+  // Allocation tracking for finding heap churn on the hot paths. Built with HU_ALLOC_TRACK ("make ALLOC_TRACK=1"),
+  // malloc, calloc, realloc, memalign and free are replaced with counting wrappers around the glibc allocator, which
+  // catches operator new, protobuf, glib and gstreamer too. Counts are kept per thread and per scope, the scope being
+  // whatever HU_ALLOC_SCOPE the thread is inside. /allocs serves them, with rates over a window that
+  // /allocs?action=reset restarts once a session is streaming, so the numbers are the steady state only. Threads that
+  // exited are summed as "other threads".
+  // Without HU_ALLOC_TRACK the scopes compile out and the report says it's disabled.
+
+  #include <stdint.h>
+  #include <string>
+  #include <vector>
+
+  enum hu_alloc_scope_id {
+    HU_ALLOC_SCOPE_NONE = 0,                                            // Outside any scope
+    HU_ALLOC_SCOPE_TRANSPORT,                                           // Frame reads, reassembly and decrypt
+    HU_ALLOC_SCOPE_PROTOCOL,                                            // Message handlers, protobuf parsing, replies
+    HU_ALLOC_SCOPE_MEDIA,                                               // Media sink callbacks
+    HU_ALLOC_SCOPE_COMMAND,                                             // Queueing and running HU thread commands
+    HU_ALLOC_SCOPE_MAIN_LOOP,                                           // run_on_main_thread and what it runs
+    HU_ALLOC_SCOPE_MIC,                                                 // Microphone capture
+    HU_ALLOC_SCOPE_COUNT
+  };
+
+  const char * hu_alloc_scope_name (int scope);
+
+  #ifdef HU_ALLOC_TRACK
+
+  extern __thread int hu_alloc_current_scope;
+
+  class hu_alloc_scope {
+    int prev;
+   public:
+    explicit hu_alloc_scope (int scope) : prev (hu_alloc_current_scope) { hu_alloc_current_scope = scope; }
+    ~hu_alloc_scope () { hu_alloc_current_scope = prev; }
+  };
+
+  #define HU_ALLOC_SCOPE(scope) hu_alloc_scope hu_alloc_scope_guard (scope)
+
+  #else
+
+  #define HU_ALLOC_SCOPE(scope) do {} while (0)
+
+  #endif
+
+  struct hu_alloc_row {
+    std::string thread;                                                 // Threads with the same name are summed
+    int         scope;
+    uint64_t    allocs;                                                 // In the window
+    uint64_t    news;                                                   // Of those, through operator new
+    uint64_t    frees;
+    uint64_t    bytes;                                                  // Allocated, as usable size
+    double      allocs_per_s;
+    double      bytes_per_s;
+  };
+
+  struct hu_alloc_report {
+    bool     enabled;
+    double   window_s;                                                  // Since the last reset, or since start
+    int64_t  live_bytes;                                                // Allocated minus freed since start
+    uint64_t allocs;                                                    // All threads, in the window
+    uint64_t bytes;
+    double   allocs_per_s;
+    double   bytes_per_s;
+    std::vector<hu_alloc_row> rows;                                     // Only the ones that allocated, busiest first
+  };
+
+  hu_alloc_report hu_alloc_get_report ();
+  void hu_alloc_reset_window ();
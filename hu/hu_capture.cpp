@@ -0,0 +1,273 @@
+
+  #define LOGTAG "hu_capture"
+  #include "hu_uti.h"
+  #include "hu_capture.h"
+
+  #include <mutex>
+  #include <condition_variable>
+  #include <thread>
+  #include <endian.h>
+  #include <time.h>
+
+  #define HU_CAPTURE_MAX_PENDING (2 * 1024 * 1024)                     // Bytes waiting for the writer before records get dropped
+
+  std::atomic<bool> hu_capture_on (false);
+
+  struct hu_capture_state {
+    std::mutex                 mutex;                                   // Guards everything below except the file, which only the writer touches
+    std::condition_variable    cv;
+    std::vector<unsigned char> pending;
+    bool                       quit = false;
+    uint64_t                   records = 0;
+    uint64_t                   bytes = 0;
+    uint64_t                   dropped = 0;
+    std::string                path;
+
+    std::mutex                 control_mutex;                           // Serialises start and stop
+    std::thread                writer;
+    FILE                     * file = NULL;
+  };
+
+  // Never destroyed, a capture may still be running when static destructors run
+  static hu_capture_state & capture_get () {
+    static hu_capture_state * state = new hu_capture_state ();
+    return (* state);
+  }
+
+  static void capture_writer_main (hu_capture_state & state) {
+    pthread_setname_np (pthread_self (), "hu_capture");
+    std::vector<unsigned char> writing;
+    std::unique_lock<std::mutex> lock (state.mutex);
+    while (true) {
+      state.cv.wait (lock, [&state] { return (state.quit || !state.pending.empty ()); });
+      if (state.pending.empty () && state.quit)
+        break;
+      writing.swap (state.pending);
+      lock.unlock ();
+
+      size_t written = fwrite (writing.data (), 1, writing.size (), state.file);
+      if (written != writing.size ())
+        loge ("Capture write failed: %s", strerror (errno));
+      writing.clear ();
+
+      lock.lock ();
+      state.bytes += written;
+    }
+    fflush (state.file);
+  }
+
+  static void capture_stop_locked (hu_capture_state & state) {
+    if (!state.writer.joinable ())
+      return;
+    hu_capture_on.store (false, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock (state.mutex);
+      state.quit = true;
+    }
+    state.cv.notify_one ();
+    state.writer.join ();
+    fclose (state.file);
+    state.file = NULL;
+    logw ("Capture %s stopped: %llu records %llu bytes %llu dropped", state.path.c_str (),
+          (unsigned long long) state.records, (unsigned long long) state.bytes, (unsigned long long) state.dropped);
+  }
+
+  int hu_capture_start (const std::string & path) {
+    hu_capture_state & state = capture_get ();
+    std::lock_guard<std::mutex> control (state.control_mutex);
+    capture_stop_locked (state);
+
+    FILE * file = fopen (path.c_str (), "wb");
+    if (file == NULL) {
+      loge ("Can't open capture file %s: %s", path.c_str (), strerror (errno));
+      return (-1);
+    }
+
+    hu_capture_file_header header;
+    memset (& header, 0, sizeof (header));
+    memcpy (header.magic, HU_CAPTURE_MAGIC, sizeof (header.magic));
+    struct timespec tp;
+    clock_gettime (CLOCK_REALTIME, & tp);
+    header.wall_start_us = htole64 ((uint64_t) tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000);
+    header.mono_start_us = htole64 (hu_get_time_us ());
+    if (fwrite (& header, sizeof (header), 1, file) != 1) {
+      loge ("Can't write capture file %s: %s", path.c_str (), strerror (errno));
+      fclose (file);
+      return (-1);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock (state.mutex);
+      state.pending.clear ();
+      state.pending.reserve (256 * 1024);
+      state.quit = false;
+      state.records = 0;
+      state.bytes = sizeof (header);
+      state.dropped = 0;
+      state.path = path;
+    }
+    state.file = file;
+    state.writer = std::thread ([&state] { capture_writer_main (state); });
+    hu_capture_on.store (true, std::memory_order_relaxed);
+    logw ("Capturing to %s", path.c_str ());
+    return (0);
+  }
+
+  void hu_capture_stop () {
+    hu_capture_state & state = capture_get ();
+    std::lock_guard<std::mutex> control (state.control_mutex);
+    capture_stop_locked (state);
+  }
+
+  hu_capture_stats hu_capture_get_stats () {
+    hu_capture_state & state = capture_get ();
+    std::lock_guard<std::mutex> lock (state.mutex);
+    hu_capture_stats stats;
+    stats.active = hu_capture_active ();
+    stats.path = state.path;
+    stats.records = state.records;
+    stats.bytes = state.bytes;
+    stats.dropped = state.dropped;
+    return (stats);
+  }
+
+  void hu_capture_message (int chan, int flags, bool outbound, const unsigned char * buf, int len) {
+    if (len < 2)
+      return;
+    hu_capture_record_header rec;
+    rec.ts_us = htole64 (hu_get_time_us ());
+    rec.len = htole32 (len - 2);
+    rec.msg_type = htole16 (be16toh (*(const uint16_t *) buf));
+    rec.chan = (uint8_t) chan;
+    rec.flags = (uint8_t) ((flags & 0x0c) | (outbound ? HU_CAPTURE_OUTBOUND : 0));   // Keep control and encrypted, first/last mean nothing here
+
+    hu_capture_state & state = capture_get ();
+    {
+      std::lock_guard<std::mutex> lock (state.mutex);
+      if (!hu_capture_active ())
+        return;
+      if (state.pending.size () + sizeof (rec) + len > HU_CAPTURE_MAX_PENDING) {
+        state.dropped ++;
+        return;
+      }
+      const unsigned char * rec_bytes = reinterpret_cast<const unsigned char *> (& rec);
+      state.pending.insert (state.pending.end (), rec_bytes, rec_bytes + sizeof (rec));
+      state.pending.insert (state.pending.end (), buf + 2, buf + len);
+      state.records ++;
+    }
+    state.cv.notify_one ();
+  }
+
+  hu_capture_reader::~hu_capture_reader () {
+    if (file)
+      fclose (file);
+  }
+
+  int hu_capture_reader::open (const char * path) {
+    if (file)
+      fclose (file);
+    file = fopen (path, "rb");
+    if (file == NULL) {
+      loge ("Can't open capture file %s: %s", path, strerror (errno));
+      return (-1);
+    }
+    if (fread (& header, sizeof (header), 1, file) != 1 || memcmp (header.magic, HU_CAPTURE_MAGIC, sizeof (header.magic)) != 0) {
+      loge ("%s is not a capture file", path);
+      fclose (file);
+      file = NULL;
+      return (-1);
+    }
+    header.wall_start_us = le64toh (header.wall_start_us);
+    header.mono_start_us = le64toh (header.mono_start_us);
+    return (0);
+  }
+
+  int hu_capture_reader::next (hu_capture_record_header & rec, std::vector<unsigned char> & payload) {
+    if (file == NULL)
+      return (-1);
+    size_t got = fread (& rec, 1, sizeof (rec), file);
+    if (got == 0)
+      return (0);
+    if (got != sizeof (rec))
+      return (-1);
+    rec.ts_us = le64toh (rec.ts_us);
+    rec.len = le32toh (rec.len);
+    rec.msg_type = le16toh (rec.msg_type);
+    payload.resize (rec.len);
+    if (rec.len > 0 && fread (payload.data (), rec.len, 1, file) != 1)
+      return (-1);
+    return (1);
+  }
+
+  void hu_capture_reader::rewind () {
+    if (file)
+      fseek (file, sizeof (header), SEEK_SET);
+  }
+
+  // pcapng with one LINKTYPE_USER0 interface. Each packet is chan (1), flags (1), msg_type (2, big endian) and the payload.
+  static bool pcapng_block (FILE * out, uint32_t type, const void * body, uint32_t body_len, const void * data, uint32_t data_len) {
+    static const unsigned char zero [4] = {0};
+    uint32_t pad = (4 - (data_len & 3)) & 3;
+    uint32_t total = 12 + body_len + data_len + pad;
+    return (fwrite (& type, 4, 1, out) == 1 && fwrite (& total, 4, 1, out) == 1
+         && (body_len == 0 || fwrite (body, body_len, 1, out) == 1)
+         && (data_len == 0 || fwrite (data, data_len, 1, out) == 1)
+         && (pad == 0 || fwrite (zero, pad, 1, out) == 1)
+         && fwrite (& total, 4, 1, out) == 1);
+  }
+
+  int hu_capture_export_pcapng (const char * capture_path, const char * pcapng_path) {
+    hu_capture_reader reader;
+    if (reader.open (capture_path) < 0)
+      return (-1);
+    FILE * out = fopen (pcapng_path, "wb");
+    if (out == NULL) {
+      loge ("Can't open %s: %s", pcapng_path, strerror (errno));
+      return (-1);
+    }
+
+    struct {
+      uint32_t magic;
+      uint16_t major;
+      uint16_t minor;
+      int64_t  section_len;
+    } __attribute__ ((packed)) shb = {0x1A2B3C4D, 1, 0, -1};
+    struct {
+      uint16_t link_type;
+      uint16_t reserved;
+      uint32_t snap_len;
+    } __attribute__ ((packed)) idb = {147, 0, 0};                      // LINKTYPE_USER0, no snap length limit
+    bool ok = pcapng_block (out, 0x0A0D0D0A, & shb, sizeof (shb), NULL, 0) && pcapng_block (out, 1, & idb, sizeof (idb), NULL, 0);
+
+    hu_capture_record_header rec;
+    std::vector<unsigned char> payload;
+    std::vector<unsigned char> packet;
+    int records = 0;
+    int ret = 0;
+    while (ok && (ret = reader.next (rec, payload)) > 0) {
+      uint64_t ts = reader.header.wall_start_us + (rec.ts_us - reader.header.mono_start_us);
+      packet.resize (4 + payload.size ());
+      packet [0] = rec.chan;
+      packet [1] = rec.flags;
+      packet [2] = rec.msg_type >> 8;
+      packet [3] = rec.msg_type & 0xff;
+      if (!payload.empty ())
+        memcpy (& packet [4], payload.data (), payload.size ());
+      struct {
+        uint32_t interface_id;
+        uint32_t ts_high;
+        uint32_t ts_low;
+        uint32_t captured_len;
+        uint32_t original_len;
+      } __attribute__ ((packed)) epb = {0, (uint32_t) (ts >> 32), (uint32_t) ts, (uint32_t) packet.size (), (uint32_t) packet.size ()};
+      ok = pcapng_block (out, 6, & epb, sizeof (epb), packet.data (), packet.size ());
+      records ++;
+    }
+    fclose (out);
+    if (!ok || ret < 0) {
+      loge ("Export of %s stopped after %d records: %s", capture_path, records, ok ? "truncated capture" : strerror (errno));
+      return (-1);
+    }
+    logw ("Exported %d records from %s to %s", records, capture_path, pcapng_path);
+    return (records);
+  }
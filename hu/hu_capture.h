@@ -0,0 +1,67 @@
+#pragma once
+
+  // Session capture: every message after reassembly/decryption (inbound) or before fragmentation/encryption (outbound)
+  // is copied into a memory buffer and written to disk by a background thread.
+  //
+  // File layout, little endian:
+  //   hu_capture_file_header
+  //   { hu_capture_record_header, payload [len] } ...
+  // The payload is the message body after the 2 byte message type, exactly as passed to iaap_msg_process.
+
+  #include <stdint.h>
+  #include <stdio.h>
+  #include <atomic>
+  #include <string>
+  #include <vector>
+
+  #define HU_CAPTURE_MAGIC   "HUCAP01"                                  // 8 bytes with the terminator
+  #define HU_CAPTURE_OUTBOUND 0x80                                      // In flags: sent by us, otherwise received from the phone
+
+  struct hu_capture_file_header {
+    char     magic [8];
+    uint64_t wall_start_us;                                             // CLOCK_REALTIME when the capture started
+    uint64_t mono_start_us;                                             // hu_get_time_us () at the same moment
+  } __attribute__ ((packed));
+
+  struct hu_capture_record_header {
+    uint64_t ts_us;                                                     // hu_get_time_us ()
+    uint32_t len;                                                       // Payload bytes
+    uint16_t msg_type;
+    uint8_t  chan;
+    uint8_t  flags;                                                     // HU_FRAME_CONTROL_MESSAGE / HU_FRAME_ENCRYPTED of the frames, plus HU_CAPTURE_OUTBOUND
+  } __attribute__ ((packed));
+
+  struct hu_capture_stats {
+    bool        active;
+    std::string path;
+    uint64_t    records;
+    uint64_t    bytes;                                                  // Written to the file so far
+    uint64_t    dropped;                                                // Records lost because the writer fell behind
+  };
+
+  extern std::atomic<bool> hu_capture_on;
+
+  inline bool hu_capture_active () {
+    return (hu_capture_on.load (std::memory_order_relaxed));
+  }
+
+  int  hu_capture_start (const std::string & path);                     // Replaces a running capture
+  void hu_capture_stop ();
+  hu_capture_stats hu_capture_get_stats ();
+
+  // buf starts at the 2 byte big endian message type, len includes it
+  void hu_capture_message (int chan, int flags, bool outbound, const unsigned char * buf, int len);
+
+  class hu_capture_reader {
+    FILE * file = NULL;
+  public:
+    hu_capture_file_header header;
+
+    ~hu_capture_reader ();
+    int  open (const char * path);                                      // -1 if missing or not a capture file
+    // Returns 1 with the next record, 0 at the end, -1 on a truncated file
+    int  next (hu_capture_record_header & rec, std::vector<unsigned char> & payload);
+    void rewind ();
+  };
+
+  int hu_capture_export_pcapng (const char * capture_path, const char * pcapng_path);
@@ -0,0 +1,274 @@
+
+  #define LOGTAG "hu_headless"
+  #include "hu_uti.h"
+  #include "hu_headless.h"
+  #include "hu_loopback.h"
+  #include "hu_replay.h"
+
+  #include <sys/resource.h>
+
+  static const uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+  static const uint64_t FNV_PRIME  = 0x100000001b3ULL;
+
+  static uint64_t headless_cpu_us () {
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, & usage);
+    return ((uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+  }
+
+  const char * hu_headless_callback_name (int cb) {
+    switch (cb) {
+      case HU_HEADLESS_CB_MEDIA_PACKET:   return ("MediaPacket");
+      case HU_HEADLESS_CB_MEDIA_CHUNK:    return ("MediaPacketChunk");
+      case HU_HEADLESS_CB_MEDIA_START:    return ("MediaStart");
+      case HU_HEADLESS_CB_MEDIA_STOP:     return ("MediaStop");
+      case HU_HEADLESS_CB_SETUP_COMPLETE: return ("MediaSetupComplete");
+      case HU_HEADLESS_CB_AUDIO_FOCUS:    return ("AudioFocusRequest");
+      case HU_HEADLESS_CB_VIDEO_FOCUS:    return ("VideoFocusRequest");
+    }
+    return ("<Invalid>");
+  }
+
+  bool hu_headless_transport (const char * name, HU_TRANSPORT_TYPE & transport) {
+    static const struct { const char * name; HU_TRANSPORT_TYPE type; } names [] = {
+      {"usb", HU_TRANSPORT_TYPE::USB}, {"wifi", HU_TRANSPORT_TYPE::WIFI}, {"loopback", HU_TRANSPORT_TYPE::LOOPBACK}, {"replay", HU_TRANSPORT_TYPE::REPLAY},
+    };
+    for (const auto & entry : names) {
+      if (strcmp (name, entry.name) == 0) {
+        transport = entry.type;
+        return (true);
+      }
+    }
+    return (false);
+  }
+
+  void HeadlessEventCallbacks::timed (hu_headless_callback cb, uint64_t start_us) {
+    uint64_t us = hu_get_time_us () - start_us;
+    hu_headless_callback_timing & t = timing [cb];
+    t.us.observe (us);
+    if (us > t.max_us.load (std::memory_order_relaxed))                 // Only the HU thread writes
+      t.max_us.store (us, std::memory_order_relaxed);
+  }
+
+  void HeadlessEventCallbacks::media (int chan, uint64_t timestamp, const byte * buf, int len, bool first) {
+    hu_headless_channel_stats & stats = channels [chan & (AA_CH_MAX - 1)];
+    if (stats.checksum == 0)
+      stats.checksum = FNV_OFFSET;
+    uint64_t hash = stats.checksum;
+    for (int idx = 0; idx < len; idx ++) {
+      hash ^= buf [idx];
+      hash *= FNV_PRIME;
+    }
+    stats.checksum = hash;
+    stats.bytes.fetch_add (len, std::memory_order_relaxed);
+    if (!first)
+      return;
+
+    uint64_t now_us = hu_get_time_us ();
+    if (stats.packets.load (std::memory_order_relaxed) == 0) {
+      stats.first_ts = timestamp;
+    }
+    else {
+      if (timestamp < stats.last_ts)
+        stats.ts_regressions ++;
+      if (stats.last_rx_us && now_us - stats.last_rx_us > stats.max_gap_us)
+        stats.max_gap_us = now_us - stats.last_rx_us;
+    }
+    stats.last_ts = timestamp;
+    stats.last_rx_us = now_us;
+    stats.packets.fetch_add (1, std::memory_order_relaxed);
+  }
+
+  int HeadlessEventCallbacks::MediaPacket (int chan, uint64_t timestamp, const byte * buf, int len) {
+    uint64_t start_us = hu_get_time_us ();
+    media (chan, timestamp, buf, len, true);
+    timed (HU_HEADLESS_CB_MEDIA_PACKET, start_us);
+    return (0);
+  }
+
+  int HeadlessEventCallbacks::MediaPacketChunk (int chan, uint64_t timestamp, int offset, int total, const byte * buf, int len) {
+    uint64_t start_us = hu_get_time_us ();
+    media (chan, timestamp, buf, len, offset == 0);
+    timed (HU_HEADLESS_CB_MEDIA_CHUNK, start_us);
+    return (0);
+  }
+
+  int HeadlessEventCallbacks::MediaStart (int chan) {
+    uint64_t start_us = hu_get_time_us ();
+    channels [chan & (AA_CH_MAX - 1)].starts ++;
+    channels [chan & (AA_CH_MAX - 1)].last_rx_us = 0;                   // Don't count the time stopped as a gap
+    timed (HU_HEADLESS_CB_MEDIA_START, start_us);
+    return (0);
+  }
+
+  int HeadlessEventCallbacks::MediaStop (int chan) {
+    uint64_t start_us = hu_get_time_us ();
+    channels [chan & (AA_CH_MAX - 1)].stops ++;
+    channels [chan & (AA_CH_MAX - 1)].last_rx_us = 0;
+    timed (HU_HEADLESS_CB_MEDIA_STOP, start_us);
+    return (0);
+  }
+
+  void HeadlessEventCallbacks::MediaSetupComplete (int chan) {
+    uint64_t start_us = hu_get_time_us ();
+    if (chan == AA_CH_VID && hu) {                                      // Take video focus like a real head unit does
+      hu->hu_queue_command ([] (IHUConnectionThreadInterface & s) {
+        HU::VideoFocus videoFocusGained;
+        videoFocusGained.set_mode (HU::VIDEO_FOCUS_MODE_FOCUSED);
+        videoFocusGained.set_unrequested (true);
+        s.hu_aap_enc_send_message (0, AA_CH_VID, HU_MEDIA_CHANNEL_MESSAGE::VideoFocus, videoFocusGained);
+      });
+    }
+    timed (HU_HEADLESS_CB_SETUP_COMPLETE, start_us);
+  }
+
+  void HeadlessEventCallbacks::DisconnectionOrError () {
+    std::lock_guard<std::mutex> lock (done_mutex);
+    disconnected = true;
+    done_cv.notify_all ();
+  }
+
+  bool HeadlessEventCallbacks::WaitForDisconnect (int timeout_ms) {
+    std::unique_lock<std::mutex> lock (done_mutex);
+    return (done_cv.wait_for (lock, std::chrono::milliseconds (timeout_ms), [this] { return disconnected; }));
+  }
+
+  void HeadlessEventCallbacks::AudioFocusRequest (int chan, const HU::AudioFocusRequest & request) {
+    uint64_t start_us = hu_get_time_us ();
+    HU::AudioFocusResponse response;
+    if (request.focus_type () == HU::AudioFocusRequest::AUDIO_FOCUS_RELEASE)
+      response.set_focus_type (HU::AudioFocusResponse::AUDIO_FOCUS_STATE_LOSS);
+    else
+      response.set_focus_type (HU::AudioFocusResponse::AUDIO_FOCUS_STATE_GAIN);
+    if (hu) {
+      hu->hu_queue_command ([chan, response] (IHUConnectionThreadInterface & s) {
+        s.hu_aap_enc_send_message (0, chan, HU_PROTOCOL_MESSAGE::AudioFocusResponse, response);
+      });
+    }
+    timed (HU_HEADLESS_CB_AUDIO_FOCUS, start_us);
+  }
+
+  void HeadlessEventCallbacks::VideoFocusRequest (int chan, const HU::VideoFocusRequest & request) {
+    uint64_t start_us = hu_get_time_us ();
+    bool focused = request.mode () == HU::VIDEO_FOCUS_MODE_FOCUSED;
+    if (hu) {
+      hu->hu_queue_command ([focused] (IHUConnectionThreadInterface & s) {
+        HU::VideoFocus videoFocus;
+        videoFocus.set_mode (focused ? HU::VIDEO_FOCUS_MODE_FOCUSED : HU::VIDEO_FOCUS_MODE_UNFOCUSED);
+        videoFocus.set_unrequested (false);
+        s.hu_aap_enc_send_message (0, AA_CH_VID, HU_MEDIA_CHANNEL_MESSAGE::VideoFocus, videoFocus);
+      });
+    }
+    timed (HU_HEADLESS_CB_VIDEO_FOCUS, start_us);
+  }
+
+  // Upper bound of the bucket holding the given fraction of the observations, 0 if there are none
+  static uint32_t headless_quantile_us (const hu_metric_histogram & hist, double fraction) {
+    uint64_t count = hist.count.load (std::memory_order_relaxed);
+    if (count == 0)
+      return (0);
+    uint64_t want = (uint64_t) (count * fraction);
+    uint64_t seen = 0;
+    for (int idx = 0; idx < HU_METRICS_BUCKETS - 1; idx ++) {
+      seen += hist.buckets [idx].load (std::memory_order_relaxed);
+      if (seen >= want)
+        return (hu_metrics_bucket_us [idx]);
+    }
+    return (UINT32_MAX);
+  }
+
+  void hu_headless_print_summary (const HeadlessEventCallbacks & callbacks, uint64_t elapsed_us, uint64_t cpu_us) {
+    double seconds = std::max (elapsed_us, (uint64_t) 1) / 1000000.0;
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, & usage);
+    printf ("\nHeadless session: %.1f s, CPU %.1f s (%.1f%% of a core, whole process), max RSS %ld kB\n",
+            seconds, cpu_us / 1000000.0, cpu_us / 10000.0 / seconds, usage.ru_maxrss);
+
+    printf ("\n%-10s %10s %10s %9s %9s %8s %9s %6s %18s\n", "channel", "packets", "MB", "pkt/s", "MB/s", "ts regr", "max gap", "start", "checksum");
+    for (int chan = 0; chan < AA_CH_MAX; chan ++) {
+      const hu_headless_channel_stats & stats = callbacks.channels [chan];
+      uint64_t packets = stats.packets.load (std::memory_order_relaxed);
+      uint64_t bytes = stats.bytes.load (std::memory_order_relaxed);
+      if (packets == 0 && stats.starts == 0)
+        continue;
+      printf ("%-10s %10llu %10.1f %9.1f %9.2f %8llu %7.1fms %6llu   %016llx\n", chan_get (chan), (unsigned long long) packets,
+              bytes / 1048576.0, packets / seconds, bytes / 1048576.0 / seconds, (unsigned long long) stats.ts_regressions,
+              stats.max_gap_us / 1000.0, (unsigned long long) stats.starts, (unsigned long long) stats.checksum);
+    }
+
+    printf ("\n%-20s %10s %10s %10s %10s\n", "callback", "calls", "mean us", "p99 <= us", "max us");
+    for (int cb = 0; cb < HU_HEADLESS_CB_COUNT; cb ++) {
+      const hu_headless_callback_timing & t = callbacks.timing [cb];
+      uint64_t count = t.us.count.load (std::memory_order_relaxed);
+      if (count == 0)
+        continue;
+      printf ("%-20s %10llu %10.1f %10u %10llu\n", hu_headless_callback_name (cb), (unsigned long long) count,
+              (double) t.us.sum_us.load (std::memory_order_relaxed) / count, headless_quantile_us (t.us, 0.99),
+              (unsigned long long) t.max_us.load (std::memory_order_relaxed));
+    }
+    printf ("\n");
+  }
+
+  int hu_headless_run (HU_TRANSPORT_TYPE transport, std::string address, int seconds, bool chunks) {
+    if (transport == HU_TRANSPORT_TYPE::LOOPBACK)
+      hu_fake_phone_config.duration_ms = 0;                             // We decide when the session ends
+
+    HeadlessEventCallbacks callbacks (chunks);
+    HUServer headunit (callbacks);
+    callbacks.SetServer (& headunit.GetAnyThreadInterface ());
+
+    uint64_t connect_us = hu_get_time_us ();
+    if (headunit.hu_aap_start (transport, address, true) < 0) {
+      loge ("hu_aap_start() failed");
+      return (1);
+    }
+    uint64_t start_us = hu_get_time_us ();
+    uint64_t cpu_start_us = headless_cpu_us ();
+    printf ("Headless session started in %.1f ms, running %s\n", (start_us - connect_us) / 1000.0, seconds > 0 ? "for the set time" : "until the phone goes away");
+
+    uint64_t last_report_us = start_us;
+    uint64_t last_bytes = 0;
+    bool disconnected = false;
+    while (!disconnected) {
+      uint64_t now_us = hu_get_time_us ();
+      int wait_ms = 10000;
+      if (seconds > 0) {
+        uint64_t end_us = start_us + (uint64_t) seconds * 1000000;
+        if (now_us >= end_us)
+          break;
+        wait_ms = std::min ((uint64_t) wait_ms, (end_us - now_us) / 1000 + 1);
+      }
+      disconnected = callbacks.WaitForDisconnect (wait_ms);
+
+      now_us = hu_get_time_us ();
+      if (now_us - last_report_us >= 10000000) {                        // Progress every 10 s
+        uint64_t bytes = 0;
+        for (int chan = 0; chan < AA_CH_MAX; chan ++)
+          bytes += callbacks.channels [chan].bytes.load (std::memory_order_relaxed);
+        printf ("  %6.0f s  media %8.2f MB/s  CPU %5.1f%%\n", (now_us - start_us) / 1000000.0,
+                (bytes - last_bytes) / 1048576.0 / ((now_us - last_report_us) / 1000000.0),
+                (headless_cpu_us () - cpu_start_us) / 10000.0 / ((now_us - start_us) / 1000000.0));
+        last_report_us = now_us;
+        last_bytes = bytes;
+      }
+    }
+    if (disconnected)
+      printf ("Phone disconnected\n");
+
+    uint64_t elapsed_us = hu_get_time_us () - start_us;
+    uint64_t cpu_us = headless_cpu_us () - cpu_start_us;
+    headunit.hu_aap_shutdown ();                                        // Joins the HU thread, the stats are ours alone after this
+    hu_headless_print_summary (callbacks, elapsed_us, cpu_us);
+
+    if (transport == HU_TRANSPORT_TYPE::LOOPBACK) {
+      hu_fake_phone_stats phone = hu_fake_phone_last_stats ();
+      printf ("Fake phone: MediaAck latency p50 %u us  p99 %u us  max %u us, %llu stalls\n", phone.ack_p50_us, phone.ack_p99_us,
+              phone.ack_max_us, (unsigned long long) phone.stalls);
+    }
+    else if (transport == HU_TRANSPORT_TYPE::REPLAY) {
+      hu_replay_stats replay = hu_replay_last_stats ();
+      printf ("Replay: %llu messages in, %llu matched %llu mismatched %llu missing\n", (unsigned long long) replay.messages_in,
+              (unsigned long long) replay.matched, (unsigned long long) replay.mismatched, (unsigned long long) replay.missing);
+    }
+    return (0);
+  }
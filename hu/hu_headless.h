@@ -0,0 +1,75 @@
+#pragma once
+
+#include "hu_aap.h"
+#include "hu_metrics.h"
+#include <mutex>
+#include <condition_variable>
+
+// Callbacks with no GStreamer, ALSA, SDL or D-Bus behind them, so the protocol core can be load tested on its own.
+// Media is checksummed and its timestamps tracked, focus requests are granted at once, and every callback is timed.
+// hu_headless_run drives one session over any transport and prints a summary; "headunit headless" calls it.
+
+enum hu_headless_callback {
+  HU_HEADLESS_CB_MEDIA_PACKET,
+  HU_HEADLESS_CB_MEDIA_CHUNK,
+  HU_HEADLESS_CB_MEDIA_START,
+  HU_HEADLESS_CB_MEDIA_STOP,
+  HU_HEADLESS_CB_SETUP_COMPLETE,
+  HU_HEADLESS_CB_AUDIO_FOCUS,
+  HU_HEADLESS_CB_VIDEO_FOCUS,
+  HU_HEADLESS_CB_COUNT
+};
+
+struct hu_headless_callback_timing {
+  hu_metric_histogram   us;
+  std::atomic<uint64_t> max_us;
+};
+
+struct hu_headless_channel_stats {
+  std::atomic<uint64_t> packets;                                        // Whole messages, chunks count once
+  std::atomic<uint64_t> bytes;
+  uint64_t checksum;                                                    // FNV-1a over every payload byte in order, HU thread only
+  uint64_t first_ts;                                                    // Media timestamps as sent by the phone
+  uint64_t last_ts;
+  uint64_t ts_regressions;                                              // Timestamp lower than the one before
+  uint64_t last_rx_us;
+  uint64_t max_gap_us;                                                  // Longest wait between two packets while started
+  uint64_t starts;
+  uint64_t stops;
+};
+
+class HeadlessEventCallbacks : public IHUConnectionThreadEventCallbacks
+{
+  IHUAnyThreadInterface * hu = nullptr;
+  bool chunks;
+  std::mutex done_mutex;
+  std::condition_variable done_cv;
+  bool disconnected = false;
+
+  void media (int chan, uint64_t timestamp, const byte * buf, int len, bool first);
+  void timed (hu_headless_callback cb, uint64_t start_us);
+ public:
+  hu_headless_channel_stats channels [AA_CH_MAX] = {};
+  hu_headless_callback_timing timing [HU_HEADLESS_CB_COUNT] = {};
+
+  HeadlessEventCallbacks(bool chunks = false) : chunks(chunks) {}
+  void SetServer(IHUAnyThreadInterface * server) { hu = server; }
+  bool WaitForDisconnect(int timeout_ms);                               // False on timeout
+
+  virtual int MediaPacket(int chan, uint64_t timestamp, const byte * buf, int len) override;
+  virtual bool MediaStreamChunks(int chan) override { return chunks; }
+  virtual int MediaPacketChunk(int chan, uint64_t timestamp, int offset, int total, const byte * buf, int len) override;
+  virtual int MediaStart(int chan) override;
+  virtual int MediaStop(int chan) override;
+  virtual void MediaSetupComplete(int chan) override;
+  virtual void DisconnectionOrError() override;
+  virtual void AudioFocusRequest(int chan, const HU::AudioFocusRequest& request) override;
+  virtual void VideoFocusRequest(int chan, const HU::VideoFocusRequest& request) override;
+};
+
+const char * hu_headless_callback_name (int cb);
+bool hu_headless_transport (const char * name, HU_TRANSPORT_TYPE & transport);   // usb, wifi, loopback or replay
+void hu_headless_print_summary (const HeadlessEventCallbacks & callbacks, uint64_t elapsed_us, uint64_t cpu_us);
+
+// One session for up to seconds (0: until the phone goes away), then the summary. Returns the process exit code.
+int hu_headless_run (HU_TRANSPORT_TYPE transport, std::string address, int seconds, bool chunks = false);
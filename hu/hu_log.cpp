@@ -0,0 +1,283 @@
+
+  // Log sink: lines are formatted on the calling thread and handed to a writer thread through a bounded byte ring,
+  // so a slow log file never stalls the HU thread. Full ring means the line is dropped and counted.
+
+  #define LOGTAG "hu_log"
+  #include "hu_uti.h"
+  #include "hu_metrics.h"
+
+  #include <mutex>
+  #include <condition_variable>
+  #include <thread>
+  #include <inttypes.h>
+  #include <algorithm>
+
+  extern int ena_log_debug;
+  extern int ena_log_warni;
+  extern int ena_log_error;
+
+  int ena_log_async      = 1;
+  int ena_log_rate_limit = 20;
+
+  #define HU_LOG_MAX_TAGS    64
+  #define HU_LOG_QUEUE_BYTES (64 * 1024)
+  #define HU_LOG_PRIO_OFF    8                                          // Above hu_LOG_ERR, silences a tag
+
+  struct hu_log_tag {
+    char             name [32];
+    std::atomic<int> level;                                             // 0 for the ena_log_* defaults, else the lowest prio printed
+  };
+
+  static hu_log_tag log_tags [HU_LOG_MAX_TAGS];
+  static std::atomic<int> log_tag_count (0);
+  static std::mutex log_tag_mutex;                                      // Only for adding tags
+
+  struct hu_log_queue {
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::mutex              write_mutex;                                // Held while a chunk is between the ring and stdout
+    char                    ring [HU_LOG_QUEUE_BYTES];
+    uint64_t                head = 0;                                   // Bytes ever queued
+    uint64_t                tail = 0;                                   // Bytes ever taken by the writer
+    uint64_t                dropped = 0;                                // Lines dropped since the writer last reported it
+    bool                    writer_started = false;
+  };
+
+  // Never destroyed: the detached writer thread is still waiting on the condition variable when static destructors run
+  static hu_log_queue & log_queue_get () {
+    static hu_log_queue * queue = new hu_log_queue ();
+    return (* queue);
+  }
+
+  static const char * prio_get (int prio) {
+    switch (prio) {
+      case hu_LOG_EXT: return ("X");
+      case hu_LOG_VER: return ("V");
+      case hu_LOG_DEB: return ("D");
+      case hu_LOG_WAR: return ("W");
+      case hu_LOG_ERR: return ("E");
+    }
+    return ("?");
+  }
+
+  const char * hu_log_level_name (int prio) {
+    switch (prio) {
+      case 0:               return ("default");
+      case hu_LOG_EXT:      return ("extra");
+      case hu_LOG_VER:      return ("verbose");
+      case hu_LOG_DEB:      return ("debug");
+      case hu_LOG_WAR:      return ("warn");
+      case hu_LOG_ERR:      return ("error");
+      case HU_LOG_PRIO_OFF: return ("off");
+    }
+    return ("?");
+  }
+
+  int hu_log_level_from_name (const std::string & name) {
+    static const int prios [] = {0, hu_LOG_EXT, hu_LOG_VER, hu_LOG_DEB, hu_LOG_WAR, hu_LOG_ERR, HU_LOG_PRIO_OFF};
+    for (int prio : prios) {
+      if (name == hu_log_level_name (prio))
+        return (prio);
+    }
+    return (-1);
+  }
+
+  static int log_tag_find (const char * tag, bool add) {
+    int count = log_tag_count.load (std::memory_order_acquire);
+    for (int idx = 0; idx < count; idx ++) {
+      if (strcmp (log_tags [idx].name, tag) == 0)
+        return (idx);
+    }
+    if (!add)
+      return (-1);
+
+    std::lock_guard<std::mutex> lock (log_tag_mutex);
+    count = log_tag_count.load (std::memory_order_relaxed);             // Someone may have added it meanwhile
+    for (int idx = 0; idx < count; idx ++) {
+      if (strcmp (log_tags [idx].name, tag) == 0)
+        return (idx);
+    }
+    if (count >= HU_LOG_MAX_TAGS)
+      return (-1);
+    strncpy (log_tags [count].name, tag, sizeof (log_tags [count].name) - 1);
+    log_tags [count].level.store (0, std::memory_order_relaxed);
+    log_tag_count.store (count + 1, std::memory_order_release);
+    return (count);
+  }
+
+  int hu_log_set_level (const char * tag, int prio) {
+    int idx = log_tag_find (tag, true);
+    if (idx < 0)
+      return (-1);
+    log_tags [idx].level.store (prio, std::memory_order_relaxed);
+    return (0);
+  }
+
+  std::vector<std::pair<std::string, int>> hu_log_levels () {
+    std::vector<std::pair<std::string, int>> levels;
+    int count = log_tag_count.load (std::memory_order_acquire);
+    for (int idx = 0; idx < count; idx ++)
+      levels.push_back (std::make_pair (std::string (log_tags [idx].name), log_tags [idx].level.load (std::memory_order_relaxed)));
+    return (levels);
+  }
+
+  // Moves queued bytes to stdout, returns false once there was nothing left. Caller holds queue.write_mutex.
+  static bool log_queue_write_locked (std::unique_lock<std::mutex> & queue_lock) {
+    hu_log_queue & queue = log_queue_get ();
+    static char chunk [HU_LOG_QUEUE_BYTES];
+    uint64_t dropped = queue.dropped;
+    queue.dropped = 0;
+    size_t len = queue.head - queue.tail;
+    size_t pos = queue.tail % HU_LOG_QUEUE_BYTES;
+    size_t first = std::min (len, (size_t) HU_LOG_QUEUE_BYTES - pos);
+    memcpy (chunk, & queue.ring [pos], first);
+    memcpy (chunk + first, queue.ring, len - first);
+    queue.tail += len;
+    queue_lock.unlock ();
+
+    if (len)
+      fwrite (chunk, 1, len, stdout);
+    if (dropped)                                                        // The drops came after everything that made it into the ring
+      fprintf (stdout, "... %" PRIu64 " log lines dropped, writer fell behind\n", dropped);
+    fflush (stdout);
+
+    queue_lock.lock ();
+    return (len > 0 || dropped > 0);
+  }
+
+  static void log_writer_main () {
+    hu_log_queue & queue = log_queue_get ();
+    pthread_setname_np (pthread_self (), "hu_log_writer");
+    while (true) {
+      {
+        std::unique_lock<std::mutex> queue_lock (queue.mutex);
+        queue.cv.wait (queue_lock, [&queue] { return (queue.head != queue.tail || queue.dropped != 0); });
+      }
+      std::lock_guard<std::mutex> write_lock (queue.write_mutex);       // Always write then queue, same as hu_log_flush
+      std::unique_lock<std::mutex> queue_lock (queue.mutex);
+      while (log_queue_write_locked (queue_lock))
+        ;
+    }
+  }
+
+  static void log_flush_at_exit () {
+    hu_log_flush (true);
+  }
+
+  void hu_log_flush (bool wait) {
+    hu_log_queue & queue = log_queue_get ();
+    std::unique_lock<std::mutex> write_lock (queue.write_mutex, std::defer_lock);
+    if (wait)
+      write_lock.lock ();
+    else if (!write_lock.try_lock ())
+      return;
+    std::unique_lock<std::mutex> queue_lock (queue.mutex, std::defer_lock);
+    if (wait)
+      queue_lock.lock ();
+    else if (!queue_lock.try_lock ())
+      return;
+    while (log_queue_write_locked (queue_lock))
+      ;
+  }
+
+  static void log_enqueue (const char * line, int len) {
+    hu_log_queue & queue = log_queue_get ();
+    std::unique_lock<std::mutex> lock (queue.mutex);
+    if (!queue.writer_started) {
+      queue.writer_started = true;
+      std::thread (log_writer_main).detach ();
+      atexit (log_flush_at_exit);
+    }
+    if (HU_LOG_QUEUE_BYTES - (queue.head - queue.tail) < (uint64_t) len) {
+      queue.dropped ++;
+      hu_metrics_add (hu_metrics.log_dropped);
+      return;
+    }
+    size_t pos = queue.head % HU_LOG_QUEUE_BYTES;
+    size_t first = std::min ((size_t) len, (size_t) HU_LOG_QUEUE_BYTES - pos);
+    memcpy (& queue.ring [pos], line, first);
+    memcpy (queue.ring, line + first, len - first);
+    queue.head += len;
+    lock.unlock ();
+    queue.cv.notify_one ();
+  }
+
+  static bool log_enabled (hu_log_site * site, int prio) {
+    int tag_index = site->tag_index.load (std::memory_order_relaxed);
+    if (tag_index == -1) {
+      tag_index = log_tag_find (site->tag, true);
+      site->tag_index.store (tag_index < 0 ? -2 : tag_index, std::memory_order_relaxed);   // -2: tag table full, use the defaults
+    }
+    int level = tag_index >= 0 ? log_tags [tag_index].level.load (std::memory_order_relaxed) : 0;
+    if (level > 0)
+      return (prio >= level);
+
+    if (! ena_log_extra && prio == hu_LOG_EXT)
+      return (false);
+    if (! ena_log_verbo && prio == hu_LOG_VER)
+      return (false);
+    if (! ena_log_debug && prio == hu_LOG_DEB)
+      return (false);
+    if (! ena_log_warni && prio == hu_LOG_WAR)
+      return (false);
+    if (! ena_log_error && prio == hu_LOG_ERR)
+      return (false);
+    return (true);
+  }
+
+  // Returns false if the site is over its budget for this second. *suppressed gets the count from the last window.
+  static bool log_rate_ok (hu_log_site * site, uint64_t now_us, uint32_t * suppressed) {
+    *suppressed = 0;
+    if (ena_log_rate_limit <= 0)
+      return (true);
+    uint64_t start = site->window_start_us.load (std::memory_order_relaxed);
+    if (now_us - start >= 1000000 && site->window_start_us.compare_exchange_strong (start, now_us, std::memory_order_relaxed)) {
+      site->window_count.store (0, std::memory_order_relaxed);
+      *suppressed = site->suppressed.exchange (0, std::memory_order_relaxed);
+    }
+    if (site->window_count.fetch_add (1, std::memory_order_relaxed) >= (uint32_t) ena_log_rate_limit) {
+      site->suppressed.fetch_add (1, std::memory_order_relaxed);
+      hu_metrics_add (hu_metrics.log_suppressed);
+      return (false);
+    }
+    return (true);
+  }
+
+  int hu_log (hu_log_site * site, int prio, const char * func, const char * fmt, ...) {
+    if (!log_enabled (site, prio))
+      return (-1);
+
+    uint64_t now_us = hu_get_time_us ();
+    uint32_t suppressed = 0;
+    if (!log_rate_ok (site, now_us, & suppressed))
+      return (-1);
+
+    va_list ap;
+    va_start (ap, fmt);
+  #ifdef __ANDROID_API__
+    char tag_str [512] = {0};
+    snprintf (tag_str, sizeof (tag_str), "%32.32s", func);
+    __android_log_vprint (prio, tag_str, fmt, ap);
+  #else
+    char log_line [4096];
+    int len = 0;
+    if (suppressed)
+      len = snprintf (log_line, sizeof (log_line), "%" PRIu64 ".%06u %s: %s: %s : (%u similar lines suppressed)\n",
+                      now_us / 1000000, (unsigned int) (now_us % 1000000), prio_get (prio), site->where, func, suppressed);
+    len += snprintf (log_line + len, sizeof (log_line) - len, "%" PRIu64 ".%06u %s: %s: %s : ",
+                     now_us / 1000000, (unsigned int) (now_us % 1000000), prio_get (prio), site->where, func);
+    len += vsnprintf (log_line + len, sizeof (log_line) - len, fmt, ap);
+    if (len > (int) sizeof (log_line) - 2)
+      len = sizeof (log_line) - 2;
+    log_line [len ++] = '\n';
+    log_line [len] = 0;
+
+    if (ena_log_async)
+      log_enqueue (log_line, len);
+    else
+      fwrite (log_line, 1, len, stdout);
+  #endif
+    va_end (ap);
+
+    return (0);
+  }
@@ -0,0 +1,555 @@
+
+  #define LOGTAG "hu_loopback"
+  #include "hu_uti.h"
+  #include "hu_loopback.h"
+
+  #include <openssl/ssl.h>
+  #include <openssl/err.h>
+  #include <sys/socket.h>
+  #include <poll.h>
+  #include <fcntl.h>
+  #include <algorithm>
+
+  hu_fake_phone_options hu_fake_phone_config;
+
+  #define PHONE_FRAGMENT_SIZE (MAX_FRAME_PAYLOAD_SIZE - 256)            // The HU drops frames over MAX_FRAME_PAYLOAD_SIZE, so leave room for the record overhead
+  #define PHONE_LATENCY_SAMPLES 65536
+
+  static std::mutex last_stats_mutex;
+  static hu_fake_phone_stats last_stats = {};
+
+  static pthread_once_t phone_ctx_once = PTHREAD_ONCE_INIT;
+  static SSL_CTX * phone_ctx = NULL;                                    // Shared by all phones, never freed
+
+  static void phone_ctx_init () {
+    SSL_CTX * ctx = hu_ssl_ctx_new (TLSv1_2_server_method ());          // Our own certificate stands in for the phone's
+    if (ctx == NULL)
+      return;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && defined (SSL_CTX_set_ecdh_auto)
+    SSL_CTX_set_ecdh_auto (ctx, 1);
+#endif
+    phone_ctx = ctx;
+  }
+
+  hu_fake_phone_stats hu_fake_phone_last_stats () {
+    std::lock_guard<std::mutex> lock (last_stats_mutex);
+    return (last_stats);
+  }
+
+  hu_fake_phone::hu_fake_phone (int fd, int done_fd, const hu_fake_phone_options & options) : fd (fd), done_fd (done_fd), options (options), quit (false), live (new hu_fake_phone_live ()) {
+    // Synthetic media: an IDR NAL of filler for video, a ramp for audio. Each keeps 8 bytes in front for the timestamp.
+    video_frame.resize (8 + std::max (options.video_frame_bytes, 5));
+    static const unsigned char nal [] = {0, 0, 0, 1, 0x65};
+    memcpy (& video_frame [8], nal, sizeof (nal));
+    uint32_t seed = 0x12345678;
+    for (size_t idx = 8 + sizeof (nal); idx < video_frame.size (); idx ++) {
+      seed = seed * 1103515245 + 12345;
+      video_frame [idx] = (seed >> 16) | 0x01;                          // Never a start code
+    }
+    audio_packet.resize (8 + 48000 * 2 * 2 * std::max (options.audio_packet_ms, 1) / 1000);
+    for (size_t idx = 8; idx < audio_packet.size (); idx ++)
+      audio_packet [idx] = idx & 0xff;
+  }
+
+  hu_fake_phone::~hu_fake_phone () {
+    stop ();
+    if (ssl)
+      SSL_free (ssl);                                                   // Also frees the BIOs
+    close (fd);
+  }
+
+  int hu_fake_phone::start () {
+    pthread_once (& phone_ctx_once, phone_ctx_init);
+    if (phone_ctx == NULL) {
+      loge ("No SSL context for the fake phone");
+      return (-1);
+    }
+    ssl = SSL_new (phone_ctx);
+    rbio = BIO_new (BIO_s_mem ());
+    wbio = BIO_new (BIO_s_mem ());
+    if (ssl == NULL || rbio == NULL || wbio == NULL) {
+      loge ("SSL_new() or BIO_new() failed");
+      return (-1);
+    }
+    SSL_set_bio (ssl, rbio, wbio);
+    SSL_set_accept_state (ssl);
+
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    thread = std::thread ([this] { main_loop (); });
+    return (0);
+  }
+
+  void hu_fake_phone::stop () {
+    quit = true;
+    if (thread.joinable ())
+      thread.join ();
+  }
+
+  int hu_fake_phone::read_available (bool block, int tmo_ms) {
+    if (block) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll (& pfd, 1, tmo_ms) <= 0)
+        return (0);
+    }
+    unsigned char buf [16384];
+    while (true) {
+      int ret = recv (fd, buf, sizeof (buf), 0);
+      if (ret > 0) {
+        rx.insert (rx.end (), buf, buf + ret);
+        continue;
+      }
+      if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return (0);
+      return (-1);                                                      // HU closed its end
+    }
+  }
+
+  int hu_fake_phone::write_all (const unsigned char * buf, int len) {
+    int written = 0;
+    while (written < len) {
+      if (quit)
+        return (-1);
+      int ret = send (fd, buf + written, len - written, MSG_NOSIGNAL);
+      if (ret > 0) {
+        written += ret;
+        continue;
+      }
+      if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return (-1);
+      struct pollfd pfd = {fd, POLLOUT | POLLIN, 0};                    // Keep reading so the HU never blocks on us while we block on it
+      poll (& pfd, 1, 100);
+      if ((pfd.revents & POLLIN) && read_available (false, 0) < 0)
+        return (-1);
+    }
+    return (0);
+  }
+
+  int hu_fake_phone::send_message (int chan, uint16_t msg_type, const unsigned char * buf, int len, uint64_t now_us, int interleave_chan) {
+    std::vector<unsigned char> plain;                                   // The interleaved send below reuses the scratch, so hold it here meanwhile
+    plain.swap (plain_scratch);
+    plain.resize (2 + len);
+    plain [0] = msg_type >> 8;
+    plain [1] = msg_type & 0xff;
+    if (len > 0)
+      memcpy (& plain [2], buf, len);
+
+    byte base_flags = encrypted ? HU_FRAME_ENCRYPTED : 0;
+    if (chan != AA_CH_CTR && msg_type >= 2 && msg_type < 0x8000)
+      base_flags |= HU_FRAME_CONTROL_MESSAGE;
+
+    byte frame [MAX_FRAME_SIZE];
+    int total = plain.size ();
+    for (int frag_start = 0; frag_start < total; frag_start += PHONE_FRAGMENT_SIZE) {
+      byte flags = base_flags;
+      if (frag_start == 0)
+        flags |= HU_FRAME_FIRST_FRAME;
+      int cur_len = PHONE_FRAGMENT_SIZE;
+      if (frag_start + PHONE_FRAGMENT_SIZE >= total) {
+        flags |= HU_FRAME_LAST_FRAME;
+        cur_len = total - frag_start;
+      }
+
+      frame [0] = chan;
+      frame [1] = flags;
+      int header_size = 4;
+      if ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) {
+        *((uint32_t *) & frame [header_size]) = htobe32 (total);
+        header_size += 4;
+      }
+
+      int frame_len = cur_len;
+      if (encrypted) {
+        if (SSL_write (ssl, & plain [frag_start], cur_len) != cur_len) {
+          loge ("Fake phone SSL_write() failed");
+          return (-1);
+        }
+        frame_len = BIO_read (wbio, & frame [header_size], sizeof (frame) - header_size);
+        if (frame_len <= 0 || BIO_ctrl_pending (wbio) > 0) {
+          loge ("Fake phone record doesn't fit a frame");
+          return (-1);
+        }
+      }
+      else {
+        memcpy (& frame [header_size], & plain [frag_start], cur_len);
+      }
+      *((uint16_t *) & frame [2]) = htobe16 (frame_len);
+
+      if (write_all (frame, header_size + frame_len) < 0)
+        return (-1);
+      if (frag_start == 0 && !(flags & HU_FRAME_LAST_FRAME) && interleave_chan >= 0 && send_media (interleave_chan, now_us, -1) < 0)
+        return (-1);
+    }
+    plain.swap (plain_scratch);
+    return (0);
+  }
+
+  int hu_fake_phone::send_message (int chan, uint16_t msg_type, const google::protobuf::MessageLite & message) {
+    std::string body = message.SerializeAsString ();
+    return (send_message (chan, msg_type, (const unsigned char *) body.data (), body.size ()));
+  }
+
+  int hu_fake_phone::send_handshake_output () {
+    int pending = BIO_ctrl_pending (wbio);
+    if (pending <= 0)
+      return (0);
+    std::vector<unsigned char> out (pending);
+    BIO_read (wbio, out.data (), pending);
+    return (send_message (AA_CH_CTR, (uint16_t) HU_INIT_MESSAGE::SSLHandshake, out.data (), pending));
+  }
+
+  int hu_fake_phone::handle_message (int chan, uint16_t msg_type, const unsigned char * buf, int len) {
+    uint64_t now_us = hu_get_time_us ();
+    if (!encrypted) {
+      switch ((HU_INIT_MESSAGE) msg_type) {
+        case HU_INIT_MESSAGE::VersionRequest: {
+          start_us = now_us;
+          static const unsigned char version [] = {0, 1, 0, 1, 0, 0};   // 1.1, status OK
+          return (send_message (AA_CH_CTR, (uint16_t) HU_INIT_MESSAGE::VersionResponse, version, sizeof (version)));
+        }
+        case HU_INIT_MESSAGE::SSLHandshake: {
+          BIO_write (rbio, buf, len);
+          int ret = SSL_do_handshake (ssl);
+          if (ret != 1 && SSL_get_error (ssl, ret) != SSL_ERROR_WANT_READ) {
+            loge ("Fake phone SSL_do_handshake() ret: %d  err: %d", ret, SSL_get_error (ssl, ret));
+            return (-1);
+          }
+          return (send_handshake_output ());
+        }
+        case HU_INIT_MESSAGE::AuthComplete: {
+          if (!SSL_is_init_finished (ssl)) {
+            loge ("AuthComplete before the handshake finished");
+            return (-1);
+          }
+          encrypted = true;
+          stats.handshake_ok = true;
+          stats.handshake_us = now_us - start_us;
+          HU::ServiceDiscoveryRequest request;
+          request.set_phone_name ("hu_fake_phone");
+          return (send_message (AA_CH_CTR, (uint16_t) HU_PROTOCOL_MESSAGE::ServiceDiscoveryRequest, request));
+        }
+        default:
+          logw ("Fake phone ignoring init msg_type: %d", msg_type);
+          return (0);
+      }
+    }
+
+    if (chan == AA_CH_CTR) {
+      switch ((HU_PROTOCOL_MESSAGE) msg_type) {
+        case HU_PROTOCOL_MESSAGE::ServiceDiscoveryResponse: {
+          HU::ServiceDiscoveryResponse response;
+          if (!response.ParseFromArray (buf, len)) {
+            loge ("Fake phone can't parse ServiceDiscoveryResponse");
+            return (-1);
+          }
+          for (const HU::ChannelDescriptor & channel : response.channels ()) {
+            if (!channel.has_output_stream_channel () || channel.channel_id () >= AA_CH_MAX)
+              continue;
+            const HU::ChannelDescriptor::OutputStreamChannel & output = channel.output_stream_channel ();
+            bool video = output.type () == HU::STREAM_TYPE_VIDEO;
+            bool media_audio = output.type () == HU::STREAM_TYPE_AUDIO && output.audio_type () == HU::AUDIO_TYPE_MEDIA;
+            if (!(video && options.video) && !(media_audio && options.audio))
+              continue;
+            int id = channel.channel_id ();
+            streams [id].open = true;
+            streams [id].video = video;
+            media_chans.push_back (id);
+            HU::ChannelOpenRequest request;
+            request.set_priority (0);
+            request.set_id (id);
+            if (send_message (id, (uint16_t) HU_PROTOCOL_MESSAGE::ChannelOpenRequest, request) < 0)
+              return (-1);
+          }
+          return (0);
+        }
+        case HU_PROTOCOL_MESSAGE::ShutdownRequest: {
+          HU::ShutdownResponse response;
+          send_message (AA_CH_CTR, (uint16_t) HU_PROTOCOL_MESSAGE::ShutdownResponse, response);
+          finished = true;
+          return (0);
+        }
+        case HU_PROTOCOL_MESSAGE::ShutdownResponse:
+          finished = true;
+          return (0);
+        default:
+          return (0);
+      }
+    }
+
+    media_stream & stream = streams [chan];
+    if (!stream.open)
+      return (0);
+    if (msg_type == (uint16_t) HU_PROTOCOL_MESSAGE::ChannelOpenResponse) {
+      HU::MediaSetupRequest request;
+      request.set_type (stream.video ? 3 : 1);
+      return (send_message (chan, (uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaSetupRequest, request));
+    }
+    if (msg_type == (uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaSetupResponse) {
+      HU::MediaSetupResponse response;
+      if (response.ParseFromArray (buf, len))
+        stream.max_unacked = std::max ((int) response.max_unacked (), 1);
+      HU::MediaStartRequest request;
+      request.set_session (chan);
+      request.set_config (0);
+      if (send_message (chan, (uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaStartRequest, request) < 0)
+        return (-1);
+      int rate = stream.video ? options.video_fps : (options.audio_packet_ms > 0 ? 1000 / options.audio_packet_ms : 0);
+      stream.interval_us = rate > 0 ? 1000000 / rate : 0;
+      stream.next_due_us = now_us;
+      stream.streaming = true;
+      return (0);
+    }
+    if (msg_type == (uint16_t) HU_MEDIA_CHANNEL_MESSAGE::MediaAck) {
+      if (!stream.unacked.empty ()) {
+        uint32_t latency_us = (uint32_t) std::min (now_us - stream.unacked.front (), (uint64_t) UINT32_MAX);
+        stream.unacked.pop_front ();
+        ack_samples_seen ++;
+        if (ack_latencies.size () < PHONE_LATENCY_SAMPLES) {
+          ack_latencies.push_back (latency_us);
+        }
+        else {
+          sample_seed = sample_seed * 1664525 + 1013904223;
+          uint64_t slot = ((uint64_t) sample_seed << 16 | (sample_seed >> 16)) % ack_samples_seen;
+          if (slot < PHONE_LATENCY_SAMPLES)
+            ack_latencies [slot] = latency_us;
+        }
+        live->ack_us_sum.fetch_add (latency_us, std::memory_order_relaxed);
+        if (latency_us > live->ack_max_us.load (std::memory_order_relaxed))
+          live->ack_max_us.store (latency_us, std::memory_order_relaxed);
+      }
+      stats.acks ++;
+      live->acks.fetch_add (1, std::memory_order_relaxed);
+    }
+    return (0);
+  }
+
+  int hu_fake_phone::process_frames () {
+    size_t pos = 0;
+    unsigned char decrypted [MAX_FRAME_SIZE];
+    int ret = 0;
+    while (ret >= 0 && rx.size () - pos >= 4) {
+      int chan = rx [pos];
+      int flags = rx [pos + 1];
+      int frame_len = be16toh (*(uint16_t *) & rx [pos + 2]);
+      int header_size = ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) ? 8 : 4;
+      if (rx.size () - pos < (size_t) (header_size + frame_len))
+        break;
+      const unsigned char * payload = & rx [pos + header_size];
+      pos += header_size + frame_len;
+
+      rx_assembly & msg = assembly [chan];
+      if (flags & HU_FRAME_FIRST_FRAME) {
+        msg.buf.clear ();
+        msg.active = true;
+      }
+      if (!msg.active)
+        continue;
+      if (flags & HU_FRAME_ENCRYPTED) {
+        BIO_write (rbio, payload, frame_len);
+        int got;
+        while ((got = SSL_read (ssl, decrypted, sizeof (decrypted))) > 0)
+          msg.buf.insert (msg.buf.end (), decrypted, decrypted + got);
+        if (SSL_get_error (ssl, got) != SSL_ERROR_WANT_READ) {
+          loge ("Fake phone SSL_read() failed: %d", SSL_get_error (ssl, got));
+          ret = -1;
+          break;
+        }
+      }
+      else {
+        msg.buf.insert (msg.buf.end (), payload, payload + frame_len);
+      }
+
+      if ((flags & HU_FRAME_LAST_FRAME) && msg.buf.size () >= 2) {
+        msg.active = false;
+        uint16_t msg_type = be16toh (*(uint16_t *) msg.buf.data ());
+        ret = handle_message (chan, msg_type, msg.buf.data () + 2, msg.buf.size () - 2);
+      }
+    }
+    rx.erase (rx.begin (), rx.begin () + pos);
+    return (ret);
+  }
+
+  bool hu_fake_phone::media_ready (int chan) {
+    media_stream & stream = streams [chan];
+    if ((int) stream.unacked.size () >= stream.max_unacked) {           // The ack wakes us up
+      if (!stream.stalled) {
+        stream.stalled = true;
+        stats.stalls ++;
+      }
+      return (false);
+    }
+    stream.stalled = false;
+    return (true);
+  }
+
+  int hu_fake_phone::send_media (int chan, uint64_t now_us, int interleave_chan) {
+    media_stream & stream = streams [chan];
+    if (media_start_us == 0) {
+      media_start_us = now_us;
+      stats.setup_us = now_us - start_us;
+    }
+    std::vector<unsigned char> & packet = stream.video ? video_frame : audio_packet;
+    *((uint64_t *) packet.data ()) = htobe64 (stream.timestamp_us);
+    stream.unacked.push_back (now_us);
+    if (send_message (chan, (uint16_t) HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp, packet.data (), packet.size (), now_us, interleave_chan) < 0)
+      return (-1);
+    live->media_packets.fetch_add (1, std::memory_order_relaxed);
+    live->media_bytes.fetch_add (packet.size () - 8, std::memory_order_relaxed);
+    if (stream.video) {
+      stats.video_frames ++;
+      stats.video_bytes += packet.size () - 8;
+    }
+    else {
+      stats.audio_packets ++;
+      stats.audio_bytes += packet.size () - 8;
+    }
+
+    stream.timestamp_us += stream.interval_us ? stream.interval_us : 1;
+    if (stream.interval_us) {
+      stream.next_due_us += stream.interval_us;
+      if (stream.next_due_us + 10 * stream.interval_us < now_us)       // Fell far behind, don't burst to catch up
+        stream.next_due_us = now_us;
+    }
+    return (0);
+  }
+
+  int hu_fake_phone::pump_media (uint64_t now_us, int * wait_ms) {
+    if (shutdown_sent_us)
+      return (0);
+    for (int chan : media_chans) {
+      media_stream & stream = streams [chan];
+      if (!stream.streaming)
+        continue;
+      if (stream.interval_us && now_us < stream.next_due_us) {
+        *wait_ms = std::min (*wait_ms, (int) ((stream.next_due_us - now_us) / 1000) + 1);
+        continue;
+      }
+      if (!media_ready (chan))
+        continue;
+
+      int interleave_chan = -1;                                         // An audio packet that's due goes between the first two video fragments
+      if (options.interleave && stream.video) {
+        for (int other : media_chans) {
+          media_stream & audio = streams [other];
+          if (!audio.video && audio.streaming && (!audio.interval_us || now_us >= audio.next_due_us) && media_ready (other)) {
+            interleave_chan = other;
+            break;
+          }
+        }
+      }
+      if (send_media (chan, now_us, interleave_chan) < 0)
+        return (-1);
+      *wait_ms = stream.interval_us ? std::min (*wait_ms, (int) (stream.interval_us / 1000)) : 0;
+    }
+    return (0);
+  }
+
+  void hu_fake_phone::main_loop () {
+    pthread_setname_np (pthread_self (), "hu_fake_phone");
+    start_us = hu_get_time_us ();
+    while (!quit && !finished) {
+      uint64_t now_us = hu_get_time_us ();
+      int wait_ms = 100;
+      if (pump_media (now_us, & wait_ms) < 0)
+        break;
+
+      if (media_start_us && options.duration_ms > 0 && !shutdown_sent_us && now_us - media_start_us >= (uint64_t) options.duration_ms * 1000) {
+        shutdown_sent_us = now_us;
+        HU::ShutdownRequest request;
+        request.set_reason (HU::ShutdownRequest::REASON_QUIT);
+        if (send_message (AA_CH_CTR, (uint16_t) HU_PROTOCOL_MESSAGE::ShutdownRequest, request) < 0)
+          break;
+      }
+      if (shutdown_sent_us && now_us - shutdown_sent_us > 2000000) {
+        logw ("Fake phone: no ShutdownResponse from the HU");
+        break;
+      }
+
+      if (read_available (true, wait_ms) < 0)
+        break;
+      if (process_frames () < 0)
+        break;
+    }
+    finish_stats ();
+    if (!quit)
+      write (done_fd, "", 1);                                           // The HU sees this as a disconnect
+  }
+
+  void hu_fake_phone::finish_stats () {
+    uint64_t now_us = hu_get_time_us ();
+    if (media_start_us)
+      stats.media_us = (shutdown_sent_us ? shutdown_sent_us : now_us) - media_start_us;
+    if (!ack_latencies.empty ()) {
+      std::sort (ack_latencies.begin (), ack_latencies.end ());
+      stats.ack_p50_us = ack_latencies [ack_latencies.size () / 2];
+      stats.ack_p99_us = ack_latencies [std::min (ack_latencies.size () - 1, ack_latencies.size () * 99 / 100)];
+      stats.ack_max_us = ack_latencies.back ();
+    }
+
+    double seconds = stats.media_us / 1000000.0;
+    logw ("Fake phone: handshake %s in %.1f ms, media after %.1f ms", stats.handshake_ok ? "ok" : "failed", stats.handshake_us / 1000.0, stats.setup_us / 1000.0);
+    logw ("Fake phone: %llu video frames (%.1f fps, %.2f MB/s), %llu audio packets (%.2f MB/s) in %.3f s",
+          (unsigned long long) stats.video_frames, seconds > 0 ? stats.video_frames / seconds : 0.0, seconds > 0 ? stats.video_bytes / seconds / 1e6 : 0.0,
+          (unsigned long long) stats.audio_packets, seconds > 0 ? stats.audio_bytes / seconds / 1e6 : 0.0, seconds);
+    logw ("Fake phone: ack latency p50 %u us  p99 %u us  max %u us, %llu acks, %llu stalls",
+          stats.ack_p50_us, stats.ack_p99_us, stats.ack_max_us, (unsigned long long) stats.acks, (unsigned long long) stats.stalls);
+
+    std::lock_guard<std::mutex> lock (last_stats_mutex);
+    last_stats = stats;
+  }
+
+  HUTransportStreamLoopback::~HUTransportStreamLoopback () {
+    Stop ();
+  }
+
+  int HUTransportStreamLoopback::Start (bool waitForDevice) {
+    int sv [2];
+    int done [2];
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+      loge ("socketpair failed errno: %d (%s)", errno, strerror (errno));
+      return (-1);
+    }
+    if (pipe2 (done, O_CLOEXEC) < 0) {
+      loge ("pipe2 failed errno: %d (%s)", errno, strerror (errno));
+      close (sv [0]);
+      close (sv [1]);
+      return (-1);
+    }
+    readfd = sv [0];
+    errorfd = done [0];
+    done_write_fd = done [1];
+    phone = new hu_fake_phone (sv [1], done_write_fd, hu_fake_phone_config);
+    live = phone->live;
+    if (phone->start () < 0) {
+      Stop ();
+      return (-1);
+    }
+    return (0);
+  }
+
+  int HUTransportStreamLoopback::Stop () {
+    delete phone;                                                       // Joins the phone thread and closes its end
+    phone = NULL;
+    for (int * fd : {& readfd, & errorfd, & done_write_fd}) {
+      if (*fd >= 0)
+        close (*fd);
+      *fd = -1;
+    }
+    return (0);
+  }
+
+  int HUTransportStreamLoopback::Write (const byte * buf, int len, int tmo) {
+    int written = 0;
+    while (written < len) {
+      struct pollfd pfd = {readfd, POLLOUT, 0};
+      int ret = poll (& pfd, 1, tmo);
+      if (ret <= 0)
+        return (written > 0 ? written : ret);
+      ret = send (readfd, buf + written, len - written, MSG_NOSIGNAL);
+      if (ret < 0) {
+        loge ("Loopback send errno: %d (%s)", errno, strerror (errno));
+        return (-1);
+      }
+      written += ret;
+    }
+    return (written);
+  }
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "hu_aap.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <memory>
+
+// In-process phone for end to end tests without hardware. HU_TRANSPORT_TYPE::LOOPBACK connects HUServer to a
+// hu_fake_phone over a socketpair; the phone plays the AA side for real: version exchange, TLS server, service
+// discovery, channel opens, media setup, then synthetic H.264 and PCM at the configured rates, timing every MediaAck.
+
+struct hu_fake_phone_options {
+  bool video = true;
+  int  video_fps = 30;                                                  // 0: next frame as soon as the last one is acked
+  int  video_frame_bytes = 24000;
+  bool audio = true;
+  int  audio_packet_ms = 20;                                            // 48 kHz 16 bit stereo, 0: as fast as acked
+  int  duration_ms = 10000;                                             // Then the phone asks the HU to shut down, 0: until stopped
+  bool interleave = false;                                              // Send due audio between the fragments of a video frame, as phones do
+};
+
+extern hu_fake_phone_options hu_fake_phone_config;                      // Used by every loopback transport started afterwards
+
+struct hu_fake_phone_stats {
+  bool     handshake_ok;
+  uint64_t handshake_us;                                                // VersionRequest to AuthComplete
+  uint64_t setup_us;                                                    // VersionRequest to the first media packet
+  uint64_t video_frames;
+  uint64_t video_bytes;
+  uint64_t audio_packets;
+  uint64_t audio_bytes;
+  uint64_t acks;
+  uint64_t stalls;                                                      // Packets that were due but waited for an ack
+  uint64_t media_us;                                                    // First media packet to the end
+  uint32_t ack_p50_us;                                                  // Media sent to MediaAck received
+  uint32_t ack_p99_us;
+  uint32_t ack_max_us;
+};
+
+hu_fake_phone_stats hu_fake_phone_last_stats ();                        // Of the last phone that stopped
+
+// Updated by the phone thread as it goes, for watching a session while it runs. Outlives the phone.
+struct hu_fake_phone_live {
+  std::atomic<uint64_t> media_packets;
+  std::atomic<uint64_t> media_bytes;
+  std::atomic<uint64_t> acks;
+  std::atomic<uint64_t> ack_us_sum;
+  std::atomic<uint32_t> ack_max_us;                                     // Readers exchange it with 0 to get the max per window
+};
+
+class hu_fake_phone
+{
+  struct rx_assembly {
+    std::vector<unsigned char> buf;
+    bool active = false;
+  };
+  struct media_stream {
+    bool     open = false;
+    bool     streaming = false;
+    bool     video = false;
+    bool     stalled = false;                                           // Due but waiting for an ack
+    int      max_unacked = 1;
+    uint64_t next_due_us = 0;
+    uint64_t interval_us = 0;
+    uint64_t timestamp_us = 0;
+    std::deque<uint64_t> unacked;                                       // Send times
+  };
+
+  int fd;                                                               // Phone end of the socketpair, owned
+  int done_fd;                                                          // Written once when the phone hangs up
+  hu_fake_phone_options options;
+  std::thread thread;
+  std::atomic<bool> quit;
+
+  SSL * ssl = NULL;
+  BIO * rbio = NULL;                                                    // Ciphertext from the HU
+  BIO * wbio = NULL;                                                    // Ciphertext to the HU
+  bool  encrypted = false;                                              // After AuthComplete
+  bool  finished = false;
+
+  std::vector<unsigned char> rx;                                        // Bytes read but not parsed yet
+  rx_assembly assembly [AA_CH_MAX];
+  media_stream streams [AA_CH_MAX];
+  std::vector<int> media_chans;
+  std::vector<unsigned char> video_frame;
+  std::vector<unsigned char> audio_packet;
+  std::vector<unsigned char> plain_scratch;                             // send_message's plaintext, kept to save the allocation
+  std::vector<uint32_t> ack_latencies;                                  // Reservoir sample, so hours long runs stay bounded
+  uint64_t ack_samples_seen = 0;
+  uint32_t sample_seed = 0x9e3779b9;
+
+  uint64_t start_us = 0;
+  uint64_t media_start_us = 0;
+  uint64_t shutdown_sent_us = 0;
+  hu_fake_phone_stats stats = {};
+
+  void main_loop ();
+  int  read_available (bool block, int tmo_ms);
+  int  write_all (const unsigned char * buf, int len);
+  int  process_frames ();
+  int  handle_message (int chan, uint16_t msg_type, const unsigned char * buf, int len);
+  int  send_message (int chan, uint16_t msg_type, const unsigned char * buf, int len, uint64_t now_us = 0, int interleave_chan = -1);
+  int  send_message (int chan, uint16_t msg_type, const google::protobuf::MessageLite & message);
+  int  send_handshake_output ();
+  bool media_ready (int chan);                                          // False while waiting for acks
+  int  send_media (int chan, uint64_t now_us, int interleave_chan);
+  int  pump_media (uint64_t now_us, int * wait_ms);
+  void finish_stats ();
+ public:
+  const std::shared_ptr<hu_fake_phone_live> live;
+
+  hu_fake_phone (int fd, int done_fd, const hu_fake_phone_options & options);
+  ~hu_fake_phone ();
+  int  start ();
+  void stop ();
+};
+
+class HUTransportStreamLoopback : public HUTransportStream
+{
+  hu_fake_phone * phone = NULL;
+  int done_write_fd = -1;
+  std::shared_ptr<hu_fake_phone_live> live;
+ public:
+  ~HUTransportStreamLoopback();
+  HUTransportStreamLoopback() {}
+  std::shared_ptr<hu_fake_phone_live> GetLive() const { return live; }
+  virtual int Start(bool waitForDevice) override;
+  virtual int Stop() override;
+  virtual int Write(const byte* buf, int len, int tmo) override;
+};
@@ -0,0 +1,252 @@
+
+  #define LOGTAG "hu_metrics"
+  #include "hu_uti.h"
+  #include "hu_aap.h"
+  #include "hu_metrics.h"
+
+  #include <inttypes.h>
+  #include <string.h>
+  #include <algorithm>
+  #include <mutex>
+
+  hu_metrics_registry hu_metrics;
+
+  const uint32_t hu_metrics_bucket_us [HU_METRICS_BUCKETS - 1] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000};
+
+  void hu_metric_histogram::observe (uint64_t us) {
+    int idx = 0;
+    while (idx < HU_METRICS_BUCKETS - 1 && us > hu_metrics_bucket_us [idx])
+      idx ++;
+    buckets [idx].fetch_add (1, std::memory_order_relaxed);
+    count.fetch_add (1, std::memory_order_relaxed);
+    sum_us.fetch_add (us, std::memory_order_relaxed);
+  }
+
+  uint64_t hu_metric_histogram::percentile_us (double q) const {
+    uint64_t total = count.load (std::memory_order_relaxed);
+    if (total == 0)
+      return (0);
+    double rank = q * total;
+    uint64_t below = 0;
+    for (int idx = 0; idx < HU_METRICS_BUCKETS; idx ++) {
+      uint64_t n = buckets [idx].load (std::memory_order_relaxed);
+      if (n > 0 && below + n >= rank) {
+        uint64_t lower = idx > 0 ? hu_metrics_bucket_us [idx - 1] : 0;
+        if (idx == HU_METRICS_BUCKETS - 1)                              // No upper bound to interpolate to
+          return (lower);
+        return (lower + (uint64_t) ((hu_metrics_bucket_us [idx] - lower) * (rank - below) / n));
+      }
+      below += n;
+    }
+    return (hu_metrics_bucket_us [HU_METRICS_BUCKETS - 2]);
+  }
+
+  static std::mutex handlers_mutex;
+
+  hu_handler_metrics & hu_metrics_handler (const char * name) {
+    std::lock_guard<std::mutex> lk (handlers_mutex);
+    int idx = 0;
+    for (; idx < HU_METRICS_HANDLERS - 1; idx ++) {
+      hu_handler_metrics & m = hu_metrics.handlers [idx];
+      if (!m.used.load (std::memory_order_relaxed)) {
+        snprintf (m.name, sizeof (m.name), "%s", name);
+        m.used.store (true, std::memory_order_release);
+        return (m);
+      }
+      if (strncmp (m.name, name, sizeof (m.name) - 1) == 0)
+        return (m);
+    }
+    hu_handler_metrics & other = hu_metrics.handlers [idx];
+    if (!other.used.load (std::memory_order_relaxed)) {
+      snprintf (other.name, sizeof (other.name), "other");
+      other.used.store (true, std::memory_order_release);
+    }
+    return (other);
+  }
+
+  __thread hu_input_stamp * hu_input_current = NULL;
+
+  static const char * input_stage_names [HU_INPUT_STAGES] = {"kernel", "app", "queue", "wire", "total"};
+
+  const char * hu_input_stage_name (int stage) {
+    return (stage >= 0 && stage < HU_INPUT_STAGES ? input_stage_names [stage] : "unknown");
+  }
+
+  static void input_stage (int stage, uint64_t from_us, uint64_t to_us) {
+    if (from_us == 0 || to_us < from_us)
+      return;
+    hu_metrics.input_latency_us [stage].observe (to_us - from_us);
+    hu_metrics.input_latency_last_us [stage].store (to_us - from_us, std::memory_order_relaxed);
+  }
+
+  void hu_input_written (const hu_input_stamp & stamp, uint64_t written_us) {
+    input_stage (HU_INPUT_STAGE_KERNEL, stamp.event_us, stamp.read_us);
+    input_stage (HU_INPUT_STAGE_APP, stamp.read_us, stamp.queued_us);
+    input_stage (HU_INPUT_STAGE_QUEUE, stamp.queued_us, stamp.ssl_us);
+    input_stage (HU_INPUT_STAGE_WIRE, stamp.ssl_us, written_us);
+    input_stage (HU_INPUT_STAGE_TOTAL, stamp.event_us ? stamp.event_us : stamp.read_us, written_us);
+  }
+
+  static const char * metrics_chan_name (int chan) {
+    if (chan == HU_METRICS_CHANNELS - 1)
+      return ("other");
+    return (chan_get (chan));
+  }
+
+  static bool metrics_chan_used (const hu_channel_metrics & m) {
+    return (m.rx_frames.load (std::memory_order_relaxed) || m.tx_frames.load (std::memory_order_relaxed) || m.drops.load (std::memory_order_relaxed));
+  }
+
+  static void metrics_line (std::string & out, const char * name, const char * labels, uint64_t value) {
+    char line [256];
+    snprintf (line, sizeof (line), "%s%s %" PRIu64 "\n", name, labels, value);
+    out += line;
+  }
+
+  static void metrics_header (std::string & out, const char * name, const char * type, const char * help) {
+    out += "# HELP ";
+    out += name;
+    out += " ";
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+  }
+
+  typedef std::atomic<uint64_t> hu_channel_metrics::* chan_counter;
+  typedef hu_metric_histogram hu_channel_metrics::* chan_histogram;
+
+  static void metrics_chan_counter (std::string & out, const char * name, const char * help, chan_counter field) {
+    metrics_header (out, name, "counter", help);
+    for (int chan = 0; chan < HU_METRICS_CHANNELS; chan ++) {
+      const hu_channel_metrics & m = hu_metrics.chan [chan];
+      if (!metrics_chan_used (m))
+        continue;
+      char labels [64];
+      snprintf (labels, sizeof (labels), "{chan=\"%s\"}", metrics_chan_name (chan));
+      metrics_line (out, name, labels, (m.*field).load (std::memory_order_relaxed));
+    }
+  }
+
+  // label is "" or one name="value" pair, le is added to it for the buckets
+  static void metrics_histogram_lines (std::string & out, const char * name, const char * label, const hu_metric_histogram & h) {
+    uint64_t count = h.count.load (std::memory_order_relaxed);
+    if (count == 0)
+      return;
+    std::string bucket_name = std::string (name) + "_bucket";
+    std::string sum_name = std::string (name) + "_sum";
+    std::string count_name = std::string (name) + "_count";
+    const char * sep = label [0] ? "," : "";
+    char labels [96];
+    uint64_t cumulative = 0;
+    for (int idx = 0; idx < HU_METRICS_BUCKETS; idx ++) {
+      cumulative += h.buckets [idx].load (std::memory_order_relaxed);
+      if (idx < HU_METRICS_BUCKETS - 1)
+        snprintf (labels, sizeof (labels), "{%s%sle=\"%u\"}", label, sep, hu_metrics_bucket_us [idx]);
+      else
+        snprintf (labels, sizeof (labels), "{%s%sle=\"+Inf\"}", label, sep);
+      metrics_line (out, bucket_name.c_str (), labels, cumulative);
+    }
+    if (label [0])
+      snprintf (labels, sizeof (labels), "{%s}", label);
+    else
+      labels [0] = 0;
+    metrics_line (out, sum_name.c_str (), labels, h.sum_us.load (std::memory_order_relaxed));
+    metrics_line (out, count_name.c_str (), labels, count);
+  }
+
+  static void metrics_histogram (std::string & out, const char * name, const char * help, const hu_metric_histogram & h) {
+    metrics_header (out, name, "histogram", help);
+    metrics_histogram_lines (out, name, "", h);
+  }
+
+  static void metrics_chan_histogram (std::string & out, const char * name, const char * help, chan_histogram field) {
+    metrics_header (out, name, "histogram", help);
+    for (int chan = 0; chan < HU_METRICS_CHANNELS; chan ++) {
+      char label [64];
+      snprintf (label, sizeof (label), "chan=\"%s\"", metrics_chan_name (chan));
+      metrics_histogram_lines (out, name, label, hu_metrics.chan [chan].*field);
+    }
+  }
+
+  std::string hu_metrics_text () {
+    std::string out;
+    out.reserve (16 * 1024);
+
+    metrics_chan_counter (out, "hu_rx_bytes_total", "Bytes received including frame headers", &hu_channel_metrics::rx_bytes);
+    metrics_chan_counter (out, "hu_rx_frames_total", "Frames received", &hu_channel_metrics::rx_frames);
+    metrics_chan_counter (out, "hu_rx_messages_total", "Reassembled messages received", &hu_channel_metrics::rx_messages);
+    metrics_chan_counter (out, "hu_tx_bytes_total", "Bytes sent including frame headers", &hu_channel_metrics::tx_bytes);
+    metrics_chan_counter (out, "hu_tx_frames_total", "Frames sent", &hu_channel_metrics::tx_frames);
+    metrics_chan_counter (out, "hu_tx_messages_total", "Messages sent", &hu_channel_metrics::tx_messages);
+    metrics_chan_counter (out, "hu_drops_total", "Media packets the sink dropped", &hu_channel_metrics::drops);
+
+    metrics_header (out, "hu_queue_depth_bytes", "gauge", "Bytes queued in the sink");
+    for (int chan = 0; chan < HU_METRICS_CHANNELS; chan ++) {
+      const hu_channel_metrics & m = hu_metrics.chan [chan];
+      if (!metrics_chan_used (m))
+        continue;
+      char labels [64];
+      snprintf (labels, sizeof (labels), "{chan=\"%s\"}", metrics_chan_name (chan));
+      metrics_line (out, "hu_queue_depth_bytes", labels, (uint64_t) std::max ((int64_t) 0, m.queue_depth.load (std::memory_order_relaxed)));
+    }
+
+    metrics_chan_histogram (out, "hu_decrypt_us", "Decrypt time per frame", &hu_channel_metrics::decrypt_us);
+    metrics_chan_histogram (out, "hu_encrypt_us", "Encrypt time per frame", &hu_channel_metrics::encrypt_us);
+    metrics_chan_histogram (out, "hu_sink_us", "Time spent in the media callback", &hu_channel_metrics::sink_us);
+    metrics_chan_histogram (out, "hu_ack_latency_us", "First frame received to MediaAck sent", &hu_channel_metrics::ack_latency_us);
+
+    metrics_header (out, "hu_transport_rx_bytes_total", "counter", "Bytes read from the transport");
+    metrics_line (out, "hu_transport_rx_bytes_total", "", hu_metrics.transport_rx_bytes.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_transport_tx_bytes_total", "counter", "Bytes written to the transport");
+    metrics_line (out, "hu_transport_tx_bytes_total", "", hu_metrics.transport_tx_bytes.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_transport_errors_total", "counter", "Transport read and write errors");
+    metrics_line (out, "hu_transport_errors_total", "", hu_metrics.transport_errors.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_transport_tx_pending", "gauge", "Transport writes in flight");
+    metrics_line (out, "hu_transport_tx_pending", "", (uint64_t) std::max ((int64_t) 0, hu_metrics.transport_tx_pending.load (std::memory_order_relaxed)));
+    metrics_header (out, "hu_command_queue_depth", "gauge", "Commands queued for the HU thread");
+    metrics_line (out, "hu_command_queue_depth", "", (uint64_t) std::max ((int64_t) 0, hu_metrics.command_queue_depth.load (std::memory_order_relaxed)));
+    metrics_header (out, "hu_sessions_total", "counter", "Phone sessions started");
+    metrics_line (out, "hu_sessions_total", "", hu_metrics.sessions.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_log_dropped_total", "counter", "Log lines dropped because the writer queue was full");
+    metrics_line (out, "hu_log_dropped_total", "", hu_metrics.log_dropped.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_log_suppressed_total", "counter", "Log lines suppressed by the rate limit");
+    metrics_line (out, "hu_log_suppressed_total", "", hu_metrics.log_suppressed.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_main_loop_wakeups_total", "counter", "Main loop dispatches that ran posted tasks");
+    metrics_line (out, "hu_main_loop_wakeups_total", "", hu_metrics.main_loop_wakeups.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_main_loop_tasks_total", "counter", "Tasks run by those dispatches");
+    metrics_line (out, "hu_main_loop_tasks_total", "", hu_metrics.main_loop_tasks.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_main_loop_batch_max", "gauge", "Most tasks a single dispatch ran");
+    metrics_line (out, "hu_main_loop_batch_max", "", hu_metrics.main_loop_batch_max.load (std::memory_order_relaxed));
+    metrics_histogram (out, "hu_main_loop_wait_us", "Task posted, or due if delayed, until it ran", hu_metrics.main_loop_wait_us);
+    metrics_header (out, "hu_touch_reports_total", "counter", "Touch screen reports read");
+    metrics_line (out, "hu_touch_reports_total", "", hu_metrics.touch_reports.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_touch_messages_total", "counter", "Touch InputEvents sent");
+    metrics_line (out, "hu_touch_messages_total", "", hu_metrics.touch_messages.load (std::memory_order_relaxed));
+    metrics_header (out, "hu_input_latency_us", "histogram", "Input event latency per stage, from the event to the transport write completing");
+    for (int stage = 0; stage < HU_INPUT_STAGES; stage ++) {
+      char label [32];
+      snprintf (label, sizeof (label), "stage=\"%s\"", hu_input_stage_name (stage));
+      metrics_histogram_lines (out, "hu_input_latency_us", label, hu_metrics.input_latency_us [stage]);
+    }
+    metrics_header (out, "hu_handler_us", "histogram", "Time in each protocol message handler, _count is its calls");
+    for (const hu_handler_metrics & m : hu_metrics.handlers) {
+      if (!m.used.load (std::memory_order_acquire))
+        continue;
+      char label [64];
+      snprintf (label, sizeof (label), "handler=\"%s\"", m.name);
+      metrics_histogram_lines (out, "hu_handler_us", label, m.time_us);
+    }
+    metrics_header (out, "hu_handler_errors_total", "counter", "Handler calls that ended the connection");
+    for (const hu_handler_metrics & m : hu_metrics.handlers) {
+      if (!m.used.load (std::memory_order_acquire))
+        continue;
+      char labels [64];
+      snprintf (labels, sizeof (labels), "{handler=\"%s\"}", m.name);
+      metrics_line (out, "hu_handler_errors_total", labels, m.errors.load (std::memory_order_relaxed));
+    }
+
+    return (out);
+  }
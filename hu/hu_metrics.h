@@ -0,0 +1,124 @@
+#pragma once
+
+  // Runtime counters, gauges and latency histograms. Everything is a relaxed atomic so any thread (HU thread,
+  // USB thread, gstreamer, the web server) can update or read without taking a lock. Served as text on /metrics.
+
+  #include <stdint.h>
+  #include <atomic>
+  #include <string>
+
+  #define HU_METRICS_CHANNELS 16                                        // AA_CH_CTR .. AA_CH_NAVI, higher channels share the last slot
+  #define HU_METRICS_BUCKETS  12                                        // Last bucket is +Inf
+  #define HU_METRICS_HANDLERS 48                                        // Message handlers with stats of their own, the rest share the last slot
+
+  extern const uint32_t hu_metrics_bucket_us [HU_METRICS_BUCKETS - 1];  // Upper bounds in microseconds
+
+  struct hu_metric_histogram {
+    std::atomic<uint64_t> buckets [HU_METRICS_BUCKETS];                // Not cumulative, summed when printed
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_us;
+
+    void observe (uint64_t us);
+    uint64_t percentile_us (double q) const;                            // Interpolated within the bucket, 0 if empty
+  };
+
+  // Input events carry these from the read to the wire, all CLOCK_MONOTONIC us, 0 where not known
+  enum {
+    HU_INPUT_STAGE_KERNEL,                                              // Event time to our read (SDL: to our poll)
+    HU_INPUT_STAGE_APP,                                                 // Read to hu_queue_command, including moves held back to be merged
+    HU_INPUT_STAGE_QUEUE,                                               // Queued to SSL_write on the HU thread
+    HU_INPUT_STAGE_WIRE,                                                // SSL_write to the transport write completing
+    HU_INPUT_STAGE_TOTAL,
+    HU_INPUT_STAGES
+  };
+
+  struct hu_input_stamp {
+    uint64_t event_us;
+    uint64_t read_us;
+    uint64_t queued_us;
+    uint64_t ssl_us;
+    bool handed_off;                                                    // The transport records it when the write completes
+  };
+
+  struct hu_channel_metrics {
+    std::atomic<uint64_t> rx_bytes;                                     // Wire bytes including the frame headers
+    std::atomic<uint64_t> rx_frames;
+    std::atomic<uint64_t> rx_messages;
+    std::atomic<uint64_t> tx_bytes;
+    std::atomic<uint64_t> tx_frames;
+    std::atomic<uint64_t> tx_messages;
+    std::atomic<uint64_t> drops;                                        // Media the sink could not take
+    std::atomic<int64_t>  queue_depth;                                  // Bytes queued in the sink, where the sink can tell
+
+    hu_metric_histogram decrypt_us;                                     // Per frame
+    hu_metric_histogram encrypt_us;                                     // Per frame
+    hu_metric_histogram sink_us;                                        // MediaPacket / MediaPacketChunk callback
+    hu_metric_histogram ack_latency_us;                                 // First frame received to MediaAck sent
+  };
+
+  struct hu_handler_metrics {
+    char name [40];                                                     // Written once, before used is set
+    std::atomic<bool> used;
+    std::atomic<uint64_t> errors;                                       // Calls that returned < 0
+    hu_metric_histogram time_us;                                        // Its count is the calls
+  };
+
+  struct hu_metrics_registry {
+    hu_channel_metrics chan [HU_METRICS_CHANNELS];
+
+    std::atomic<uint64_t> transport_rx_bytes;
+    std::atomic<uint64_t> transport_tx_bytes;
+    std::atomic<uint64_t> transport_errors;
+    std::atomic<int64_t>  transport_tx_pending;                         // USB writes submitted but not completed
+    std::atomic<int64_t>  command_queue_depth;                          // hu_queue_command entries not yet run
+    std::atomic<uint64_t> sessions;                                     // Successful hu_aap_start calls
+    std::atomic<uint64_t> log_dropped;                                  // Log lines lost to a full writer queue
+    std::atomic<uint64_t> log_suppressed;                               // Log lines held back by the per call site rate limit
+    std::atomic<uint64_t> main_loop_wakeups;                            // run_on_main_thread dispatches that ran anything
+    std::atomic<uint64_t> main_loop_tasks;                              // Tasks they ran, tasks per wakeup is the ratio
+    std::atomic<uint64_t> main_loop_batch_max;                          // Most tasks run by one dispatch
+    hu_metric_histogram   main_loop_wait_us;                            // Posted, or due for delayed tasks, until run
+    std::atomic<uint64_t> touch_reports;                                // Touch screen reports read
+    std::atomic<uint64_t> touch_messages;                               // Touch InputEvents sent for them, after merging moves
+    hu_metric_histogram   input_latency_us [HU_INPUT_STAGES];
+    std::atomic<uint64_t> input_latency_last_us [HU_INPUT_STAGES];     // Of the last input event written, for the overlay
+    hu_handler_metrics    handlers [HU_METRICS_HANDLERS];
+  };
+
+  extern hu_metrics_registry hu_metrics;                                // Zero initialised, lives for the whole process
+
+  inline hu_channel_metrics & hu_metrics_chan (int chan) {
+    if (chan < 0 || chan >= HU_METRICS_CHANNELS)
+      chan = HU_METRICS_CHANNELS - 1;
+    return (hu_metrics.chan [chan]);
+  }
+
+  inline void hu_metrics_add (std::atomic<uint64_t> & counter, uint64_t n = 1) {
+    counter.fetch_add (n, std::memory_order_relaxed);
+  }
+
+  inline void hu_metrics_add (std::atomic<int64_t> & gauge, int64_t n) {
+    gauge.fetch_add (n, std::memory_order_relaxed);
+  }
+
+  inline void hu_metrics_set (std::atomic<int64_t> & gauge, int64_t v) {
+    gauge.store (v, std::memory_order_relaxed);
+  }
+
+  // Found or claimed by name. Takes a lock, look it up when the handler is registered and keep the reference
+  hu_handler_metrics & hu_metrics_handler (const char * name);
+
+  std::string hu_metrics_text ();                                       // Prometheus text exposition format
+
+  // The input event hu_aap_enc_send is sending on this thread, see hu_input_scope
+  extern __thread hu_input_stamp * hu_input_current;
+
+  // Around the hu_aap_enc_send_message call for an input event, in the hu_queue_command lambda
+  struct hu_input_scope {
+    hu_input_stamp * prev;
+    hu_input_scope (hu_input_stamp & stamp) : prev (hu_input_current) { hu_input_current = & stamp; }
+    ~hu_input_scope () { hu_input_current = prev; }
+  };
+
+  void hu_input_written (const hu_input_stamp & stamp, uint64_t written_us);
+  const char * hu_input_stage_name (int stage);
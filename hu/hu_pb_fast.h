@@ -0,0 +1,154 @@
+#pragma once
+
+  // Encoders for the messages sent the most: a MediaAck for every media packet, InputEvents and SensorEvents.
+  // They write the wire bytes straight into the caller's buffer, with no message object, no ByteSize pass and
+  // no allocation. Field numbers are taken from the generated hu.pb.h, so renumbering a field in hu.proto
+  // breaks the build here instead of the phone. Fields go out in field number order, so the bytes match what
+  // SerializeToArray gives for the same values. headunit-bench checks that before it times either one.
+
+  #include <stdint.h>
+  #include <string.h>
+
+  #include "hu_uti.h"
+  #include "hu.pb.h"
+
+  enum {
+    HU_PB_VARINT = 0,
+    HU_PB_LENGTH = 2,
+  };
+
+  #define HU_PB_MEDIA_ACK_MAX     17                                    // Two tags, a negative int32 is 10 bytes
+  #define HU_PB_TOUCH_POINTERS    10
+  #define HU_PB_INPUT_EVENT_MAX   256                                   // A touch with HU_PB_TOUCH_POINTERS, or a key with a scroll
+  #define HU_PB_SENSOR_EVENT_MAX  32
+
+  inline byte * hu_pb_varint (byte * out, uint64_t value) {
+    while (value >= 0x80) {
+      *out ++ = (byte) (value | 0x80);
+      value >>= 7;
+    }
+    *out ++ = (byte) value;
+    return (out);
+  }
+
+  template<int Field, int WireType>
+  inline byte * hu_pb_tag (byte * out) {
+    static_assert (Field > 0 && Field < 16, "Only one byte tags");
+    *out ++ = (byte) ((Field << 3) | WireType);
+    return (out);
+  }
+
+  template<int Field>
+  inline byte * hu_pb_uint (byte * out, uint64_t value) {              // uint32, uint64, bool
+    return (hu_pb_varint (hu_pb_tag<Field, HU_PB_VARINT> (out), value));
+  }
+
+  template<int Field>
+  inline byte * hu_pb_int (byte * out, int32_t value) {                 // int32 and enums, negative ones are sign extended to 10 bytes
+    return (hu_pb_uint<Field> (out, (uint64_t) (int64_t) value));
+  }
+
+  // A nested message: one byte is kept for its length, the body is written after it and the length patched in.
+  // The body is moved up in the rare case it needs a longer length
+  template<int Field>
+  inline byte * hu_pb_begin (byte * out) {
+    return (hu_pb_tag<Field, HU_PB_LENGTH> (out) + 1);
+  }
+
+  inline byte * hu_pb_end (byte * body, byte * end) {
+    uint32_t len = end - body;
+    if (len < 0x80) {
+      body [-1] = (byte) len;
+      return (end);
+    }
+    int extra = 0;
+    for (uint32_t rest = len >> 7; rest > 0; rest >>= 7)
+      extra ++;
+    memmove (body + extra, body, len);
+    hu_pb_varint (body - 1, len);
+    return (end + extra);
+  }
+
+  inline int hu_pb_media_ack (byte * out, int32_t session, uint32_t value) {
+    byte * p = out;
+    p = hu_pb_int<HU::MediaAck::kSessionFieldNumber> (p, session);
+    p = hu_pb_uint<HU::MediaAck::kValueFieldNumber> (p, value);
+    return (p - out);
+  }
+
+  struct hu_pb_touch_pointer {
+    uint32_t x;
+    uint32_t y;
+    uint32_t id;
+  };
+
+  // An InputEvent, built up in field number order: touch, then button, then relative
+  class hu_pb_input_event {
+    byte * start;
+    byte * p;
+   public:
+    hu_pb_input_event (byte * out, uint64_t timestamp) : start (out) {
+      p = hu_pb_uint<HU::InputEvent::kTimestampFieldNumber> (out, timestamp);
+    }
+
+    // Pointer is anything with x, y and id. action_index only goes out when it is >= 0
+    template<typename Pointer>
+    void touch (HU::TouchInfo::TOUCH_ACTION action, const Pointer * pointers, int count, int action_index = -1) {
+      byte * touch = hu_pb_begin<HU::InputEvent::kTouchFieldNumber> (p);
+      byte * t = touch;
+      for (int idx = 0; idx < count && idx < HU_PB_TOUCH_POINTERS; idx ++) {
+        byte * location = hu_pb_begin<HU::TouchInfo::kLocationFieldNumber> (t);
+        byte * l = location;
+        l = hu_pb_uint<HU::TouchInfo::Location::kXFieldNumber> (l, pointers [idx].x);
+        l = hu_pb_uint<HU::TouchInfo::Location::kYFieldNumber> (l, pointers [idx].y);
+        l = hu_pb_uint<HU::TouchInfo::Location::kPointerIdFieldNumber> (l, pointers [idx].id);
+        t = hu_pb_end (location, l);
+      }
+      if (action_index >= 0)
+        t = hu_pb_uint<HU::TouchInfo::kActionIndexFieldNumber> (t, (uint32_t) action_index);
+      t = hu_pb_int<HU::TouchInfo::kActionFieldNumber> (t, action);
+      p = hu_pb_end (touch, t);
+    }
+
+    void button (uint32_t scan_code, bool is_pressed, uint32_t meta, bool long_press) {
+      byte * wrapper = hu_pb_begin<HU::InputEvent::kButtonFieldNumber> (p);
+      byte * button = hu_pb_begin<HU::ButtonInfoWrapper::kButtonFieldNumber> (wrapper);
+      byte * b = button;
+      b = hu_pb_uint<HU::ButtonInfo::kScanCodeFieldNumber> (b, scan_code);
+      b = hu_pb_uint<HU::ButtonInfo::kIsPressedFieldNumber> (b, is_pressed);
+      b = hu_pb_uint<HU::ButtonInfo::kMetaFieldNumber> (b, meta);
+      b = hu_pb_uint<HU::ButtonInfo::kLongPressFieldNumber> (b, long_press);
+      p = hu_pb_end (wrapper, hu_pb_end (button, b));
+    }
+
+    void relative (uint32_t scan_code, int32_t delta) {
+      byte * wrapper = hu_pb_begin<HU::InputEvent::kRelEventFieldNumber> (p);
+      byte * event = hu_pb_begin<HU::RelativeInputEventWrapper::kEventFieldNumber> (wrapper);
+      byte * e = event;
+      e = hu_pb_uint<HU::RelativeInputEvent::kScanCodeFieldNumber> (e, scan_code);
+      e = hu_pb_int<HU::RelativeInputEvent::kDeltaFieldNumber> (e, delta);
+      p = hu_pb_end (wrapper, hu_pb_end (event, e));
+    }
+
+    int size () const { return (p - start); }
+  };
+
+  // A SensorEvent, built up in field number order: night mode, then driving status
+  class hu_pb_sensor_event {
+    byte * start;
+    byte * p;
+   public:
+    hu_pb_sensor_event (byte * out) : start (out), p (out) {}
+
+    void night_mode (bool is_night) {
+      byte * night = hu_pb_begin<HU::SensorEvent::kNightModeFieldNumber> (p);
+      p = hu_pb_end (night, hu_pb_uint<HU::SensorEvent::NightMode::kIsNightFieldNumber> (night, is_night));
+    }
+
+    void driving_status (int32_t status) {
+      byte * driving = hu_pb_begin<HU::SensorEvent::kDrivingStatusFieldNumber> (p);
+      p = hu_pb_end (driving, hu_pb_int<HU::SensorEvent::DrivingStatus::kStatusFieldNumber> (driving, status));
+    }
+
+    int size () const { return (p - start); }
+  };
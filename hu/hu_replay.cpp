@@ -0,0 +1,260 @@
+
+  #define LOGTAG "hu_replay"
+  #include "hu_uti.h"
+  #include "hu_replay.h"
+
+  #include <fcntl.h>
+  #include <poll.h>
+  #include <sys/ioctl.h>
+  #include <sys/resource.h>
+
+  int ena_replay_realtime = 0;
+  int ena_replay_verify   = 1;
+
+  static std::mutex last_stats_mutex;
+  static hu_replay_stats last_stats = {};
+
+  hu_replay_stats hu_replay_last_stats () {
+    std::lock_guard<std::mutex> lock (last_stats_mutex);
+    return (last_stats);
+  }
+
+  static uint64_t replay_cpu_us () {
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, & usage);
+    return ((uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+  }
+
+  // The version exchange, handshake and auth complete are not replayed, the server skips them in replay mode
+  static bool replay_is_init_message (const hu_capture_record_header & rec) {
+    return (rec.chan == AA_CH_CTR && rec.msg_type >= (uint16_t) HU_INIT_MESSAGE::VersionRequest && rec.msg_type <= (uint16_t) HU_INIT_MESSAGE::AuthComplete);
+  }
+
+  HUTransportStreamReplay::~HUTransportStreamReplay () {
+    Stop ();
+  }
+
+  int HUTransportStreamReplay::Start (bool waitForDevice) {
+    if (reader.open (path.c_str ()) < 0)
+      return (-1);
+
+    if (ena_replay_verify) {
+      hu_capture_record_header rec;
+      std::vector<unsigned char> payload;
+      while (reader.next (rec, payload) > 0) {
+        if ((rec.flags & HU_CAPTURE_OUTBOUND) && !replay_is_init_message (rec))
+          expected [rec.chan].push_back ({rec.msg_type, payload});
+      }
+      reader.rewind ();
+    }
+
+    int data_pipe [2];
+    int error_pipe [2];
+    if (pipe2 (data_pipe, O_CLOEXEC) < 0) {
+      loge ("pipe2 failed errno: %d (%s)", errno, strerror (errno));
+      return (-1);
+    }
+    if (pipe2 (error_pipe, O_CLOEXEC) < 0) {
+      loge ("pipe2 failed errno: %d (%s)", errno, strerror (errno));
+      close (data_pipe [0]);
+      close (data_pipe [1]);
+      return (-1);
+    }
+    fcntl (data_pipe [1], F_SETFL, O_NONBLOCK);                         // So Stop can get the feeder out of a full pipe
+    readfd = data_pipe [0];
+    write_fd = data_pipe [1];
+    errorfd = error_pipe [0];
+    error_write_fd = error_pipe [1];
+
+    quit = false;
+    stats = {};
+    feeder = std::thread ([this] { feeder_main (); });
+    logw ("Replaying %s %s", path.c_str (), ena_replay_realtime ? "at recorded speed" : "as fast as possible");
+    return (0);
+  }
+
+  int HUTransportStreamReplay::Stop () {
+    if (readfd < 0 && !feeder.joinable ())
+      return (0);
+    quit = true;
+    if (feeder.joinable ())
+      feeder.join ();
+
+    {
+      std::lock_guard<std::mutex> lock (stats_mutex);
+      stats.missing = 0;
+      for (auto & entry : expected)
+        stats.missing += entry.second.size ();
+      expected.clear ();
+      std::lock_guard<std::mutex> last_lock (last_stats_mutex);
+      last_stats = stats;
+    }
+
+    for (int * fd : {& readfd, & write_fd, & errorfd, & error_write_fd}) {
+      if (*fd >= 0)
+        close (*fd);
+      *fd = -1;
+    }
+    return (0);
+  }
+
+  int HUTransportStreamReplay::feed_message (const hu_capture_record_header & rec, const std::vector<unsigned char> & payload) {
+    std::vector<unsigned char> msg (2 + payload.size ());
+    msg [0] = rec.msg_type >> 8;
+    msg [1] = rec.msg_type & 0xff;
+    if (!payload.empty ())
+      memcpy (& msg [2], payload.data (), payload.size ());
+
+    byte frame [MAX_FRAME_SIZE];
+    int total = msg.size ();
+    for (int frag_start = 0; frag_start < total; frag_start += MAX_FRAME_PAYLOAD_SIZE) {
+      byte flags = rec.flags & HU_FRAME_CONTROL_MESSAGE;                // Never HU_FRAME_ENCRYPTED
+      if (frag_start == 0)
+        flags |= HU_FRAME_FIRST_FRAME;
+      int cur_len = MAX_FRAME_PAYLOAD_SIZE;
+      if (frag_start + MAX_FRAME_PAYLOAD_SIZE >= total) {
+        flags |= HU_FRAME_LAST_FRAME;
+        cur_len = total - frag_start;
+      }
+
+      frame [0] = rec.chan;
+      frame [1] = flags;
+      *((uint16_t *) & frame [2]) = htobe16 (cur_len);
+      int header_size = 4;
+      if ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) {
+        *((uint32_t *) & frame [header_size]) = htobe32 (total);
+        header_size += 4;
+      }
+      memcpy (& frame [header_size], & msg [frag_start], cur_len);
+
+      int frame_len = header_size + cur_len;
+      int written = 0;
+      while (written < frame_len) {
+        if (quit)
+          return (-1);
+        int ret = write (write_fd, & frame [written], frame_len - written);
+        if (ret < 0 && errno == EAGAIN) {
+          struct pollfd pfd = {write_fd, POLLOUT, 0};
+          poll (& pfd, 1, 100);
+          continue;
+        }
+        if (ret < 0) {
+          loge ("Replay write errno: %d (%s)", errno, strerror (errno));
+          return (-1);
+        }
+        written += ret;
+      }
+
+      std::lock_guard<std::mutex> lock (stats_mutex);
+      stats.frames_in ++;
+      stats.bytes_in += frame_len;
+    }
+    std::lock_guard<std::mutex> lock (stats_mutex);
+    stats.messages_in ++;
+    return (0);
+  }
+
+  void HUTransportStreamReplay::feeder_main () {
+    pthread_setname_np (pthread_self (), "hu_replay");
+    hu_capture_record_header rec;
+    std::vector<unsigned char> payload;
+    uint64_t first_ts_us = 0;
+    uint64_t start_us = 0;
+    uint64_t cpu_start_us = 0;
+    int ret = 0;
+    while (!quit && (ret = reader.next (rec, payload)) > 0) {
+      if ((rec.flags & HU_CAPTURE_OUTBOUND) || replay_is_init_message (rec))
+        continue;
+
+      if (start_us == 0) {
+        first_ts_us = rec.ts_us;
+        start_us = hu_get_time_us ();
+        cpu_start_us = replay_cpu_us ();
+      }
+      else if (ena_replay_realtime) {
+        uint64_t due_us = start_us + (rec.ts_us - first_ts_us);
+        uint64_t now_us;
+        while (!quit && (now_us = hu_get_time_us ()) < due_us)
+          usleep (std::min (due_us - now_us, (uint64_t) 50000));
+      }
+
+      if (feed_message (rec, payload) < 0)
+        break;
+    }
+    if (ret < 0)
+      loge ("Capture %s is truncated", path.c_str ());
+
+    int pending = 1;                                                    // Wait for the HU to read everything before telling it we're done
+    while (!quit && ioctl (readfd, FIONREAD, & pending) == 0 && pending > 0)
+      ms_sleep (1);
+
+    {
+      std::lock_guard<std::mutex> lock (stats_mutex);
+      if (start_us) {
+        stats.elapsed_us = hu_get_time_us () - start_us;
+        stats.cpu_us = replay_cpu_us () - cpu_start_us;
+      }
+      double seconds = stats.elapsed_us / 1000000.0;
+      logw ("Replay done: %llu messages %llu frames %llu bytes in %.3f s, %.0f msg/s, %.1f us CPU per frame",
+            (unsigned long long) stats.messages_in, (unsigned long long) stats.frames_in, (unsigned long long) stats.bytes_in, seconds,
+            seconds > 0 ? stats.messages_in / seconds : 0.0, stats.frames_in ? (double) stats.cpu_us / stats.frames_in : 0.0);
+      if (ena_replay_verify)
+        logw ("Replay outbound: %llu sent %llu matched %llu mismatched %llu unexpected", (unsigned long long) stats.messages_out,
+              (unsigned long long) stats.matched, (unsigned long long) stats.mismatched, (unsigned long long) stats.unexpected);
+    }
+
+    if (!quit)
+      write (error_write_fd, "", 1);                                    // Ends the session like a disconnect
+  }
+
+  void HUTransportStreamReplay::check_outbound (int chan, const unsigned char * buf, int len) {
+    if (chan < 0 || chan >= AA_CH_MAX || len < 4)
+      return;
+    int flags = buf [1];
+    int header_size = ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) ? 8 : 4;
+    if (len < header_size)
+      return;
+
+    outbound_assembly & assembly = outbound [chan];
+    if (flags & HU_FRAME_FIRST_FRAME) {
+      assembly.buf.clear ();
+      assembly.active = true;
+    }
+    if (!assembly.active)
+      return;
+    assembly.buf.insert (assembly.buf.end (), buf + header_size, buf + len);
+    if (!(flags & HU_FRAME_LAST_FRAME) || assembly.buf.size () < 2)
+      return;
+    assembly.active = false;
+
+    uint16_t msg_type = be16toh (*(const uint16_t *) assembly.buf.data ());
+    std::lock_guard<std::mutex> lock (stats_mutex);
+    stats.messages_out ++;
+    if (!ena_replay_verify)
+      return;
+
+    std::deque<expected_message> & queue = expected [chan];
+    if (queue.empty ()) {
+      stats.unexpected ++;
+      if (mismatch_logs ++ < 10)
+        logw ("Replay: unexpected %s msg_type: %d  len: %d", chan_get (chan), msg_type, (int) assembly.buf.size () - 2);
+      return;
+    }
+    expected_message & want = queue.front ();
+    if (want.msg_type == msg_type && want.payload.size () == assembly.buf.size () - 2
+        && memcmp (want.payload.data (), assembly.buf.data () + 2, want.payload.size ()) == 0) {
+      stats.matched ++;
+    }
+    else {
+      stats.mismatched ++;
+      if (mismatch_logs ++ < 10)
+        logw ("Replay: %s sent msg_type: %d  len: %d, capture had msg_type: %d  len: %d", chan_get (chan), msg_type,
+              (int) assembly.buf.size () - 2, want.msg_type, (int) want.payload.size ());
+    }
+    queue.pop_front ();
+  }
+
+  int HUTransportStreamReplay::Write (const byte * buf, int len, int tmo) {
+    check_outbound (buf [0], buf, len);
+    return (len);
+  }
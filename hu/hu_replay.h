@@ -0,0 +1,65 @@
+#pragma once
+
+#include "hu_aap.h"
+#include "hu_capture.h"
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <map>
+
+// Plays a session recorded by hu_capture back into HUServer. There is no TLS: the server skips the version
+// exchange and handshake (HU_TRANSPORT_TYPE::REPLAY) and frames go both ways unencrypted. Inbound messages
+// are re-framed and fed through a pipe; outbound messages are compared against the ones in the capture.
+
+extern int ena_replay_realtime;                                          // Keep the recorded gaps between messages, else as fast as the HU reads
+extern int ena_replay_verify;                                            // Compare what we send with the capture
+
+struct hu_replay_stats {
+  uint64_t messages_in;                                                  // Inbound messages fed to the HU
+  uint64_t frames_in;
+  uint64_t bytes_in;
+  uint64_t messages_out;                                                 // Outbound messages the HU sent
+  uint64_t matched;
+  uint64_t mismatched;                                                   // Different type or payload than the capture had next on that channel
+  uint64_t unexpected;                                                   // Nothing left in the capture for that channel
+  uint64_t missing;                                                      // In the capture but never sent
+  uint64_t elapsed_us;                                                   // First message fed to the last one read by the HU
+  uint64_t cpu_us;                                                       // Process user + system time over the same span
+};
+
+hu_replay_stats hu_replay_last_stats ();                                 // Of the last replay that stopped
+
+class HUTransportStreamReplay : public HUTransportStream
+{
+  struct expected_message {
+    uint16_t msg_type;
+    std::vector<unsigned char> payload;
+  };
+  struct outbound_assembly {
+    std::vector<unsigned char> buf;                                      // Message type + payload
+    bool active = false;
+  };
+
+  std::string path;
+  hu_capture_reader reader;
+  std::thread feeder;
+  int write_fd = -1;                                                     // Our end of readfd
+  int error_write_fd = -1;                                               // Our end of errorfd, written when the capture is done
+  std::atomic<bool> quit;
+
+  std::mutex stats_mutex;                                                // Write runs on the HU thread, the feeder on its own
+  hu_replay_stats stats = {};
+  std::map<int, std::deque<expected_message>> expected;
+  outbound_assembly outbound [AA_CH_MAX];
+  int mismatch_logs = 0;
+
+  void feeder_main ();
+  int  feed_message (const hu_capture_record_header & rec, const std::vector<unsigned char> & payload);
+  void check_outbound (int chan, const unsigned char * buf, int len);
+ public:
+  ~HUTransportStreamReplay();
+  HUTransportStreamReplay(const std::string& path): path(path), quit(false) {}
+  virtual int Start(bool waitForDevice) override;
+  virtual int Stop() override;
+  virtual int Write(const byte* buf, int len, int tmo) override;
+};
@@ -0,0 +1,226 @@
+
+  #define LOGTAG "hu_soak"
+  #include "hu_uti.h"
+  #include "hu_soak.h"
+
+  #include <dirent.h>
+  #include <memory>
+
+  #define SOAK_RSS_GROWTH_PCT 10                                         // More than this over the warm RSS is reported as a leak
+
+  class hu_soak_server : public HUServer
+  {
+   public:
+    hu_soak_server (IHUConnectionThreadEventCallbacks & callbacks) : HUServer (callbacks) {}
+    std::shared_ptr<hu_fake_phone_live> live () {                       // Only while started, the transport goes away on shutdown
+      if (!transport)
+        return (nullptr);
+      return (static_cast<HUTransportStreamLoopback *> (transport.get ())->GetLive ());
+    }
+  };
+
+  struct hu_soak_session {
+    HeadlessEventCallbacks callbacks;
+    hu_soak_server server;
+    std::shared_ptr<hu_fake_phone_live> live;
+    uint64_t last_acks = 0;
+    uint64_t last_ack_us_sum = 0;
+    uint64_t last_media_bytes = 0;
+
+    hu_soak_session () : server (callbacks) {
+      callbacks.SetServer (& server.GetAnyThreadInterface ());
+    }
+  };
+
+  static uint64_t soak_rss_kb () {
+    FILE * fp = fopen ("/proc/self/statm", "r");
+    if (fp == NULL)
+      return (0);
+    unsigned long size = 0, resident = 0;
+    if (fscanf (fp, "%lu %lu", & size, & resident) != 2)
+      resident = 0;
+    fclose (fp);
+    return ((uint64_t) resident * (sysconf (_SC_PAGESIZE) / 1024));
+  }
+
+  static int soak_fd_count () {
+    DIR * dir = opendir ("/proc/self/fd");
+    if (dir == NULL)
+      return (-1);
+    int count = 0;
+    while (readdir (dir) != NULL)
+      count ++;
+    closedir (dir);
+    return (count - 3);                                                 // ".", ".." and the one opendir holds
+  }
+
+  // CPU ticks of the HU threads and of the fake phone threads, by thread name. Threads that already exited are not counted.
+  static void soak_thread_ticks (uint64_t * hu_ticks, uint64_t * phone_ticks) {
+    *hu_ticks = *phone_ticks = 0;
+    DIR * dir = opendir ("/proc/self/task");
+    if (dir == NULL)
+      return;
+    struct dirent * entry;
+    while ((entry = readdir (dir)) != NULL) {
+      if (entry->d_name [0] == '.')
+        continue;
+      char path [64];
+      snprintf (path, sizeof (path), "/proc/self/task/%s/stat", entry->d_name);
+      FILE * fp = fopen (path, "r");
+      if (fp == NULL)
+        continue;
+      char line [512];
+      size_t len = fread (line, 1, sizeof (line) - 1, fp);
+      fclose (fp);
+      line [len] = 0;
+      char * comm = strchr (line, '(');
+      char * rest = strrchr (line, ')');                                // The name may hold spaces or parens
+      if (comm == NULL || rest == NULL)
+        continue;
+      *rest = 0;
+      unsigned long utime = 0, stime = 0;
+      if (sscanf (rest + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", & utime, & stime) != 2)
+        continue;
+      if (strcmp (comm + 1, "hu_thread_main") == 0)
+        *hu_ticks += utime + stime;
+      else if (strcmp (comm + 1, "hu_fake_phone") == 0)
+        *phone_ticks += utime + stime;
+    }
+    closedir (dir);
+  }
+
+  static void soak_print_sample (const hu_soak_sample & s) {
+    printf ("%8.0f %5d %5llu %9.1f %6d %8.1f%% %8.1f%% %9.2f %9.0f %9u %6lld\n", s.elapsed_us / 1000000.0, s.sessions,
+            (unsigned long long) s.restarts, s.rss_kb / 1024.0, s.fds, s.hu_cpu_pct, s.phone_cpu_pct, s.media_mbs, s.ack_mean_us,
+            s.ack_max_us, (long long) s.command_queue_depth);
+  }
+
+  static std::unique_ptr<hu_soak_session> soak_start_session () {
+    std::unique_ptr<hu_soak_session> session (new hu_soak_session ());
+    std::string address;
+    if (session->server.hu_aap_start (HU_TRANSPORT_TYPE::LOOPBACK, address, false) < 0)
+      return (nullptr);
+    session->live = session->server.live ();
+    return (session);
+  }
+
+  int hu_soak_run (int sessions, int seconds, int report_seconds) {
+    hu_fake_phone_config.duration_ms = 0;                               // Sessions run until we stop them
+    hu_fake_phone_config.interleave = true;                             // Keeps the HU's interleaved reassembly under load too
+    report_seconds = std::max (report_seconds, 1);
+    long ticks_per_second = sysconf (_SC_CLK_TCK);
+
+    std::vector<std::unique_ptr<hu_soak_session>> running;
+    for (int idx = 0; idx < sessions; idx ++) {
+      std::unique_ptr<hu_soak_session> session = soak_start_session ();
+      if (!session) {
+        printf ("Session %d failed to start\n", idx);
+        return (1);
+      }
+      running.push_back (std::move (session));
+    }
+    printf ("Soak: %d sessions, video %d fps x %d bytes, audio every %d ms, %s\n", sessions, hu_fake_phone_config.video_fps,
+            hu_fake_phone_config.video_frame_bytes, hu_fake_phone_config.audio_packet_ms, seconds > 0 ? "for the set time" : "until stopped");
+    printf ("%8s %5s %5s %9s %6s %9s %9s %9s %9s %9s %6s\n", "s", "sess", "rest", "RSS MB", "fds", "HU CPU", "phone CPU", "MB/s",
+            "ack us", "ack max", "cmdq");
+
+    std::vector<hu_soak_sample> samples;
+    uint64_t start_us = hu_get_time_us ();
+    uint64_t last_us = start_us;
+    uint64_t last_hu_ticks = 0, last_phone_ticks = 0;
+    soak_thread_ticks (& last_hu_ticks, & last_phone_ticks);
+    uint64_t restarts = 0;
+
+    while (seconds <= 0 || hu_get_time_us () - start_us < (uint64_t) seconds * 1000000) {
+      uint64_t next_us = last_us + (uint64_t) report_seconds * 1000000;
+      while (hu_get_time_us () < next_us) {
+        ms_sleep (100);
+        for (std::unique_ptr<hu_soak_session> & session : running) {    // A session that dropped is replaced, the churn is part of the test
+          if (!session->callbacks.WaitForDisconnect (0))
+            continue;
+          session->server.hu_aap_shutdown ();
+          session = soak_start_session ();
+          restarts ++;
+          if (!session) {
+            printf ("Restarting a session failed\n");
+            return (1);
+          }
+        }
+      }
+
+      uint64_t now_us = hu_get_time_us ();
+      double interval_s = (now_us - last_us) / 1000000.0;
+      uint64_t hu_ticks, phone_ticks;
+      soak_thread_ticks (& hu_ticks, & phone_ticks);
+
+      hu_soak_sample sample = {};
+      sample.elapsed_us = now_us - start_us;
+      sample.sessions = running.size ();
+      sample.restarts = restarts;
+      sample.rss_kb = soak_rss_kb ();
+      sample.fds = soak_fd_count ();
+      sample.hu_cpu_pct = hu_ticks > last_hu_ticks ? (hu_ticks - last_hu_ticks) * 100.0 / ticks_per_second / interval_s / sessions : 0;
+      sample.phone_cpu_pct = phone_ticks > last_phone_ticks ? (phone_ticks - last_phone_ticks) * 100.0 / ticks_per_second / interval_s / sessions : 0;
+      sample.command_queue_depth = hu_metrics.command_queue_depth.load (std::memory_order_relaxed);
+
+      uint64_t acks = 0, ack_us = 0, media_bytes = 0;
+      for (std::unique_ptr<hu_soak_session> & session : running) {
+        if (!session->live)
+          continue;
+        hu_fake_phone_live & live = *session->live;
+        uint64_t now_acks = live.acks.load (std::memory_order_relaxed);
+        uint64_t now_ack_us = live.ack_us_sum.load (std::memory_order_relaxed);
+        uint64_t now_bytes = live.media_bytes.load (std::memory_order_relaxed);
+        acks += now_acks - session->last_acks;
+        ack_us += now_ack_us - session->last_ack_us_sum;
+        media_bytes += now_bytes - session->last_media_bytes;
+        session->last_acks = now_acks;
+        session->last_ack_us_sum = now_ack_us;
+        session->last_media_bytes = now_bytes;
+        sample.ack_max_us = std::max (sample.ack_max_us, live.ack_max_us.exchange (0, std::memory_order_relaxed));
+      }
+      sample.ack_mean_us = acks ? (double) ack_us / acks : 0;
+      sample.media_mbs = media_bytes / 1048576.0 / interval_s;
+
+      soak_print_sample (sample);
+      samples.push_back (sample);
+      last_us = now_us;
+      last_hu_ticks = hu_ticks;
+      last_phone_ticks = phone_ticks;
+    }
+
+    for (std::unique_ptr<hu_soak_session> & session : running)
+      session->server.hu_aap_shutdown ();
+    running.clear ();
+
+    if (samples.size () < 2) {
+      printf ("Soak: too short to compare intervals\n");
+      return (0);
+    }
+
+    // The first interval includes the handshakes and warm up, so it's the reference rather than the start
+    const hu_soak_sample & first = samples.front ();
+    const hu_soak_sample & last = samples.back ();
+    double hours = (last.elapsed_us - first.elapsed_us) / 3600e6;
+    double rss_growth_mb = ((double) last.rss_kb - first.rss_kb) / 1024.0;
+    int result = 0;
+
+    printf ("\nSoak summary over %.2f h after the first interval, %llu restarts\n", hours, (unsigned long long) last.restarts);
+    printf ("  RSS          %9.1f MB -> %9.1f MB  (%+.1f MB, %+.1f MB/h)\n", first.rss_kb / 1024.0, last.rss_kb / 1024.0, rss_growth_mb,
+            hours > 0 ? rss_growth_mb / hours : 0.0);
+    printf ("  fds          %9d    -> %9d\n", first.fds, last.fds);
+    printf ("  HU CPU       %9.1f %%  -> %9.1f %%  per session\n", first.hu_cpu_pct, last.hu_cpu_pct);
+    printf ("  ack latency  %9.0f us -> %9.0f us  (%+.1f%%)\n", first.ack_mean_us, last.ack_mean_us,
+            first.ack_mean_us > 0 ? (last.ack_mean_us - first.ack_mean_us) * 100 / first.ack_mean_us : 0.0);
+    printf ("  command queue depth at the end: %lld\n", (long long) hu_metrics.command_queue_depth.load (std::memory_order_relaxed));
+
+    if (last.fds > first.fds) {
+      printf ("  LEAK? %d more fds than after the first interval\n", last.fds - first.fds);
+      result = 1;
+    }
+    if (last.rss_kb > first.rss_kb + first.rss_kb * SOAK_RSS_GROWTH_PCT / 100) {
+      printf ("  LEAK? RSS grew more than %d%% after the first interval\n", SOAK_RSS_GROWTH_PCT);
+      result = 1;
+    }
+    return (result);
+  }
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "hu_headless.h"
+#include "hu_loopback.h"
+
+// Soak test: many HUServer instances in one process, each with a fake phone on a loopback transport and headless
+// callbacks, streaming at the configured media rates for as long as asked. Every report interval it samples RSS,
+// open fds, CPU of the HU and phone threads per session and the MediaAck latency, and at the end compares the
+// first interval with the last to show growth and drift. "headunit soak" calls it.
+
+struct hu_soak_sample {
+  uint64_t elapsed_us;
+  int      sessions;                                                    // Running when sampled
+  uint64_t restarts;                                                    // Sessions that dropped and were started again
+  uint64_t rss_kb;
+  int      fds;
+  double   hu_cpu_pct;                                                  // Per session, % of one core
+  double   phone_cpu_pct;
+  double   media_mbs;                                                   // All sessions
+  double   ack_mean_us;                                                 // Over the interval, all sessions
+  uint32_t ack_max_us;
+  int64_t  command_queue_depth;
+};
+
+// Exit code: 0, or 1 when sessions could not start or fds / RSS kept growing after the first interval
+int hu_soak_run (int sessions, int seconds, int report_seconds);
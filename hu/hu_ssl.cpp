@@ -55,16 +55,17 @@
 
   int HUServer::send_ssl_handshake_packet()
   {
-    byte hs_buf [MAX_FRAME_SIZE] = {0};
+    std::vector<byte> & hs_buf = hu_ssl_bio_state.wr_spill;            // No frame is open during the handshake so the records collect here
 
-    int len = BIO_read (hu_ssl_wm_bio, hs_buf, sizeof (hs_buf));         // Read from the BIO Client request: Hello/Key Exchange
+    int len = hs_buf.size ();
     if (len <= 0) {
-      loge ("BIO_read() HS client req ret: %d", len);
+      loge ("No HS client req to send");
       return (-1);
     }
-    logw ("BIO_read() HS client req ret: %d", len);
+    logw ("HS client req len: %d", len);
 
-    int ret = hu_aap_unenc_send_blob(0, AA_CH_CTR, HU_INIT_MESSAGE::SSLHandshake, hs_buf, len, 5000);
+    int ret = hu_aap_unenc_send_blob(0, AA_CH_CTR, HU_INIT_MESSAGE::SSLHandshake, hs_buf.data (), len, 5000);
+    hs_buf.clear ();
     if (ret < 0) {
       loge ("hu_aap_tra_send() HS client req ret: %d  len: %d", ret, len);
       return -1;
@@ -74,20 +75,119 @@
   }
 
 
-  int HUServer::hu_ssl_begin_handshake () {
+  // Frame BIO: source/sink backed by hu_ssl_frame_bio instead of a memory buffer
 
-    int                 ret;
-    BIO               * cert_bio = NULL;
-    BIO               * pkey_bio = NULL;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  static inline void * BIO_get_data (BIO * b)             { return (b->ptr); }
+  static inline void   BIO_set_data (BIO * b, void * ptr) { b->ptr = ptr; }
+  static inline void   BIO_set_init (BIO * b, int init)   { b->init = init; }
+#endif
 
-    ret = SSL_library_init ();                                          // Init
-    logd ("SSL_library_init ret: %d", ret);
-    if (ret != 1) {                                                     // Always returns "1", so it is safe to discard the return value.
-      loge ("SSL_library_init() error");
+  static int hu_ssl_frame_bio_write (BIO * b, const char * buf, int len) {
+    hu_ssl_frame_bio * state = (hu_ssl_frame_bio *) BIO_get_data (b);
+    BIO_clear_retry_flags (b);
+    if (state == NULL || len <= 0)
+      return (0);
+
+    if (state->wr_buf == NULL) {                                        // Nothing to send yet, keep it for the next frame
+      state->wr_spill.insert (state->wr_spill.end (), buf, buf + len);
+      return (len);
+    }
+
+    int avail = state->wr_cap - state->wr_len;
+    if (avail <= 0) {
+      BIO_set_retry_write (b);
+      return (-1);
+    }
+    if (len > avail)
+      len = avail;
+    memcpy (state->wr_buf + state->wr_len, buf, len);
+    state->wr_len += len;
+    return (len);
+  }
+
+  static int hu_ssl_frame_bio_read (BIO * b, char * buf, int len) {
+    hu_ssl_frame_bio * state = (hu_ssl_frame_bio *) BIO_get_data (b);
+    BIO_clear_retry_flags (b);
+    if (state == NULL || len <= 0)
+      return (0);
+
+    if (state->rd_len <= 0) {                                           // Need the next frame
+      BIO_set_retry_read (b);
       return (-1);
     }
+    if (len > state->rd_len)
+      len = state->rd_len;
+    memcpy (buf, state->rd_buf, len);
+    state->rd_buf += len;
+    state->rd_len -= len;
+    return (len);
+  }
+
+  static long hu_ssl_frame_bio_ctrl (BIO * b, int cmd, long num, void * ptr) {
+    hu_ssl_frame_bio * state = (hu_ssl_frame_bio *) BIO_get_data (b);
+    switch (cmd) {
+      case BIO_CTRL_PENDING:  return (state ? state->rd_len : 0);
+      case BIO_CTRL_WPENDING: return (state ? state->wr_len : 0);
+      case BIO_CTRL_FLUSH:    return (1);
+    }
+    return (0);
+  }
+
+  static int hu_ssl_frame_bio_create (BIO * b) {
+    BIO_set_data (b, NULL);
+    BIO_set_init (b, 1);
+    return (1);
+  }
+
+  static int hu_ssl_frame_bio_destroy (BIO * b) {
+    BIO_set_data (b, NULL);                                             // State is owned by HUServer
+    return (1);
+  }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  static BIO_METHOD hu_ssl_frame_bio_method_1_0 = {
+    BIO_TYPE_SOURCE_SINK, "hu_frame",
+    hu_ssl_frame_bio_write, hu_ssl_frame_bio_read, NULL, NULL,
+    hu_ssl_frame_bio_ctrl, hu_ssl_frame_bio_create, hu_ssl_frame_bio_destroy, NULL,
+  };
+  static BIO_METHOD * hu_ssl_frame_bio_method = & hu_ssl_frame_bio_method_1_0;
+#else
+  static BIO_METHOD * hu_ssl_frame_bio_method = NULL;                   // Created in hu_ssl_ctx_init ()
+#endif
+
+  BIO * hu_ssl_frame_bio_new (hu_ssl_frame_bio * state) {
+    if (hu_ssl_frame_bio_method == NULL)
+      return (NULL);
+    BIO * b = BIO_new (hu_ssl_frame_bio_method);
+    if (b)
+      BIO_set_data (b, state);
+    return (b);
+  }
 
+  // The context, certificate and private key are the same for every connection, so they are built once per process
+  // and shared by all HUServer instances. The last negotiated session is kept so a reconnect can offer it for an
+  // abbreviated handshake; if the phone doesn't know it any more it just falls back to a full one.
 
+  std::string             hu_ssl_cipher_list;                           // Set from the config before connecting
+
+  static pthread_once_t   hu_ssl_lib_once       = PTHREAD_ONCE_INIT;
+  static bool             hu_ssl_lib_ok         = false;
+
+  static pthread_once_t   hu_ssl_ctx_once       = PTHREAD_ONCE_INIT;
+  static SSL_CTX        * hu_ssl_shared_ctx     = NULL;
+
+  static pthread_mutex_t  hu_ssl_session_mutex  = PTHREAD_MUTEX_INITIALIZER;
+  static SSL_SESSION    * hu_ssl_cached_session = NULL;
+
+  static void hu_ssl_lib_init () {
+
+    int ret = SSL_library_init ();                                      // Init
+    logd ("SSL_library_init ret: %d", ret);
+    if (ret != 1) {                                                     // Always returns "1", so it is safe to discard the return value.
+      loge ("SSL_library_init() error");
+      return;
+    }
 
     SSL_load_error_strings ();                                          // Before or after init ?
     ERR_load_BIO_strings ();
@@ -100,69 +200,126 @@
     logd ("RAND_status ret: %d", ret);
     if (ret != 1) {
       loge ("RAND_status() error");
-      return (-1);
+      return;
     }
 
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    BIO_METHOD * bio_method = BIO_meth_new (BIO_get_new_index () | BIO_TYPE_SOURCE_SINK, "hu_frame");
+    BIO_meth_set_write   (bio_method, hu_ssl_frame_bio_write);
+    BIO_meth_set_read    (bio_method, hu_ssl_frame_bio_read);
+    BIO_meth_set_ctrl    (bio_method, hu_ssl_frame_bio_ctrl);
+    BIO_meth_set_create  (bio_method, hu_ssl_frame_bio_create);
+    BIO_meth_set_destroy (bio_method, hu_ssl_frame_bio_destroy);
+    hu_ssl_frame_bio_method = bio_method;
+#endif
+
+    hu_ssl_lib_ok = true;
+  }
+
+  SSL_CTX * hu_ssl_ctx_new (const SSL_METHOD * method) {
+
+    int                 ret;
+    BIO               * cert_bio = NULL;
+    BIO               * pkey_bio = NULL;
+
+    pthread_once (& hu_ssl_lib_once, hu_ssl_lib_init);
+    if (!hu_ssl_lib_ok || method == NULL)
+      return (NULL);
 
     cert_bio = BIO_new_mem_buf (cert_buf, sizeof (cert_buf));           // Read only memory BIO for certificate
-    pem_password_cb * ppcb1 = NULL;
-    void * u1 = NULL;
-    X509 * x509 = NULL;
-    X509 * x509_cert = PEM_read_bio_X509_AUX (cert_bio, & x509, ppcb1, u1);
+    X509 * x509_cert = PEM_read_bio_X509_AUX (cert_bio, NULL, NULL, NULL);
+    BIO_free (cert_bio);
     if (x509_cert == NULL) {
       loge ("read_bio_X509_AUX() error");
-      return (-1);
+      return (NULL);
     }
     logd ("PEM_read_bio_X509_AUX() x509_cert: %p", x509_cert);
-    ret = BIO_free (cert_bio);
-    if (ret != 1)
-      loge ("BIO_free(cert_bio) ret: %d", ret);
-    else
-      logd ("BIO_free(cert_bio) ret: %d", ret);
 
     pkey_bio = BIO_new_mem_buf (pkey_buf, sizeof (pkey_buf));           // Read only memory BIO for private key
-    pem_password_cb * ppcb2 = NULL;
-    void * u2 = NULL;
-      // Read a private key from a BIO using a pass phrase callback:    key = PEM_read_bio_PrivateKey(bp, NULL, pass_cb,  "My Private Key");
-      // Read a private key from a BIO using the pass phrase "hello":   key = PEM_read_bio_PrivateKey(bp, NULL, 0,        "hello");
-    EVP_PKEY * priv_key_ret = NULL;
-    EVP_PKEY * priv_key = PEM_read_bio_PrivateKey (pkey_bio, & priv_key_ret, ppcb2, u2);
+    EVP_PKEY * priv_key = PEM_read_bio_PrivateKey (pkey_bio, NULL, NULL, NULL);
+    BIO_free (pkey_bio);
     if (priv_key == NULL) {
       loge ("PEM_read_bio_PrivateKey() error");
-      return (-1);
+      X509_free (x509_cert);
+      return (NULL);
     }
     logd ("PEM_read_bio_PrivateKey() priv_key: %p", priv_key);
-    ret = BIO_free (pkey_bio);
-    if (ret != 1)
-      loge ("BIO_free(pkey_bio) ret: %d", ret);
-    else
-      logd ("BIO_free(pkey_bio) ret: %d", ret);
-
-    hu_ssl_method = (SSL_METHOD *) TLSv1_2_client_method ();
-    if (hu_ssl_method == NULL) {
-      loge ("TLSv1_2_client_method() error");
-      return (-1);
-    }
-    logd ("TLSv1_2_client_method() hu_ssl_method: %p", hu_ssl_method);
 
-    hu_ssl_ctx = SSL_CTX_new (hu_ssl_method);
-    if (hu_ssl_ctx == NULL) {
+    SSL_CTX * ctx = SSL_CTX_new (method);
+    if (ctx == NULL) {
       loge ("SSL_CTX_new() error");
-      return (-1);
+      X509_free (x509_cert);
+      EVP_PKEY_free (priv_key);
+      return (NULL);
     }
-    logd ("SSL_CTX_new() hu_ssl_ctx: %p", hu_ssl_ctx);
+    logd ("SSL_CTX_new() ctx: %p", ctx);
 
-    ret = SSL_CTX_use_certificate (hu_ssl_ctx, x509_cert);
+    ret = SSL_CTX_use_certificate (ctx, x509_cert);                     // Takes its own reference
     if (ret != 1)
       loge ("SSL_CTX_use_certificate() ret: %d", ret);
-    else
-      logd ("SSL_CTX_use_certificate() ret: %d", ret);
+    X509_free (x509_cert);
 
-    ret = SSL_CTX_use_PrivateKey (hu_ssl_ctx, priv_key);
+    ret = SSL_CTX_use_PrivateKey (ctx, priv_key);
     if (ret != 1)
       loge ("SSL_CTX_use_PrivateKey() ret: %d", ret);
-    else
-      logd ("SSL_CTX_use_PrivateKey() ret: %d", ret);
+    EVP_PKEY_free (priv_key);
+
+    ret = SSL_CTX_check_private_key (ctx);
+    if (ret != 1) {
+      loge ("SSL_CTX_check_private_key() ret: %d", ret);
+      SSL_CTX_free (ctx);
+      return (NULL);
+    }
+
+    SSL_CTX_set_verify (ctx, SSL_VERIFY_NONE, NULL);
+    return (ctx);
+  }
+
+  static void hu_ssl_ctx_init () {
+    SSL_CTX * ctx = hu_ssl_ctx_new (TLSv1_2_client_method ());
+    if (ctx == NULL)
+      return;
+
+    SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);  // We keep the client session ourselves
+
+    hu_ssl_shared_ctx = ctx;
+  }
+
+  void HUServer::hu_ssl_free () {
+    if (hu_ssl_ssl == NULL)
+      return;
+
+    if (SSL_is_init_finished (hu_ssl_ssl)) {                            // Remember the session for the next connect
+      SSL_SESSION * session = SSL_get1_session (hu_ssl_ssl);
+      if (session) {
+        pthread_mutex_lock (& hu_ssl_session_mutex);
+        if (hu_ssl_cached_session)
+          SSL_SESSION_free (hu_ssl_cached_session);
+        hu_ssl_cached_session = session;
+        pthread_mutex_unlock (& hu_ssl_session_mutex);
+      }
+    }
+
+    hu_ssl_fast.reset ();
+    SSL_free (hu_ssl_ssl);                                              // Also frees the BIO
+    hu_ssl_ssl = NULL;
+    hu_ssl_bio = NULL;
+  }
+
+  int HUServer::hu_ssl_begin_handshake () {
+
+    int ret;
+
+    hu_ssl_handshake_start_us = hu_get_time_us ();
+
+    pthread_once (& hu_ssl_ctx_once, hu_ssl_ctx_init);
+    if (hu_ssl_shared_ctx == NULL) {
+      loge ("No SSL context");
+      return (-1);
+    }
+    hu_ssl_ctx = hu_ssl_shared_ctx;
+
+    hu_ssl_free ();                                                     // Left over from a previous connection
 
     // Must do all CTX setup before SSL_new() !!
     hu_ssl_ssl = SSL_new (hu_ssl_ctx);
@@ -174,37 +331,31 @@
 
 //	SSL_set_mode (hu_ssl_ssl, SSL_OP_NO_TLSv1|SSL_OP_NO_TLSv1_1 |SSL_OP_NO_SSLv2|SSL_OP_NO_SSLv3);
 
-    ret = SSL_check_private_key (hu_ssl_ssl);
-    if (ret != 1) {
-      loge ("SSL_check_private_key() ret: %d", ret);
-      return (-1);
+    if (!hu_ssl_cipher_list.empty ()) {                                 // Per connection so config changes apply on reconnect
+      ret = SSL_set_cipher_list (hu_ssl_ssl, hu_ssl_cipher_list.c_str ());
+      if (ret != 1)
+        loge ("SSL_set_cipher_list(%s) failed, using the default list", hu_ssl_cipher_list.c_str ());
     }
-    logd ("SSL_check_private_key() ret: %d", ret);
-
 
-    hu_ssl_rm_bio = BIO_new (BIO_s_mem ());
-    if (hu_ssl_rm_bio == NULL) {
-      loge ("BIO_new() hu_ssl_rm_bio: %p", hu_ssl_rm_bio);
-      return (-1);
+    pthread_mutex_lock (& hu_ssl_session_mutex);
+    if (hu_ssl_cached_session) {
+      ret = SSL_set_session (hu_ssl_ssl, hu_ssl_cached_session);        // Offer the previous session for resumption
+      logd ("SSL_set_session() ret: %d", ret);
     }
-    logd ("BIO_new() hu_ssl_rm_bio: %p", hu_ssl_rm_bio);
+    pthread_mutex_unlock (& hu_ssl_session_mutex);
 
-    hu_ssl_wm_bio = BIO_new (BIO_s_mem ());
-    if (hu_ssl_wm_bio == NULL) {
-      loge ("BIO_new() hu_ssl_wm_bio: %p", hu_ssl_wm_bio);
+    hu_ssl_bio_state = hu_ssl_frame_bio ();
+    hu_ssl_bio = hu_ssl_frame_bio_new (& hu_ssl_bio_state);
+    if (hu_ssl_bio == NULL) {
+      loge ("hu_ssl_frame_bio_new() hu_ssl_bio: %p", hu_ssl_bio);
       return (-1);
     }
-    logd ("BIO_new() hu_ssl_wm_bio: %p", hu_ssl_wm_bio);
-
-    SSL_set_bio (hu_ssl_ssl, hu_ssl_rm_bio, hu_ssl_wm_bio);                                  // Read from memory, write to memory
+    logd ("hu_ssl_frame_bio_new() hu_ssl_bio: %p", hu_ssl_bio);
 
-    BIO_set_write_buf_size (hu_ssl_rm_bio, MAX_FRAME_PAYLOAD_SIZE);                             // BIO_ctrl() API to increase the buffer size.
-    BIO_set_write_buf_size (hu_ssl_wm_bio, MAX_FRAME_PAYLOAD_SIZE);
+    SSL_set_bio (hu_ssl_ssl, hu_ssl_bio, hu_ssl_bio);                   // Read from received frames, write into outbound frames
 
     SSL_set_connect_state (hu_ssl_ssl);                                        // Set ssl to work in client mode
 
-    SSL_set_verify (hu_ssl_ssl, SSL_VERIFY_NONE, NULL);
-
     ret = SSL_do_handshake (hu_ssl_ssl);                             // Do current handshake step processing
     logw ("SSL_do_handshake() ret: %d", ret);
 
@@ -221,23 +372,19 @@
 
     int HUServer::hu_handle_SSLHandshake(int chan, byte * buf, int len)
   {
-      int ret = BIO_write (hu_ssl_rm_bio, buf, len);          // Write to the BIO Server response
-      if (ret <= 0) {
-        loge ("BIO_write() server rsp ret: %d", ret);
-        hu_ssl_ret_log (ret);
-        hu_ssl_inf_log ();
-//        g_free(hs_buf);
-        return (-1);
-      }
-      logw ("BIO_write() server rsp ret: %d", ret);
-
-      ret = SSL_do_handshake (hu_ssl_ssl);                             // Do current handshake step processing
+      hu_ssl_bio_state.set_input (buf, len);                           // Server response is read straight from the message
+      int ret = SSL_do_handshake (hu_ssl_ssl);                             // Do current handshake step processing
       logw ("SSL_do_handshake() ret: %d", ret);
+      if (hu_ssl_bio_state.rd_len > 0)
+        logw ("SSL_do_handshake() left %d bytes unread", hu_ssl_bio_state.rd_len);
+      hu_ssl_bio_state.set_input (NULL, 0);
 
 
       if ((SSL_get_error (hu_ssl_ssl, ret) == SSL_ERROR_WANT_READ))
       {
-        //keep going
+        //keep going, unless we are just waiting for the rest of the server flight
+        if (hu_ssl_bio_state.wr_spill.size () == 0)
+          return (0);
         return send_ssl_handshake_packet();
       }
 
@@ -247,6 +394,11 @@
         return (-1);
       }
 
+      if (hu_ssl_bio_state.wr_spill.size () > 0) {                      // Resumed sessions finish on our side: send our Finished
+        if (send_ssl_handshake_packet () < 0)
+          return (-1);
+      }
+
       HU::AuthCompleteResponse response;
       response.set_status(HU::STATUS_OK);
       ret = hu_aap_unenc_send_message(0, AA_CH_CTR, HU_INIT_MESSAGE::AuthComplete, response, 2000);
@@ -257,8 +409,52 @@
       }
       hu_ssl_inf_log ();
 
+      if (ena_ssl_aead)                                                 // Optional: records are handled directly from now on
+        hu_ssl_fast.init (hu_ssl_ssl);
+
+      uint64_t handshake_us = hu_get_time_us () - hu_ssl_handshake_start_us;
+      logw ("SSL handshake done in %llu ms (%s), cipher: %s", (unsigned long long) (handshake_us / 1000), SSL_session_reused (hu_ssl_ssl) ? "resumed" : "full",
+            SSL_CIPHER_get_name (SSL_get_current_cipher (hu_ssl_ssl)));
+
       iaap_state = hu_STATE_STARTED;
       logw ("  SET: iaap_state: %d (%s)", iaap_state, state_get (iaap_state));
 
       return  0;
   }
+
+  int HUServer::hu_ssl_fast_recv (const byte * buf, int len, byte * out, int out_cap) {
+    // A frame normally holds one application data record. Alerts and renegotiation can't be handed back to
+    // SSL_read since OpenSSL's sequence numbers no longer match, so they are handled here.
+    int out_len = 0;
+    while (len > 0) {
+      int content_type = 0;
+      int rec_used = 0;
+      int ret = hu_ssl_fast.open (buf, len, out + out_len, out_cap - out_len, & content_type, & rec_used);
+      if (ret < 0)
+        return (-1);
+
+      if (content_type == HU_SSL_CONTENT_APPLICATION_DATA) {
+        out_len += ret;
+      }
+      else if (content_type == HU_SSL_CONTENT_ALERT && ret >= 2) {
+        int level = out [out_len];
+        int desc = out [out_len + 1];
+        if (level == 2 || desc == 0) {                                  // Fatal or close_notify
+          loge ("TLS alert level: %d  desc: %d", level, desc);
+          return (-1);
+        }
+        logw ("TLS warning alert desc: %d", desc);
+      }
+      else if (content_type == HU_SSL_CONTENT_HANDSHAKE && ret >= 1 && out [out_len] == 0) {
+        logw ("Ignoring HelloRequest, renegotiation isn't supported");  // RFC 5246 7.4.1.1 allows the client to ignore it
+      }
+      else {
+        loge ("Unexpected TLS record type: %d", content_type);
+        return (-1);
+      }
+
+      buf += rec_used;
+      len -= rec_used;
+    }
+    return (out_len);
+  }
@@ -5,10 +5,106 @@
   #include <openssl/pem.h>
   #include <openssl/x509.h>
   #include <openssl/x509_vfy.h>
+  #include <openssl/evp.h>
 
   //SSL_METHOD  * hu_ssl_method  = NULL;
   //SSL_CTX     * hu_ssl_ctx     = NULL;
 
+  #include <stdint.h>
+  #include <vector>
+  #include <string>
+  #include <string.h>
+
+  // Ciphertext window for the frame BIO. Instead of staging records in memory BIOs, OpenSSL reads them straight out
+  // of the received frame and writes them straight into the outbound frame after the AA header.
+
+  struct hu_ssl_frame_bio {
+    const unsigned char * rd_buf = NULL;                                // Received ciphertext not yet consumed by OpenSSL
+    int                   rd_len = 0;
+
+    unsigned char       * wr_buf = NULL;                                // Outbound frame payload being filled by OpenSSL
+    int                   wr_cap = 0;
+    int                   wr_len = 0;
+
+    std::vector<unsigned char> wr_spill;                                // Records written with no frame open (alerts etc), sent ahead of the next one
+
+    void set_input (const unsigned char * buf, int len) {
+      rd_buf = buf;
+      rd_len = len;
+    }
+
+    void set_output (unsigned char * buf, int cap) {
+      wr_buf = buf;
+      wr_cap = cap;
+      wr_len = 0;
+      if (wr_spill.size () > 0 && (int) wr_spill.size () <= cap) {
+        memcpy (wr_buf, wr_spill.data (), wr_spill.size ());
+        wr_len = wr_spill.size ();
+        wr_spill.clear ();
+      }
+    }
+
+    int take_output () {                                                // Returns the number of ciphertext bytes written
+      int len = wr_len;
+      wr_buf = NULL;
+      wr_cap = wr_len = 0;
+      return (len);
+    }
+  };
+
+  BIO * hu_ssl_frame_bio_new (hu_ssl_frame_bio * state);
+  SSL_CTX * hu_ssl_ctx_new (const SSL_METHOD * method);                 // New context with our certificate and key
+
+  // Cipher suites offered to the phone, most preferred first (OpenSSL cipher list format). Empty means OpenSSL's default.
+  extern std::string hu_ssl_cipher_list;
+
+  struct hu_ssl_bench_result {
+    std::string cipher;                                                 // As negotiated
+    double      handshake_ms = 0;
+    double      ssl_mbs = 0;                                            // Encrypt + decrypt through SSL_write/SSL_read
+    double      aead_mbs = 0;                                           // Same through hu_ssl_aead, 0 if it can't handle the suite
+  };
+
+  // SSL_write/SSL_read vs hu_ssl_aead for one suite, and every suite of a list ranked. See hu_ssl_bench.cpp
+  int hu_ssl_bench (const char * cipher_list, int megabytes, hu_ssl_bench_result * result = NULL);
+  int hu_ssl_bench_suites (const std::string & cipher_list, int megabytes);
+
+  // Optional AES-GCM record layer used instead of SSL_read/SSL_write once the handshake is done (hu_ssl_aead.cpp).
+  // The record keys are derived from the negotiated session; only TLS 1.2 AES-GCM suites are supported.
+
+  extern int ena_ssl_aead;
+
+  #define HU_SSL_AEAD_OVERHEAD  (5 + 8 + 16)                               // Record header, explicit nonce, tag
+
+  enum HU_SSL_CONTENT_TYPE
+  {
+    HU_SSL_CONTENT_ALERT = 21,
+    HU_SSL_CONTENT_HANDSHAKE = 22,
+    HU_SSL_CONTENT_APPLICATION_DATA = 23,
+  };
+
+  class hu_ssl_aead {
+  public:
+    ~hu_ssl_aead () { reset (); }
+
+    bool init (SSL * ssl);                                              // False if the negotiated suite can't be handled
+    void reset ();
+    bool active () const { return (enc_ctx != NULL); }
+
+    // Encrypt len bytes into one record at out, returns the record length or -1
+    int seal (int content_type, const unsigned char * in, int len, unsigned char * out, int out_cap);
+    // Decrypt the record at the start of rec, returns the plaintext length or -1. *rec_used is the record length.
+    int open (const unsigned char * rec, int rec_len, unsigned char * out, int out_cap, int * content_type, int * rec_used);
+
+  private:
+    EVP_CIPHER_CTX * enc_ctx = NULL;
+    EVP_CIPHER_CTX * dec_ctx = NULL;
+    unsigned char    enc_salt [4];
+    unsigned char    dec_salt [4];
+    uint64_t         enc_seq = 0;
+    uint64_t         dec_seq = 0;
+  };
+
   // Internal:
 
 #ifdef  MR_SSL_INTERNAL
@@ -0,0 +1,231 @@
+
+  // Direct TLS 1.2 AES-GCM record processing, bypassing the SSL_read/SSL_write state machine after the handshake
+
+  #define LOGTAG "hu_ssl_aead"
+  #include "hu_uti.h"
+  #include "hu_ssl.h"
+
+  #include <openssl/hmac.h>
+  #include <endian.h>
+
+  int ena_ssl_aead = 0;                                                 // Off by default, set from the config
+
+  static const int GCM_SALT_LEN     = 4;                                  // Implicit part of the nonce, from the key block
+  static const int GCM_EXPLICIT_LEN = 8;                                  // Explicit part, sent with every record
+  static const int GCM_TAG_LEN      = 16;
+  static const int TLS_HEADER_LEN   = 5;
+
+  // TLS 1.2 PRF (RFC 5246 section 5): P_hash (secret, label + seed)
+  static bool tls12_prf (const EVP_MD * md, const unsigned char * secret, int secret_len, const char * label,
+                         const unsigned char * seed, int seed_len, unsigned char * out, int out_len) {
+    unsigned char full_seed [128];
+    int label_len = strlen (label);
+    if (label_len + seed_len > (int) sizeof (full_seed))
+      return (false);
+    memcpy (full_seed, label, label_len);
+    memcpy (full_seed + label_len, seed, seed_len);
+    int full_len = label_len + seed_len;
+
+    unsigned char a [EVP_MAX_MD_SIZE];                                  // A(i)
+    unsigned int a_len = 0;
+    if (HMAC (md, secret, secret_len, full_seed, full_len, a, & a_len) == NULL)
+      return (false);
+
+    while (out_len > 0) {
+      unsigned char block [EVP_MAX_MD_SIZE + sizeof (full_seed)];
+      unsigned char chunk [EVP_MAX_MD_SIZE];
+      unsigned int chunk_len = 0;
+      memcpy (block, a, a_len);
+      memcpy (block + a_len, full_seed, full_len);
+      if (HMAC (md, secret, secret_len, block, a_len + full_len, chunk, & chunk_len) == NULL)
+        return (false);
+
+      int n = out_len < (int) chunk_len ? out_len : chunk_len;
+      memcpy (out, chunk, n);
+      out += n;
+      out_len -= n;
+
+      if (HMAC (md, secret, secret_len, a, a_len, a, & a_len) == NULL)
+        return (false);
+    }
+    return (true);
+  }
+
+  static EVP_CIPHER_CTX * gcm_ctx_new (const EVP_CIPHER * cipher, const unsigned char * key, bool encrypt) {
+    EVP_CIPHER_CTX * ctx = EVP_CIPHER_CTX_new ();
+    if (ctx == NULL)
+      return (NULL);
+    // The key schedule is done once here, each record only sets the nonce
+    if (EVP_CipherInit_ex (ctx, cipher, NULL, NULL, NULL, encrypt ? 1 : 0) != 1
+        || EVP_CIPHER_CTX_ctrl (ctx, EVP_CTRL_GCM_SET_IVLEN, GCM_SALT_LEN + GCM_EXPLICIT_LEN, NULL) != 1
+        || EVP_CipherInit_ex (ctx, NULL, NULL, key, NULL, encrypt ? 1 : 0) != 1) {
+      EVP_CIPHER_CTX_free (ctx);
+      return (NULL);
+    }
+    return (ctx);
+  }
+
+  static void tls_aad (unsigned char * aad, uint64_t seq, int content_type, int len) {
+    uint64_t seq_be = htobe64 (seq);
+    memcpy (aad, & seq_be, 8);
+    aad [8]  = content_type;
+    aad [9]  = 0x03;                                                    // TLS 1.2
+    aad [10] = 0x03;
+    aad [11] = (len >> 8) & 0xff;
+    aad [12] = len & 0xff;
+  }
+
+  bool hu_ssl_aead::init (SSL * ssl) {
+    reset ();
+
+    if (SSL_version (ssl) != TLS1_2_VERSION) {
+      logw ("Not TLS 1.2, staying on SSL_read/SSL_write");
+      return (false);
+    }
+
+    const char * cipher_name = SSL_CIPHER_get_name (SSL_get_current_cipher (ssl));
+    const EVP_CIPHER * cipher = NULL;
+    if (strstr (cipher_name, "AES128-GCM"))
+      cipher = EVP_aes_128_gcm ();
+    else if (strstr (cipher_name, "AES256-GCM"))
+      cipher = EVP_aes_256_gcm ();
+    if (cipher == NULL) {
+      logw ("Cipher %s is not AES-GCM, staying on SSL_read/SSL_write", cipher_name);
+      return (false);
+    }
+    const EVP_MD * md = strstr (cipher_name, "SHA384") ? EVP_sha384 () : EVP_sha256 ();
+
+    unsigned char master [SSL_MAX_MASTER_KEY_LENGTH];
+    unsigned char randoms [2 * SSL3_RANDOM_SIZE];                       // server_random + client_random for key expansion
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    int master_len = SSL_SESSION_get_master_key (SSL_get_session (ssl), master, sizeof (master));
+    SSL_get_server_random (ssl, randoms, SSL3_RANDOM_SIZE);
+    SSL_get_client_random (ssl, randoms + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+    bool is_server = SSL_is_server (ssl);
+#else
+    int master_len = ssl->session->master_key_length;
+    memcpy (master, ssl->session->master_key, master_len);
+    memcpy (randoms, ssl->s3->server_random, SSL3_RANDOM_SIZE);
+    memcpy (randoms + SSL3_RANDOM_SIZE, ssl->s3->client_random, SSL3_RANDOM_SIZE);
+    bool is_server = ssl->server;
+#endif
+
+    // AEAD suites have no MAC keys: client_write_key, server_write_key, client_write_IV, server_write_IV
+    int key_len = EVP_CIPHER_key_length (cipher);
+    unsigned char key_block [2 * 32 + 2 * GCM_SALT_LEN];
+    bool ok = tls12_prf (md, master, master_len, "key expansion", randoms, sizeof (randoms), key_block, 2 * key_len + 2 * GCM_SALT_LEN);
+    OPENSSL_cleanse (master, sizeof (master));
+    if (!ok) {
+      loge ("Key expansion failed");
+      OPENSSL_cleanse (key_block, sizeof (key_block));
+      return (false);
+    }
+
+    const unsigned char * client_key  = key_block;
+    const unsigned char * server_key  = key_block + key_len;
+    const unsigned char * client_salt = key_block + 2 * key_len;
+    const unsigned char * server_salt = client_salt + GCM_SALT_LEN;
+
+    enc_ctx = gcm_ctx_new (cipher, is_server ? server_key : client_key, true);
+    dec_ctx = gcm_ctx_new (cipher, is_server ? client_key : server_key, false);
+    memcpy (enc_salt, is_server ? server_salt : client_salt, GCM_SALT_LEN);
+    memcpy (dec_salt, is_server ? client_salt : server_salt, GCM_SALT_LEN);
+    OPENSSL_cleanse (key_block, sizeof (key_block));
+
+    if (enc_ctx == NULL || dec_ctx == NULL) {
+      loge ("GCM context setup failed");
+      reset ();
+      return (false);
+    }
+
+    enc_seq = 1;                                                        // Sequence 0 was each side's Finished
+    dec_seq = 1;
+    logd ("AEAD record layer active for %s", cipher_name);
+    return (true);
+  }
+
+  void hu_ssl_aead::reset () {
+    if (enc_ctx)
+      EVP_CIPHER_CTX_free (enc_ctx);
+    if (dec_ctx)
+      EVP_CIPHER_CTX_free (dec_ctx);
+    enc_ctx = dec_ctx = NULL;
+    enc_seq = dec_seq = 0;
+  }
+
+  int hu_ssl_aead::seal (int content_type, const unsigned char * in, int len, unsigned char * out, int out_cap) {
+    int rec_len = TLS_HEADER_LEN + GCM_EXPLICIT_LEN + len + GCM_TAG_LEN;
+    if (enc_ctx == NULL || len < 0 || rec_len > out_cap || len > 0x4000)
+      return (-1);
+
+    unsigned char nonce [GCM_SALT_LEN + GCM_EXPLICIT_LEN];
+    uint64_t seq_be = htobe64 (enc_seq);
+    memcpy (nonce, enc_salt, GCM_SALT_LEN);
+    memcpy (nonce + GCM_SALT_LEN, & seq_be, GCM_EXPLICIT_LEN);          // Same explicit nonce choice as OpenSSL
+
+    unsigned char aad [13];
+    tls_aad (aad, enc_seq, content_type, len);
+
+    int payload_len = rec_len - TLS_HEADER_LEN;
+    out [0] = content_type;
+    out [1] = 0x03;
+    out [2] = 0x03;
+    out [3] = (payload_len >> 8) & 0xff;
+    out [4] = payload_len & 0xff;
+    memcpy (out + TLS_HEADER_LEN, nonce + GCM_SALT_LEN, GCM_EXPLICIT_LEN);
+    unsigned char * ct = out + TLS_HEADER_LEN + GCM_EXPLICIT_LEN;
+
+    int outl = 0;
+    if (EVP_EncryptInit_ex (enc_ctx, NULL, NULL, NULL, nonce) != 1
+        || EVP_EncryptUpdate (enc_ctx, NULL, & outl, aad, sizeof (aad)) != 1
+        || EVP_EncryptUpdate (enc_ctx, ct, & outl, in, len) != 1
+        || EVP_EncryptFinal_ex (enc_ctx, ct + outl, & outl) != 1
+        || EVP_CIPHER_CTX_ctrl (enc_ctx, EVP_CTRL_GCM_GET_TAG, GCM_TAG_LEN, ct + len) != 1) {
+      loge ("AES-GCM seal failed");
+      return (-1);
+    }
+
+    enc_seq ++;
+    return (rec_len);
+  }
+
+  int hu_ssl_aead::open (const unsigned char * rec, int rec_len, unsigned char * out, int out_cap, int * content_type, int * rec_used) {
+    if (dec_ctx == NULL || rec_len < TLS_HEADER_LEN)
+      return (-1);
+
+    int payload_len = (rec [3] << 8) | rec [4];
+    if (TLS_HEADER_LEN + payload_len > rec_len || payload_len < GCM_EXPLICIT_LEN + GCM_TAG_LEN) {
+      loge ("Bad record length %d of %d", payload_len, rec_len);
+      return (-1);
+    }
+    int len = payload_len - GCM_EXPLICIT_LEN - GCM_TAG_LEN;
+    if (len > out_cap)
+      return (-1);
+
+    *content_type = rec [0];
+    *rec_used = TLS_HEADER_LEN + payload_len;
+
+    unsigned char nonce [GCM_SALT_LEN + GCM_EXPLICIT_LEN];
+    memcpy (nonce, dec_salt, GCM_SALT_LEN);
+    memcpy (nonce + GCM_SALT_LEN, rec + TLS_HEADER_LEN, GCM_EXPLICIT_LEN);
+
+    unsigned char aad [13];
+    tls_aad (aad, dec_seq, rec [0], len);
+
+    const unsigned char * ct = rec + TLS_HEADER_LEN + GCM_EXPLICIT_LEN;
+    unsigned char tag [GCM_TAG_LEN];
+    memcpy (tag, ct + len, GCM_TAG_LEN);
+
+    int outl = 0;
+    if (EVP_DecryptInit_ex (dec_ctx, NULL, NULL, NULL, nonce) != 1
+        || EVP_DecryptUpdate (dec_ctx, NULL, & outl, aad, sizeof (aad)) != 1
+        || EVP_DecryptUpdate (dec_ctx, out, & outl, ct, len) != 1
+        || EVP_CIPHER_CTX_ctrl (dec_ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_LEN, tag) != 1
+        || EVP_DecryptFinal_ex (dec_ctx, out + outl, & outl) != 1) {
+      loge ("AES-GCM open failed, seq: %llu", (unsigned long long) dec_seq);
+      return (-1);
+    }
+
+    dec_seq ++;
+    return (len);
+  }
@@ -0,0 +1,231 @@
+
+  // Crypto benchmark: encrypt/decrypt throughput of SSL_write/SSL_read versus the hu_ssl_aead record layer.
+  // Runs a client and a server over an in-memory BIO pair, so no phone is needed. Used by "headunit bench-crypto".
+
+  #define LOGTAG "hu_ssl_bench"
+  #include "hu_uti.h"
+  #include "hu_ssl.h"
+
+  #include <openssl/rand.h>
+  #include <vector>
+  #include <string>
+  #include <algorithm>
+
+  static const int BENCH_RECORD_SIZE = 0x4000;                          // Same as MAX_FRAME_PAYLOAD_SIZE, one record per AA frame
+
+  static double cpu_mhz () {                                            // 0 if unknown
+    FILE * fp = fopen ("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
+    if (fp == NULL)
+      return (0);
+    long khz = 0;
+    if (fscanf (fp, "%ld", & khz) != 1)
+      khz = 0;
+    fclose (fp);
+    return (khz / 1000.0);
+  }
+
+  static double bench_report (const char * what, uint64_t us, uint64_t bytes, double mhz) {
+    if (us == 0)
+      us = 1;
+    double ns_per_byte = us * 1000.0 / bytes;
+    if (mhz > 0)
+      printf ("  %-12s %8.1f MB/s  %6.2f ns/byte  %6.2f cycles/byte\n", what, bytes / (double) us, ns_per_byte, ns_per_byte * mhz / 1000.0);
+    else
+      printf ("  %-12s %8.1f MB/s  %6.2f ns/byte\n", what, bytes / (double) us, ns_per_byte);
+    return (bytes / (double) us);
+  }
+
+  static bool bench_handshake (SSL * client, SSL * server) {
+    for (int i = 0; i < 100; i ++) {
+      int c = SSL_do_handshake (client);
+      int s = SSL_do_handshake (server);
+      if (c == 1 && s == 1)
+        return (true);
+      if ((c != 1 && SSL_get_error (client, c) != SSL_ERROR_WANT_READ) || (s != 1 && SSL_get_error (server, s) != SSL_ERROR_WANT_READ))
+        return (false);
+    }
+    return (false);
+  }
+
+  // Checks hu_ssl_aead against OpenSSL in both directions before timing it
+  static bool bench_aead_verify (SSL * client, SSL * server, BIO * client_end, BIO * server_end, hu_ssl_aead & client_aead, hu_ssl_aead & server_aead) {
+    unsigned char probe [64];
+    unsigned char rec [256];
+    unsigned char out [256];
+    RAND_bytes (probe, sizeof (probe));
+
+    if (SSL_write (client, probe, sizeof (probe)) != sizeof (probe))
+      return (false);
+    int rec_len = BIO_read (server_end, rec, sizeof (rec));
+    int content_type = 0;
+    int rec_used = 0;
+    int len = server_aead.open (rec, rec_len, out, sizeof (out), & content_type, & rec_used);
+    if (len != sizeof (probe) || memcmp (out, probe, len) || content_type != HU_SSL_CONTENT_APPLICATION_DATA)
+      return (false);
+
+    rec_len = client_aead.seal (HU_SSL_CONTENT_APPLICATION_DATA, probe, sizeof (probe), rec, sizeof (rec));
+    if (rec_len <= 0 || BIO_write (client_end, rec, rec_len) != rec_len)
+      return (false);
+    len = SSL_read (server, out, sizeof (out));
+    return (len == sizeof (probe) && !memcmp (out, probe, len));
+  }
+
+  int hu_ssl_bench (const char * cipher_list, int megabytes, hu_ssl_bench_result * result) {
+    int ret = -1;
+    SSL_CTX * client_ctx = hu_ssl_ctx_new (TLSv1_2_client_method ());
+    SSL_CTX * server_ctx = hu_ssl_ctx_new (TLSv1_2_server_method ());    // Our own certificate is good enough for the server side
+    SSL * client = NULL;
+    SSL * server = NULL;
+    BIO * client_end = NULL;
+    BIO * server_end = NULL;
+    hu_ssl_aead client_aead;
+    hu_ssl_aead server_aead;
+    std::vector<unsigned char> plain (BENCH_RECORD_SIZE);
+    std::vector<unsigned char> rec (BENCH_RECORD_SIZE + HU_SSL_AEAD_OVERHEAD + 256);
+    std::vector<unsigned char> out (BENCH_RECORD_SIZE);
+    int records = (megabytes * 1024 * 1024) / BENCH_RECORD_SIZE;
+    uint64_t bytes = (uint64_t) records * BENCH_RECORD_SIZE;
+    uint64_t enc_us = 0, dec_us = 0;
+    uint64_t handshake_us = 0;
+    double mhz = cpu_mhz ();
+
+    if (client_ctx == NULL || server_ctx == NULL) {
+      loge ("hu_ssl_ctx_new() failed");
+      goto done;
+    }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && defined (SSL_CTX_set_ecdh_auto)
+    SSL_CTX_set_ecdh_auto (server_ctx, 1);
+#endif
+    if (SSL_CTX_set_cipher_list (client_ctx, cipher_list) != 1 || SSL_CTX_set_cipher_list (server_ctx, cipher_list) != 1) {
+      printf ("%s: not supported by this OpenSSL\n", cipher_list);
+      goto done;
+    }
+
+    client = SSL_new (client_ctx);
+    server = SSL_new (server_ctx);
+    if (client == NULL || server == NULL || BIO_new_bio_pair (& client_end, 4 * BENCH_RECORD_SIZE, & server_end, 4 * BENCH_RECORD_SIZE) != 1)
+      goto done;
+    SSL_set_bio (client, client_end, client_end);
+    SSL_set_bio (server, server_end, server_end);
+    SSL_set_connect_state (client);
+    SSL_set_accept_state (server);
+
+    handshake_us = hu_get_time_us ();
+    if (!bench_handshake (client, server)) {
+      printf ("%s: handshake failed\n", cipher_list);
+      goto done;
+    }
+    handshake_us = hu_get_time_us () - handshake_us;                     // Both sides, so an upper bound for ours
+    printf ("%s (%s), %d MB in %d byte records\n", SSL_CIPHER_get_name (SSL_get_current_cipher (client)), SSL_get_version (client), megabytes, BENCH_RECORD_SIZE);
+    printf ("  handshake    %8.1f ms\n", handshake_us / 1000.0);
+    if (result) {
+      result->cipher = SSL_CIPHER_get_name (SSL_get_current_cipher (client));
+      result->handshake_ms = handshake_us / 1000.0;
+    }
+
+    RAND_bytes (plain.data (), plain.size ());
+
+    // AEAD keys have to be derived before any application data moves
+    if (client_aead.init (client) && server_aead.init (server)) {
+      if (!bench_aead_verify (client, server, client_end, server_end, client_aead, server_aead)) {
+        printf ("  AEAD       does not match OpenSSL, not timed\n");
+        client_aead.reset ();
+      }
+    }
+
+    for (int i = 0; i < records; i ++) {
+      uint64_t t0 = hu_get_time_us ();
+      SSL_write (client, plain.data (), plain.size ());
+      uint64_t t1 = hu_get_time_us ();
+      int len = SSL_read (server, out.data (), out.size ());
+      uint64_t t2 = hu_get_time_us ();
+      if (len != BENCH_RECORD_SIZE) {
+        loge ("SSL_read() len: %d", len);
+        goto done;
+      }
+      enc_us += t1 - t0;
+      dec_us += t2 - t1;
+    }
+    bench_report ("SSL_write", enc_us, bytes, mhz);
+    bench_report ("SSL_read", dec_us, bytes, mhz);
+    if (result)
+      result->ssl_mbs = bytes / (double) (enc_us + dec_us + 1);
+
+    if (client_aead.active ()) {
+      enc_us = dec_us = 0;
+      for (int i = 0; i < records; i ++) {
+        int content_type = 0;
+        int rec_used = 0;
+        uint64_t t0 = hu_get_time_us ();
+        int rec_len = client_aead.seal (HU_SSL_CONTENT_APPLICATION_DATA, plain.data (), plain.size (), rec.data (), rec.size ());
+        uint64_t t1 = hu_get_time_us ();
+        int len = server_aead.open (rec.data (), rec_len, out.data (), out.size (), & content_type, & rec_used);
+        uint64_t t2 = hu_get_time_us ();
+        if (len != BENCH_RECORD_SIZE) {
+          loge ("open() len: %d", len);
+          goto done;
+        }
+        enc_us += t1 - t0;
+        dec_us += t2 - t1;
+      }
+      bench_report ("AEAD seal", enc_us, bytes, mhz);
+      bench_report ("AEAD open", dec_us, bytes, mhz);
+      if (result)
+        result->aead_mbs = bytes / (double) (enc_us + dec_us + 1);
+    }
+    else {
+      printf ("  AEAD       not available for this suite\n");
+    }
+    ret = 0;
+
+  done:
+    if (client)
+      SSL_free (client);                                                // Frees the BIO pair ends too
+    if (server)
+      SSL_free (server);
+    if (client_ctx)
+      SSL_CTX_free (client_ctx);
+    if (server_ctx)
+      SSL_CTX_free (server_ctx);
+    return (ret);
+  }
+
+  // Benchmarks every suite of an OpenSSL cipher list on its own and ranks them by encrypt + decrypt throughput
+  int hu_ssl_bench_suites (const std::string & cipher_list, int megabytes) {
+    std::vector<hu_ssl_bench_result> results;
+    size_t start = 0;
+    while (start < cipher_list.size ()) {
+      size_t end = cipher_list.find (':', start);
+      if (end == std::string::npos)
+        end = cipher_list.size ();
+      std::string suite = cipher_list.substr (start, end - start);
+      start = end + 1;
+      if (suite.empty ())
+        continue;
+
+      hu_ssl_bench_result result;
+      if (hu_ssl_bench (suite.c_str (), megabytes, & result) == 0)
+        results.push_back (result);
+      printf ("\n");
+    }
+
+    if (results.empty ()) {
+      printf ("No usable suites in \"%s\"\n", cipher_list.c_str ());
+      return (-1);
+    }
+
+    std::sort (results.begin (), results.end (), [] (const hu_ssl_bench_result & a, const hu_ssl_bench_result & b) {
+      return (std::max (a.ssl_mbs, a.aead_mbs) > std::max (b.ssl_mbs, b.aead_mbs));
+    });
+
+    printf ("%-32s %10s %10s %12s\n", "suite", "SSL MB/s", "AEAD MB/s", "handshake ms");
+    std::string ordered;
+    for (const hu_ssl_bench_result & result : results) {
+      printf ("%-32s %10.1f %10.1f %12.1f\n", result.cipher.c_str (), result.ssl_mbs, result.aead_mbs, result.handshake_ms);
+      if (!ordered.empty ())
+        ordered += ":";
+      ordered += result.cipher;
+    }
+    printf ("\nFastest first: \"sslCipherList\": \"%s\"\n", ordered.c_str ());
+    return (0);
+  }
@@ -1,6 +1,7 @@
   #define LOGTAG "hu_tcp"
   #include "hu_uti.h"                                                  // Utilities
   #include "hu_tcp.h"
+  #include "hu_metrics.h"
 
   int itcp_state = 0; // 0: Initial    1: Startin    2: Started    3: Stoppin    4: Stopped
   int last_errno = 0; //store last error printed
@@ -47,6 +48,7 @@
     errno = 0;
     ret = write (readfd, buf, len);
     if (ret != len) {             // Write, if can't write full buffer...
+      hu_metrics_add (hu_metrics.transport_errors);
       loge ("Error write  errno: %d (%s)", errno, strerror (errno));
       //ms_sleep (101);                                                 // Sleep 0.1 second to try to clear errors
     }
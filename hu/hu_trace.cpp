@@ -0,0 +1,208 @@
+
+  #define LOGTAG "hu_trace"
+  #include "hu_uti.h"
+  #include "hu_aap.h"
+  #include "hu_trace.h"
+
+  #include <atomic>
+  #include <mutex>
+  #include <vector>
+  #include <algorithm>
+  #include <inttypes.h>
+  #include <sys/prctl.h>
+  #include <sys/syscall.h>
+
+  int ena_trace = 1;
+
+  #define HU_TRACE_MAX_THREADS 16                                       // Threads past this are not traced
+  #define HU_TRACE_RING_SIZE   512                                      // Records per thread, power of 2
+
+  struct hu_trace_record {                                              // 32 bytes
+    uint64_t ts_us;
+    uint16_t event;
+    int16_t  chan;
+    uint32_t a;
+    uint64_t b;
+    uint64_t c;
+  };
+
+  struct hu_trace_ring {
+    std::atomic<int>      owner;                                        // Thread id, 0 when free. Data stays readable after the thread exits
+    char                  name [16];
+    std::atomic<uint64_t> head;                                         // Records ever written, only the owner writes it
+    uint64_t              tail;                                         // Records already drained, guarded by drain_mutex
+    hu_trace_record       records [HU_TRACE_RING_SIZE];
+  };
+
+  static hu_trace_ring trace_rings [HU_TRACE_MAX_THREADS];
+  static std::mutex drain_mutex;
+  static pthread_key_t trace_key;
+  static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+  static __thread hu_trace_ring * trace_ring = NULL;
+  static __thread bool trace_ring_failed = false;
+
+  struct hu_trace_event_info {
+    const char * name;
+    const char * a;                                                     // Arg labels, NULL if unused
+    const char * b;
+    const char * c;
+  };
+
+  static const hu_trace_event_info trace_events [HU_TRACE_EVENT_COUNT] = {
+    {"none",            NULL,     NULL,      NULL},
+    {"wake_transport",  NULL,     NULL,      NULL},
+    {"wake_command",    NULL,     NULL,      NULL},
+    {"command_run",     "queued", NULL,      NULL},
+    {"frame_rx",        "flags",  "len",     NULL},
+    {"frame_rx_more",   "need",   NULL,      NULL},
+    {"frame_rx_total",  NULL,     "total",   NULL},
+    {"frame_rx_resume", NULL,     "have",    NULL},
+    {"msg_rx",          "type",   "len",     NULL},
+    {"msg_tx",          "type",   "len",     NULL},
+    {"media_rx",        NULL,     "len",     "ts"},
+    {"media_ack_rx",    NULL,     NULL,      NULL},
+    {"usb_rx",          "status", "len",     NULL},
+    {"usb_rx_pipe",     NULL,     "wrote",   "of"},
+    {"usb_tx_submit",   NULL,     "len",     NULL},
+    {"usb_tx_done",     "status", NULL,      NULL},
+  };
+
+  static void trace_thread_exit (void * ring) {
+    reinterpret_cast<hu_trace_ring *> (ring)->owner.store (0, std::memory_order_release);
+  }
+
+  static void trace_key_create () {
+    pthread_key_create (& trace_key, trace_thread_exit);
+  }
+
+  static hu_trace_ring * trace_ring_claim () {
+    pthread_once (& trace_key_once, trace_key_create);
+    int tid = (int) syscall (SYS_gettid);
+    for (int idx = 0; idx < HU_TRACE_MAX_THREADS; idx ++) {
+      hu_trace_ring & ring = trace_rings [idx];
+      int expected = 0;
+      if (!ring.owner.compare_exchange_strong (expected, tid))
+        continue;
+
+      std::lock_guard<std::mutex> lock (drain_mutex);                   // Forget the old thread's records
+      ring.head.store (0, std::memory_order_relaxed);
+      ring.tail = 0;
+      memset (ring.name, 0, sizeof (ring.name));
+      prctl (PR_GET_NAME, ring.name);
+      pthread_setspecific (trace_key, & ring);
+      return (& ring);
+    }
+    return (NULL);
+  }
+
+  void hu_trace_event (uint16_t event, int chan, uint32_t a, uint64_t b, uint64_t c) {
+    hu_trace_ring * ring = trace_ring;
+    if (ring == NULL) {
+      if (trace_ring_failed)
+        return;
+      ring = trace_ring = trace_ring_claim ();
+      if (ring == NULL) {
+        trace_ring_failed = true;
+        return;
+      }
+    }
+
+    uint64_t head = ring->head.load (std::memory_order_relaxed);
+    hu_trace_record & rec = ring->records [head & (HU_TRACE_RING_SIZE - 1)];
+    rec.ts_us = hu_get_time_us ();
+    rec.event = event;
+    rec.chan = (int16_t) chan;
+    rec.a = a;
+    rec.b = b;
+    rec.c = c;
+    ring->head.store (head + 1, std::memory_order_release);
+  }
+
+  // Copies the records in [from, head) that were not overwritten while copying. Returns the new read position.
+  static uint64_t trace_ring_copy (hu_trace_ring & ring, uint64_t from, hu_trace_record * out, int * out_count) {
+    uint64_t head = ring.head.load (std::memory_order_acquire);
+    if (head > HU_TRACE_RING_SIZE && from < head - HU_TRACE_RING_SIZE)
+      from = head - HU_TRACE_RING_SIZE;
+    int count = 0;
+    for (uint64_t pos = from; pos < head; pos ++)
+      out [count ++] = ring.records [pos & (HU_TRACE_RING_SIZE - 1)];
+
+    uint64_t head_after = ring.head.load (std::memory_order_acquire);     // The writer may have lapped us
+    int skip = 0;
+    if (head_after > HU_TRACE_RING_SIZE && from < head_after - HU_TRACE_RING_SIZE)
+      skip = std::min ((uint64_t) count, head_after - HU_TRACE_RING_SIZE - from);
+    if (skip > 0)
+      memmove (out, out + skip, (count - skip) * sizeof (hu_trace_record));
+    *out_count = count - skip;
+    return (head);
+  }
+
+  static int trace_format (char * line, int size, const char * thread, const hu_trace_record & rec) {
+    const hu_trace_event_info & info = trace_events [rec.event < HU_TRACE_EVENT_COUNT ? rec.event : HU_TRACE_NONE];
+    int len = snprintf (line, size, "%" PRIu64 ".%06u %-15s %-16s", rec.ts_us / 1000000, (unsigned int) (rec.ts_us % 1000000), thread, info.name);
+    if (rec.chan >= 0 && len < size)
+      len += snprintf (line + len, size - len, " %s", chan_get (rec.chan));
+    if (info.a && len < size)
+      len += snprintf (line + len, size - len, " %s=%u", info.a, rec.a);
+    if (info.b && len < size)
+      len += snprintf (line + len, size - len, " %s=%" PRIu64, info.b, rec.b);
+    if (info.c && len < size)
+      len += snprintf (line + len, size - len, " %s=%" PRIu64, info.c, rec.c);
+    if (len < size - 1)
+      line [len ++] = '\n';
+    else
+      line [(len = size - 1) - 1] = '\n';
+    line [len] = 0;
+    return (len);
+  }
+
+  std::string hu_trace_drain () {
+    struct drained {
+      hu_trace_record rec;
+      int ring;
+    };
+    std::vector<drained> all;
+    std::vector<hu_trace_record> copy (HU_TRACE_RING_SIZE);
+    char names [HU_TRACE_MAX_THREADS][32];
+
+    {
+      std::lock_guard<std::mutex> lock (drain_mutex);
+      for (int idx = 0; idx < HU_TRACE_MAX_THREADS; idx ++) {
+        hu_trace_ring & ring = trace_rings [idx];
+        snprintf (names [idx], sizeof (names [idx]), "%.15s", ring.name);
+        int count = 0;
+        ring.tail = trace_ring_copy (ring, ring.tail, copy.data (), & count);
+        for (int rec = 0; rec < count; rec ++)
+          all.push_back ({copy [rec], idx});
+      }
+    }
+
+    std::stable_sort (all.begin (), all.end (), [] (const drained & l, const drained & r) { return (l.rec.ts_us < r.rec.ts_us); });
+
+    std::string out;
+    out.reserve (all.size () * 80);
+    char line [256];
+    for (const drained & entry : all) {
+      trace_format (line, sizeof (line), names [entry.ring], entry.rec);
+      out += line;
+    }
+    return (out);
+  }
+
+  void hu_trace_dump (int fd) {
+    static hu_trace_record copy [HU_TRACE_RING_SIZE];                   // Static so the crash handler does not need the stack
+    char line [256];
+    for (int idx = 0; idx < HU_TRACE_MAX_THREADS; idx ++) {
+      hu_trace_ring & ring = trace_rings [idx];
+      if (ring.head.load (std::memory_order_acquire) == 0)
+        continue;
+      int len = snprintf (line, sizeof (line), "Trace for thread %.15s (%d):\n", ring.name, ring.owner.load ());
+      write (fd, line, len);
+      int count = 0;
+      trace_ring_copy (ring, 0, copy, & count);                         // No lock, the crash may have happened while draining
+      for (int rec = 0; rec < count; rec ++) {
+        len = trace_format (line, sizeof (line), ring.name, copy [rec]);
+        write (fd, line, len);
+      }
+    }
+  }
@@ -0,0 +1,37 @@
+#pragma once
+
+  // Binary trace ring for the hot paths. Each thread appends fixed size records (monotonic time, event id, channel,
+  // three integer args) to its own ring without locks or formatting; the text is only built when the rings are
+  // drained through the command server (/trace) or dumped by the crash handler.
+
+  #include <stdint.h>
+  #include <string>
+
+  extern int ena_trace;                                                 // Master enable, checked before every record
+
+  enum HU_TRACE_EVENT : uint16_t {
+    HU_TRACE_NONE = 0,
+    HU_TRACE_THREAD_WAKE_TRANSPORT,                                     // hu_thread_main woke up for the transport
+    HU_TRACE_THREAD_WAKE_COMMAND,                                       // hu_thread_main woke up for the command pipe
+    HU_TRACE_COMMAND_RUN,                                               // a: queue depth
+    HU_TRACE_FRAME_RX,                                                  // chan, a: flags  b: frame len
+    HU_TRACE_FRAME_RX_MORE,                                             // chan, a: bytes still missing
+    HU_TRACE_FRAME_RX_TOTAL,                                            // chan, b: total message size from the first frame
+    HU_TRACE_FRAME_RX_RESUME,                                           // chan, b: bytes already in the preserved buffer
+    HU_TRACE_MSG_RX,                                                    // chan, a: msg_type  b: len
+    HU_TRACE_MSG_TX,                                                    // chan, a: msg_type  b: len
+    HU_TRACE_MEDIA_RX,                                                  // chan, b: len  c: media timestamp
+    HU_TRACE_MEDIA_ACK_RX,                                              // chan
+    HU_TRACE_USB_RX,                                                    // a: transfer status  b: len
+    HU_TRACE_USB_RX_PIPE,                                               // b: bytes written to the pipe  c: transfer len
+    HU_TRACE_USB_TX_SUBMIT,                                             // b: len
+    HU_TRACE_USB_TX_DONE,                                               // a: transfer status
+    HU_TRACE_EVENT_COUNT
+  };
+
+  void hu_trace_event (uint16_t event, int chan, uint32_t a = 0, uint64_t b = 0, uint64_t c = 0);
+
+  #define hu_trace(...) do { if (ena_trace) hu_trace_event (__VA_ARGS__); } while (0)
+
+  std::string hu_trace_drain ();                                        // Records since the last drain, all threads merged by time
+  void hu_trace_dump (int fd);                                          // Everything still in the rings, for the crash handler. No allocation
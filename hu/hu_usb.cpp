@@ -1,6 +1,8 @@
 #define LOGTAG "hu_usb"
 #include "hu_uti.h"  // Utilities
 #include "hu_usb.h"
+#include "hu_metrics.h"
+#include "hu_trace.h"
 #include <vector>
 #include <algorithm>
 
@@ -93,10 +95,24 @@ const char * iusb_error_get (int error) {
   #endif
 }
 
+// Kept after the data in the copy of each write, the transfer length leaves it out. Carries the input event being
+// written, if any, to the completion callback
+struct usb_tx_trailer {
+  bool has_input;
+  hu_input_stamp input;
+};
+
 int HUTransportStreamUSB::Write(const byte * buf, int len, int tmo) {
 
-  byte* copy_buf = (byte*)malloc(len);
+  byte* copy_buf = (byte*)malloc(len + sizeof(usb_tx_trailer));
   memcpy(copy_buf, buf, len);
+  usb_tx_trailer trailer = {};
+  if (hu_input_current != NULL) {
+    trailer.has_input = true;
+    trailer.input = *hu_input_current;
+    hu_input_current->handed_off = true;
+  }
+  memcpy(copy_buf + len, &trailer, sizeof(trailer));
 
   libusb_transfer *transfer = libusb_alloc_transfer(0);
   libusb_fill_bulk_transfer(transfer, iusb_dev_hndl, iusb_ep_out,
@@ -107,11 +123,13 @@ int HUTransportStreamUSB::Write(const byte * buf, int len, int tmo) {
   {
     loge("  Failed: libusb_submit_transfer: %d (%s)", iusb_state, iusb_error_get (iusb_state));
     libusb_free_transfer(transfer);
+    hu_metrics_add (hu_metrics.transport_errors);
     return -1;
   }
   else
   {
-    logd(" libusb_submit_transfer for %d bytes", len);
+    hu_trace (HU_TRACE_USB_TX_SUBMIT, -1, 0, len);
+    hu_metrics_add (hu_metrics.transport_tx_pending, 1);
   }
   return len;
 }
@@ -249,7 +267,7 @@ void HUTransportStreamUSB::usb_recv_thread_main()
 
 void HUTransportStreamUSB::libusb_callback(libusb_transfer *transfer)
 {
-  logd("libusb_callback %d %d %d", transfer->status, LIBUSB_TRANSFER_COMPLETED, LIBUSB_TRANSFER_OVERFLOW);
+  hu_trace (HU_TRACE_USB_RX, -1, transfer->status, transfer->actual_length);
   libusb_transfer_status recv_last_status = transfer->status;
   if (recv_last_status == LIBUSB_TRANSFER_COMPLETED || recv_last_status == LIBUSB_TRANSFER_OVERFLOW)
   {
@@ -270,7 +288,7 @@ void HUTransportStreamUSB::libusb_callback(libusb_transfer *transfer)
         ret = write(pipe_write_fd, buffer, bytesToWrite);
         if (ret < 0)
           break;
-        logd("Wrote %d of %d bytes", ret, transfer->actual_length);
+        hu_trace (HU_TRACE_USB_RX_PIPE, -1, 0, ret, transfer->actual_length);
         buffer += ret;
         bytesToWrite -= ret;
       }
@@ -288,6 +306,7 @@ void HUTransportStreamUSB::libusb_callback(libusb_transfer *transfer)
   }
   else
   {
+    hu_metrics_add (hu_metrics.transport_errors);
     loge("libusb_callback: abort");
     write(abort_usb_thread_pipe_write_fd, &abort_usb_thread_pipe_write_fd, 1);
   }
@@ -302,13 +321,22 @@ void HUTransportStreamUSB::libusb_callback_tramp(libusb_transfer *transfer)
 
 void HUTransportStreamUSB::libusb_callback_send(libusb_transfer *transfer)
 {
-  logd("libusb_callback_send %d %d %d", transfer->status, LIBUSB_TRANSFER_COMPLETED, LIBUSB_TRANSFER_OVERFLOW);
+  hu_trace (HU_TRACE_USB_TX_DONE, -1, transfer->status);
   libusb_transfer_status recv_last_status = transfer->status;
+  hu_metrics_add (hu_metrics.transport_tx_pending, -1);
   if (recv_last_status != LIBUSB_TRANSFER_COMPLETED)
   {
+    hu_metrics_add (hu_metrics.transport_errors);
     loge("libusb_callback_send: abort");
     write(abort_usb_thread_pipe_write_fd, &abort_usb_thread_pipe_write_fd, 1);
   }
+  else
+  {
+    usb_tx_trailer trailer;
+    memcpy(&trailer, transfer->buffer + transfer->length, sizeof(trailer));
+    if (trailer.has_input)
+      hu_input_written(trailer.input, hu_get_time_us());
+  }
   free(transfer->buffer);
   libusb_free_transfer(transfer);
 }
@@ -8,6 +8,7 @@
 
 #define LOGTAG "hu_uti"
 #include "hu_uti.h"
+#include "hu_trace.h"
 #include "hu.pb.h"
 
 #include <stdio.h>
@@ -28,6 +29,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <time.h>
 
 #include <dirent.h>                                                   // For opendir (), readdir (), closedir (), DIR, struct dirent.
 #include <sys/utsname.h>
@@ -61,66 +63,17 @@ int ena_log_hexdu = 1;//1;    // Hex dump master enable
 int max_hex_dump  = 64;//32;
 
 
-const  char * prio_get (int prio) {
-  switch (prio) {
-    case hu_LOG_EXT: return ("X");
-    case hu_LOG_VER: return ("V");
-    case hu_LOG_DEB: return ("D");
-    case hu_LOG_WAR: return ("W");
-    case hu_LOG_ERR: return ("E");
-  }
-  return ("?");
-}
-
-int hu_log (int prio, const char * tag, const char * func, const char * fmt, ...) {
-
-  if (! ena_log_extra && prio == hu_LOG_EXT)
-    return -1;
-  if (! ena_log_verbo && prio == hu_LOG_VER)
-    return -1;
-  if (! ena_log_debug && prio == hu_LOG_DEB)
-    return -1;
-  if (! ena_log_warni && prio == hu_LOG_WAR)
-    return -1;
-  if (! ena_log_error && prio == hu_LOG_ERR)
-    return -1;
-
-
-  va_list ap;
-  va_start (ap, fmt);
-#ifdef __ANDROID_API__
-  char tag_str [512] = {0};
-  snprintf (tag_str, sizeof (tag_str), "%32.32s", func);
-  __android_log_vprint (prio, tag_str, fmt, ap);
-#else
-  va_list aq;
-  va_start (aq, fmt);
-
-  char log_line [4096] = {0};
-  int len = vsnprintf (log_line, sizeof (log_line), fmt, aq);
-
-  //Time doesn't work on CMU anyway, always says 1970
-  time_t timestamp;
-  time(&timestamp);
-  printf ("%d %s: %s: %s : %s\n", timestamp, prio_get (prio), tag, func, log_line);
-
-  va_end(aq);
-#endif
-  va_end(ap);
-
-  // if (prio == hu_LOG_ERR)
-  // {
-  //   raise(SIGTRAP);
-  // }
-
-  return (0);
-}
-
 unsigned long ms_sleep (unsigned long ms) {
   usleep (ms * 1000L);
   return (ms);
 }
 
+uint64_t hu_get_time_us () {
+  struct timespec tp;
+  clock_gettime (CLOCK_MONOTONIC, & tp);
+  return ((uint64_t) tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000);
+}
+
 
 #define HD_MW   256
 void hex_dump (const char * prefix, int width, unsigned char * buf, int len) {
@@ -281,10 +234,13 @@ static void print_backtrace(ucontext_t* ucontext)
 static void crash_handler(int sig, siginfo_t * info, void * ucontext)
 {
   ucontext_t* context = reinterpret_cast<ucontext_t*>(ucontext);
+  hu_log_flush(false);
   // print out all the frames to stderr
   printf("Error: signal %s context %p :\n", strsignal(sig), context);
 
   print_backtrace(context);
+  fflush(stdout);
+  hu_trace_dump(STDOUT_FILENO);
 #if CMU
   //JS code looks for this to flush the log
   printf("END \n");
@@ -295,9 +251,12 @@ static void crash_handler(int sig, siginfo_t * info, void * ucontext)
 static void crash_handler_terminate()
 {
     // print out all the frames to stderr
+  hu_log_flush(false);
   printf("Error: c++ exception\n");
 
   print_backtrace(nullptr);
+  fflush(stdout);
+  hu_trace_dump(STDOUT_FILENO);
 #if CMU
   //JS code looks for this to flush the log
   printf("END \n");
@@ -12,6 +12,10 @@
 
 #include <pthread.h>
 
+#include <atomic>
+#include <string>
+#include <vector>
+
 #include <errno.h>
 
 #include <unistd.h>
@@ -67,11 +71,14 @@ typedef unsigned char byte;
 #define STR(s) STR2(s)
 #define STR2(s) #s
 
-#define  logx(...)  hu_log(hu_LOG_EXT,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
-#define  logv(...)  hu_log(hu_LOG_VER,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
-#define  logd(...)  hu_log(hu_LOG_DEB,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
-#define  logw(...)  hu_log(hu_LOG_WAR,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
-#define  loge(...)  hu_log(hu_LOG_ERR,__FILE__ ":" STR(__LINE__),__FUNCTION__,__VA_ARGS__)
+// Each call site gets a static hu_log_site, which caches the LOGTAG lookup and holds the rate limit window
+#define  hu_log_at(prio, ...)  do { static hu_log_site hu_log_site_ = {LOGTAG, __FILE__ ":" STR(__LINE__), {-1}, {0}, {0}, {0}}; hu_log(&hu_log_site_, prio, __FUNCTION__, __VA_ARGS__); } while (0)
+
+#define  logx(...)  hu_log_at(hu_LOG_EXT,__VA_ARGS__)
+#define  logv(...)  hu_log_at(hu_LOG_VER,__VA_ARGS__)
+#define  logd(...)  hu_log_at(hu_LOG_DEB,__VA_ARGS__)
+#define  logw(...)  hu_log_at(hu_LOG_WAR,__VA_ARGS__)
+#define  loge(...)  hu_log_at(hu_LOG_ERR,__VA_ARGS__)
 
 //!!
 //  #define  logx(...)
@@ -81,10 +88,33 @@ typedef unsigned char byte;
 
 #endif
 
-int hu_log (int prio, const char * tag, const char * func, const char * fmt, ...);
+#ifndef LOGTAG
+  #define LOGTAG "headunit"                                           // Files that don't set their own tag share this one
+#endif
+
+struct hu_log_site {
+  const char * tag;                                                   // LOGTAG
+  const char * where;                                                 // file:line
+  std::atomic<int>      tag_index;                                    // -1 until looked up
+  std::atomic<uint64_t> window_start_us;                              // Rate limit window
+  std::atomic<uint32_t> window_count;
+  std::atomic<uint32_t> suppressed;                                   // Reported with the next line let through
+};
+
+extern int ena_log_async;                                             // Queue lines for the writer thread instead of printing on the caller
+extern int ena_log_rate_limit;                                        // Lines per second per call site, 0 for no limit
+
+int hu_log (hu_log_site * site, int prio, const char * func, const char * fmt, ...);
+
+int hu_log_set_level (const char * tag, int prio);                    // prio 0 goes back to the ena_log_* defaults
+std::vector<std::pair<std::string, int>> hu_log_levels ();            // Every tag seen so far with its level
+const char * hu_log_level_name (int prio);
+int hu_log_level_from_name (const std::string & name);                // -1 if unknown
+void hu_log_flush (bool wait = true);                                 // wait = false for signal handlers, gives up if the queue is busy
 
 
 unsigned long ms_sleep        (unsigned long ms);
+uint64_t hu_get_time_us       ();                                    // Monotonic clock, for measuring intervals only
 void hex_dump                 (const char * prefix, int width, unsigned char * buf, int len);
 
 void hu_log_library_versions();
@@ -5,28 +5,55 @@
 #include "main.h"
 #include "bt/mzd_bluetooth.h"
 #include "hud/hud.h"
+#include "dbus/mzd_dbus.h"
 #include "config.h"
+#include "hu_metrics.h"
 
 #include "json/json.hpp"
 using json = nlohmann::json;
 
-MazdaEventCallbacks::MazdaEventCallbacks(DBus::Connection& serviceBus, DBus::Connection& hmiBus)
+#define AUDIO_FOCUS_ANSWER_MS 1000                                      //The phone waits on the answer before it plays anything
+#define AUDIO_TABLE_REFRESH_MS 5000                                     //At most one session table rebuild this often
+#define AUDIO_TABLE_TIMEOUT_MS 10000                                    //Several calls, and the first one races the audio manager starting
+
+static hu_metric_histogram audio_focus_latency_us;                     //Phone's AudioFocusRequest to our AudioFocusResponse
+static std::atomic<uint64_t> audio_focus_latency_max_us(0);
+
+MazdaEventCallbacks::MazdaEventCallbacks()
     : micInput("mic")
-    , serviceBus(serviceBus)
-    , hmiBus(hmiBus)
     , connected(false)
     , videoFocus(false)
     , inCall(false)
     , audioFocus(AudioManagerClient::FocusType::NONE)
+    , audioFocusRequestUs(0)
+    , mainContext(run_on_thread_main_context_ref())
 {
     //no need to create/destroy this
     audioOutput.reset(new AudioOutput("entertainmentMl"));
-    audioMgrClient.reset(new AudioManagerClient(*this, serviceBus));
-    videoMgrClient.reset(new VideoManagerClient(*this, hmiBus));
+    mzd_dbus_run([this]()
+    {
+        audioMgrClient.reset(new AudioManagerClient(*this, mzd_dbus_service_bus()));
+        videoMgrClient.reset(new VideoManagerClient(*this, mzd_dbus_hmi_bus()));
+    });
 }
 
 MazdaEventCallbacks::~MazdaEventCallbacks() {
-
+    //Calls still queued use the clients
+    mzd_dbus_flush();
+    try
+    {
+        mzd_dbus_run([this]()
+        {
+            videoMgrClient.reset();
+            audioMgrClient.reset();
+        });
+    }
+    catch(DBus::Error& error)
+    {
+        loge("DBUS: Releasing the audio and video managers failed %s: %s", error.name(), error.message());
+    }
+    if (mainContext != nullptr)
+        g_main_context_unref(mainContext);
 }
 
 int MazdaEventCallbacks::MediaPacket(int chan, uint64_t timestamp, const byte *buf, int len) {
@@ -41,6 +68,18 @@ int MazdaEventCallbacks::MediaPacket(int chan, uint64_t timestamp, const byte *b
     return 0;
 }
 
+bool MazdaEventCallbacks::MediaStreamChunks(int chan) {
+    //h264parse splits the byte stream on start codes itself, so partial frames can go straight in
+    return chan == AA_CH_VID && config::streamVideoChunks;
+}
+
+int MazdaEventCallbacks::MediaPacketChunk(int chan, uint64_t timestamp, int offset, int total, const byte *buf, int len) {
+    if (chan == AA_CH_VID && videoOutput) {
+        videoOutput->MediaPacket(timestamp, buf, len);
+    }
+    return 0;
+}
+
 int MazdaEventCallbacks::MediaStart(int chan) {
     if (chan == AA_CH_MIC) {
         printf("SHAI1 : Mic Started\n");
@@ -88,7 +127,7 @@ void MazdaEventCallbacks::releaseAudioFocus()  {
     });
 }
 void MazdaEventCallbacks::AudioFocusRequest(int chan, const HU::AudioFocusRequest &request)  {
-
+    audioFocusRequestUs = hu_get_time_us();
     run_on_main_thread([this, request](){
         //The chan passed here is always AA_CH_CTR but internally we pass the channel AA means
         if (request.focus_type() == HU::AudioFocusRequest::AUDIO_FOCUS_RELEASE) {
@@ -102,6 +141,7 @@ void MazdaEventCallbacks::AudioFocusRequest(int chan, const HU::AudioFocusReques
                 }
             } else {
                 logw("Tried to request focus %i but was in a call", (int)request.focus_type());
+                audioFocusRequestUs = 0;
             }
         }
 
@@ -155,6 +195,13 @@ void MazdaEventCallbacks::VideoFocusHappened(bool hasFocus, bool unrequested) {
 void MazdaEventCallbacks::AudioFocusHappend(AudioManagerClient::FocusType type) {
     printf("AudioFocusHappend(%i)\n", int(type));
     audioFocus = type;
+    uint64_t requestUs = audioFocusRequestUs.exchange(0);
+    if (requestUs != 0) {
+        uint64_t latency = hu_get_time_us() - requestUs;
+        audio_focus_latency_us.observe(latency);
+        if (latency > audio_focus_latency_max_us)
+            audio_focus_latency_max_us = latency; //main loop is the only writer
+    }
     HU::AudioFocusResponse response;
     switch(type) {
         case AudioManagerClient::FocusType::NONE:
@@ -173,6 +220,12 @@ void MazdaEventCallbacks::AudioFocusHappend(AudioManagerClient::FocusType type)
     logd("Sent channel %i HU_PROTOCOL_MESSAGE::AudioFocusResponse %s\n", AA_CH_CTR,  HU::AudioFocusResponse::AUDIO_FOCUS_STATE_Name(response.focus_type()).c_str());
 }
 
+void MazdaEventCallbacks::logAudioFocusStats() {
+    uint64_t count = audio_focus_latency_us.count;
+    printf("Audio focus: %llu requests answered, request to answer mean %.1f ms max %.1f ms\n", (unsigned long long) count,
+           count ? audio_focus_latency_us.sum_us / 1000.0 / count : 0.0, audio_focus_latency_max_us / 1000.0);
+}
+
 void MazdaEventCallbacks::HandlePhoneStatus(IHUConnectionThreadInterface& stream, const HU::PhoneStatus& phoneStatus) {
     inCall = phoneStatus.calls_size() > 0;
 }
@@ -183,7 +236,7 @@ VideoManagerClient::VideoManagerClient(MazdaEventCallbacks& callbacks, DBus::Con
     uint32_t currentDisplayMode;
     int32_t returnValue;
     // check if backup camera is not visible at the moment and get output only when not
-    GetDisplayMode(currentDisplayMode, returnValue);
+    mzd_dbus_timed("bucpsa.GetDisplayMode", *this, [&]() { GetDisplayMode(currentDisplayMode, returnValue); });
     allowedToGetFocus = !(bool)currentDisplayMode;
 }
 
@@ -191,10 +244,21 @@ VideoManagerClient::~VideoManagerClient() {
     //We can't call release video focus since the callbacks object is being destroyed, but make sure we got to opera if no in backup cam
     if (allowedToGetFocus) {
         logd("Requesting video surface: JCI_OPERA_PRIMARY");
-        guiClient.SetRequiredSurfacesByEnum({NativeGUICtrlClient::JCI_OPERA_PRIMARY}, true);
+        mzd_dbus_timed("nativeguictrl.SetRequiredSurfaces", guiClient, [this]()
+        {
+            guiClient.SetRequiredSurfacesByEnum({NativeGUICtrlClient::JCI_OPERA_PRIMARY}, true);
+        });
     }
 }
 
+void VideoManagerClient::setSurface(NativeGUICtrlClient::SURFACES surface)
+{
+    mzd_dbus_call("nativeguictrl.SetRequiredSurfaces", guiClient, [this, surface]()
+    {
+        guiClient.SetRequiredSurfacesByEnum({surface}, true);
+    });
+}
+
 void VideoManagerClient::requestVideoFocus(VIDEO_FOCUS_REQUESTOR requestor)
 {
     if (!allowedToGetFocus) {
@@ -209,7 +273,7 @@ void VideoManagerClient::requestVideoFocus(VIDEO_FOCUS_REQUESTOR requestor)
     auto handleRequest = [this, unrequested](){
         callbacks.VideoFocusHappened(true, unrequested);
         logd("Requesting video surface: TV_TOUCH_SURFACE");
-        guiClient.SetRequiredSurfacesByEnum({NativeGUICtrlClient::TV_TOUCH_SURFACE}, true);
+        setSurface(NativeGUICtrlClient::TV_TOUCH_SURFACE);
         return false;
     };
     if (requestor == VIDEO_FOCUS_REQUESTOR::BACKUP_CAMERA)
@@ -235,11 +299,22 @@ void VideoManagerClient::releaseVideoFocus(VIDEO_FOCUS_REQUESTOR requestor)
     callbacks.VideoFocusHappened(false, unrequested);
     if (requestor != VIDEO_FOCUS_REQUESTOR::BACKUP_CAMERA) {
         logd("Requesting video surface: JCI_OPERA_PRIMARY");
-        guiClient.SetRequiredSurfacesByEnum({NativeGUICtrlClient::JCI_OPERA_PRIMARY}, true);
+        setSurface(NativeGUICtrlClient::JCI_OPERA_PRIMARY);
     }
 }
 
 void VideoManagerClient::DisplayMode(const uint32_t &currentDisplayMode)
+{
+    //Signals come in on the D-Bus reactor, the focus state belongs to the main loop. Dropped once the session's loop is gone
+    uint32_t mode = currentDisplayMode;
+    run_on_main_thread_in(callbacks.mainContext, 0, [this, mode]()
+    {
+        handleDisplayMode(mode);
+        return false;
+    });
+}
+
+void VideoManagerClient::handleDisplayMode(uint32_t currentDisplayMode)
 {
     // currentDisplayMode != 0 means backup camera wants the screen
     allowedToGetFocus = !(bool)currentDisplayMode;
@@ -327,7 +402,7 @@ std::string MazdaCommandServerCallbacks::ChangeParameterConfig(std::string param
     return "Config wasn't updated. Wrong parameters.";
 }
 
-void AudioManagerClient::aaRegisterStream()
+void AudioManagerClient::aaRegisterStream(SessionTable& fresh)
 {
     // First open a new Stream
     json sessArgs = {
@@ -335,23 +410,23 @@ void AudioManagerClient::aaRegisterStream()
         { "objectPath", "/com/jci/usbm_am_client" },
         { "destination", "Cabin" }
     };
-    if (aaSessionID < 0)
+    if (fresh.aaSessionID < 0)
     {
         try
         {
-            std::string sessString = Request("openSession", sessArgs.dump());
+            std::string sessString = requestSync("openSession", sessArgs.dump());
             printf("openSession(%s)\n%s\n", sessArgs.dump().c_str(), sessString.c_str());
-            aaSessionID = json::parse(sessString)["sessionId"];
+            fresh.aaSessionID = json::parse(sessString)["sessionId"];
 
             // Register the stream
             json regArgs = {
-                { "sessionId", aaSessionID },
+                { "sessionId", fresh.aaSessionID },
                 { "streamName", aaStreamName },
                 // { "streamModeName", aaStreamName },
                 { "focusType", "permanent" },
                 { "streamType", "Media" }
             };
-            std::string regString = Request("registerAudioStream", regArgs.dump());
+            std::string regString = requestSync("registerAudioStream", regArgs.dump());
             printf("registerAudioStream(%s)\n%s\n", regArgs.dump().c_str(), regString.c_str());
         }
         catch (const std::domain_error& ex)
@@ -364,26 +439,26 @@ void AudioManagerClient::aaRegisterStream()
         }
 
         // Stream is registered add it to the array
-        streamToSessionIds[aaStreamName] = aaSessionID;
+        fresh.streamToSessionIds[aaStreamName] = fresh.aaSessionID;
     }
 
-    if (aaTransientSessionID < 0)
+    if (fresh.aaTransientSessionID < 0)
     {
         try
         {
-            std::string sessString = Request("openSession", sessArgs.dump());
+            std::string sessString = requestSync("openSession", sessArgs.dump());
             printf("openSession(%s)\n%s\n", sessArgs.dump().c_str(), sessString.c_str());
-            aaTransientSessionID = json::parse(sessString)["sessionId"];
+            fresh.aaTransientSessionID = json::parse(sessString)["sessionId"];
 
             // Register the stream
             json regArgs = {
-                { "sessionId", aaTransientSessionID },
+                { "sessionId", fresh.aaTransientSessionID },
                 { "streamName", aaStreamName },
                 // { "streamModeName", aaStreamName },
                 { "focusType", "transient" },
                 { "streamType", "InfoUser" }
             };
-            std::string regString = Request("registerAudioStream", regArgs.dump());
+            std::string regString = requestSync("registerAudioStream", regArgs.dump());
             printf("registerAudioStream(%s)\n%s\n", regArgs.dump().c_str(), regString.c_str());
         }
         catch (const std::domain_error& ex)
@@ -396,19 +471,18 @@ void AudioManagerClient::aaRegisterStream()
         }
 
         // Stream is registered add it to the array
-        streamToSessionIds[aaStreamName] = aaTransientSessionID;
+        fresh.streamToSessionIds[aaStreamName] = fresh.aaTransientSessionID;
     }
 
 
 }
-void AudioManagerClient::populateStreamTable()
+void AudioManagerClient::populateStreamTable(SessionTable& fresh)
 {
-    streamToSessionIds.clear();
     json requestArgs = {
         { "svc", "SRCS" },
         { "pretty", false }
     };
-    std::string resultString = Request("dumpState", requestArgs.dump());
+    std::string resultString = requestSync("dumpState", requestArgs.dump());
     printf("dumpState(%s)\n%s\n", requestArgs.dump().c_str(), resultString.c_str());
     /*
          * An example resonse:
@@ -448,21 +522,21 @@ void AudioManagerClient::populateStreamTable()
             printf("Found stream %s session id %i\n", streamName.c_str(), sessionId);
             if(streamName == aaStreamName)
             {
-                if (aaSessionID < 0)
-                    aaSessionID = sessionId;
+                if (fresh.aaSessionID < 0)
+                    fresh.aaSessionID = sessionId;
                 else
-                    aaTransientSessionID = sessionId;
+                    fresh.aaTransientSessionID = sessionId;
             }
             else
             {
                 //We have two so this doesn't work
-                streamToSessionIds[streamName] = sessionId;
+                fresh.streamToSessionIds[streamName] = sessionId;
             }
         }
         // Create and register stream (only if we need to)
-        if (aaSessionID < 0 || aaTransientSessionID < 0)
+        if (fresh.aaSessionID < 0 || fresh.aaTransientSessionID < 0)
         {
-            aaRegisterStream();
+            aaRegisterStream(fresh);
         }
     }
     catch (const std::domain_error& ex)
@@ -475,40 +549,123 @@ void AudioManagerClient::populateStreamTable()
         loge("Failed to parse state json: %s", ex.what());
         printf("%s\n", resultString.c_str());
     }
+
+    if (fresh.aaSessionID < 0 || fresh.aaTransientSessionID < 0)
+    {
+        loge("Can't find audio stream. Audio will not work");
+        return;
+    }
+    json permanentArgs = { { "sessionId", fresh.aaSessionID } };
+    json transientArgs = { { "sessionId", fresh.aaTransientSessionID } };
+    fresh.focusArgs[0] = permanentArgs.dump();
+    fresh.focusArgs[1] = transientArgs.dump();
+}
+
+void AudioManagerClient::refreshStreamTable()
+{
+    //A rebuild already on its way covers this one too
+    uint64_t now = hu_get_time_us();
+    if (tableRefreshUs != 0 && now - tableRefreshUs < AUDIO_TABLE_REFRESH_MS * 1000)
+        return;
+    tableRefreshUs = now;
+    uint64_t deadlineUs = now + AUDIO_TABLE_TIMEOUT_MS * 1000ULL;
+    tableRebuildDeadlineUs = deadlineUs;
+    mzd_dbus_call("AudioManager.sessionTable", *this, [this, deadlineUs]()
+    {
+        SessionTable fresh;
+        populateStreamTable(fresh);
+        {
+            std::lock_guard<std::mutex> lk(tableMutex);
+            table = std::move(fresh);
+        }
+        //Unless a later rebuild was queued in the meantime. One that threw just leaves its deadline to run out
+        uint64_t expected = deadlineUs;
+        tableRebuildDeadlineUs.compare_exchange_strong(expected, 0);
+    }, nullptr, MzdDBusDoneOn::REACTOR, AUDIO_TABLE_TIMEOUT_MS);
 }
 
 AudioManagerClient::AudioManagerClient(MazdaEventCallbacks& callbacks, DBus::Connection &connection)
     : DBus::ObjectProxy(connection, "/com/xse/service/AudioManagement/AudioApplication", "com.xsembedded.service.AudioManagement")
+    , tableRebuildDeadlineUs(0)
     , callbacks(callbacks)
 {
-    populateStreamTable();
-    if (aaSessionID < 0 || aaTransientSessionID < 0)
-    {
-        loge("Can't find audio stream. Audio will not work");
-    }
+    //Built while the phone connects. Focus calls queue up behind it, so they never see a half built table
+    refreshStreamTable();
 }
 
 AudioManagerClient::~AudioManagerClient()
 {
+    //On the D-Bus thread after the queue drained, nothing else touches the table now
     if (currentFocus != FocusType::NONE && previousSessionID >= 0)
     {
         json args = { { "sessionId", previousSessionID } };
-        std::string result = Request("requestAudioFocus", args.dump());
+        std::string result = requestSync("requestAudioFocus", args.dump());
         printf("requestAudioFocus(%s)\n%s\n", args.dump().c_str(), result.c_str());
     }
 
-    for (int session : {aaSessionID, aaTransientSessionID })
+    for (int session : {table.aaSessionID, table.aaTransientSessionID })
     {
         if (session >= 0)
         {
             json args = { { "sessionId", session } };
-            std::string result = Request("closeSession", args.dump());
+            std::string result = requestSync("closeSession", args.dump());
             printf("closeSession(%s)\n%s\n", args.dump().c_str(), result.c_str());
         }
     }
 }
 
-bool AudioManagerClient::canSwitchAudio() { return aaSessionID >= 0 && aaTransientSessionID >= 0; }
+std::string AudioManagerClient::requestSync(const std::string& method, const std::string& args)
+{
+    std::string result;
+    mzd_dbus_timed("AudioManager." + method, *this, [&]() { result = Request(method, args); });
+    return result;
+}
+
+void AudioManagerClient::requestFocusAsync(const std::string& method, FocusType type, int sessionId)
+{
+    //Queued behind a rebuild, which may take up to AUDIO_TABLE_TIMEOUT_MS, so it gets that long on top of its own
+    //timeout. Otherwise it would be dropped unsent while the rebuild runs. If it lands after AUDIO_FOCUS_ANSWER_MS,
+    //the phone hears about the gain from the audio manager's focus event
+    int timeout_ms = MZD_DBUS_TIMEOUT_MS;
+    uint64_t rebuildDeadlineUs = tableRebuildDeadlineUs;
+    uint64_t now = hu_get_time_us();
+    if (rebuildDeadlineUs > now)
+        timeout_ms += (int) ((rebuildDeadlineUs - now + 999) / 1000);
+
+    mzd_dbus_call("AudioManager." + method, *this, [this, method, type, sessionId]()
+    {
+        std::string args;
+        if (sessionId >= 0)
+        {
+            json sessionArgs = { { "sessionId", sessionId } };
+            args = sessionArgs.dump();
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lk(tableMutex);
+            args = table.focusArgs[type == FocusType::TRANSIENT ? 1 : 0];
+        }
+        if (args.empty())
+        {
+            loge("No audio session for %s, audio will not work", method.c_str());
+            return;
+        }
+        std::string result = Request(method, args);
+        printf("%s(%s)\n%s\n", method.c_str(), args.c_str(), result.c_str());
+    });
+}
+
+bool AudioManagerClient::canSwitchAudio()
+{
+    std::lock_guard<std::mutex> lk(tableMutex);
+    return table.aaSessionID >= 0 && table.aaTransientSessionID >= 0;
+}
+
+void AudioManagerClient::answer(FocusType type)
+{
+    pendingFocus = FocusType::NONE;
+    callbacks.AudioFocusHappend(type);
+}
 
 void AudioManagerClient::audioMgrRequestAudioFocus(FocusType type)
 {
@@ -520,152 +677,171 @@ void AudioManagerClient::audioMgrRequestAudioFocus(FocusType type)
     printf("audioMgrRequestAudioFocus(%i)\n", int(type));
     if (currentFocus == type)
     {
-        callbacks.AudioFocusHappend(currentFocus);
+        answer(currentFocus);
         return;
     }
+    if (pendingFocus == type)
+    {
+        //Already asked, the answer covers this request too
+        return;
+    }
+    if (!canSwitchAudio())
+    {
+        //Still being built, or it failed. The request below waits for a rebuild in the queue
+        refreshStreamTable();
+    }
 
     if (currentFocus == FocusType::NONE && type == FocusType::PERMANENT)
     {
         waitingForFocusLostEvent = true;
         previousSessionID = -1;
     }
-    json args = { { "sessionId", type == FocusType::TRANSIENT ? aaTransientSessionID : aaSessionID } };
-    std::string result = Request("requestAudioFocus", args.dump());
-    printf("requestAudioFocus(%s)\n%s\n", args.dump().c_str(), result.c_str());
+    pendingFocus = type;
+    uint32_t generation = ++pendingGeneration;
+    requestFocusAsync("requestAudioFocus", type);
+
+    run_on_main_thread_delay(AUDIO_FOCUS_ANSWER_MS, [this, generation]()
+    {
+        if (pendingFocus != FocusType::NONE && pendingGeneration == generation)
+        {
+            logw("Audio manager didn't answer focus request %i within %d ms", int(pendingFocus), AUDIO_FOCUS_ANSWER_MS);
+            answer(currentFocus);
+        }
+        return false;
+    });
 }
 
 void AudioManagerClient::audioMgrReleaseAudioFocus()
 {
     printf("audioMgrReleaseAudioFocus()\n");
-    if (currentFocus == FocusType::NONE)
-    {
-        //nothing to do
-        callbacks.AudioFocusHappend(currentFocus);
-    }
-    else if (currentFocus == FocusType::PERMANENT && previousSessionID >= 0)
+    //The phone gave it up, so it hears about the loss now rather than when the audio manager gets around to it
+    pendingFocus = FocusType::NONE;
+    if (currentFocus == FocusType::PERMANENT && previousSessionID >= 0)
     {
         //We released the last one, give up audio focus for real
-        json args = { { "sessionId", previousSessionID } };
-        std::string result = Request("requestAudioFocus", args.dump());
-        printf("requestAudioFocus(%s)\n%s\n", args.dump().c_str(), result.c_str());
+        requestFocusAsync("requestAudioFocus", FocusType::PERMANENT, previousSessionID);
         previousSessionID = -1;
     }
     else if (currentFocus == FocusType::TRANSIENT)
     {
-        json args = { { "sessionId", aaTransientSessionID } };
-        std::string result = Request("abandonAudioFocus", args.dump());
-        printf("abandonAudioFocus(%s)\n%s\n", args.dump().c_str(), result.c_str());
+        requestFocusAsync("abandonAudioFocus", FocusType::TRANSIENT);
         previousSessionID = -1;
     }
-    else
-    {
-        currentFocus = FocusType::NONE;
-        callbacks.AudioFocusHappend(currentFocus);
-    }
+    currentFocus = FocusType::NONE;
+    answer(currentFocus);
 }
 
 void AudioManagerClient::Notify(const std::string &signalName, const std::string &payload)
+{
+    //Signals come in on the D-Bus reactor, the focus state belongs to the main loop. Dropped once the session's loop is gone
+    if (signalName != "audioFocusChangeEvent")
+        return;
+    run_on_main_thread_in(callbacks.mainContext, 0, [this, signalName, payload]()
+    {
+        handleNotify(signalName, payload);
+        return false;
+    });
+}
+
+void AudioManagerClient::handleNotify(const std::string &signalName, const std::string &payload)
 {
     printf("AudioManagerClient::Notify signalName=%s payload=%s\n", signalName.c_str(), payload.c_str());
-    if (signalName == "audioFocusChangeEvent")
+    try
     {
-        try
-        {
-            auto result = json::parse(payload);
-            std::string streamName = result["streamName"].get<std::string>();
-            std::string newFocus = result["newFocus"].get<std::string>();
-            std::string focusType = result["focusType"].get<std::string>();
+        auto result = json::parse(payload);
+        std::string streamName = result["streamName"].get<std::string>();
+        std::string newFocus = result["newFocus"].get<std::string>();
+        std::string focusType = result["focusType"].get<std::string>();
 
-            int eventSessionID = -1;
+        int eventSessionID = -1;
+        int aaSessionID, aaTransientSessionID;
+        {
+            std::lock_guard<std::mutex> lk(tableMutex);
+            aaSessionID = table.aaSessionID;
+            aaTransientSessionID = table.aaTransientSessionID;
             if (streamName == aaStreamName)
             {
-                if (focusType == "permanent")
-                {
-                    eventSessionID = aaSessionID;
-                }
-                else
-                {
-                    eventSessionID = aaTransientSessionID;
-                }
-                logd("Found audio sessionId %i for stream %s\n", eventSessionID, streamName.c_str());
+                eventSessionID = focusType == "permanent" ? aaSessionID : aaTransientSessionID;
             }
             else
             {
-                auto findIt = streamToSessionIds.find(streamName);
-                if (findIt != streamToSessionIds.end())
-                {
+                auto findIt = table.streamToSessionIds.find(streamName);
+                if (findIt != table.streamToSessionIds.end())
                     eventSessionID = findIt->second;
-                    logd("Found audio sessionId %i for stream %s with focusType %s & newFocus %s\n", eventSessionID, streamName.c_str(), focusType.c_str(), newFocus.c_str());
-                }
-                else
-                {
-                    loge("Can't find audio sessionId for stream %s\n", streamName.c_str());
-                }
             }
+        }
+        if (eventSessionID >= 0)
+        {
+            logd("Found audio sessionId %i for stream %s with focusType %s & newFocus %s\n", eventSessionID, streamName.c_str(), focusType.c_str(), newFocus.c_str());
+        }
+        else
+        {
+            //Started after the table was built, pick it up for next time
+            loge("Can't find audio sessionId for stream %s\n", streamName.c_str());
+            refreshStreamTable();
+        }
 
-            if (eventSessionID >= 0)
+        if (eventSessionID >= 0)
+        {
+            if (waitingForFocusLostEvent && newFocus == "lost")
             {
-                if (waitingForFocusLostEvent && newFocus == "lost")
-                {
-                    previousSessionID = eventSessionID;
-                    waitingForFocusLostEvent = false;
-                }
+                previousSessionID = eventSessionID;
+                waitingForFocusLostEvent = false;
+            }
 
-                FocusType newFocusType = currentFocus;
-                if (newFocus != "gained")
+            FocusType newFocusType = currentFocus;
+            if (newFocus != "gained")
+            {
+                if (eventSessionID == aaSessionID || eventSessionID == aaTransientSessionID)
                 {
-                    if (eventSessionID == aaSessionID || eventSessionID == aaTransientSessionID)
-                    {
-                        newFocusType = FocusType::NONE;
-                    }
+                    newFocusType = FocusType::NONE;
                 }
-                else
+            }
+            else
+            {
+                if (eventSessionID == aaTransientSessionID)
                 {
-                    if (eventSessionID == aaTransientSessionID)
-                    {
-                        newFocusType = FocusType::TRANSIENT;
-                    }
-                    else if (eventSessionID == aaSessionID)
-                    {
-                        newFocusType = FocusType::PERMANENT;
-                    }
+                    newFocusType = FocusType::TRANSIENT;
                 }
-
-                if (currentFocus != newFocusType)
+                else if (eventSessionID == aaSessionID)
                 {
-                    currentFocus = newFocusType;
-                    callbacks.AudioFocusHappend(currentFocus);
+                    newFocusType = FocusType::PERMANENT;
                 }
             }
+
+            if (currentFocus != newFocusType)
+            {
+                currentFocus = newFocusType;
+                answer(currentFocus);
+            }
         }
-        catch (const std::domain_error& ex)
-        {
-            loge("Failed to parse state json: %s", ex.what());
-        }
-        catch (const std::invalid_argument& ex)
-        {
-            loge("Failed to parse state json: %s", ex.what());
-        }
+    }
+    catch (const std::domain_error& ex)
+    {
+        loge("Failed to parse state json: %s", ex.what());
+    }
+    catch (const std::invalid_argument& ex)
+    {
+        loge("Failed to parse state json: %s", ex.what());
     }
 }
 
-extern NaviData *navi_data;
-extern std::mutex hudmutex;
+void MazdaEventCallbacks::NaviDataChanged(){
+  naviData.previous_msg = naviData.previous_msg + 1;
+  if (naviData.previous_msg == 8){
+    naviData.previous_msg = 1;
+  }
+  hud_publish(naviData);
+}
 
 void MazdaEventCallbacks::HandleNaviStatus(IHUConnectionThreadInterface& stream, const HU::NAVMessagesStatus &request){
   if (request.status() == HU::NAVMessagesStatus_STATUS_STOP) {
-    hudmutex.lock();
-    navi_data->event_name = "";
-    navi_data->turn_event = 0;
-    navi_data->turn_side = 0;
-    navi_data->turn_number = -1;
-    navi_data->turn_angle = -1;
-    navi_data->changed = 1;
-    navi_data->previous_msg = navi_data->previous_msg + 1;
-    if (navi_data->previous_msg == 8){
-      navi_data->previous_msg = 1;
-    }
-    hudmutex.unlock();
+    naviData.event_name = "";
+    naviData.turn_event = 0;
+    naviData.turn_side = 0;
+    naviData.turn_number = -1;
+    naviData.turn_angle = -1;
+    NaviDataChanged();
   }
 }
 
@@ -681,40 +857,33 @@ void MazdaEventCallbacks::HandleNaviTurn(IHUConnectionThreadInterface& stream, c
   );
   logUnknownFields(request.unknown_fields());
 
-  hudmutex.lock();
   int changed = 0;
-  if (navi_data->event_name != request.event_name()) {
-    navi_data->event_name = request.event_name();
+  if (naviData.event_name != request.event_name()) {
+    naviData.event_name = request.event_name();
     changed = 1;
   }
-  if (navi_data->turn_event != request.turn_event()) {
-    navi_data->turn_event = request.turn_event();
+  if (naviData.turn_event != request.turn_event()) {
+    naviData.turn_event = request.turn_event();
     changed = 1;
   }
-  if (navi_data->turn_side != request.turn_side()) {
-    navi_data->turn_side = request.turn_side();
+  if (naviData.turn_side != request.turn_side()) {
+    naviData.turn_side = request.turn_side();
     changed = 1;
   }
-  if (navi_data->turn_number != request.turn_number()) {
-    navi_data->turn_number = request.turn_number();
+  if (naviData.turn_number != request.turn_number()) {
+    naviData.turn_number = request.turn_number();
     changed = 1;
   }
-  if (navi_data->turn_angle != request.turn_angle()) {
-    navi_data->turn_angle = request.turn_angle();
+  if (naviData.turn_angle != request.turn_angle()) {
+    naviData.turn_angle = request.turn_angle();
     changed = 1;
   }
   if (changed) {
-    navi_data->changed = 1;
-    navi_data->previous_msg = navi_data->previous_msg+1;
-    if (navi_data->previous_msg == 8) {
-      navi_data->previous_msg = 1;
-    }
+    NaviDataChanged();
   }
-  hudmutex.unlock();
 }
 
 void MazdaEventCallbacks::HandleNaviTurnDistance(IHUConnectionThreadInterface& stream, const HU::NAVDistanceMessage &request) {
-  hudmutex.lock();
   int now_distance;
   HudDistanceUnit now_unit;
   switch (request.display_distance_unit()) {
@@ -754,26 +923,22 @@ void MazdaEventCallbacks::HandleNaviTurnDistance(IHUConnectionThreadInterface& s
         }
   }
   
-  if (now_distance != navi_data->distance || now_unit != navi_data->distance_unit) {
-    navi_data->distance_unit = now_unit;
-    navi_data->distance = now_distance;
-    navi_data->changed = 1;
-    navi_data->previous_msg = navi_data->previous_msg+1;
-    if (navi_data->previous_msg == 8) {
-      navi_data->previous_msg = 1;
-    }
+  //One publish even if both changed, the HUD only needs the newest
+  bool changed = false;
+  if (now_distance != naviData.distance || now_unit != naviData.distance_unit) {
+    naviData.distance_unit = now_unit;
+    naviData.distance = now_distance;
+    changed = true;
   }
 
-  if (navi_data->time_until != request.time_until()) {
-    navi_data->time_until = request.time_until();
-    navi_data->changed = 1;
-    navi_data->previous_msg = navi_data->previous_msg+1;
-    if (navi_data->previous_msg == 8) {
-      navi_data->previous_msg = 1;
-    }
+  if (naviData.time_until != request.time_until()) {
+    naviData.time_until = request.time_until();
+    changed = true;
   }
 
-  hudmutex.unlock();
+  if (changed) {
+    NaviDataChanged();
+  }
 }
 
 void logUnknownFields(const ::google::protobuf::UnknownFieldSet& fields) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <mutex>
 #include <set>
 #include "hu_aap.h"
 
@@ -10,6 +11,7 @@
 #include <asoundlib.h>
 
 #include "dbus/generated_cmu.h"
+#include "hud/hud.h"
 #include "version.h"
 
 class VideoOutput;
@@ -70,18 +72,43 @@ public:
         TRANSIENT,
     };
 private:
-    std::map<std::string, int> streamToSessionIds;
+    //Stream and session ids, built once a session on the D-Bus thread and rebuilt there when an unknown stream shows up
+    struct SessionTable
+    {
+        std::map<std::string, int> streamToSessionIds;
+        int aaSessionID = -1;
+        int aaTransientSessionID = -1;
+        std::string focusArgs[2];                                       //{"sessionId":N} for the two AA sessions, dumped once
+    };
+
     std::string aaStreamName = "MLENT";
-    int aaSessionID = -1;
-    int aaTransientSessionID = -1;
+    std::mutex tableMutex;
+    SessionTable table;                                                 //Under tableMutex
+    uint64_t tableRefreshUs = 0;                                        //When the last rebuild was queued. Main loop, after the constructor
+    std::atomic<uint64_t> tableRebuildDeadlineUs;                       //When the queued rebuild gives up, 0 once it is done
+
+    //Focus state machine, main loop only. currentFocus is what the audio manager last told us, pendingFocus a gain we
+    //asked for and haven't heard back about. The phone is answered when the audio manager answers, right away for a
+    //release, or with whatever we hold if the audio manager stays quiet for AUDIO_FOCUS_ANSWER_MS
+    FocusType currentFocus = FocusType::NONE;
+    FocusType pendingFocus = FocusType::NONE;
+    uint32_t pendingGeneration = 0;
     int previousSessionID = -1;
     bool waitingForFocusLostEvent = false;
     MazdaEventCallbacks& callbacks;
-    FocusType currentFocus = FocusType::NONE;
 
     //These IDs are usually the same, but they depend on the startup order of the services on the car so we can't assume them 100% reliably
-    void populateStreamTable();
-    void aaRegisterStream();
+    void populateStreamTable(SessionTable& fresh);
+    void aaRegisterStream(SessionTable& fresh);
+    void refreshStreamTable();
+
+    //Blocking, for the D-Bus thread
+    std::string requestSync(const std::string& method, const std::string& args);
+    //Queued. sessionId -1 takes the AA session for type from the table when the call runs, so a request made
+    //before the table is built still goes to the right session. Its deadline covers a rebuild queued ahead of it
+    void requestFocusAsync(const std::string& method, FocusType type, int sessionId = -1);
+    void answer(FocusType type);
+    void handleNotify(const std::string& signalName, const std::string& payload);
 public:
     AudioManagerClient(MazdaEventCallbacks& callbacks, DBus::Connection &connection);
     ~AudioManagerClient();
@@ -108,6 +135,9 @@ class VideoManagerClient : public com::jci::bucpsa_proxy,
 
     MazdaEventCallbacks& callbacks;
     NativeGUICtrlClient guiClient;
+
+    void setSurface(NativeGUICtrlClient::SURFACES surface);
+    void handleDisplayMode(uint32_t currentDisplayMode);
 public:
     VideoManagerClient(MazdaEventCallbacks& callbacks, DBus::Connection &hmiBus);
     ~VideoManagerClient();
@@ -128,16 +158,20 @@ class MazdaEventCallbacks : public IHUConnectionThreadEventCallbacks {
     std::unique_ptr<AudioOutput> audioOutput;
 
     MicInput micInput;
-    DBus::Connection& serviceBus;
-    DBus::Connection& hmiBus;
 
+    //Made and destroyed on the D-Bus reactor thread, their signals come in there
     std::unique_ptr<AudioManagerClient> audioMgrClient;
     std::unique_ptr<VideoManagerClient> videoMgrClient;
+
+    NaviData naviData = {};  //Only touched by the nav callbacks on the HU thread, copies go to the HUD
+    void NaviDataChanged();
 public:
-    MazdaEventCallbacks(DBus::Connection& serviceBus, DBus::Connection& hmiBus);
+    MazdaEventCallbacks();
     ~MazdaEventCallbacks();
 
     virtual int MediaPacket(int chan, uint64_t timestamp, const byte * buf, int len) override;
+    virtual bool MediaStreamChunks(int chan) override;
+    virtual int MediaPacketChunk(int chan, uint64_t timestamp, int offset, int total, const byte * buf, int len) override;
     virtual int MediaStart(int chan) override;
     virtual int MediaStop(int chan) override;
     virtual void MediaSetupComplete(int chan) override;
@@ -154,6 +188,7 @@ public:
 
     void VideoFocusHappened(bool hasFocus, bool unrequested);
     void AudioFocusHappend(AudioManagerClient::FocusType type);
+    void logAudioFocusStats();
 
     void HandlePhoneStatus(IHUConnectionThreadInterface& stream, const HU::PhoneStatus& phoneStatus) override;
 
@@ -161,6 +196,8 @@ public:
     std::atomic<bool> videoFocus;
     std::atomic<bool> inCall;
     std::atomic<AudioManagerClient::FocusType> audioFocus;
+    std::atomic<uint64_t> audioFocusRequestUs;                          //When the phone's unanswered AudioFocusRequest came in, or 0
+    GMainContext* mainContext;                                          //Ref on this session's loop, for posts from the D-Bus threads
 
     virtual void HandleNaviStatus(IHUConnectionThreadInterface& stream, const HU::NAVMessagesStatus &request) override;
     virtual void HandleNaviTurn(IHUConnectionThreadInterface& stream, const HU::NAVTurnMessage &request) override;
@@ -0,0 +1,365 @@
+#include "mzd_dbus.h"
+
+#include <dbus-c++/glib-integration.h>
+#include <glib.h>
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define LOGTAG "mazda-dbus"
+
+#include "hu_uti.h"
+#include "hu_metrics.h"
+#include "glib_utils.h"
+
+#define MZD_DBUS_ERRORS_LOGGED 10                                       //In a row per method, the rest are only counted
+
+struct MzdDBusCall
+{
+    std::string method;
+    DBus::ObjectProxy* proxy = nullptr;
+    std::function<void()> call;
+    MzdDBusDone done;
+    MzdDBusDoneOn doneOn = MzdDBusDoneOn::REACTOR;
+    GMainContext* mainContext = nullptr;                                //Ref on the session the call was made in, for MAIN
+    uint64_t session = 0;
+    uint64_t queuedUs = 0;
+    uint64_t deadlineUs = 0;
+    std::atomic<bool> finished;                                         //done already ran, from the reply or the timeout
+
+    MzdDBusCall() : finished(false) {}
+    ~MzdDBusCall()
+    {
+        //Held so the context can't be freed and another allocated where it was while the call is out
+        if (mainContext != nullptr)
+            g_main_context_unref(mainContext);
+    }
+};
+
+struct MzdDBusMethodStats
+{
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    uint64_t errorsInARow = 0;
+    uint64_t timeouts = 0;
+    uint64_t waitUs = 0;                                                //Queued until sent
+    uint64_t callUs = 0;                                                //Sent until the reply
+    uint64_t callMaxUs = 0;
+};
+
+static std::mutex dbus_start_mutex;
+static bool dbus_started = false;
+static GMainContext* dbus_context = nullptr;
+static GMainLoop* dbus_loop = nullptr;
+static DBus::Glib::BusDispatcher* dbus_dispatcher = nullptr;
+static DBus::Connection* dbus_service = nullptr;
+static DBus::Connection* dbus_hmi = nullptr;
+static std::thread::id dbus_reactor_id;
+
+//One per service, made the first time a call goes to it and kept for the life of the process like its thread
+struct MzdDBusQueue
+{
+    std::string service;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<MzdDBusCall>> calls;
+    uint64_t queued = 0;                                                //Ever queued and ever run, for mzd_dbus_flush
+    uint64_t ran = 0;
+};
+
+static std::mutex dbus_queue_mutex;
+static std::condition_variable dbus_ran_cv;
+static std::map<std::string, std::unique_ptr<MzdDBusQueue>> dbus_queues;
+
+static std::mutex dbus_stats_mutex;
+static std::map<std::string, MzdDBusMethodStats> dbus_stats;
+
+static gboolean dbus_source_func(gpointer p)
+{
+    (*reinterpret_cast<std::function<void()>*>(p))();
+    return FALSE;
+}
+
+static void dbus_source_free(gpointer p)
+{
+    delete reinterpret_cast<std::function<void()>*>(p);
+}
+
+static void dbus_on_reactor(guint delay_ms, std::function<void()> f)
+{
+    GSource* source = delay_ms > 0 ? g_timeout_source_new(delay_ms) : g_idle_source_new();
+    g_source_set_callback(source, dbus_source_func, new std::function<void()>(std::move(f)), dbus_source_free);
+    g_source_attach(source, dbus_context);
+    g_source_unref(source);
+}
+
+static void dbus_record(const std::string& method, uint64_t waitUs, uint64_t callUs, bool timedOut, const char* error, bool logError)
+{
+    std::lock_guard<std::mutex> lk(dbus_stats_mutex);
+    MzdDBusMethodStats& stats = dbus_stats[method];
+    stats.calls++;
+    stats.waitUs += waitUs;
+    stats.callUs += callUs;
+    stats.callMaxUs = std::max(stats.callMaxUs, callUs);
+    if (timedOut)
+        stats.timeouts++;
+    if (error != nullptr)
+    {
+        stats.errors++;
+        stats.errorsInARow++;
+        //prevent insane log spam from something polled
+        if (logError && stats.errorsInARow <= MZD_DBUS_ERRORS_LOGGED)
+            loge("DBUS: %s failed: %s", method.c_str(), error);
+    }
+    else if (stats.errorsInARow > 0)
+    {
+        if (stats.errorsInARow > MZD_DBUS_ERRORS_LOGGED)
+            loge("DBUS: %s hid %llu failures", method.c_str(), (unsigned long long) (stats.errorsInARow - MZD_DBUS_ERRORS_LOGGED));
+        stats.errorsInARow = 0;
+    }
+}
+
+static void dbus_finish(const std::shared_ptr<MzdDBusCall>& call, bool ok)
+{
+    if (!call->finished.exchange(true))
+        call->done(ok);
+}
+
+//Where done runs, for both the reply and the timeout
+static void dbus_post_done(const std::shared_ptr<MzdDBusCall>& call, guint delay_ms, bool ok)
+{
+    if (call->doneOn == MzdDBusDoneOn::REACTOR)
+    {
+        dbus_on_reactor(delay_ms, [call, ok]() { dbus_finish(call, ok); });
+        return;
+    }
+    //The context is remade every session and whatever done captured went with the old one. It is compared and
+    //posted to under the lock main.cpp swaps it with, so a late reply can't land on a context being torn down
+    if (hu_metrics.sessions.load(std::memory_order_relaxed) != call->session)
+        return;
+    run_on_main_thread_in(call->mainContext, delay_ms, [call, ok]() { dbus_finish(call, ok); return false; });
+}
+
+static void dbus_execute(const std::shared_ptr<MzdDBusCall>& call)
+{
+    uint64_t startUs = hu_get_time_us();
+    if (startUs >= call->deadlineUs)
+    {
+        //Its timeout already reported it, don't send something nobody is waiting for
+        dbus_record(call->method, startUs - call->queuedUs, 0, true, nullptr, false);
+        return;
+    }
+
+    bool ok = false;
+    try
+    {
+        //Rounded up, and at least 1 ms since 0 means no timeout at all to libdbus
+        call->proxy->set_timeout((int) std::max<uint64_t>(1, (call->deadlineUs - startUs + 999) / 1000));
+        call->call();
+        ok = true;
+    }
+    catch (DBus::Error& error)
+    {
+        dbus_record(call->method, startUs - call->queuedUs, hu_get_time_us() - startUs, false, error.message(), true);
+    }
+    catch (std::exception& ex)
+    {
+        dbus_record(call->method, startUs - call->queuedUs, hu_get_time_us() - startUs, false, ex.what(), true);
+    }
+    uint64_t endUs = hu_get_time_us();
+    bool late = endUs > call->deadlineUs;
+    if (ok)
+        dbus_record(call->method, startUs - call->queuedUs, endUs - startUs, late, nullptr, false);
+
+    if (call->done && !late)
+        dbus_post_done(call, 0, ok);
+}
+
+static void dbus_caller_main(MzdDBusQueue* queue)
+{
+    //"dbus:" and the last part of the service name, cut to what pthread names allow
+    std::string name = "dbus:" + queue->service.substr(queue->service.rfind('.') + 1);
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    std::unique_lock<std::mutex> lk(dbus_queue_mutex);
+    while (true)
+    {
+        queue->cv.wait(lk, [queue] { return !queue->calls.empty(); });
+        std::shared_ptr<MzdDBusCall> call = std::move(queue->calls.front());
+        queue->calls.pop_front();
+        lk.unlock();
+
+        dbus_execute(call);
+        call.reset();                                                   //Whatever the call captured goes here, not under the lock
+
+        lk.lock();
+        queue->ran++;
+        dbus_ran_cv.notify_all();
+    }
+}
+
+static void dbus_reactor_main()
+{
+    pthread_setname_np(pthread_self(), "dbus_reactor");
+    g_main_context_push_thread_default(dbus_context);
+    g_main_loop_run(dbus_loop);
+}
+
+static DBus::Connection* dbus_open(const char* address)
+{
+    std::unique_ptr<DBus::Connection> connection(new DBus::Connection(address, false));
+    connection->register_bus();
+    return connection.release();
+}
+
+void mzd_dbus_start()
+{
+    std::lock_guard<std::mutex> lk(dbus_start_mutex);
+    if (dbus_started)
+        return;
+
+    if (dbus_context == nullptr)
+    {
+        dbus_context = g_main_context_new();
+        dbus_loop = g_main_loop_new(dbus_context, FALSE);
+        dbus_dispatcher = new DBus::Glib::BusDispatcher();
+        dbus_dispatcher->attach(dbus_context);
+        //Connections pick up the default dispatcher when they are made, and these are the only ones
+        DBus::default_dispatcher = dbus_dispatcher;
+    }
+    //Either can throw, the one that worked is kept for the next try
+    if (dbus_service == nullptr)
+        dbus_service = dbus_open(SERVICE_BUS_ADDRESS);
+    if (dbus_hmi == nullptr)
+        dbus_hmi = dbus_open(HMI_BUS_ADDRESS);
+
+    //Lives as long as the process, like the connections
+    std::thread reactor(dbus_reactor_main);
+    dbus_reactor_id = reactor.get_id();
+    reactor.detach();
+    dbus_started = true;
+    printf("D-Bus service and HMI connections established\n");
+}
+
+DBus::Connection& mzd_dbus_service_bus()
+{
+    return *dbus_service;
+}
+
+DBus::Connection& mzd_dbus_hmi_bus()
+{
+    return *dbus_hmi;
+}
+
+void mzd_dbus_run(const std::function<void()>& f)
+{
+    if (std::this_thread::get_id() == dbus_reactor_id)
+    {
+        f();
+        return;
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool ran = false;
+    std::exception_ptr error;
+    dbus_on_reactor(0, [&]()
+    {
+        try
+        {
+            f();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lk(mutex);
+        ran = true;
+        cv.notify_one();
+    });
+
+    std::unique_lock<std::mutex> lk(mutex);
+    cv.wait(lk, [&ran] { return ran; });
+    if (error)
+        std::rethrow_exception(error);
+}
+
+void mzd_dbus_call(const std::string& method, DBus::ObjectProxy& proxy, std::function<void()> call, MzdDBusDone done, MzdDBusDoneOn doneOn, int timeout_ms)
+{
+    std::shared_ptr<MzdDBusCall> entry = std::make_shared<MzdDBusCall>();
+    entry->method = method;
+    entry->proxy = &proxy;
+    entry->call = std::move(call);
+    entry->done = std::move(done);
+    entry->doneOn = doneOn;
+    if (doneOn == MzdDBusDoneOn::MAIN)
+        entry->mainContext = run_on_thread_main_context_ref();
+    entry->session = hu_metrics.sessions.load(std::memory_order_relaxed);
+    entry->queuedUs = hu_get_time_us();
+    entry->deadlineUs = entry->queuedUs + (uint64_t) timeout_ms * 1000;
+
+    if (entry->done)
+        dbus_post_done(entry, timeout_ms, false);
+
+    std::lock_guard<std::mutex> lk(dbus_queue_mutex);
+    std::unique_ptr<MzdDBusQueue>& queue = dbus_queues[proxy.service()];
+    if (!queue)
+    {
+        queue.reset(new MzdDBusQueue());
+        queue->service = proxy.service();
+        std::thread(dbus_caller_main, queue.get()).detach();
+    }
+    queue->calls.push_back(std::move(entry));
+    queue->queued++;
+    queue->cv.notify_one();
+}
+
+void mzd_dbus_flush()
+{
+    std::unique_lock<std::mutex> lk(dbus_queue_mutex);
+    std::vector<std::pair<MzdDBusQueue*, uint64_t>> waits;
+    for (auto& entry : dbus_queues)
+        waits.emplace_back(entry.second.get(), entry.second->queued);
+    dbus_ran_cv.wait(lk, [&waits]
+    {
+        return std::all_of(waits.begin(), waits.end(), [](const std::pair<MzdDBusQueue*, uint64_t>& wait) { return wait.first->ran >= wait.second; });
+    });
+}
+
+void mzd_dbus_timed(const std::string& method, DBus::ObjectProxy& proxy, const std::function<void()>& call)
+{
+    uint64_t startUs = hu_get_time_us();
+    try
+    {
+        proxy.set_timeout(MZD_DBUS_TIMEOUT_MS);
+        call();
+    }
+    catch (DBus::Error& error)
+    {
+        dbus_record(method, 0, hu_get_time_us() - startUs, false, error.message(), false);
+        throw;
+    }
+    dbus_record(method, 0, hu_get_time_us() - startUs, false, nullptr, false);
+}
+
+void mzd_dbus_log_stats()
+{
+    std::map<std::string, MzdDBusMethodStats> stats;
+    {
+        std::lock_guard<std::mutex> lk(dbus_stats_mutex);
+        stats.swap(dbus_stats);
+    }
+    for (auto& entry : stats)
+    {
+        const MzdDBusMethodStats& s = entry.second;
+        printf("D-Bus %s: %llu calls, %llu errors, %llu timeouts, wait mean %.1f ms, call mean %.1f ms max %.1f ms\n",
+               entry.first.c_str(), (unsigned long long) s.calls, (unsigned long long) s.errors, (unsigned long long) s.timeouts,
+               s.calls ? s.waitUs / 1000.0 / s.calls : 0.0, s.calls ? s.callUs / 1000.0 / s.calls : 0.0, s.callMaxUs / 1000.0);
+    }
+}
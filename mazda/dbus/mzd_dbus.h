@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <functional>
+
+#include <dbus-c++/dbus.h>
+
+#define HMI_BUS_ADDRESS "unix:path=/tmp/dbus_hmi_socket"
+#define SERVICE_BUS_ADDRESS "unix:path=/tmp/dbus_service_socket"
+
+#define MZD_DBUS_TIMEOUT_MS 2000
+
+// All the CMU clients share one connection per bus, opened once for the life of the process. Both connections
+// are dispatched by the dbus_reactor thread, so signal handlers run there and not on the main loop; handlers
+// that touch session state hand the work over with run_on_main_thread. Proxies have to be created and destroyed
+// through mzd_dbus_run, otherwise a signal can be dispatched to one that is half built or half destroyed.
+//
+// Method calls go through mzd_dbus_call, which queues them and returns straight away. Each service the proxies
+// talk to has its own queue and thread, where its calls run one at a time in the order they were queued. A stalled
+// service holds up its own queue, never the caller or the other services. The proxy is given what is left of the
+// call's timeout, so libdbus gives up on a call when its caller does instead of after its own default of 25 s.
+
+// Opens both connections and starts the threads, once. Throws DBus::Error if a bus can't be reached
+void mzd_dbus_start();
+DBus::Connection& mzd_dbus_service_bus();
+DBus::Connection& mzd_dbus_hmi_bus();
+
+// Runs f on the reactor thread and waits for it, rethrowing whatever it threw
+void mzd_dbus_run(const std::function<void()>& f);
+
+enum class MzdDBusDoneOn
+{
+    REACTOR,    // For callers that only store the result somewhere
+    MAIN,       // The session main loop. Dropped if that session is over by the time the call finishes
+};
+
+// ok is false if the call threw (already logged) or didn't finish within its timeout. A call still queued at its
+// deadline is dropped without being sent. One that was already sent can't be taken back, its late result is ignored
+typedef std::function<void(bool ok)> MzdDBusDone;
+
+// method names the call in the stats, like "lds.data.GetPosition". call may only use proxy, whose service picks the queue
+void mzd_dbus_call(const std::string& method, DBus::ObjectProxy& proxy, std::function<void()> call, MzdDBusDone done = nullptr,
+                   MzdDBusDoneOn doneOn = MzdDBusDoneOn::REACTOR, int timeout_ms = MZD_DBUS_TIMEOUT_MS);
+
+// Waits until every call queued so far, on every queue, has run, so the proxies they use can go. Not from inside a call
+void mzd_dbus_flush();
+
+// Runs a call on proxy that has to block on this thread, recording it like mzd_dbus_call. The proxy is given
+// MZD_DBUS_TIMEOUT_MS. DBus::Error is counted and rethrown
+void mzd_dbus_timed(const std::string& method, DBus::ObjectProxy& proxy, const std::function<void()>& call);
+
+// Per method calls, errors, timeouts, queue wait and call time since the last time this was called
+void mzd_dbus_log_stats();
@@ -2,8 +2,12 @@
 #include <dbus/dbus.h>
 #include <dbus-c++/dbus.h>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <cmath>
 
 #include "../dbus/generated_cmu.h"
+#include "../dbus/mzd_dbus.h"
 
 #define LOGTAG "mazda-gps"
 
@@ -11,7 +15,7 @@
 
 #include "mzd_gps.h"
 
-#define SERVICE_BUS_ADDRESS "unix:path=/tmp/dbus_service_socket"
+#define GPS_CALL_TIMEOUT_MS 1000
 
 enum LDSControl
 {
@@ -48,7 +52,12 @@ public:
 
 static std::unique_ptr<GPSLDSCLient> gps_client;
 static std::unique_ptr<GPSLDSControl> gps_control;
-static int get_data_errors_in_a_row = 0;
+
+static std::atomic<bool> gps_call_pending(false);
+static std::mutex gps_reply_mutex;
+static GPSData gps_reply;
+static uint64_t gps_reply_us = 0;
+static bool gps_reply_new = false;
 
 void GPSLDSControl::ReadStatus(const int32_t& commandReply, const int32_t& status)
 {
@@ -64,74 +73,85 @@ void mzd_gps2_start()
 
     try
     {
-        DBus::Connection gpservice_bus(SERVICE_BUS_ADDRESS, false);
-        gpservice_bus.register_bus();
-        gps_client.reset(new GPSLDSCLient(gpservice_bus));
-        gps_control.reset(new GPSLDSControl(gpservice_bus));
+        mzd_dbus_run([]()
+        {
+            gps_client.reset(new GPSLDSCLient(mzd_dbus_service_bus()));
+            gps_control.reset(new GPSLDSControl(mzd_dbus_service_bus()));
+        });
     }
     catch(DBus::Error& error)
     {
         loge("DBUS: Failed to connect to SERVICE bus %s: %s", error.name(), error.message());
-        gps_client.reset();
-        gps_control.reset();
+        mzd_dbus_run([]()
+        {
+            gps_client.reset();
+            gps_control.reset();
+        });
         return;
     }
 
     printf("GPS service connection established.\n");
 }
 
-bool mzd_gps2_get(GPSData& data)
+void mzd_gps2_request()
 {
-    if (gps_client == NULL)
-        return false;
+    if (gps_client == NULL || gps_call_pending.exchange(true))
+        return;
 
-    try
+    GPSLDSCLient* client = gps_client.get();
+    std::shared_ptr<GPSData> reply = std::make_shared<GPSData>();
+    mzd_dbus_call("lds.data.GetPosition", *client, [client, reply]()
     {
-        gps_client->GetPosition(data.positionAccuracy, data.uTCtime, data.latitude, data.longitude, data.altitude, data.heading, data.velocity, data.horizontalAccuracy, data.verticalAccuracy);
-
-        if (get_data_errors_in_a_row > 0)
-        {
-            loge("DBUS: GetPosition hid %i failures", get_data_errors_in_a_row);
-            get_data_errors_in_a_row = 0;
-        }
-
-        //timestamp 0 means "invalid" and positionAccuracy 0 means "no lock"
-        if (data.uTCtime == 0 || data.positionAccuracy == 0)
-            return false;
-
-        return true;
-    }
-    catch(DBus::Error& error)
+        GPSData& data = *reply;
+        client->GetPosition(data.positionAccuracy, data.uTCtime, data.latitude, data.longitude, data.altitude, data.heading, data.velocity, data.horizontalAccuracy, data.verticalAccuracy);
+    }, [reply](bool ok)
     {
-        get_data_errors_in_a_row++;
-        //prevent insane log spam
-        if (get_data_errors_in_a_row < 10)
+        //timestamp 0 means "invalid" and positionAccuracy 0 means "no lock"
+        if (ok && reply->uTCtime != 0 && reply->positionAccuracy != 0)
         {
-            loge("DBUS: GetPosition failed %s: %s", error.name(), error.message());
+            std::lock_guard<std::mutex> lk(gps_reply_mutex);
+            gps_reply = *reply;
+            gps_reply_us = hu_get_time_us();
+            gps_reply_new = true;
         }
+        gps_call_pending = false;
+    }, MzdDBusDoneOn::REACTOR, GPS_CALL_TIMEOUT_MS);
+}
+
+bool mzd_gps2_get(GPSData& data, uint64_t& readUs)
+{
+    std::lock_guard<std::mutex> lk(gps_reply_mutex);
+    if (!gps_reply_new)
         return false;
-    }
+    data = gps_reply;
+    readUs = gps_reply_us;
+    gps_reply_new = false;
+    return true;
 }
 
 void mzd_gps2_set_enabled(bool bEnabled)
 {
     if (gps_control)
     {
-        try
-        {
-            gps_control->ReadControl(bEnabled ? LDS_READ_START : LDS_READ_STOP);
-        }
-        catch(DBus::Error& error)
+        GPSLDSControl* control = gps_control.get();
+        mzd_dbus_call("lds.control.ReadControl", *control, [control, bEnabled]()
         {
-            loge("DBUS: ReadControl failed %s: %s", error.name(), error.message());
-        }
+            control->ReadControl(bEnabled ? LDS_READ_START : LDS_READ_STOP);
+        });
     }
 }
 
 void mzd_gps2_stop()
 {
-    gps_client.reset();
-    gps_control.reset();
+    mzd_dbus_flush();
+    mzd_dbus_run([]()
+    {
+        gps_client.reset();
+        gps_control.reset();
+        //After any reply that was still on its way in, so the next session doesn't start from this one's fix
+        std::lock_guard<std::mutex> lk(gps_reply_mutex);
+        gps_reply_new = false;
+    });
 }
 
 bool GPSData::IsSame(const GPSData& other) const
@@ -148,3 +168,20 @@ bool GPSData::IsSame(const GPSData& other) const
             int32_t(horizontalAccuracy * 1E7) == int32_t(other.horizontalAccuracy * 1E7) &&
             int32_t(verticalAccuracy * 1E7) == int32_t(other.verticalAccuracy * 1E7);
 }
+
+GPSData mzd_gps2_project(const GPSData& data, double seconds)
+{
+    const double earthRadius = 6371000.0;
+    const double degToRad = M_PI / 180.0;
+
+    GPSData projected = data;
+    double distance = data.velocity / 3.6 * seconds; //velocity is km/h
+    double heading = data.heading * degToRad;
+    projected.latitude = data.latitude + (distance * cos(heading) / earthRadius) / degToRad;
+    double latitudeScale = cos(data.latitude * degToRad);
+    if (latitudeScale > 1E-6) //nothing sensible to do at the poles
+    {
+        projected.longitude = data.longitude + (distance * sin(heading) / (earthRadius * latitudeScale)) / degToRad;
+    }
+    return projected;
+}
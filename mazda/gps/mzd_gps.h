@@ -17,7 +17,12 @@ struct GPSData
 
 void mzd_gps2_start();
 
-bool mzd_gps2_get(GPSData& data);
+//Asks LDS for the position without waiting for it. Does nothing while the last request is still out
+void mzd_gps2_request();
+//The fix from the last request that got one, once. readUs is when the reply came in
+bool mzd_gps2_get(GPSData& data, uint64_t& readUs);
+//Where the car would be after seconds going straight on at the heading and velocity in data
+GPSData mzd_gps2_project(const GPSData& data, double seconds);
 void mzd_gps2_set_enabled(bool bEnabled);
 
 void mzd_gps2_stop();
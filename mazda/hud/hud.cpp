@@ -1,164 +1,232 @@
-#include "hud.h"
-
-#include <dbus/dbus.h>
-#include <dbus-c++/dbus.h>
-#include <stdint.h>
-#include <string>
-#include <functional>
-#include <condition_variable>
-#include <signal.h>
-#include <thread>
-
-#include "../dbus/generated_cmu.h"
-
-#define LOGTAG "mazda-hud"
-
-#include "hu_uti.h"
-
-#define SERVICE_BUS_ADDRESS "unix:path=/tmp/dbus_service_socket"
-#define HMI_BUS_ADDRESS "unix:path=/tmp/dbus_hmi_socket"
-
-std::mutex hudmutex;
-
-static HUDSettingsClient *hud_client = NULL;
-static NaviClient *vbsnavi_client = NULL;
-static TMCClient *tmc_client = NULL;
-
-NaviData *navi_data = NULL;
-
-uint8_t turns[][3] = {
-  {0,0,0}, //TURN_UNKNOWN
-  {NaviTurns::FLAG_LEFT,NaviTurns::FLAG_RIGHT,NaviTurns::FLAG}, //TURN_DEPART
-  {NaviTurns::STRAIGHT,NaviTurns::STRAIGHT,NaviTurns::STRAIGHT}, //TURN_NAME_CHANGE
-  {NaviTurns::SLIGHT_LEFT,NaviTurns::SLIGHT_RIGHT,NaviTurns::STRAIGHT}, //TURN_SLIGHT_TURN
-  {NaviTurns::LEFT,NaviTurns::RIGHT,0}, //TURN_TURN
-  {NaviTurns::SHARP_LEFT,NaviTurns::SHARP_RIGHT,0}, //TURN_SHARP_TURN
-  {NaviTurns::U_TURN_LEFT, NaviTurns::U_TURN_RIGHT,0}, //TURN_U_TURN
-  {NaviTurns::LEFT,NaviTurns::RIGHT,NaviTurns::STRAIGHT}, //TURN_ON_RAMP
-  {NaviTurns::OFF_RAMP_LEFT,NaviTurns::OFF_RAMP_RIGHT,NaviTurns::STRAIGHT}, //TURN_OFF_RAMP
-  {NaviTurns::FORK_LEFT, NaviTurns::FORK_RIGHT, 0}, //TURN_FORK
-  {NaviTurns::MERGE_LEFT, NaviTurns::MERGE_RIGHT, 0}, //TURN_MERGE
-  {0,0,0},  //TURN_ROUNDABOUT_ENTER
-  {0,0,0}, // TURN_ROUNDABOUT_EXIT
-  {0,0,0}, //TURN_ROUNDABOUT_ENTER_AND_EXIT (Will have to handle seperatly)
-  {NaviTurns::STRAIGHT,NaviTurns::STRAIGHT,NaviTurns::STRAIGHT}, //TURN_STRAIGHT
-  {0,0,0}, //unused?
-  {0,0,0}, //TURN_FERRY_BOAT
-  {0,0,0}, //TURN_FERRY_TRAIN
-  {0,0,0}, //unused??
-  {NaviTurns::DESTINATION_LEFT, NaviTurns::DESTINATION_RIGHT, NaviTurns::DESTINATION} //TURN_DESTINATION
-};
-
-uint8_t roundabout(int32_t degrees, int32_t side){
-  uint8_t nearest = (degrees + 15) / 30;
-  uint8_t offset = side == 0 ? 49 : 37;
-  return(nearest + offset);
-}
-
-void hud_thread_func(std::condition_variable& quitcv, std::mutex& quitmutex, std::mutex& hudmutex){
-  std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-  //Don't bother with the HUD if we aren't connected via dbus
-  while (hud_installed())
-  {
-    // if (hud_client == NULL) {
-    //   return;
-    // }
-    hudmutex.lock();
-
-    uint32_t diricon;
-    if (navi_data->turn_event == 13) {
-      diricon = roundabout(navi_data->turn_angle, navi_data->turn_side - 1);
-    } else {
-      int32_t turn_side = navi_data->turn_side - 1; //Google starts at 1 for some reason...
-      diricon = turns[navi_data->turn_event][turn_side];
-    }
-
-    ::DBus::Struct< uint32_t, uint16_t, uint8_t, uint16_t, uint8_t, uint8_t > hudDisplayMsg;
-    hudDisplayMsg._1 = diricon;
-    hudDisplayMsg._2 = navi_data->distance;// distance;
-    hudDisplayMsg._3 = navi_data->distance_unit;
-    hudDisplayMsg._4 = 0; //Speed limit (Not Used)
-    hudDisplayMsg._5 = 0; //Speed limit units (Not used)
-    hudDisplayMsg._6 = navi_data->previous_msg;
-
-    ::DBus::Struct< std::string, uint8_t > guidancePointData;
-    guidancePointData._1 = navi_data->event_name;
-    guidancePointData._2 = navi_data->previous_msg;
-
-    if(navi_data->changed){
-      try
-      {
-        vbsnavi_client->SetHUDDisplayMsgReq(hudDisplayMsg);
-        tmc_client->SetHUD_Display_Msg2(guidancePointData);
-      }
-      catch(DBus::Error& error)
-      {
-        loge("DBUS: hud_send failed %s: %s\n", error.name(), error.message());
-        return;
-      }
-	  navi_data->changed = 0;
-    }
-    hudmutex.unlock();
-    {
-        std::unique_lock<std::mutex> lk(quitmutex);
-        if (quitcv.wait_for(lk, std::chrono::milliseconds(1000)) == std::cv_status::no_timeout)
-        {
-            break;
-        }
-    }
-  }
-}
-
-void hud_start()
-{
-  if (hud_client != NULL)
-    return;
-    
-  try
-  {
-    DBus::Connection service_bus(SERVICE_BUS_ADDRESS, false);
-    service_bus.register_bus();
-    DBus::Connection hmiBus(HMI_BUS_ADDRESS, false);
-    hmiBus.register_bus();
-    hud_client = new HUDSettingsClient(hmiBus, "/com/jci/navi2IHU", "com.jci.navi2IHU");
-    vbsnavi_client = new NaviClient(service_bus, "/com/jci/vbs/navi", "com.jci.vbs.navi");
-    tmc_client = new TMCClient(service_bus, "/com/jci/vbs/navi", "com.jci.vbs.navi");
-  }
-  catch(DBus::Error& error)
-  {
-    loge("DBUS: Failed to connect to SERVICE bus %s: %s\n", error.name(), error.message());
-    hud_stop();
-    return;
-  }
-  //logv("HUD dbus connections established\n");
-  navi_data = new NaviData();
-  return;
-}
-
-void hud_stop()
-{
-  delete hud_client;
-  hud_client = nullptr;
-
-  delete vbsnavi_client;
-  vbsnavi_client = nullptr;
-
-  delete tmc_client;
-  tmc_client = nullptr;
-}
-
-bool hud_installed()
-{
-  if (hud_client == NULL)
-      return(false);
-
-  try
-  {
-      return(hud_client->GetHUDIsInstalled());
-  }
-  catch(DBus::Error& error)
-  {
-      loge("DBUS: GetHUDIsInstalled failed %s: %s\n", error.name(), error.message());
-      return(false);
-  }
-}
+#include "hud.h"
+
+#include <dbus/dbus.h>
+#include <dbus-c++/dbus.h>
+#include <stdint.h>
+#include <string>
+#include <functional>
+#include <condition_variable>
+#include <signal.h>
+#include <thread>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "../dbus/generated_cmu.h"
+#include "../dbus/mzd_dbus.h"
+
+#define LOGTAG "mazda-hud"
+
+#include "hu_uti.h"
+#include "hu_metrics.h"
+
+static HUDSettingsClient *hud_client = NULL;
+static NaviClient *vbsnavi_client = NULL;
+static TMCClient *tmc_client = NULL;
+
+static NaviDataSlot hud_slot;
+static std::thread hud_worker;
+static std::atomic<int> hud_wake_fd(-1); // eventfd, so several wakeups before the worker runs read back as one
+static std::atomic<bool> hud_quit(false);
+
+static std::atomic<uint64_t> hud_published(0);
+static std::atomic<uint64_t> hud_sent(0);
+static std::atomic<uint64_t> hud_errors(0);
+static std::atomic<uint64_t> hud_latency_max_us(0);
+static hu_metric_histogram hud_latency_us; // hud_publish to both D-Bus calls done
+
+uint8_t turns[][3] = {
+  {0,0,0}, //TURN_UNKNOWN
+  {NaviTurns::FLAG_LEFT,NaviTurns::FLAG_RIGHT,NaviTurns::FLAG}, //TURN_DEPART
+  {NaviTurns::STRAIGHT,NaviTurns::STRAIGHT,NaviTurns::STRAIGHT}, //TURN_NAME_CHANGE
+  {NaviTurns::SLIGHT_LEFT,NaviTurns::SLIGHT_RIGHT,NaviTurns::STRAIGHT}, //TURN_SLIGHT_TURN
+  {NaviTurns::LEFT,NaviTurns::RIGHT,0}, //TURN_TURN
+  {NaviTurns::SHARP_LEFT,NaviTurns::SHARP_RIGHT,0}, //TURN_SHARP_TURN
+  {NaviTurns::U_TURN_LEFT, NaviTurns::U_TURN_RIGHT,0}, //TURN_U_TURN
+  {NaviTurns::LEFT,NaviTurns::RIGHT,NaviTurns::STRAIGHT}, //TURN_ON_RAMP
+  {NaviTurns::OFF_RAMP_LEFT,NaviTurns::OFF_RAMP_RIGHT,NaviTurns::STRAIGHT}, //TURN_OFF_RAMP
+  {NaviTurns::FORK_LEFT, NaviTurns::FORK_RIGHT, 0}, //TURN_FORK
+  {NaviTurns::MERGE_LEFT, NaviTurns::MERGE_RIGHT, 0}, //TURN_MERGE
+  {0,0,0},  //TURN_ROUNDABOUT_ENTER
+  {0,0,0}, // TURN_ROUNDABOUT_EXIT
+  {0,0,0}, //TURN_ROUNDABOUT_ENTER_AND_EXIT (Will have to handle seperatly)
+  {NaviTurns::STRAIGHT,NaviTurns::STRAIGHT,NaviTurns::STRAIGHT}, //TURN_STRAIGHT
+  {0,0,0}, //unused?
+  {0,0,0}, //TURN_FERRY_BOAT
+  {0,0,0}, //TURN_FERRY_TRAIN
+  {0,0,0}, //unused??
+  {NaviTurns::DESTINATION_LEFT, NaviTurns::DESTINATION_RIGHT, NaviTurns::DESTINATION} //TURN_DESTINATION
+};
+
+uint8_t roundabout(int32_t degrees, int32_t side){
+  uint8_t nearest = (degrees + 15) / 30;
+  uint8_t offset = side == 0 ? 49 : 37;
+  return(nearest + offset);
+}
+
+static bool hud_send(const NaviData& data){
+  uint32_t diricon;
+  if (data.turn_event == 13) {
+    diricon = roundabout(data.turn_angle, data.turn_side - 1);
+  } else {
+    int32_t turn_side = data.turn_side - 1; //Google starts at 1 for some reason...
+    diricon = turns[data.turn_event][turn_side];
+  }
+
+  ::DBus::Struct< uint32_t, uint16_t, uint8_t, uint16_t, uint8_t, uint8_t > hudDisplayMsg;
+  hudDisplayMsg._1 = diricon;
+  hudDisplayMsg._2 = data.distance;// distance;
+  hudDisplayMsg._3 = data.distance_unit;
+  hudDisplayMsg._4 = 0; //Speed limit (Not Used)
+  hudDisplayMsg._5 = 0; //Speed limit units (Not used)
+  hudDisplayMsg._6 = data.previous_msg;
+
+  ::DBus::Struct< std::string, uint8_t > guidancePointData;
+  guidancePointData._1 = data.event_name;
+  guidancePointData._2 = data.previous_msg;
+
+  try
+  {
+    //Already off the HU thread and only ever the newest turn, so these stay blocking but get timed with the rest
+    mzd_dbus_timed("vbs.navi.SetHUDDisplayMsgReq", *vbsnavi_client, [&]() { vbsnavi_client->SetHUDDisplayMsgReq(hudDisplayMsg); });
+    mzd_dbus_timed("vbs.navi.tmc.SetHUD_Display_Msg2", *tmc_client, [&]() { tmc_client->SetHUD_Display_Msg2(guidancePointData); });
+  }
+  catch(DBus::Error& error)
+  {
+    loge("DBUS: hud_send failed %s: %s\n", error.name(), error.message());
+    return(false);
+  }
+  return(true);
+}
+
+//Sleeps until something is published, then sends only the newest. Runs for as long as the HUD connection exists,
+//so a D-Bus call that takes a while delays the HUD but never the nav callbacks
+static void hud_worker_main(){
+  pthread_setname_np(pthread_self(), "hud_worker");
+  int fd = hud_wake_fd;
+  while (true) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      loge("hud_worker poll failed %d", errno);
+      return;
+    }
+    uint64_t wakeups;
+    if (read(fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+      loge("hud_worker read failed %d", errno);
+      return;
+    }
+    if (hud_quit)
+      return;
+
+    const NaviData* data = hud_slot.Take();
+    if (data == nullptr)
+      continue;
+    if (!hud_send(*data)) {
+      hud_errors++;
+      continue;
+    }
+    uint64_t latency = hu_get_time_us() - data->published_us;
+    hud_latency_us.observe(latency);
+    if (latency > hud_latency_max_us)
+      hud_latency_max_us = latency; //worker is the only writer
+    hud_sent++;
+  }
+}
+
+void hud_publish(const NaviData& data){
+  int fd = hud_wake_fd;
+  if (fd < 0)
+    return;
+  NaviData& back = hud_slot.Back();
+  back = data;
+  back.published_us = hu_get_time_us();
+  hud_slot.Publish();
+  hud_published++;
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0)
+    loge("hud_publish wake failed %d", errno);
+}
+
+void hud_log_stats(){
+  uint64_t count = hud_latency_us.count;
+  printf("HUD: %llu turn updates, %llu sent, %llu errors, callback to HUD mean %.1f ms max %.1f ms\n",
+         (unsigned long long) hud_published, (unsigned long long) hud_sent, (unsigned long long) hud_errors,
+         count ? hud_latency_us.sum_us / 1000.0 / count : 0.0, hud_latency_max_us / 1000.0);
+}
+
+void hud_start()
+{
+  if (hud_client != NULL)
+    return;
+    
+  try
+  {
+    mzd_dbus_run([](){
+      hud_client = new HUDSettingsClient(mzd_dbus_hmi_bus(), "/com/jci/navi2IHU", "com.jci.navi2IHU");
+      vbsnavi_client = new NaviClient(mzd_dbus_service_bus(), "/com/jci/vbs/navi", "com.jci.vbs.navi");
+      tmc_client = new TMCClient(mzd_dbus_service_bus(), "/com/jci/vbs/navi", "com.jci.vbs.navi");
+    });
+  }
+  catch(DBus::Error& error)
+  {
+    loge("DBUS: Failed to connect to SERVICE bus %s: %s\n", error.name(), error.message());
+    hud_stop();
+    return;
+  }
+  //logv("HUD dbus connections established\n");
+  //Don't bother with the HUD worker if there's no HUD, asked once since it can't be fitted while we run
+  if (!hud_installed())
+    return;
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0) {
+    loge("HUD eventfd failed %d", errno);
+    return;
+  }
+  hud_quit = false;
+  hud_wake_fd = fd;
+  hud_worker = std::thread(hud_worker_main);
+  return;
+}
+
+void hud_stop()
+{
+  int fd = hud_wake_fd.exchange(-1);
+  if (hud_worker.joinable()) {
+    hud_quit = true;
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0)
+      loge("hud_stop wake failed %d", errno);
+    hud_worker.join();
+  }
+  if (fd >= 0)
+    close(fd);
+
+  mzd_dbus_run([](){
+    delete hud_client;
+    hud_client = nullptr;
+
+    delete vbsnavi_client;
+    vbsnavi_client = nullptr;
+
+    delete tmc_client;
+    tmc_client = nullptr;
+  });
+}
+
+bool hud_installed()
+{
+  if (hud_client == NULL)
+      return(false);
+
+  try
+  {
+      bool installed = false;
+      mzd_dbus_timed("navi2IHU.HUDSettings.GetHUDIsInstalled", *hud_client, [&]() { installed = hud_client->GetHUDIsInstalled(); });
+      return(installed);
+  }
+  catch(DBus::Error& error)
+  {
+      loge("DBUS: GetHUDIsInstalled failed %s: %s\n", error.name(), error.message());
+      return(false);
+  }
+}
@@ -5,6 +5,7 @@
 #include <string>
 #include <functional>
 #include <condition_variable>
+#include <atomic>
 #include <dbus/dbus.h>
 #include <dbus-c++/dbus.h>
 
@@ -28,7 +29,28 @@ struct NaviData {
   HudDistanceUnit distance_unit; 
   int32_t time_until;
   uint8_t previous_msg;
-  uint8_t changed;
+  uint64_t published_us; // when hud_publish was called, for the latency
+};
+
+// Latest turn for the HUD. The nav callbacks publish from the HU thread and the HUD worker takes the newest,
+// skipping any it never got to. Three buffers rotated through one atomic index, so neither side ever waits.
+class NaviDataSlot {
+  static const uint8_t FRESH = 0x80;
+  NaviData buffers[3];
+  std::atomic<uint8_t> middle;
+  uint8_t back = 1;  // writer only
+  uint8_t front = 2; // reader only
+public:
+  NaviDataSlot() : middle(0) {}
+  NaviData& Back() { return buffers[back]; }
+  void Publish() { back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH; }
+  // nullptr if nothing new since the last call
+  const NaviData* Take() {
+    if (!(middle.load(std::memory_order_acquire) & FRESH))
+      return nullptr;
+    front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+    return &buffers[front];
+  }
 };
 
 enum NaviTurns: uint32_t {
@@ -58,7 +80,8 @@ enum NaviTurns: uint32_t {
 void hud_start();
 void hud_stop();
 bool hud_installed();
-void hud_thread_func(std::condition_variable& quitcv, std::mutex& quitmutex, std::mutex& hudmutex);
+void hud_publish(const NaviData& data); // HU thread only, never blocks. Does nothing without a HUD
+void hud_log_stats();
 
 class HUDSettingsClient : public com::jci::navi2IHU::HUDSettings_proxy,
                      public DBus::ObjectProxy
@@ -0,0 +1,148 @@
+#include "mzd_touch.h"
+
+#include "hu_metrics.h"
+
+void TouchCoalescer::Send(HU::TouchInfo::TOUCH_ACTION action, int changed, uint64_t timestamp, uint64_t read_us, uint64_t now_us)
+{
+    TouchMessage message;
+    message.action = action;
+    message.action_index = 0;
+    message.count = 0;
+    message.timestamp = timestamp;
+    message.read_us = read_us;
+    for (int idx = 0; idx < TOUCH_SLOTS; idx++)
+    {
+        if (!sent[idx].down)
+            continue;
+        if (idx == changed)
+            message.action_index = message.count;
+        sent[idx].x = current[idx].x;
+        sent[idx].y = current[idx].y;
+        message.pointers[message.count++] = {current[idx].x, current[idx].y, (uint32_t) idx};
+    }
+    last_sent_us = now_us;
+    stats.messages++;
+    hu_metrics_add(hu_metrics.touch_messages);
+    send(message);
+}
+
+void TouchCoalescer::Report(uint64_t timestamp, uint64_t now_us)
+{
+    stats.reports++;
+    hu_metrics_add(hu_metrics.touch_reports);
+
+    bool moved = false, lifted = false, landed = false;
+    int down = 0;
+    for (int idx = 0; idx < TOUCH_SLOTS; idx++)
+    {
+        if (sent[idx].down && current[idx].down)
+            moved |= sent[idx].x != current[idx].x || sent[idx].y != current[idx].y;
+        lifted |= sent[idx].down && !current[idx].down;
+        landed |= !sent[idx].down && current[idx].down;
+        if (sent[idx].down)
+            down++;
+    }
+
+    if (lifted || landed)
+    {
+        //Where the fingers got to goes first, then every finger change on its own
+        if (moved || drag_pending)
+        {
+            bool held = drag_pending && !moved;
+            Send(HU::TouchInfo::TOUCH_ACTION_DRAG, -1, held ? drag_timestamp : timestamp, held ? drag_read_us : now_us, now_us);
+        }
+        drag_pending = false;
+        for (int idx = 0; idx < TOUCH_SLOTS; idx++)
+        {
+            if (sent[idx].down && !current[idx].down)
+            {
+                Send(down == 1 ? HU::TouchInfo::TOUCH_ACTION_RELEASE : HU::TouchInfo::TOUCH_ACTION_POINTER_UP, idx, timestamp, now_us, now_us);
+                sent[idx].down = false;
+                down--;
+            }
+        }
+        for (int idx = 0; idx < TOUCH_SLOTS; idx++)
+        {
+            if (!sent[idx].down && current[idx].down)
+            {
+                sent[idx].down = true;
+                down++;
+                Send(down == 1 ? HU::TouchInfo::TOUCH_ACTION_PRESS : HU::TouchInfo::TOUCH_ACTION_POINTER_DOWN, idx, timestamp, now_us, now_us);
+            }
+        }
+        return;
+    }
+
+    if (moved)
+    {
+        if (drag_pending)
+            stats.merged++;
+        drag_pending = true;
+        drag_timestamp = timestamp;
+        drag_read_us = now_us;
+        Poll(now_us);
+    }
+}
+
+void TouchCoalescer::Event(const input_event& event, uint64_t now_us)
+{
+    switch (event.type)
+    {
+        case EV_ABS:
+            if (event.code == ABS_MT_SLOT)
+            {
+                slot = event.value >= 0 && event.value < TOUCH_SLOTS ? event.value : -1;
+                break;
+            }
+            if (slot < 0)                                               //More fingers than we track
+                break;
+            switch (event.code)
+            {
+                case ABS_MT_TRACKING_ID:
+                    tracking_ids = true;
+                    current[slot].down = event.value >= 0;
+                    break;
+                case ABS_MT_POSITION_X:
+                    current[slot].x = event.value;
+                    break;
+                case ABS_MT_POSITION_Y:
+                    current[slot].y = event.value;
+                    break;
+            }
+            break;
+        case EV_KEY:
+            if (event.code != BTN_TOUCH)
+                break;
+            if (!tracking_ids)
+            {
+                current[0].down = event.value != 0;
+            }
+            else if (event.value == 0)
+            {
+                for (Slot& s : current)
+                    s.down = false;
+            }
+            break;
+        case EV_SYN:
+            if (event.code == SYN_REPORT)
+                Report(event.time.tv_sec * 1000000ULL + event.time.tv_usec, now_us);
+            break;
+    }
+}
+
+void TouchCoalescer::Poll(uint64_t now_us)
+{
+    if (drag_pending && now_us - last_sent_us >= TOUCH_DRAG_INTERVAL_US)
+    {
+        drag_pending = false;
+        Send(HU::TouchInfo::TOUCH_ACTION_DRAG, -1, drag_timestamp, drag_read_us, now_us);
+    }
+}
+
+int TouchCoalescer::WaitMs(uint64_t now_us) const
+{
+    if (!drag_pending)
+        return -1;
+    uint64_t due_us = last_sent_us + TOUCH_DRAG_INTERVAL_US;
+    return now_us >= due_us ? 0 : (int) ((due_us - now_us + 999) / 1000);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+#include <linux/input.h>
+
+#include "hu.pb.h"
+
+#define TOUCH_SLOTS             10
+#define TOUCH_DRAG_INTERVAL_US  (1000000 / 60)                          // One video frame, moves in between are merged
+
+// Turns evdev touch reports into touch InputEvents. Every change of finger count is sent on its own, in order:
+// PRESS for the first finger, POINTER_DOWN / POINTER_UP for the others and RELEASE for the last one. Moves are
+// only sent once per frame interval, each carrying the latest position of every finger, so a fast drag costs
+// one message per video frame instead of one per report.
+//
+// Understands multitouch protocol B (ABS_MT_SLOT / ABS_MT_TRACKING_ID). Screens that only give BTN_TOUCH and
+// the slot 0 position work as a single finger, the way they always did.
+
+struct TouchPointer
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t id;
+};
+
+struct TouchMessage
+{
+    HU::TouchInfo::TOUCH_ACTION action;
+    uint32_t action_index;                                              // Into pointers, the finger that went down or up
+    int count;
+    TouchPointer pointers[TOUCH_SLOTS];
+    uint64_t timestamp;                                                 // Of the report it came from, in us
+    uint64_t read_us;                                                   // When that report was read, monotonic
+};
+
+struct TouchStats
+{
+    uint64_t reports = 0;                                               // SYN_REPORTs read
+    uint64_t messages = 0;                                              // InputEvents sent for them
+    uint64_t merged = 0;                                                // Reports whose moves went out with a later one
+};
+
+class TouchCoalescer
+{
+    struct Slot
+    {
+        uint32_t x = 0;
+        uint32_t y = 0;
+        bool down = false;
+    };
+
+    std::function<void(const TouchMessage&)> send;
+    Slot current[TOUCH_SLOTS];                                          // As of the reports read so far
+    Slot sent[TOUCH_SLOTS];                                             // As the phone last saw it
+    int slot = 0;
+    bool tracking_ids = false;                                          // The screen speaks protocol B
+    bool drag_pending = false;
+    uint64_t drag_timestamp = 0;
+    uint64_t drag_read_us = 0;
+    uint64_t last_sent_us = 0;
+    TouchStats stats;
+
+    void Send(HU::TouchInfo::TOUCH_ACTION action, int changed, uint64_t timestamp, uint64_t read_us, uint64_t now_us);
+    void Report(uint64_t timestamp, uint64_t now_us);
+public:
+    TouchCoalescer(std::function<void(const TouchMessage&)> send) : send(std::move(send)) {}
+
+    // Positions already scaled to the video. now_us is a monotonic clock, event times can jump
+    void Event(const input_event& event, uint64_t now_us);
+    // Sends a merged move once it is due
+    void Poll(uint64_t now_us);
+    // How long the reader may block before Poll has something to send, -1 for as long as it likes
+    int WaitMs(uint64_t now_us) const;
+    const TouchStats& GetStats() const { return stats; }
+};
@@ -17,16 +17,20 @@
 #include <algorithm>
 
 #include <dbus-c++/dbus.h>
-#include <dbus-c++/glib-integration.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 
 #include "hu_uti.h"
 #include "hu_aap.h"
+#include "hu_capture.h"
+#include "hu_headless.h"
+#include "hu_soak.h"
 
 #include "nm/mzd_nightmode.h"
 #include "gps/mzd_gps.h"
 #include "hud/hud.h"
+#include "sensors/mzd_sensor_hub.h"
+#include "dbus/mzd_dbus.h"
 
 #include "audio.h"
 #include "main.h"
@@ -35,140 +39,153 @@
 #include "glib_utils.h"
 #include "config.h"
 
-#define HMI_BUS_ADDRESS "unix:path=/tmp/dbus_hmi_socket"
-#define SERVICE_BUS_ADDRESS "unix:path=/tmp/dbus_service_socket"
 // Check the content folder. sd_nav still exists without the card installed
 #define SD_CARD_PATH "/tmp/mnt/sd_nav/content"
+//The timestamps on the GPS events are in seconds, but based on logging the data actually changes faster with the same timestamp
+#define GPS_READ_INTERVAL_MS 500
+#define GPS_DEAD_RECKON_MIN_KMH 2
+#define GPS_DEAD_RECKON_MAX_MS 2000
 
 __asm__(".symver realpath1,realpath1@GLIBC_2.11.1");
 
 gst_app_t gst_app;
 IHUAnyThreadInterface* g_hu = nullptr;
 
-static void nightmode_thread_func(std::condition_variable& quitcv, std::mutex& quitmutex)
+class NightModeSensor : public SensorSource
 {
     int nightmode = NM_NO_VALUE;
-    mzd_nightmode_start();
-    //Offset so the GPS and NM thread are not perfectly in sync testing each second
-    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+public:
+    virtual const char* Name() const override { return "night mode"; }
 
-    while (true)
+    virtual bool Start() override
     {
-        int nightmodenow = mzd_is_night_mode_set();
-
-        // We send nightmode status periodically, otherwise Google Maps
-        // doesn't switch to nightmode if it's started late. Even if the
-        // other AA UI is already in nightmode.
-        if (nightmodenow != NM_NO_VALUE) {
-            nightmode = nightmodenow;
-
-            g_hu->hu_queue_command([nightmodenow](IHUConnectionThreadInterface& s)
-            {
-                HU::SensorEvent sensorEvent;
-                sensorEvent.add_night_mode()->set_is_night(nightmodenow);
+        mzd_nightmode_start();
+        return true;
+    }
 
-                s.hu_aap_enc_send_message(0, AA_CH_SEN, HU_SENSOR_CHANNEL_MESSAGE::SensorEvent, sensorEvent);
-            });
-        }
+    virtual void Stop() override
+    {
+        mzd_nightmode_stop();
+    }
 
+    virtual bool Poll(HU::SensorEvent& event, bool refresh) override
+    {
+        int nightmodenow = mzd_is_night_mode_set();
+        if (nightmodenow == NM_NO_VALUE || (nightmodenow == nightmode && !refresh))
         {
-            std::unique_lock<std::mutex> lk(quitmutex);
-            if (quitcv.wait_for(lk, std::chrono::milliseconds(1000)) == std::cv_status::no_timeout)
-            {
-                break;
-            }
+            return false;
         }
+        nightmode = nightmodenow;
+        event.add_night_mode()->set_is_night(nightmodenow);
+        return true;
     }
+};
 
-    mzd_nightmode_stop();
-}
-
-static void gps_thread_func(std::condition_variable& quitcv, std::mutex& quitmutex)
+class GPSSensor : public SensorSource
 {
-    GPSData data, newData;
-    uint64_t oldTs = 0;
+    GPSData data;                                                       //Last fix, heading already corrected
+    uint64_t fixUs = 0;                                                 //When it was read
+    uint64_t nextReadUs = 0;
+    bool reverseHeading = false;
     int debugLogCount = 0;
-    mzd_gps2_start();
 
-    //Not sure if this is actually required but the built-in Nav code on CMU does it
-    mzd_gps2_set_enabled(true);
+    static void AddLocation(HU::SensorEvent& event, const GPSData& data)
+    {
+        timeval tv;
+        gettimeofday(&tv, nullptr);
+        uint64_t timestamp = tv.tv_sec * 1000000 + tv.tv_usec;
+
+        HU::SensorEvent::LocationData* location = event.add_location_data();
+        //AA uses uS and the gps data just has seconds, just use the current time to get more precision so AA can
+        //interpolate better
+        location->set_timestamp(timestamp);
+        location->set_latitude(static_cast<int32_t>(data.latitude * 1E7));
+        location->set_longitude(static_cast<int32_t>(data.longitude * 1E7));
+        location->set_bearing(static_cast<int32_t>(data.heading * 1E6));
+        //assuming these are the same units as the Android Location API (the rest are)
+        double velocityMetersPerSecond = data.velocity * 0.277778; //convert km/h to m/s
+        location->set_speed(static_cast<int32_t>(velocityMetersPerSecond * 1E3));
+
+        location->set_altitude(static_cast<int32_t>(data.altitude * 1E2));
+        location->set_accuracy(static_cast<int32_t>(data.horizontalAccuracy * 1E3));
+    }
+public:
+    virtual const char* Name() const override { return "GPS"; }
 
-    config::readConfig();
-    while (true)
+    virtual bool Start() override
     {
-        if (config::carGPS && mzd_gps2_get(newData) && !data.IsSame(newData))
-        {
-            data = newData;
-            timeval tv;
-            gettimeofday(&tv, nullptr);
-            uint64_t timestamp = tv.tv_sec * 1000000 + tv.tv_usec;
-            if (debugLogCount < 50) //only print the first 50 to avoid spamming the log and breaking the opera text box
-            {
-                logd("GPS data: %d %d %f %f %d %f %f %f %f   \n",data.positionAccuracy, data.uTCtime, data.latitude, data.longitude, data.altitude, data.heading, data.velocity, data.horizontalAccuracy, data.verticalAccuracy);
-                logd("Delta %f\n", (timestamp - oldTs)/1000000.0);
-                debugLogCount++;
-            }
-            oldTs = timestamp;
+        //Picks up carGPS and reverseGPS changes from the last session
+        config::readConfig();
 
-            g_hu->hu_queue_command([data, timestamp](IHUConnectionThreadInterface& s)
-            {
-                HU::SensorEvent sensorEvent;
-                HU::SensorEvent::LocationData* location = sensorEvent.add_location_data();
-                //AA uses uS and the gps data just has seconds, just use the current time to get more precision so AA can
-                //interpolate better
-                location->set_timestamp(timestamp);
-                location->set_latitude(static_cast<int32_t>(data.latitude * 1E7));
-                location->set_longitude(static_cast<int32_t>(data.longitude * 1E7));
-
-                // If the sd card exists then reverse heading. This should only be used on installs that have the
-                // reversed heading issue.
-                double newHeading = data.heading;
-
-                if (config::reverseGPS)
-                {
-                    const char* sdCardFolder;
-                    sdCardFolder = SD_CARD_PATH;
-                    struct stat sb;
-
-                    if (stat(sdCardFolder, &sb) == 0 && S_ISDIR(sb.st_mode))
-                    {
-                        newHeading = data.heading + 180;
-                        if (newHeading >= 360)
-                        {
-                            newHeading = newHeading - 360;
-                        }
-                    }
-                }
+        // If the sd card exists then reverse heading. This should only be used on installs that have the
+        // reversed heading issue. The card doesn't come and go during a session, so check once
+        struct stat sb;
+        reverseHeading = config::reverseGPS && stat(SD_CARD_PATH, &sb) == 0 && S_ISDIR(sb.st_mode);
 
-                location->set_bearing(static_cast<int32_t>(newHeading * 1E6));
-                //assuming these are the same units as the Android Location API (the rest are)
-                double velocityMetersPerSecond = data.velocity * 0.277778; //convert km/h to m/s
-                location->set_speed(static_cast<int32_t>(velocityMetersPerSecond * 1E3));
+        mzd_gps2_start();
+        //Not sure if this is actually required but the built-in Nav code on CMU does it
+        mzd_gps2_set_enabled(true);
+        return true;
+    }
 
-                location->set_altitude(static_cast<int32_t>(data.altitude * 1E2));
-                location->set_accuracy(static_cast<int32_t>(data.horizontalAccuracy * 1E3));
+    virtual void Stop() override
+    {
+        mzd_gps2_set_enabled(false);
+        mzd_gps2_stop();
+    }
 
-                s.hu_aap_enc_send_message(0, AA_CH_SEN, HU_SENSOR_CHANNEL_MESSAGE::SensorEvent, sensorEvent);
-            });
+    virtual bool Poll(HU::SensorEvent& event, bool refresh) override
+    {
+        if (!config::carGPS)
+        {
+            return false;
         }
 
+        //LDS has no signal for new positions, only GetPosition. Ask at GPS_READ_INTERVAL_MS and dead reckon in between.
+        //The reply comes in on the D-Bus thread and gets picked up by the next poll
+        uint64_t now = hu_get_time_us();
+        if (now >= nextReadUs)
+        {
+            nextReadUs = now + GPS_READ_INTERVAL_MS * 1000;
+            mzd_gps2_request();
+        }
+        GPSData newData;
+        uint64_t readUs;
+        if (mzd_gps2_get(newData, readUs))
         {
-            std::unique_lock<std::mutex> lk(quitmutex);
-            //The timestamps on the GPS events are in seconds, but based on logging the data actually changes faster with the same timestamp
-            if (quitcv.wait_for(lk, std::chrono::milliseconds(250)) == std::cv_status::no_timeout)
+            if (reverseHeading)
+            {
+                newData.heading = newData.heading + 180;
+                if (newData.heading >= 360)
+                {
+                    newData.heading = newData.heading - 360;
+                }
+            }
+            if (!data.IsSame(newData))
             {
-                break;
+                if (debugLogCount < 50) //only print the first 50 to avoid spamming the log and breaking the opera text box
+                {
+                    logd("GPS data: %d %d %f %f %d %f %f %f %f   \n",newData.positionAccuracy, newData.uTCtime, newData.latitude, newData.longitude, newData.altitude, newData.heading, newData.velocity, newData.horizontalAccuracy, newData.verticalAccuracy);
+                    logd("Delta %f\n", fixUs ? (readUs - fixUs)/1000000.0 : 0.0);
+                    debugLogCount++;
+                }
+                data = newData;
+                fixUs = readUs;
+                AddLocation(event, data);
+                return true;
             }
         }
-    }
-
-    mzd_gps2_set_enabled(false);
-
-    mzd_gps2_stop();
-}
-
-
 
+        //Between fixes, project the last one forward so Maps moves smoothly. Not when stopped (the heading is noise) or
+        //when the fixes stopped coming
+        if (config::gpsUpsampleMs <= 0 || fixUs == 0 || data.velocity < GPS_DEAD_RECKON_MIN_KMH || now - fixUs > GPS_DEAD_RECKON_MAX_MS * 1000)
+        {
+            return false;
+        }
+        AddLocation(event, mzd_gps2_project(data, (now - fixUs) / 1000000.0));
+        return true;
+    }
+};
 
 int main (int argc, char *argv[])
 {
@@ -181,6 +198,45 @@ int main (int argc, char *argv[])
     hu_log_library_versions();
     hu_install_crash_handler();
 
+    if (argc >= 2 && strcmp(argv[1], "bench-crypto") == 0)
+    {
+        //headunit bench-crypto [cipher list] [MB], defaults to the configured list
+        config::readConfig();
+        std::string cipherList = argc >= 3 ? argv[2] : config::sslCipherList;
+        int megabytes = argc >= 4 ? atoi(argv[3]) : 16;
+        return hu_ssl_bench_suites(cipherList, megabytes) < 0 ? 1 : 0;
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "capture-export") == 0)
+    {
+        //headunit capture-export <capture file> <pcapng file>
+        return hu_capture_export_pcapng(argv[2], argv[3]) < 0 ? 1 : 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "headless") == 0)
+    {
+        //headunit headless [usb|wifi|loopback|replay] [minutes] [phone address or capture file], no video, audio or input
+        config::readConfig();
+        HU_TRANSPORT_TYPE transport = config::transport_type;
+        if (argc >= 3 && !hu_headless_transport(argv[2], transport))
+        {
+            printf("Unknown transport %s, use usb, wifi, loopback or replay\n", argv[2]);
+            return 1;
+        }
+        int seconds = argc >= 4 ? (int) (atof(argv[3]) * 60) : 0;
+        std::string address = argc >= 5 ? argv[4] : config::phoneIpAddress;
+        return hu_headless_run(transport, address, seconds, config::streamVideoChunks);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "soak") == 0)
+    {
+        //headunit soak [sessions] [minutes] [report seconds], loopback sessions with fake phones until the time is up
+        int sessions = argc >= 3 ? atoi(argv[2]) : 4;
+        int seconds = argc >= 4 ? (int) (atof(argv[3]) * 60) : 0;
+        int report_seconds = argc >= 5 ? atoi(argv[4]) : 60;
+        return hu_soak_run(std::max(sessions, 1), seconds, report_seconds);
+    }
+
     DBus::_init_threading();
 
     gst_init(&argc, &argv);
@@ -204,28 +260,23 @@ int main (int argc, char *argv[])
         }
 
         config::readConfig();
+        //One connection per bus for every client and every session, dispatched on its own thread
+        mzd_dbus_start();
+        ena_ssl_aead = config::sslFastPath;
+        hu_ssl_cipher_list = config::sslCipherList;
+        if (config::captureFile.length() > 0)
+        {
+            hu_capture_start(config::captureFile);
+        }
         printf("Looping\n");
         while (true)
         {
             //Make a new one instead of using the default so we can clean it up each run
-            run_on_thread_main_context = g_main_context_new();
-            //Recreate this each time, it makes the error handling logic simpler
-            DBus::Glib::BusDispatcher dispatcher;
-            dispatcher.attach(run_on_thread_main_context);
-            printf("DBus::Glib::BusDispatcher attached\n");
-
-            DBus::default_dispatcher = &dispatcher;
-
-            printf("Making debug connections\n");
-            DBus::Connection hmiBus(HMI_BUS_ADDRESS, false);
-            hmiBus.register_bus();
-
-            DBus::Connection serviceBus(SERVICE_BUS_ADDRESS, false);
-            serviceBus.register_bus();
+            run_on_thread_main_context_set(g_main_context_new());
 
             hud_start();
 
-            MazdaEventCallbacks callbacks(serviceBus, hmiBus);
+            MazdaEventCallbacks callbacks;
             HUServer headunit(callbacks);
             g_hu = &headunit.GetAnyThreadInterface();
             commandCallbacks.eventCallbacks = &callbacks;
@@ -240,13 +291,15 @@ int main (int argc, char *argv[])
             gst_app.loop = g_main_loop_new(run_on_thread_main_context, FALSE);
             callbacks.connected = true;
 
-            std::condition_variable quitcv;
-            std::mutex quitmutex;
-            std::mutex hudmutex;
-
-            std::thread nm_thread([&quitcv, &quitmutex](){ nightmode_thread_func(quitcv, quitmutex); } );
-            std::thread gp_thread([&quitcv, &quitmutex](){ gps_thread_func(quitcv, quitmutex); } );
-            std::thread hud_thread([&quitcv, &quitmutex, &hudmutex](){ hud_thread_func(quitcv, quitmutex, hudmutex); } );
+            //One thread for all the car sensors. The periods line up, so night mode rides along on GPS wakeups
+            SensorHub sensorHub(*g_hu);
+            //Polled at the dead reckoning rate, it only goes to D-Bus every GPS_READ_INTERVAL_MS
+            sensorHub.Add(new GPSSensor(), config::gpsUpsampleMs > 0 ? std::min(config::gpsUpsampleMs, GPS_READ_INTERVAL_MS) : GPS_READ_INTERVAL_MS);
+            // We resend nightmode status periodically, otherwise Google Maps
+            // doesn't switch to nightmode if it's started late. Even if the
+            // other AA UI is already in nightmode.
+            sensorHub.Add(new NightModeSensor(), 1000, 5000);
+            sensorHub.Start();
 
             /* Start gstreamer pipeline and main loop */
 
@@ -262,17 +315,12 @@ int main (int argc, char *argv[])
             callbacks.inCall = false;
 
             printf("quitting...\n");
-            //wake up night mode  and gps polling threads
-            quitcv.notify_all();
-
-            printf("waiting for nm_thread\n");
-            nm_thread.join();
-
-            printf("waiting for gps_thread\n");
-            gp_thread.join();
 
-            printf("waiting for hud_thread\n");
-            hud_thread.join();
+            printf("waiting for sensor_hub\n");
+            sensorHub.Stop();
+            hud_log_stats();
+            mzd_dbus_log_stats();
+            callbacks.logAudioFocusStats();
 
             printf("shutting down\n");
 
@@ -286,10 +334,11 @@ int main (int argc, char *argv[])
                 return ret;
             }
 
-            g_main_context_unref(run_on_thread_main_context);
-            run_on_thread_main_context = nullptr;
+            //D-Bus replies and signals check it under the same lock before they post, none reach it after this
+            GMainContext* mainContext = run_on_thread_main_context;
+            run_on_thread_main_context_set(nullptr);
+            g_main_context_unref(mainContext);
             g_hu = nullptr;
-            DBus::default_dispatcher = nullptr;
         }
     }
     catch(DBus::Error& error)
@@ -2,14 +2,17 @@
 
 #include <dbus/dbus.h>
 #include <dbus-c++/dbus.h>
+#include <atomic>
+#include <memory>
 
 #include "../dbus/generated_cmu.h"
+#include "../dbus/mzd_dbus.h"
 
 #define LOGTAG "mazda-nm"
 
 #include "hu_uti.h"
 
-#define SERVICE_BUS_ADDRESS "unix:path=/tmp/dbus_service_socket"
+#define NM_CALL_TIMEOUT_MS 1000
 
 class Navi2NNGClient : public com::jci::navi2NNG_proxy,
                      public DBus::ObjectProxy
@@ -62,6 +65,8 @@ public:
 
 
 static Navi2NNGClient *navi_client = NULL;
+static std::atomic<int> nm_last_reply(NM_NO_VALUE);
+static std::atomic<bool> nm_call_pending(false);
 
 void mzd_nightmode_start()
 {
@@ -70,9 +75,10 @@ void mzd_nightmode_start()
 
     try
     {
-        DBus::Connection service_bus(SERVICE_BUS_ADDRESS, false);
-        service_bus.register_bus();
-        navi_client = new Navi2NNGClient(service_bus, "/com/jci/navi2NNG", "com.jci.navi2NNG");
+        mzd_dbus_run([]()
+        {
+            navi_client = new Navi2NNGClient(mzd_dbus_service_bus(), "/com/jci/navi2NNG", "com.jci.navi2NNG");
+        });
     }
     catch(DBus::Error& error)
     {
@@ -89,20 +95,31 @@ int mzd_is_night_mode_set()
     if (navi_client == NULL)
         return NM_NO_VALUE;
 
-    try
-    {
-        int32_t nm_daynightmode = navi_client->GetDayNightMode();
-        return (nm_daynightmode == 1) ? NM_NIGHT_MODE : NM_DAY_MODE;
-    }
-    catch(DBus::Error& error)
+    //One call out at a time, a stalled navi service shouldn't pile them up
+    if (!nm_call_pending.exchange(true))
     {
-        loge("DBUS: GetDayNightMode failed %s: %s", error.name(), error.message());
-        return NM_NO_VALUE;
+        Navi2NNGClient* client = navi_client;
+        std::shared_ptr<int32_t> reply = std::make_shared<int32_t>(0);
+        mzd_dbus_call("navi2NNG.GetDayNightMode", *client, [client, reply]()
+        {
+            *reply = client->GetDayNightMode();
+        }, [reply](bool ok)
+        {
+            nm_last_reply = !ok ? NM_NO_VALUE : (*reply == 1) ? NM_NIGHT_MODE : NM_DAY_MODE;
+            nm_call_pending = false;
+        }, MzdDBusDoneOn::REACTOR, NM_CALL_TIMEOUT_MS);
     }
+    return nm_last_reply;
 }
 
 void mzd_nightmode_stop()
 {
-    delete navi_client;
-    navi_client = nullptr;
+    mzd_dbus_flush();
+    mzd_dbus_run([]()
+    {
+        delete navi_client;
+        navi_client = nullptr;
+        //After any reply that was still on its way in, so the next session starts clean
+        nm_last_reply = NM_NO_VALUE;
+    });
 }
@@ -8,7 +8,9 @@
 /** Sets up a connection. Has to be called before mzd_is_night_mode_set returns values. **/
 void mzd_nightmode_start();
 
-/** Returns NM_NIGHT_MODE if night mode is set, NM_DAY_MODE if it's not and NM_NO_VALUE if there was an error. **/
+/** Returns NM_NIGHT_MODE if night mode is set, NM_DAY_MODE if it's not and NM_NO_VALUE if there was an error.
+    Never waits on D-Bus: it answers with the reply to the previous call and asks again, so the first call of a
+    session is always NM_NO_VALUE. **/
 int mzd_is_night_mode_set();
 
 /** Tears down the connection and frees stuff **/
@@ -1,6 +1,9 @@
 #include "outputs.h"
+#include "hu_metrics.h"
+#include "hu_pb_fast.h"
 #include "main.h"
 #include "callbacks.h"
+#include "input/mzd_touch.h"
 
 #include "json/json.hpp"
 using json = nlohmann::json;
@@ -63,29 +66,20 @@ static gboolean bus_callback(GstBus *bus, GstMessage *message, gpointer *ptr)
     return TRUE;
 }
 
-struct TouchScreenState {
-    int x;
-    int y;
-    HU::TouchInfo::TOUCH_ACTION action;
-    int action_recvd;
-};
+static void aa_touch_event(const TouchMessage& message, uint64_t event_us) {
 
-static void aa_touch_event(HU::TouchInfo::TOUCH_ACTION action, unsigned int x, unsigned int y, uint64_t ts) {
-
-    g_hu->hu_queue_command([action, x, y, ts](IHUConnectionThreadInterface& s)
+    hu_input_stamp stamp = {event_us, message.read_us, hu_get_time_us()};
+    g_hu->hu_queue_command([message, stamp](IHUConnectionThreadInterface& s) mutable
     {
-        HU::InputEvent inputEvent;
-        inputEvent.set_timestamp(ts);
-        HU::TouchInfo* touchEvent = inputEvent.mutable_touch();
-        touchEvent->set_action(action);
-        HU::TouchInfo::Location* touchLocation = touchEvent->add_location();
-        touchLocation->set_x(x);
-        touchLocation->set_y(y);
-        touchLocation->set_pointer_id(0);
+        byte buf[HU_PB_INPUT_EVENT_MAX];
+        hu_pb_input_event inputEvent(buf, message.timestamp);
+        bool pointerChange = message.action == HU::TouchInfo::TOUCH_ACTION_POINTER_DOWN || message.action == HU::TouchInfo::TOUCH_ACTION_POINTER_UP;
+        inputEvent.touch(message.action, message.pointers, message.count, pointerChange ? (int) message.action_index : -1);
 
         /* Send touch event */
 
-        int ret = s.hu_aap_enc_send_message(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, inputEvent);
+        hu_input_scope scope(stamp);
+        int ret = s.hu_aap_enc_send_blob(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, buf, inputEvent.size());
         if (ret < 0) {
             printf("aa_touch_event(): hu_aap_enc_send() failed with (%d)\n", ret);
         }
@@ -94,8 +88,18 @@ static void aa_touch_event(HU::TouchInfo::TOUCH_ACTION action, unsigned int x, u
 
 static uint64_t get_timestamp(struct input_event& ii)
 {
-    return ii.time.tv_sec * 1000000 + ii.time.tv_usec;
+    return ii.time.tv_sec * 1000000ULL + ii.time.tv_usec;
 }
+
+//Event times are CLOCK_REALTIME, which is also what the phone is sent. Only the latency stamps are monotonic
+static uint64_t event_time_monotonic(uint64_t event_us)
+{
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    int64_t offset_us = (int64_t) hu_get_time_us() - ((int64_t) real.tv_sec * 1000000 + real.tv_nsec / 1000);
+    return (uint64_t) std::max<int64_t>(0, (int64_t) event_us + offset_us);
+}
+
 static void emit(int fd, int type, int code, int val)
 {
   struct input_event ie;
@@ -127,7 +131,10 @@ void VideoOutput::pass_key_to_mzd(int type, int code, int val)
 }
 void VideoOutput::input_thread_func()
 {
-    TouchScreenState mTouch {0,0,(HU::TouchInfo::TOUCH_ACTION)0,0};
+    TouchCoalescer touch([this](const TouchMessage& message)
+    {
+        aa_touch_event(message, event_time_monotonic(message.timestamp));
+    });
     int maxfdPlus1 = std::max(std::max(touch_fd, kbd_fd), input_thread_quit_pipe_read) + 1;
     while (true)
     {
@@ -139,7 +146,10 @@ void VideoOutput::input_thread_func()
         FD_SET(kbd_fd, &set);
         FD_SET(input_thread_quit_pipe_read, &set);
 
-        unblocked = select(maxfdPlus1, &set, NULL, NULL, NULL);
+        //Only wait as long as a merged move can be held back
+        int waitMs = touch.WaitMs(hu_get_time_us());
+        struct timeval timeout = {waitMs / 1000, (waitMs % 1000) * 1000};
+        unblocked = select(maxfdPlus1, &set, NULL, NULL, waitMs >= 0 ? &timeout : NULL);
 
         if (unblocked == -1)
         {
@@ -169,48 +179,26 @@ void VideoOutput::input_thread_func()
             }
 
             int num_chars = size / sizeof(input_event);
+            uint64_t now = hu_get_time_us();
             for (int i=0;i < num_chars;i++)
             {
                 auto& event = events[i];
-                switch (event.type)
+                if (event.type == EV_ABS && event.code == ABS_MT_POSITION_X)
                 {
-                    case EV_ABS:
-                        switch (event.code) {
-                            case ABS_MT_POSITION_X:
-                                mTouch.x = event.value * 800 /4095;
-                                break;
-                            case ABS_MT_POSITION_Y:
-                                #if ASPECT_RATIO_FIX
-                                mTouch.y = event.value * 450/4095 + 15;
-                                #else
-                                mTouch.y = event.value * 480/4095;
-                                #endif
-                                break;
-                        }
-                        break;
-                    case EV_KEY:
-                        if (event.code == BTN_TOUCH) {
-                            mTouch.action_recvd = 1;
-                            if (event.value == 1) {
-                                mTouch.action = HU::TouchInfo::TOUCH_ACTION_PRESS;
-                            }
-                            else {
-                                mTouch.action = HU::TouchInfo::TOUCH_ACTION_RELEASE;
-                            }
-                        }
-                        break;
-                    case EV_SYN:
-                        if (mTouch.action_recvd == 0) {
-                            mTouch.action = HU::TouchInfo::TOUCH_ACTION_DRAG;
-                            aa_touch_event(mTouch.action, mTouch.x, mTouch.y, get_timestamp(event));
-                        } else {
-                            aa_touch_event(mTouch.action, mTouch.x, mTouch.y, get_timestamp(event));
-                            mTouch.action_recvd = 0;
-                        }
-                        break;
+                    event.value = event.value * 800 /4095;
+                }
+                else if (event.type == EV_ABS && event.code == ABS_MT_POSITION_Y)
+                {
+                    #if ASPECT_RATIO_FIX
+                    event.value = event.value * 450/4095 + 15;
+                    #else
+                    event.value = event.value * 480/4095;
+                    #endif
                 }
+                touch.Event(event, now);
             }
         }
+        touch.Poll(hu_get_time_us());
 
         if (FD_ISSET(kbd_fd, &set))
         {
@@ -226,6 +214,7 @@ void VideoOutput::input_thread_func()
             }
 
             int num_chars = size / sizeof(input_event);
+            uint64_t readUs = hu_get_time_us();
             for (int i=0;i < num_chars;i++)
             {
                 auto& event = events[i];
@@ -370,31 +359,31 @@ void VideoOutput::input_thread_func()
 
                     if (scanCode != 0 || scrollAmount != 0)
                     {
-                        g_hu->hu_queue_command([timeStamp, scanCode, scrollAmount, isPressed, longPress](IHUConnectionThreadInterface& s)
+                        hu_input_stamp stamp = {event_time_monotonic(timeStamp), readUs, hu_get_time_us()};
+                        g_hu->hu_queue_command([timeStamp, scanCode, scrollAmount, isPressed, longPress, stamp](IHUConnectionThreadInterface& s) mutable
                         {
-                            HU::InputEvent inputEvent;
-                            inputEvent.set_timestamp(timeStamp);
+                            byte buf[HU_PB_INPUT_EVENT_MAX];
+                            hu_pb_input_event inputEvent(buf, timeStamp);
                             if (scanCode != 0)
                             {
-                                HU::ButtonInfo* buttonInfo = inputEvent.mutable_button()->add_button();
-                                buttonInfo->set_is_pressed(isPressed);
-                                buttonInfo->set_meta(0);
-                                buttonInfo->set_long_press(longPress);
-                                buttonInfo->set_scan_code(scanCode);
+                                inputEvent.button(scanCode, isPressed, 0, longPress);
                             }
                             if (scrollAmount != 0)
                             {
-                                HU::RelativeInputEvent* rel = inputEvent.mutable_rel_event()->mutable_event();
-                                rel->set_delta(scrollAmount);
-                                rel->set_scan_code(HUIB_SCROLLWHEEL);
+                                inputEvent.relative(HUIB_SCROLLWHEEL, scrollAmount);
                             }
-                            s.hu_aap_enc_send_message(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, inputEvent);
+                            hu_input_scope scope(stamp);
+                            s.hu_aap_enc_send_blob(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, buf, inputEvent.size());
                         });
                     }
                 }
             }
         }
     }
+
+    const TouchStats& stats = touch.GetStats();
+    printf("Touch: %llu reports in, %llu messages out, %llu moves merged\n", (unsigned long long) stats.reports,
+           (unsigned long long) stats.messages, (unsigned long long) stats.merged);
 }
 
 
@@ -538,5 +527,6 @@ void VideoOutput::MediaPacket(uint64_t timestamp, const byte *buf, int len)
     int ret = gst_app_src_push_buffer(vid_src, buffer);
     if(ret !=  GST_FLOW_OK){
         printf("push buffer returned %d for %d bytes \n", ret, len);
+        hu_metrics_add(hu_metrics_chan(AA_CH_VID).drops);
     }
 }
@@ -0,0 +1,138 @@
+#define LOGTAG "mazda-sensors"
+
+#include "mzd_sensor_hub.h"
+
+#include <algorithm>
+#include <chrono>
+#include <pthread.h>
+
+#include "hu_uti.h"
+
+void SensorHub::Add(SensorSource* source, int period_ms, int refresh_ms)
+{
+    Entry entry;
+    entry.source.reset(source);
+    entry.period_ticks = std::max(1, (period_ms + SENSOR_HUB_TICK_MS / 2) / SENSOR_HUB_TICK_MS);
+    entry.refresh_ticks = refresh_ms > 0 ? std::max<uint64_t>(entry.period_ticks, refresh_ms / SENSOR_HUB_TICK_MS) : 0;
+    entries.push_back(std::move(entry));
+}
+
+void SensorHub::Schedule(int idx)
+{
+    wheel[entries[idx].due_tick % SENSOR_HUB_SLOTS].push_back(idx);
+}
+
+uint64_t SensorHub::NextDueTick(uint64_t tick) const
+{
+    //First slot after this tick with something due in this turn of the wheel, the empty ticks in between are slept through
+    for (uint64_t next = tick + 1; next <= tick + SENSOR_HUB_SLOTS; next++)
+    {
+        for (int idx : wheel[next % SENSOR_HUB_SLOTS])
+        {
+            if (entries[idx].due_tick <= next)
+                return next;
+        }
+    }
+    return tick + SENSOR_HUB_SLOTS;
+}
+
+void SensorHub::ThreadMain()
+{
+    pthread_setname_np(pthread_self(), "sensor_hub");
+
+    for (size_t idx = 0; idx < entries.size(); idx++)
+    {
+        Entry& entry = entries[idx];
+        entry.active = entry.source->Start();
+        if (entry.active)
+            Schedule(idx);
+        else
+            logw("%s not available, left out of this session", entry.source->Name());
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t tick = 0;
+    std::unique_lock<std::mutex> lk(mutex);
+    while (!quit)
+    {
+        lk.unlock();
+        stats.wakeups++;
+
+        //Logical ticks, so a late wakeup runs what was due instead of skipping past it
+        std::vector<int>& slot = wheel[tick % SENSOR_HUB_SLOTS];
+        due.assign(slot.begin(), slot.end());
+        slot.clear();
+
+        HU::SensorEvent event;
+        int readings = 0;
+        for (int idx : due)
+        {
+            Entry& entry = entries[idx];
+            if (entry.due_tick > tick)                                  //A later turn of the wheel
+            {
+                slot.push_back(idx);
+                continue;
+            }
+            bool refresh = entry.refresh_ticks > 0 && tick - entry.last_sent_tick >= entry.refresh_ticks;
+            stats.polls++;
+            if (entry.source->Poll(event, refresh))
+            {
+                entry.last_sent_tick = tick;
+                readings++;
+            }
+            entry.due_tick = tick + entry.period_ticks;
+            Schedule(idx);
+        }
+
+        if (readings > 0)
+        {
+            stats.events++;
+            stats.readings += readings;
+            hu.hu_queue_command([event](IHUConnectionThreadInterface& s)
+            {
+                s.hu_aap_enc_send_message(0, AA_CH_SEN, HU_SENSOR_CHANNEL_MESSAGE::SensorEvent, event);
+            });
+        }
+
+        tick = NextDueTick(tick);
+        lk.lock();
+        cv.wait_until(lk, start + std::chrono::milliseconds(tick * SENSOR_HUB_TICK_MS), [this] { return quit; });
+    }
+    lk.unlock();
+
+    for (Entry& entry : entries)
+    {
+        if (entry.active)
+            entry.source->Stop();
+    }
+}
+
+void SensorHub::Start()
+{
+    if (thread.joinable())
+        return;
+    quit = false;
+    stats = SensorHubStats();
+    for (std::vector<int>& slot : wheel)
+        slot.clear();
+    for (Entry& entry : entries)
+    {
+        entry.due_tick = 0;
+        entry.last_sent_tick = 0;
+    }
+    thread = std::thread([this] { ThreadMain(); });
+}
+
+void SensorHub::Stop()
+{
+    if (!thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        quit = true;
+    }
+    cv.notify_all();
+    thread.join();
+    logd("Sensor hub: %llu wakeups, %llu polls, %llu events carrying %llu readings", (unsigned long long) stats.wakeups,
+         (unsigned long long) stats.polls, (unsigned long long) stats.events, (unsigned long long) stats.readings);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+#include "hu_aap.h"
+
+#define SENSOR_HUB_TICK_MS 50
+#define SENSOR_HUB_SLOTS   64                                           // 3.2 s per turn of the wheel, longer periods wait out whole turns
+
+// One thread polls every car sensor on a timer wheel instead of a thread per sensor. Sources register with
+// their own period; sources that are due on the same tick are polled together and whatever changed goes to
+// the phone as a single SensorEvent.
+
+class SensorSource
+{
+public:
+    virtual ~SensorSource() {}
+    virtual const char* Name() const = 0;
+    // Called on the hub thread. Returning false leaves the source out of this session
+    virtual bool Start() { return true; }
+    virtual void Stop() {}
+    // Adds the reading to the event if it changed, or whenever refresh is set. Returns true if it added anything
+    virtual bool Poll(HU::SensorEvent& event, bool refresh) = 0;
+};
+
+struct SensorHubStats
+{
+    uint64_t wakeups = 0;
+    uint64_t polls = 0;
+    uint64_t events = 0;                                                // SensorEvents sent, each may carry several readings
+    uint64_t readings = 0;
+};
+
+class SensorHub
+{
+    struct Entry
+    {
+        std::unique_ptr<SensorSource> source;
+        uint64_t period_ticks;
+        uint64_t refresh_ticks;                                         // 0: only send changes
+        uint64_t due_tick = 0;
+        uint64_t last_sent_tick = 0;
+        bool active = false;
+    };
+
+    IHUAnyThreadInterface& hu;
+    std::vector<Entry> entries;
+    std::vector<int> wheel[SENSOR_HUB_SLOTS];                           // Entry indexes by due_tick % SENSOR_HUB_SLOTS
+    std::vector<int> due;                                               // Scratch, so a tick doesn't allocate
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool quit = false;
+    SensorHubStats stats;
+
+    void Schedule(int idx);
+    uint64_t NextDueTick(uint64_t tick) const;
+    void ThreadMain();
+public:
+    SensorHub(IHUAnyThreadInterface& hu) : hu(hu) {}
+    ~SensorHub() { Stop(); }
+
+    // Before Start. Periods are rounded to the 50 ms tick; refresh_ms resends an unchanged value that often
+    void Add(SensorSource* source, int period_ms, int refresh_ms = 0);
+    void Start();
+    void Stop();
+    SensorHubStats GetStats() const { return stats; }                  // After Stop
+};
@@ -0,0 +1,600 @@
+// headunit-bench: micro benchmarks of the protocol hot paths. No phone, display or audio needed.
+//
+//   headunit-bench [-f filter] [-n trials] [-s baseline.json] [-c baseline.json] [-t percent] [-v]
+//
+//   -f  only benchmarks whose name contains filter
+//   -n  runs per benchmark, the median is reported (default 5)
+//   -s  save the results as a baseline
+//   -c  compare against a saved baseline, exit status 1 if anything got slower by more than -t percent (default 10)
+//   -v  keep the debug log, it's off by default so it doesn't end up in the numbers
+//
+// Build with "make bench", here for x86 or in mazda/ for the CMU. Compare baselines from the same machine only.
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "hu_uti.h"
+#include "hu_aap.h"
+#include "hu_pb_fast.h"
+
+#include "glib_utils.h"
+#include "json/json.hpp"
+using json = nlohmann::json;
+
+struct bench_result {
+    std::string name;
+    double value;
+    std::string unit;                                           // "ns/op" or "us/op": lower is better, "MB/s": higher is better
+};
+
+static bool higher_is_better(const std::string& unit) {
+    return unit == "MB/s";
+}
+
+class BenchCallbacks : public IHUConnectionThreadEventCallbacks {
+public:
+    uint64_t media_bytes = 0;
+
+    virtual int MediaPacket(int chan, uint64_t timestamp, const byte* buf, int len) override {
+        media_bytes += len;
+        return 0;
+    }
+    virtual int MediaStart(int chan) override { return 0; }
+    virtual int MediaStop(int chan) override { return 0; }
+    virtual void MediaSetupComplete(int chan) override {}
+    virtual void DisconnectionOrError() override {}
+    virtual void AudioFocusRequest(int chan, const HU::AudioFocusRequest& request) override {}
+    virtual void VideoFocusRequest(int chan, const HU::VideoFocusRequest& request) override {}
+};
+
+// The bench writes phone frames into a pipe the server reads, and counts what the server sends back
+class BenchTransport : public HUTransportStream {
+public:
+    int write_fd = -1;
+    int capacity = 0;
+    uint64_t sent_bytes = 0;
+
+    BenchTransport() {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            return;
+        readfd = fds[0];
+        write_fd = fds[1];
+        fcntl(write_fd, F_SETPIPE_SZ, 1024 * 1024);             // Enough for a batch of video messages
+        capacity = fcntl(write_fd, F_GETPIPE_SZ);
+    }
+    ~BenchTransport() {
+        if (readfd >= 0)
+            close(readfd);
+        if (write_fd >= 0)
+            close(write_fd);
+    }
+    virtual int Start(bool waitForDevice) override { return 0; }
+    virtual int Stop() override { return 0; }
+    virtual int Write(const byte* buf, int len, int tmo) override {
+        sent_bytes += len;
+        return len;
+    }
+    bool Feed(const std::vector<byte>& frames) {
+        return write(write_fd, frames.data(), frames.size()) == (ssize_t) frames.size();
+    }
+};
+
+// A started, plaintext session with no thread: the benchmarks call straight into the receive and send paths
+class BenchServer : public HUServer {
+public:
+    BenchTransport* pipe;
+
+    BenchServer(BenchCallbacks& callbacks) : HUServer(callbacks) {
+        pipe = new BenchTransport();
+        transport.reset(pipe);
+        iaap_plaintext = true;
+        iaap_state = hu_STATE_STARTED;
+        int fds[2];
+        if (pipe2(fds, O_DIRECT) == 0) {                        // Same as hu_aap_start
+            command_read_fd = fds[0];
+            command_write_fd = fds[1];
+        }
+    }
+
+    int RecvProcess() { return hu_aap_recv_process(1000); }
+    int SendMedia(int chan, const byte* buf, int len) {
+        return hu_aap_enc_send_media_packet(0, chan, HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp, 0, buf, len);
+    }
+    int QueueCommand(HUThreadCommand&& command) { return hu_queue_command(std::move(command)); }
+    bool RunCommand() {
+        HUThreadCommand* command = hu_pop_command();
+        if (command == nullptr)
+            return false;
+        (*command)(*this);
+        delete command;
+        return true;
+    }
+};
+
+// Frames one message the way the phone does, plaintext
+static void bench_frame_message(int chan, uint16_t msg_type, const byte* payload, int len, std::vector<byte>& out) {
+    std::vector<byte> msg(2 + len);
+    msg[0] = msg_type >> 8;
+    msg[1] = msg_type & 0xff;
+    if (len > 0)
+        memcpy(&msg[2], payload, len);
+
+    int total = msg.size();
+    for (int frag_start = 0; frag_start < total; frag_start += MAX_FRAME_PAYLOAD_SIZE) {
+        byte flags = (chan != AA_CH_CTR && msg_type >= 2 && msg_type < 0x8000) ? HU_FRAME_CONTROL_MESSAGE : 0;
+        if (frag_start == 0)
+            flags |= HU_FRAME_FIRST_FRAME;
+        int cur_len = MAX_FRAME_PAYLOAD_SIZE;
+        if (frag_start + MAX_FRAME_PAYLOAD_SIZE >= total) {
+            flags |= HU_FRAME_LAST_FRAME;
+            cur_len = total - frag_start;
+        }
+        out.push_back(chan);
+        out.push_back(flags);
+        out.push_back(cur_len >> 8);
+        out.push_back(cur_len & 0xff);
+        if ((flags & HU_FRAME_FIRST_FRAME) && !(flags & HU_FRAME_LAST_FRAME)) {
+            for (int shift = 24; shift >= 0; shift -= 8)
+                out.push_back((total >> shift) & 0xff);
+        }
+        out.insert(out.end(), &msg[frag_start], &msg[frag_start] + cur_len);
+    }
+}
+
+// Feeds messages in batches that fit the pipe and times only hu_aap_recv_process. Returns ns per message.
+static double bench_recv(const std::vector<byte>& message_frames, int messages) {
+    BenchCallbacks callbacks;
+    BenchServer server(callbacks);
+    int batch = std::max(1, std::min(1000, server.pipe->capacity / (int) message_frames.size()));
+    std::vector<byte> frames;
+    for (int idx = 0; idx < batch; idx++)
+        frames.insert(frames.end(), message_frames.begin(), message_frames.end());
+
+    uint64_t total_us = 0;
+    for (int done = 0; done < messages; done += batch) {
+        if (!server.pipe->Feed(frames)) {
+            loge("Feeding the pipe failed");
+            return -1;
+        }
+        uint64_t start_us = hu_get_time_us();
+        for (int idx = 0; idx < batch; idx++) {
+            if (server.RecvProcess() < 0) {
+                loge("hu_aap_recv_process failed");
+                return -1;
+            }
+        }
+        total_us += hu_get_time_us() - start_us;
+    }
+    int rounded = ((messages + batch - 1) / batch) * batch;
+    return total_us * 1000.0 / rounded;
+}
+
+static bool bench_recv_ping(std::vector<bench_result>& results) {
+    HU::PingRequest ping;
+    ping.set_timestamp(hu_get_time_us());
+    std::string body = ping.SerializeAsString();
+    std::vector<byte> frames;
+    bench_frame_message(AA_CH_CTR, (uint16_t) HU_PROTOCOL_MESSAGE::PingRequest, (const byte*) body.data(), body.size(), frames);
+    double ns = bench_recv(frames, 20000);
+    results.push_back({"recv_ping", ns, "ns/op"});              // Parse, dispatch and PingResponse
+    return ns >= 0;
+}
+
+static bool bench_recv_media(std::vector<bench_result>& results, const char* name, int chan, int payload_bytes, int messages) {
+    std::vector<byte> payload(8 + payload_bytes);
+    for (size_t idx = 8; idx < payload.size(); idx++)
+        payload[idx] = idx & 0xff;
+    std::vector<byte> frames;
+    bench_frame_message(chan, (uint16_t) HU_PROTOCOL_MESSAGE::MediaDataWithTimestamp, payload.data(), payload.size(), frames);
+    double ns = bench_recv(frames, messages);
+    results.push_back({name, ns < 0 ? 0 : payload_bytes * 1000.0 / ns, "MB/s"});   // Reassembly, MediaPacket and MediaAck
+    return ns >= 0;
+}
+
+static bool bench_enc_send(std::vector<bench_result>& results, const char* name, int payload_bytes, int messages) {
+    BenchCallbacks callbacks;
+    BenchServer server(callbacks);
+    std::vector<byte> payload(payload_bytes, 0x5a);
+    uint64_t start_us = hu_get_time_us();
+    for (int idx = 0; idx < messages; idx++) {
+        if (server.SendMedia(AA_CH_MIC, payload.data(), payload.size()) < 0) {
+            loge("hu_aap_enc_send failed");
+            return false;
+        }
+    }
+    uint64_t us = std::max((uint64_t) 1, hu_get_time_us() - start_us);
+    results.push_back({name, (double) payload_bytes * messages / us, "MB/s"});
+    return true;
+}
+
+template<typename Build>
+static bool bench_encode(std::vector<bench_result>& results, const char* name, Build build) {
+    const int count = 200000;
+    byte buf[1024];
+    volatile int sink = 0;
+    uint64_t start_us = hu_get_time_us();
+    for (int idx = 0; idx < count; idx++) {
+        auto message = build(idx);                              // Built every time, like the callers do
+        int size = message.ByteSize();
+        if (size > (int) sizeof(buf) || !message.SerializeToArray(buf, size))
+            return false;
+        sink = buf[0];                                          // Keep the work
+    }
+    uint64_t us = hu_get_time_us() - start_us;
+    results.push_back({name, us * 1000.0 / count, "ns/op"});
+    return true;
+}
+
+// Same thing through hu_pb_fast.h. build writes into buf and returns the size
+template<typename Build>
+static bool bench_encode_fast(std::vector<bench_result>& results, const char* name, Build build) {
+    const int count = 200000;
+    byte buf[HU_PB_INPUT_EVENT_MAX];
+    volatile int sink = 0;
+    uint64_t start_us = hu_get_time_us();
+    for (int idx = 0; idx < count; idx++) {
+        if (build(idx, buf) <= 0)
+            return false;
+        sink = buf[0];
+    }
+    uint64_t us = hu_get_time_us() - start_us;
+    results.push_back({name, us * 1000.0 / count, "ns/op"});
+    return true;
+}
+
+// The fast encoder has to give the bytes libprotobuf gives, over values that hit every varint length and sign
+template<typename Message, typename Build, typename BuildFast>
+static bool bench_encode_same(const char* name, Build build, BuildFast build_fast) {
+    static const int values[] = {0, 1, 127, 128, 16383, 16384, 0x7fffffff, -1, -300};
+    for (int value : values) {
+        Message message = build(value);
+        std::string expected = message.SerializeAsString();
+        byte buf[HU_PB_INPUT_EVENT_MAX];
+        int size = build_fast(value, buf);
+        if (size != (int) expected.size() || memcmp(buf, expected.data(), size) != 0) {
+            loge("%s: hu_pb_fast.h and libprotobuf disagree for %d", name, value);
+            hex_dump("protobuf: ", 16, (byte*) expected.data(), expected.size());
+            hex_dump("fast:     ", 16, buf, size);
+            return false;
+        }
+    }
+    return true;
+}
+
+static HU::InputEvent bench_input_event(int idx) {
+    HU::InputEvent inputEvent;
+    inputEvent.set_timestamp(1000000ULL * (uint32_t) idx);
+    HU::TouchInfo* touchEvent = inputEvent.mutable_touch();
+    touchEvent->set_action(HU::TouchInfo::TOUCH_ACTION_DRAG);
+    HU::TouchInfo::Location* touchLocation = touchEvent->add_location();
+    touchLocation->set_x(idx % 800);
+    touchLocation->set_y(idx % 480);
+    touchLocation->set_pointer_id(0);
+    return inputEvent;
+}
+
+static int bench_input_event_fast(int idx, byte* buf) {
+    hu_pb_input_event inputEvent(buf, 1000000ULL * (uint32_t) idx);
+    hu_pb_touch_pointer pointer = {(uint32_t) (idx % 800), (uint32_t) (idx % 480), 0};
+    inputEvent.touch(HU::TouchInfo::TOUCH_ACTION_DRAG, &pointer, 1);
+    return inputEvent.size();
+}
+
+static HU::InputEvent bench_key_event(int idx) {
+    HU::InputEvent inputEvent;
+    inputEvent.set_timestamp(idx);
+    HU::ButtonInfo* buttonInfo = inputEvent.mutable_button()->add_button();
+    buttonInfo->set_scan_code(idx & 0xffff);
+    buttonInfo->set_is_pressed(idx & 1);
+    buttonInfo->set_meta(0);
+    buttonInfo->set_long_press(false);
+    HU::RelativeInputEvent* rel = inputEvent.mutable_rel_event()->mutable_event();
+    rel->set_scan_code(HUIB_SCROLLWHEEL);
+    rel->set_delta(idx);
+    return inputEvent;
+}
+
+static int bench_key_event_fast(int idx, byte* buf) {
+    hu_pb_input_event inputEvent(buf, idx);
+    inputEvent.button(idx & 0xffff, idx & 1, 0, false);
+    inputEvent.relative(HUIB_SCROLLWHEEL, idx);
+    return inputEvent.size();
+}
+
+static HU::InputEvent bench_multitouch_event(int idx) {
+    HU::InputEvent inputEvent;
+    inputEvent.set_timestamp(idx);
+    HU::TouchInfo* touchEvent = inputEvent.mutable_touch();
+    for (int finger = 0; finger < HU_PB_TOUCH_POINTERS; finger++) {
+        HU::TouchInfo::Location* touchLocation = touchEvent->add_location();
+        touchLocation->set_x(idx + finger);
+        touchLocation->set_y(idx);
+        touchLocation->set_pointer_id(finger);
+    }
+    touchEvent->set_action_index(3);
+    touchEvent->set_action(HU::TouchInfo::TOUCH_ACTION_POINTER_DOWN);
+    return inputEvent;
+}
+
+static int bench_multitouch_event_fast(int idx, byte* buf) {
+    hu_pb_touch_pointer pointers[HU_PB_TOUCH_POINTERS];
+    for (int finger = 0; finger < HU_PB_TOUCH_POINTERS; finger++)
+        pointers[finger] = {(uint32_t) (idx + finger), (uint32_t) idx, (uint32_t) finger};
+    hu_pb_input_event inputEvent(buf, idx);
+    inputEvent.touch(HU::TouchInfo::TOUCH_ACTION_POINTER_DOWN, pointers, HU_PB_TOUCH_POINTERS, 3);
+    return inputEvent.size();
+}
+
+static HU::SensorEvent bench_sensor_event(int idx) {
+    HU::SensorEvent sensorEvent;
+    sensorEvent.add_night_mode()->set_is_night(idx & 1);
+    sensorEvent.add_driving_status()->set_status(idx);
+    return sensorEvent;
+}
+
+static int bench_sensor_event_fast(int idx, byte* buf) {
+    hu_pb_sensor_event sensorEvent(buf);
+    sensorEvent.night_mode(idx & 1);
+    sensorEvent.driving_status(idx);
+    return sensorEvent.size();
+}
+
+static HU::MediaAck bench_media_ack(int idx) {
+    HU::MediaAck mediaAck;
+    mediaAck.set_session(idx);
+    mediaAck.set_value(1);
+    return mediaAck;
+}
+
+static int bench_media_ack_fast(int idx, byte* buf) {
+    return hu_pb_media_ack(buf, idx, 1);
+}
+
+static bool bench_protobuf(std::vector<bench_result>& results) {
+    bool ok = bench_encode_same<HU::InputEvent>("input_event", bench_input_event, bench_input_event_fast);
+    ok = ok && bench_encode_same<HU::InputEvent>("key_event", bench_key_event, bench_key_event_fast);
+    ok = ok && bench_encode_same<HU::InputEvent>("multitouch_event", bench_multitouch_event, bench_multitouch_event_fast);
+    ok = ok && bench_encode_same<HU::SensorEvent>("sensor_event", bench_sensor_event, bench_sensor_event_fast);
+    ok = ok && bench_encode_same<HU::MediaAck>("media_ack", bench_media_ack, bench_media_ack_fast);
+
+    ok = ok && bench_encode(results, "pb_encode_input_event", bench_input_event);
+    ok = ok && bench_encode_fast(results, "pb_fast_input_event", bench_input_event_fast);
+    ok = ok && bench_encode(results, "pb_encode_sensor_event", [](int idx) {
+        HU::SensorEvent sensorEvent;
+        HU::SensorEvent_LocationData* location = sensorEvent.add_location_data();
+        location->set_timestamp(1000000ULL * idx);
+        location->set_latitude(485629640 + idx);
+        location->set_longitude(133856390 - idx);
+        location->set_speed(48000);
+        return sensorEvent;
+    });
+    ok = ok && bench_encode(results, "pb_encode_sensor_status", bench_sensor_event);
+    ok = ok && bench_encode_fast(results, "pb_fast_sensor_status", bench_sensor_event_fast);
+    ok = ok && bench_encode(results, "pb_encode_media_ack", [](int idx) { return bench_media_ack(idx & 0xff); });
+    ok = ok && bench_encode_fast(results, "pb_fast_media_ack", [](int idx, byte* buf) { return bench_media_ack_fast(idx & 0xff, buf); });
+    return ok;
+}
+
+static bool bench_ssl(std::vector<bench_result>& results) {
+    hu_ssl_bench_result result;
+    if (hu_ssl_bench("ECDHE-RSA-AES128-GCM-SHA256", 8, &result) < 0)
+        return false;
+    results.push_back({"ssl_record_openssl", result.ssl_mbs, "MB/s"});
+    if (result.aead_mbs > 0)
+        results.push_back({"ssl_record_aead", result.aead_mbs, "MB/s"});
+    return true;
+}
+
+// hu_queue_command from another thread to the HU thread side popping and running them, like the UI does
+static bool bench_command_queue(std::vector<bench_result>& results) {
+    const int count = 100000;
+    BenchCallbacks callbacks;
+    BenchServer server(callbacks);
+    int ran = 0;
+    uint64_t start_us = hu_get_time_us();
+    std::thread producer([&server, count] {
+        for (int idx = 0; idx < count; idx++)
+            server.QueueCommand([](IHUConnectionThreadInterface& s) {});
+    });
+    while (ran < count && server.RunCommand())
+        ran++;
+    producer.join();
+    uint64_t us = hu_get_time_us() - start_us;
+    results.push_back({"command_queue", us * 1000.0 / count, "ns/op"});
+    return ran == count;
+}
+
+// Throughput from another thread into the glib main loop, then the round trip of one call at a time
+static bool bench_main_thread(std::vector<bench_result>& results) {
+    const int count = 100000;
+    const int round_trips = 2000;
+    run_on_thread_main_context_set(g_main_context_new());
+    GMainLoop* loop = g_main_loop_new(run_on_thread_main_context, FALSE);
+
+    int ran = 0;
+    uint64_t start_us = hu_get_time_us();
+    std::thread poster([&ran, loop, count] {
+        for (int idx = 0; idx < count; idx++) {
+            run_on_main_thread([&ran, loop, count]() {
+                if (++ran == count)
+                    g_main_loop_quit(loop);
+                return false;
+            });
+        }
+    });
+    g_main_loop_run(loop);
+    poster.join();
+    uint64_t throughput_us = hu_get_time_us() - start_us;
+
+    std::atomic<int> done(0);
+    uint64_t latency_us = 0;
+    std::thread pinger([&done, &latency_us, loop, round_trips] {
+        for (int idx = 0; idx < round_trips; idx++) {
+            uint64_t posted_us = hu_get_time_us();
+            run_on_main_thread([&done]() {
+                done.fetch_add(1, std::memory_order_release);
+                return false;
+            });
+            while (done.load(std::memory_order_acquire) <= idx)
+                std::this_thread::yield();
+            latency_us += hu_get_time_us() - posted_us;
+        }
+        run_on_main_thread([loop]() {
+            g_main_loop_quit(loop);
+            return false;
+        });
+    });
+    g_main_loop_run(loop);
+    pinger.join();
+
+    g_main_loop_unref(loop);
+    GMainContext* context = run_on_thread_main_context;
+    run_on_thread_main_context_set(nullptr);
+    g_main_context_unref(context);
+
+    results.push_back({"run_on_main_thread", throughput_us * 1000.0 / count, "ns/op"});
+    results.push_back({"run_on_main_thread_latency", (double) latency_us / round_trips, "us/op"});
+    return true;
+}
+
+struct bench_entry {
+    const char* name;                                           // Matched by -f, results may be named differently
+    bool (*run)(std::vector<bench_result>& results);
+};
+
+static const bench_entry benches[] = {
+    {"recv_ping", bench_recv_ping},
+    {"recv_video", [](std::vector<bench_result>& r) { return bench_recv_media(r, "recv_video_64k", AA_CH_VID, 64 * 1024, 5000); }},
+    {"recv_audio", [](std::vector<bench_result>& r) { return bench_recv_media(r, "recv_audio_3840", AA_CH_AUD, 3840, 20000); }},
+    {"enc_send", [](std::vector<bench_result>& r) { return bench_enc_send(r, "enc_send_64k", 64 * 1024, 5000); }},
+    {"pb_encode", bench_protobuf},
+    {"ssl_record", bench_ssl},
+    {"command_queue", bench_command_queue},
+    {"run_on_main_thread", bench_main_thread},
+};
+
+static int compare(const std::vector<bench_result>& results, const json& baseline, double threshold) {
+    int slower = 0;
+    printf("\n%-28s %12s %12s %8s\n", "benchmark", "baseline", "now", "change");
+    for (const bench_result& result : results) {
+        auto it = baseline["results"].find(result.name);
+        if (it == baseline["results"].end() || !(*it)["value"].is_number()) {
+            printf("%-28s %12s %12.1f %8s  new\n", result.name.c_str(), "-", result.value, "");
+            continue;
+        }
+        double base = (*it)["value"];
+        if (base <= 0)
+            continue;
+        // Positive is slower, whichever way the unit goes
+        double change = higher_is_better(result.unit) ? (base - result.value) / base : (result.value - base) / base;
+        const char* verdict = "";
+        if (change * 100 > threshold) {
+            verdict = "SLOWER";
+            slower++;
+        } else if (-change * 100 > threshold) {
+            verdict = "faster";
+        }
+        printf("%-28s %12.1f %12.1f %+7.1f%%  %s\n", result.name.c_str(), base, result.value, change * 100, verdict);
+    }
+    if (slower)
+        printf("\n%d benchmark(s) slower than the baseline by more than %.0f%%\n", slower, threshold);
+    return slower ? 1 : 0;
+}
+
+int main(int argc, char* argv[]) {
+    GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+    std::string filter;
+    std::string save_file;
+    std::string compare_file;
+    double threshold = 10;
+    int trials = 5;
+    bool verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:n:s:c:t:v")) != -1) {
+        switch (opt) {
+            case 'f': filter = optarg; break;
+            case 'n': trials = std::max(1, atoi(optarg)); break;
+            case 's': save_file = optarg; break;
+            case 'c': compare_file = optarg; break;
+            case 't': threshold = atof(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-f filter] [-n trials] [-s baseline.json] [-c baseline.json] [-t percent] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    json baseline;
+    if (!compare_file.empty()) {
+        std::ifstream in(compare_file);
+        try {
+            in >> baseline;
+        } catch (std::exception& e) {
+            fprintf(stderr, "Can't read baseline %s: %s\n", compare_file.c_str(), e.what());
+            return 2;
+        }
+    }
+
+    if (!verbose) {
+        for (const char* tag : {"hu_aap", "hu_aad", "hu_ssl", "hu_ssl_bench", "hu_uti"})
+            hu_log_set_level(tag, ANDROID_LOG_WARN);
+    }
+
+    std::vector<bench_result> results;
+    for (const bench_entry& bench : benches) {
+        if (!filter.empty() && std::string(bench.name).find(filter) == std::string::npos)
+            continue;
+
+        // Each trial may report several results, keep the median of each
+        std::vector<std::vector<bench_result>> runs;
+        for (int trial = 0; trial < trials; trial++) {
+            std::vector<bench_result> run;
+            if (!bench.run(run)) {
+                fprintf(stderr, "%s failed\n", bench.name);
+                return 2;
+            }
+            runs.push_back(run);
+        }
+        for (size_t idx = 0; idx < runs[0].size(); idx++) {
+            std::vector<double> values;
+            for (const std::vector<bench_result>& run : runs)
+                values.push_back(run[idx].value);
+            std::sort(values.begin(), values.end());
+            bench_result result = runs[0][idx];
+            result.value = values[values.size() / 2];
+            printf("%-28s %12.1f %s\n", result.name.c_str(), result.value, result.unit.c_str());
+            fflush(stdout);
+            results.push_back(result);
+        }
+    }
+
+    if (!save_file.empty()) {
+        json out;
+        out["version"] = 1;
+        out["trials"] = trials;
+        for (const bench_result& result : results) {
+            out["results"][result.name]["value"] = result.value;
+            out["results"][result.name]["unit"] = result.unit;
+            out["results"][result.name]["higher_is_better"] = higher_is_better(result.unit);
+        }
+        std::ofstream file(save_file);
+        file << out.dump(4) << std::endl;
+        if (!file) {
+            fprintf(stderr, "Can't write %s\n", save_file.c_str());
+            return 2;
+        }
+        printf("Saved %d results to %s\n", (int) results.size(), save_file.c_str());
+    }
+
+    if (!compare_file.empty())
+        return compare(results, baseline, threshold);
+    return 0;
+}
@@ -27,6 +27,18 @@ int DesktopEventCallbacks::MediaPacket(int chan, uint64_t timestamp, const byte
     return 0;
 }
 
+bool DesktopEventCallbacks::MediaStreamChunks(int chan) {
+    //h264parse splits the byte stream on start codes itself, so partial frames can go straight in
+    return chan == AA_CH_VID && config::streamVideoChunks;
+}
+
+int DesktopEventCallbacks::MediaPacketChunk(int chan, uint64_t timestamp, int offset, int total, const byte *buf, int len) {
+    if (chan == AA_CH_VID && videoOutput) {
+        videoOutput->MediaPacket(timestamp, buf, len);
+    }
+    return 0;
+}
+
 int DesktopEventCallbacks::MediaStart(int chan) {
     if (chan == AA_CH_MIC) {
         printf("SHAI1 : Mic Started\n");
@@ -27,6 +27,8 @@ public:
         ~DesktopEventCallbacks();
 
         virtual int MediaPacket(int chan, uint64_t timestamp, const byte * buf, int len) override;
+        virtual bool MediaStreamChunks(int chan) override;
+        virtual int MediaPacketChunk(int chan, uint64_t timestamp, int offset, int total, const byte * buf, int len) override;
         virtual int MediaStart(int chan) override;
         virtual int MediaStop(int chan) override;
         virtual void MediaSetupComplete(int chan) override;
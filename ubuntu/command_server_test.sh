@@ -2,6 +2,11 @@ git checkout headunit.json
 
 echo "basic tests"
 curl "127.0.0.1:9999/status"
+curl "127.0.0.1:9999/metrics"
+curl "127.0.0.1:9999/trace"
+curl "127.0.0.1:9999/logLevel?tag=hu_aap&level=debug"
+curl "127.0.0.1:9999/capture?action=start&file=session.hucap"
+curl "127.0.0.1:9999/capture?action=stop"
 curl "127.0.0.1:9999/updateConfig?parameter=callbackParamString&value=onestringparamtorulethemall&type=string"
 curl "127.0.0.1:9999/updateConfig?parameter=callbackParamBool_setTo_False&value=false&type=bool"
 curl "127.0.0.1:9999/updateConfig?parameter=callbackParamBool_setTo_True&value=true&type=bool"
@@ -9,6 +9,10 @@
 
 #include "hu_uti.h"
 #include "hu_aap.h"
+#include "hu_capture.h"
+#include "hu_replay.h"
+#include "hu_headless.h"
+#include "hu_soak.h"
 
 #include "main.h"
 #include "outputs.h"
@@ -53,6 +57,43 @@ main(int argc, char *argv[]) {
 
         hu_log_library_versions();
         hu_install_crash_handler();
+
+        if (argc >= 2 && strcmp(argv[1], "bench-crypto") == 0) {
+                //headunit bench-crypto [cipher list] [MB], defaults to the configured list
+                config::configFile="headunit.json";
+                config::readConfig();
+                std::string cipherList = argc >= 3 ? argv[2] : config::sslCipherList;
+                int megabytes = argc >= 4 ? atoi(argv[3]) : 64;
+                return hu_ssl_bench_suites(cipherList, megabytes) < 0 ? 1 : 0;
+        }
+        if (argc >= 4 && strcmp(argv[1], "capture-export") == 0) {
+                //headunit capture-export <capture file> <pcapng file>
+                return hu_capture_export_pcapng(argv[2], argv[3]) < 0 ? 1 : 0;
+        }
+        if (argc >= 2 && strcmp(argv[1], "headless") == 0) {
+                //headunit headless [usb|wifi|loopback|replay] [minutes] [phone address or capture file], no video, audio or input
+                config::configFile="headunit.json";
+                config::readConfig();
+                HU_TRANSPORT_TYPE transport = config::transport_type;
+                if (argc >= 3 && !hu_headless_transport(argv[2], transport)) {
+                        printf("Unknown transport %s, use usb, wifi, loopback or replay\n", argv[2]);
+                        return 1;
+                }
+                int seconds = argc >= 4 ? (int) (atof(argv[3]) * 60) : 0;
+                std::string address = argc >= 5 ? argv[4] : config::phoneIpAddress;
+                return hu_headless_run(transport, address, seconds, config::streamVideoChunks);
+        }
+        if (argc >= 2 && strcmp(argv[1], "soak") == 0) {
+                //headunit soak [sessions] [minutes] [report seconds], loopback sessions with fake phones until the time is up
+                int sessions = argc >= 3 ? atoi(argv[2]) : 4;
+                int seconds = argc >= 4 ? (int) (atof(argv[3]) * 60) : 0;
+                int report_seconds = argc >= 5 ? atoi(argv[4]) : 60;
+                return hu_soak_run(std::max(sessions, 1), seconds, report_seconds);
+        }
+        //headunit replay <capture file> [realtime], one session from the capture instead of a phone
+        bool replay = argc >= 3 && strcmp(argv[1], "replay") == 0;
+        std::string replayFile = replay ? argv[2] : "";
+        ena_replay_realtime = argc >= 4 && strcmp(argv[3], "realtime") == 0;
 #if defined GDK_VERSION_3_10
         printf("GTK VERSION 3.10.0 or higher\n");
         //Assuming we are on Gnome, what's the DPI scale factor?
@@ -91,6 +132,12 @@ main(int argc, char *argv[]) {
 
         config::configFile="headunit.json";
         config::readConfig();
+        ena_ssl_aead = config::sslFastPath;
+        hu_ssl_cipher_list = config::sslCipherList;
+        if (config::captureFile.length() > 0 && !replay)
+        {
+            hu_capture_start(config::captureFile);
+        }
 
         //loop to emulate the car
         printf("Looping\n");
@@ -100,7 +147,10 @@ main(int argc, char *argv[]) {
             HUServer headunit(callbacks);
 
             /* Start AA processing */
-            ret = headunit.hu_aap_start(config::transport_type, config::phoneIpAddress, true);
+            if (replay)
+                ret = headunit.hu_aap_start(HU_TRANSPORT_TYPE::REPLAY, replayFile, true);
+            else
+                ret = headunit.hu_aap_start(config::transport_type, config::phoneIpAddress, true);
             if (ret < 0) {
                     printf("Phone is not connected. Connect a supported phone and restart.\n");
                     return 0;
@@ -129,6 +179,14 @@ main(int argc, char *argv[]) {
             }
 
             g_hu = nullptr;
+
+            if (replay) {
+                hu_replay_stats stats = hu_replay_last_stats();
+                printf("Replay: %llu messages in %.3f s, %llu outbound matched, %llu mismatched, %llu unexpected, %llu missing\n",
+                       (unsigned long long) stats.messages_in, stats.elapsed_us / 1000000.0, (unsigned long long) stats.matched,
+                       (unsigned long long) stats.mismatched, (unsigned long long) stats.unexpected, (unsigned long long) stats.missing);
+                break;
+            }
         }
 
         SDL_Quit();
@@ -1,5 +1,8 @@
 #include "outputs.h"
+#include "hu_metrics.h"
+#include "hu_pb_fast.h"
 #include "main.h"
+#include "config.h"
 
 static /* Print all information about a key event */
 void
@@ -84,7 +87,13 @@ gboolean VideoOutput::bus_callback(GstBus *bus, GstMessage *message, gpointer *p
     return TRUE;
 }
 
-void VideoOutput::aa_touch_event(SDL_Window *window, HU::TouchInfo::TOUCH_ACTION action, unsigned int x, unsigned int y) {
+//SDL only stamps events in ms since it started, this puts them on our clock
+static uint64_t sdl_event_us(const SDL_Event& event, uint64_t pollUs, uint32_t pollTicks) {
+    uint64_t waitedUs = (uint64_t) (pollTicks - event.common.timestamp) * 1000;
+    return waitedUs < pollUs ? pollUs - waitedUs : 0;
+}
+
+void VideoOutput::aa_touch_event(SDL_Window *window, HU::TouchInfo::TOUCH_ACTION action, unsigned int x, unsigned int y, hu_input_stamp stamp) {
     int windowW, windowH;
 
     SDL_GetWindowSize(window, &windowW, &windowH);
@@ -98,19 +107,17 @@ void VideoOutput::aa_touch_event(SDL_Window *window, HU::TouchInfo::TOUCH_ACTION
     y = (unsigned int) (normy * 480);
 #endif
 
-    g_hu->hu_queue_command([action, x, y](IHUConnectionThreadInterface & s) {
-        HU::InputEvent inputEvent;
-        inputEvent.set_timestamp(get_cur_timestamp());
-        HU::TouchInfo* touchEvent = inputEvent.mutable_touch();
-        touchEvent->set_action(action);
-        HU::TouchInfo::Location* touchLocation = touchEvent->add_location();
-        touchLocation->set_x(x);
-        touchLocation->set_y(y);
-        touchLocation->set_pointer_id(0);
+    stamp.queued_us = hu_get_time_us();
+    g_hu->hu_queue_command([action, x, y, stamp](IHUConnectionThreadInterface & s) mutable {
+        byte buf[HU_PB_INPUT_EVENT_MAX];
+        hu_pb_input_event inputEvent(buf, get_cur_timestamp());
+        hu_pb_touch_pointer pointer = {x, y, 0};
+        inputEvent.touch(action, &pointer, 1);
 
         /* Send touch event */
 
-        int ret = s.hu_aap_enc_send_message(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, inputEvent);
+        hu_input_scope scope(stamp);
+        int ret = s.hu_aap_enc_send_blob(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, buf, inputEvent.size());
         if (ret < 0) {
             printf("aa_touch_event(): hu_aap_enc_send() failed with (%d)\n", ret);
         }
@@ -132,23 +139,25 @@ gboolean VideoOutput::sdl_poll_event() {
 
     int ret;
     while (SDL_PollEvent(&event) > 0) {
+        uint64_t pollUs = hu_get_time_us();
+        hu_input_stamp stamp = {sdl_event_us(event, pollUs, SDL_GetTicks()), pollUs};
         switch (event.type) {
         case SDL_MOUSEMOTION:
             mmevent = &event.motion;
             if (mmevent->state & SDL_BUTTON_LMASK) {
-                aa_touch_event(SDL_GetWindowFromID(mmevent->windowID), HU::TouchInfo::TOUCH_ACTION_DRAG, (unsigned int) mmevent->x, (unsigned int) mmevent->y);
+                aa_touch_event(SDL_GetWindowFromID(mmevent->windowID), HU::TouchInfo::TOUCH_ACTION_DRAG, (unsigned int) mmevent->x, (unsigned int) mmevent->y, stamp);
             }
             break;
         case SDL_MOUSEBUTTONDOWN:
             mbevent = &event.button;
             if (mbevent->button == SDL_BUTTON_LEFT) {
-                aa_touch_event(SDL_GetWindowFromID(mbevent->windowID), HU::TouchInfo::TOUCH_ACTION_PRESS, (unsigned int) mbevent->x, (unsigned int) mbevent->y);
+                aa_touch_event(SDL_GetWindowFromID(mbevent->windowID), HU::TouchInfo::TOUCH_ACTION_PRESS, (unsigned int) mbevent->x, (unsigned int) mbevent->y, stamp);
             }
             break;
         case SDL_MOUSEBUTTONUP:
             mbevent = &event.button;
             if (mbevent->button == SDL_BUTTON_LEFT) {
-                aa_touch_event(SDL_GetWindowFromID(mbevent->windowID), HU::TouchInfo::TOUCH_ACTION_RELEASE, (unsigned int) mbevent->x, (unsigned int) mbevent->y);
+                aa_touch_event(SDL_GetWindowFromID(mbevent->windowID), HU::TouchInfo::TOUCH_ACTION_RELEASE, (unsigned int) mbevent->x, (unsigned int) mbevent->y, stamp);
             }
             break;
         case SDL_KEYDOWN:
@@ -157,60 +166,58 @@ gboolean VideoOutput::sdl_poll_event() {
                 key = &event.key;
                 PrintKeyInfo(key);
 
-                HU::InputEvent inputEvent;
-                inputEvent.set_timestamp(get_cur_timestamp());
-                HU::ButtonInfo* buttonInfo = inputEvent.mutable_button()->add_button();
-                buttonInfo->set_is_pressed(event.type == SDL_KEYDOWN);
-                buttonInfo->set_meta(0);
-                buttonInfo->set_long_press(false);
+                uint64_t timestamp = get_cur_timestamp();
+                bool isPressed = event.type == SDL_KEYDOWN;
+                uint32_t scanCode = 0;
                 if (key->keysym.sym == SDLK_UP) {
-                    buttonInfo->set_scan_code(HUIB_UP);
+                    scanCode = HUIB_UP;
                 } else if (key->keysym.sym == SDLK_DOWN) {
-                    buttonInfo->set_scan_code(HUIB_DOWN);
+                    scanCode = HUIB_DOWN;
                 } else if (key->keysym.sym == SDLK_TAB) { //Left is the menu, so kinda tab?
-                    buttonInfo->set_scan_code(HUIB_LEFT);
+                    scanCode = HUIB_LEFT;
                 }//This is just mic again
                 // else if (key->keysym.sym == SDLK_RIGHT) {
-                //      buttonInfo->set_scan_code(HUIB_RIGHT);
+                //      scanCode = HUIB_RIGHT;
                 // }
                 else if (key->keysym.sym == SDLK_LEFT || key->keysym.sym == SDLK_RIGHT) {
                     if (event.type == SDL_KEYDOWN) {
-                        HU::InputEvent inputEvent2;
-                        inputEvent2.set_timestamp(get_cur_timestamp());
-                        HU::RelativeInputEvent* rel = inputEvent2.mutable_rel_event()->mutable_event();
-                        rel->set_delta(key->keysym.sym == SDLK_LEFT ? -1 : 1);
-                        rel->set_scan_code(HUIB_SCROLLWHEEL);
-
-                        g_hu->hu_queue_command([inputEvent2](IHUConnectionThreadInterface & s) {
-                            s.hu_aap_enc_send_message(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, inputEvent2);
+                        int32_t delta = key->keysym.sym == SDLK_LEFT ? -1 : 1;
+
+                        stamp.queued_us = hu_get_time_us();
+                        g_hu->hu_queue_command([timestamp, delta, stamp](IHUConnectionThreadInterface & s) mutable {
+                            byte buf[HU_PB_INPUT_EVENT_MAX];
+                            hu_pb_input_event inputEvent(buf, timestamp);
+                            inputEvent.relative(HUIB_SCROLLWHEEL, delta);
+                            hu_input_scope scope(stamp);
+                            s.hu_aap_enc_send_blob(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, buf, inputEvent.size());
                         });
                     }
                 } else if (key->keysym.sym == SDLK_l) {
-                    buttonInfo->set_scan_code(HUIB_MEDIA);
+                    scanCode = HUIB_MEDIA;
                 } else if (key->keysym.sym == SDLK_k) {
-                    buttonInfo->set_scan_code(HUIB_NAVIGATION);
+                    scanCode = HUIB_NAVIGATION;
                 } else if (key->keysym.sym == SDLK_j) {
-                    buttonInfo->set_scan_code(HUIB_RADIO);
+                    scanCode = HUIB_RADIO;
                 } else if (key->keysym.sym == SDLK_h) {
-                    buttonInfo->set_scan_code(HUIB_TEL);
+                    scanCode = HUIB_TEL;
                 } else if (key->keysym.sym == SDLK_y) {
-                    buttonInfo->set_scan_code(HUIB_PRIMARY_BUTTON);
+                    scanCode = HUIB_PRIMARY_BUTTON;
                 } else if (key->keysym.sym == SDLK_u) {
-                    buttonInfo->set_scan_code(HUIB_SECONDARY_BUTTON);
+                    scanCode = HUIB_SECONDARY_BUTTON;
                 } else if (key->keysym.sym == SDLK_i) {
-                    buttonInfo->set_scan_code(HUIB_TERTIARY_BUTTON);
+                    scanCode = HUIB_TERTIARY_BUTTON;
                 } else if (key->keysym.sym == SDLK_m) {
-                    buttonInfo->set_scan_code(HUIB_MIC);
+                    scanCode = HUIB_MIC;
                 } else if (key->keysym.sym == SDLK_p) {
-                    buttonInfo->set_scan_code(HUIB_PREV);
+                    scanCode = HUIB_PREV;
                 } else if (key->keysym.sym == SDLK_n) {
-                    buttonInfo->set_scan_code(HUIB_NEXT);
+                    scanCode = HUIB_NEXT;
                 } else if (key->keysym.sym == SDLK_SPACE) {
-                    buttonInfo->set_scan_code(HUIB_PLAYPAUSE);
+                    scanCode = HUIB_PLAYPAUSE;
                 } else if (key->keysym.sym == SDLK_RETURN) {
-                    buttonInfo->set_scan_code(HUIB_ENTER);
+                    scanCode = HUIB_ENTER;
                 } else if (key->keysym.sym == SDLK_BACKSPACE) {
-                    buttonInfo->set_scan_code(HUIB_BACK);
+                    scanCode = HUIB_BACK;
                 } else if (key->keysym.sym == SDLK_F1) {
                     if (event.type == SDL_KEYUP) {
                         nightmodenow = !nightmodenow;
@@ -251,9 +258,14 @@ gboolean VideoOutput::sdl_poll_event() {
                     }
                 }
 
-                if (buttonInfo->has_scan_code()) {
-                    g_hu->hu_queue_command([inputEvent](IHUConnectionThreadInterface & s) {
-                        s.hu_aap_enc_send_message(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, inputEvent);
+                if (scanCode != 0) {
+                    stamp.queued_us = hu_get_time_us();
+                    g_hu->hu_queue_command([timestamp, scanCode, isPressed, stamp](IHUConnectionThreadInterface & s) mutable {
+                        byte buf[HU_PB_INPUT_EVENT_MAX];
+                        hu_pb_input_event inputEvent(buf, timestamp);
+                        inputEvent.button(scanCode, isPressed, 0, false);
+                        hu_input_scope scope(stamp);
+                        s.hu_aap_enc_send_blob(0, AA_CH_TOU, HU_INPUT_CHANNEL_MESSAGE::InputEvent, buf, inputEvent.size());
                     });
                 }
             }
@@ -275,15 +287,33 @@ gboolean VideoOutput::sdl_poll_event() {
        SendNightMode();
     }
 
+    if (latency_overlay) {
+        update_latency_overlay();
+    }
+
     return TRUE;
 }
 
+void VideoOutput::update_latency_overlay() {
+    char text[256];
+    int len = snprintf(text, sizeof(text), "input ms");
+    for (int stage = 0; stage < HU_INPUT_STAGES; stage++) {
+        len += snprintf(text + len, sizeof(text) - len, "  %s %.1f", hu_input_stage_name(stage),
+                        hu_metrics.input_latency_last_us[stage].load(std::memory_order_relaxed) / 1000.0);
+    }
+    const hu_metric_histogram& total = hu_metrics.input_latency_us[HU_INPUT_STAGE_TOTAL];
+    snprintf(text + len, sizeof(text) - len, "\ntotal p50 %.1f  p95 %.1f  p99 %.1f  (%llu events)", total.percentile_us(0.5) / 1000.0,
+             total.percentile_us(0.95) / 1000.0, total.percentile_us(0.99) / 1000.0,
+             (unsigned long long) total.count.load(std::memory_order_relaxed));
+    g_object_set(G_OBJECT(latency_overlay), "text", text, NULL);
+}
+
 VideoOutput::VideoOutput(DesktopEventCallbacks* callbacks) : callbacks(callbacks) {
     GstBus *bus;
 
     GError *error = NULL;
 
-    const char* vid_launch_str = "appsrc name=mysrc is-live=true block=false max-latency=100000 do-timestamp=true stream-type=stream typefind=true ! "
+    std::string vid_launch_str = "appsrc name=mysrc is-live=true block=false max-latency=100000 do-timestamp=true stream-type=stream typefind=true ! "
                                  "queue ! "
                                  "h264parse ! "
                                  "avdec_h264 ! "
@@ -293,13 +323,17 @@ VideoOutput::VideoOutput(DesktopEventCallbacks* callbacks) : callbacks(callbacks
                                  "videoscale name=myconvert ! "
                                  "videoconvert ! "
                                  "ximagesink name=mysink";
-    vid_pipeline = gst_parse_launch(vid_launch_str, &error);
+    if (config::latencyOverlay) {
+        vid_launch_str.replace(vid_launch_str.find("videoscale"), 0, "textoverlay name=latency valignment=top halignment=left font-desc=\"Sans 9\" shaded-background=true ! ");
+    }
+    vid_pipeline = gst_parse_launch(vid_launch_str.c_str(), &error);
 
     bus = gst_pipeline_get_bus(GST_PIPELINE(vid_pipeline));
     gst_bus_add_watch(bus, (GstBusFunc) bus_callback, &gst_app);
     gst_object_unref(bus);
 
     vid_src = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(vid_pipeline), "mysrc"));
+    latency_overlay = gst_bin_get_by_name(GST_BIN(vid_pipeline), "latency");
 
     gst_app_src_set_stream_type(vid_src, GST_APP_STREAM_TYPE_STREAM);
 
@@ -343,9 +377,12 @@ VideoOutput::~VideoOutput()
 
     gst_object_unref(vid_pipeline);
     gst_object_unref(vid_src);
+    if (latency_overlay)
+        gst_object_unref(latency_overlay);
 
     vid_pipeline = nullptr;
     vid_src = nullptr;
+    latency_overlay = nullptr;
     g_source_destroy(timeout_src);
     g_source_unref(timeout_src);
     timeout_src = nullptr;
@@ -360,17 +397,20 @@ void VideoOutput::MediaPacket(uint64_t timestamp, const byte *buf, int len) {
     int ret = gst_app_src_push_buffer((GstAppSrc *) vid_src, buffer);
     if (ret != GST_FLOW_OK) {
         printf("push buffer returned %d for %d bytes \n", ret, len);
+        hu_metrics_add(hu_metrics_chan(AA_CH_VID).drops);
     }
+    hu_metrics_set(hu_metrics_chan(AA_CH_VID).queue_depth, gst_app_src_get_current_level_bytes((GstAppSrc *) vid_src));
 }
 
 void VideoOutput::SendNightMode()
 {
     bool nm = nightmode;
     g_hu->hu_queue_command([nm](IHUConnectionThreadInterface & s) {
-        HU::SensorEvent sensorEvent;
-        sensorEvent.add_night_mode()->set_is_night(nm);
+        byte buf[HU_PB_SENSOR_EVENT_MAX];
+        hu_pb_sensor_event sensorEvent(buf);
+        sensorEvent.night_mode(nm);
 
-        s.hu_aap_enc_send_message(0, AA_CH_SEN, HU_SENSOR_CHANNEL_MESSAGE::SensorEvent, sensorEvent);
+        s.hu_aap_enc_send_blob(0, AA_CH_SEN, HU_SENSOR_CHANNEL_MESSAGE::SensorEvent, buf, sensorEvent.size());
     });
 
     printf("Nightmode: %s\n", nm ? "On" : "Off");
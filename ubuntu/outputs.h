@@ -16,6 +16,7 @@
 
 #include "hu_uti.h"
 #include "hu_aap.h"
+#include "hu_metrics.h"
 
 #include "callbacks.h"
 
@@ -30,14 +31,16 @@ class VideoOutput {
     GstAppSrc *vid_src = nullptr;
     GSource* timeout_src = nullptr;
     SDL_Window* window = nullptr;
+    GstElement* latency_overlay = nullptr;                      // Only with config::latencyOverlay
     bool nightmode = false;
     DesktopEventCallbacks* callbacks;
 
     static gboolean bus_callback(GstBus *bus, GstMessage *message, gpointer *ptr);
-    static void aa_touch_event(SDL_Window* window, HU::TouchInfo::TOUCH_ACTION action, unsigned int x, unsigned int y);
+    static void aa_touch_event(SDL_Window* window, HU::TouchInfo::TOUCH_ACTION action, unsigned int x, unsigned int y, hu_input_stamp stamp);
     static gboolean sdl_poll_event_wrapper(gpointer data);
 
     gboolean sdl_poll_event();
+    void update_latency_overlay();
 public:
     VideoOutput(DesktopEventCallbacks* callbacks);
     ~VideoOutput();